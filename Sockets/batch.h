@@ -0,0 +1,117 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Batched transfers of many small files (TCP_CAP_BATCH, frames in
+    outbound.h).
+
+    /files sends the files given, and the regular files of the directories
+    given, in one batch: a header table with the name and size of each
+    file, then their contents back to back, cut into segments of
+    BATCH_SEGMENT_SIZE. A segment usually carries many small files, so what
+    an f frame costs per file (its frame, log line, rate limit and memory
+    checks on the server) is paid per segment instead. The sender reads the
+    files on a separate thread, up to BATCH_READ_AHEAD segments ahead of
+    the one on the wire.
+
+    The server checks the table once and relays each segment as it
+    arrives, with its offset in the contents. The recipient finds the files
+    a segment covers through the table, so segments can be saved in any
+    order (bulk frames share the link chunk by chunk); a file split across
+    segments is written to a .part file and renamed once complete. A
+    recipient without the cap gets the files as F frames, put together by
+    the server one at a time, which is why files over BATCH_MAX_FILE_SIZE
+    are sent the usual way.
+*/
+
+#define BATCH_SEGMENT_SIZE (256 * 1024)
+#define BATCH_READ_AHEAD 8
+#define BATCH_MAX_FILE_SIZE (1024 * 1024)
+#define BATCH_MAX_FILES 50000 // keeps the table under BATCH_MAX_TABLE
+#define BATCH_MAX_TABLE (16 * 1024 * 1024)
+
+// A file of a batch; 'offset' is where its content starts in the contents
+struct BatchFile {
+    std::string filename;
+    uint64_t size;
+    uint64_t offset;
+};
+
+// Header table: count (4) + count * (filename (2+n) + size (10))
+std::string encodeBatchTable(const std::vector<BatchFile>& files) {
+    std::string table;
+    auto append = [&table](uint64_t value, int width) {
+        for (int i = width - 1; i >= 0; i--) {
+            table.push_back((value >> (i * 8)) & 0xFF);
+        }
+    };
+    append(files.size(), 4);
+    for (const BatchFile& file : files) {
+        append(file.filename.size(), 2);
+        table += file.filename;
+        append(file.size, 10);
+    }
+    return table;
+}
+
+// Read a header table, filling in the offsets; false if it is malformed
+// or lists files larger than a batch takes
+bool decodeBatchTable(const std::string& table, std::vector<BatchFile>& files) {
+    const unsigned char* p = (const unsigned char*)table.data();
+    const unsigned char* end = p + table.size();
+    auto read = [&p, end](int width, uint64_t& value) {
+        if (end - p < width) return false;
+        value = 0;
+        for (int i = 0; i < width; i++) {
+            value = (value << 8) | *p++;
+        }
+        return true;
+    };
+
+    uint64_t count;
+    if (!read(4, count) || count > BATCH_MAX_FILES) return false;
+    files.clear();
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t length, size;
+        if (!read(2, length) || (uint64_t)(end - p) < length) return false;
+        std::string filename((const char*)p, length);
+        p += length;
+        if (!read(10, size) || size > BATCH_MAX_FILE_SIZE || filename.empty()) return false;
+        files.push_back({filename, size, offset});
+        offset += size;
+    }
+    return p == end;
+}
+
+// Bytes of contents a table describes
+uint64_t batchSize(const std::vector<BatchFile>& files) {
+    return files.empty() ? 0 : files.back().offset + files.back().size;
+}
+
+// Index of the file holding the byte at 'offset' of the contents (empty
+// files hold none)
+size_t batchFileAt(const std::vector<BatchFile>& files, uint64_t offset) {
+    auto it = std::upper_bound(files.begin(), files.end(), offset,
+                               [](uint64_t value, const BatchFile& file) { return value < file.offset + file.size; });
+    return it - files.begin();
+}
+
+// A batch the server is relaying: where it goes and how far it got
+struct RelayedBatch {
+    std::string dest;
+    std::vector<BatchFile> files;
+    uint64_t size;
+    uint64_t received = 0;
+    bool failed = false;  // its segments are dropped until it ends
+    bool expand = false;  // the recipient lacks the cap: F frames
+    size_t next = 0;      // with 'expand', the file being put together
+    std::string partial;  // and its bytes so far
+};
+
+#endif
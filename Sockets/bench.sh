@@ -0,0 +1,174 @@
+#!/bin/bash
+# Measurements of the TCP server and client on loopback. Builds with g++
+# into a temporary directory and leaves nothing in the tree.
+#
+#   ./bench.sh lanes [rev]     /ping p50/p99 while three 64 MB files stream
+#                              to the same client; with rev, the server of
+#                              that revision is measured too (the clients
+#                              always come from the tree, since /ping is
+#                              newer than the lanes)
+#   ./bench.sh compress [rev]  ms for biblia.txt and img.png from /file to
+#                              the saved file, with and without
+#                              --no-compress; with rev, server and clients
+#                              of that revision
+#
+# RUNS (3) sets the runs per measurement. RATE (e.g. 100mbit) shapes
+# loopback with tc tbf while it runs (needs root).
+
+cd "$(dirname "$0")"
+OUT=$(mktemp -d)
+SERVER_PID=
+CLIENT_PIDS=
+trap 'kill $SERVER_PID $CLIENT_PIDS 2>/dev/null; [ -n "$RATE" ] && tc qdisc del dev lo root 2>/dev/null; rm -rf "$OUT"' EXIT
+CXX="g++ -std=c++17 -O2 -pthread"
+
+# Build a program of a git revision (or of the tree, without one)
+build() {
+    local rev=$1 source=$2 dest=$3
+    if [ -z "$rev" ]; then
+        $CXX "$source" -o "$dest" || exit 1
+    else
+        if [ ! -d "$OUT/$rev" ]; then
+            mkdir -p "$OUT/$rev"
+            git archive "$rev" . | tar -x -C "$OUT/$rev" || exit 1
+        fi
+        $CXX "$OUT/$rev/$source" -o "$dest" || exit 1
+    fi
+}
+
+start_server() {
+    "$@" > "$OUT/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.3
+}
+
+stop_server() {
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+}
+
+# A client reading its commands from a FIFO: start_client name dir args...
+# leaves the descriptor to write to in the variable called 'name'
+start_client() {
+    local name=$1 dir=$2
+    shift 2
+    mkdir -p "$dir"
+    mkfifo "$OUT/$name.in"
+    (cd "$dir" && exec "$OUT/client" "$@" < "$OUT/$name.in" > "$OUT/$name.log" 2>&1) &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
+    exec {fd}> "$OUT/$name.in"
+    eval "$name=$fd"
+    echo "$name" >&$fd
+}
+
+# The receiver thread may still be blocked after /exit, so the clients
+# get a moment to leave and are then killed
+stop_clients() {
+    echo /exit >&$alice
+    echo /exit >&$bob
+    exec {alice}>&- {bob}>&-
+    sleep 0.2
+    kill $CLIENT_PIDS 2>/dev/null
+    wait $CLIENT_PIDS 2>/dev/null
+    CLIENT_PIDS=
+    rm -f "$OUT"/*.in
+}
+
+# Wait until the log has 'count' lines matching the pattern (60 s at most)
+wait_log() {
+    local log=$1 pattern=$2 count=$3
+    local deadline=$((SECONDS + 60))
+    while [ $SECONDS -lt $deadline ]; do
+        [ "$(grep -ac "$pattern" "$log")" -ge "$count" ] && return 0
+        sleep 0.002
+    done
+    echo "timed out waiting for '$pattern' in $log" >&2
+    return 1
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+shape() {
+    if [ -n "$RATE" ]; then
+        tc qdisc replace dev lo root tbf rate "$RATE" burst 256kb latency 50ms || exit 1
+        echo "loopback limited to $RATE"
+    fi
+}
+
+bench_lanes() {
+    build "" client.cpp "$OUT/client"
+    build "" server.cpp "$OUT/server"
+    local servers="$OUT/server"
+    if [ -n "$1" ]; then
+        build "$1" server.cpp "$OUT/server-$1"
+        servers="$OUT/server-$1 $servers"
+    fi
+    # Three different files, so that resumed and deduplicated uploads
+    # don't skip any of them
+    for i in 1 2 3; do
+        head -c $((64 * 1024 * 1024)) /dev/urandom > "$OUT/big$i.bin"
+    done
+    shape
+    for server in $servers; do
+        start_server "$server"
+        start_client bob "$OUT/bob"
+        start_client alice "$OUT/alice"
+        ln -s "$OUT"/big?.bin "$OUT/alice/"
+        sleep 1
+        echo "$(basename "$server") idle: $(ping_bob)"
+        for i in 1 2 3; do
+            echo "/file bob big$i.bin" >&$alice
+        done
+        sleep 0.5
+        echo "$(basename "$server") during 3 x 64 MB: $(ping_bob)"
+        wait_log "$OUT/bob.log" "File received" 3
+        stop_clients
+        stop_server
+        rm -rf "$OUT/alice" "$OUT/bob"
+    done
+}
+
+# 500 round trips of bob's chat messages to itself
+ping_bob() {
+    local count=$(grep -ac "\[Ping\]" "$OUT/bob.log")
+    echo "/ping 500" >&$bob
+    wait_log "$OUT/bob.log" "\[Ping\]" $((count + 1)) && grep -a "\[Ping\]" "$OUT/bob.log" | tail -1
+}
+
+bench_compress() {
+    build "$1" server.cpp "$OUT/server"
+    build "$1" client.cpp "$OUT/client"
+    shape
+    for file in biblia.txt img.png; do
+        for option in "" --no-compress; do
+            start_server "$OUT/server"
+            start_client bob "$OUT/bob" $option
+            start_client alice "$OUT/alice" $option
+            sleep 1
+            for run in $(seq ${RUNS:-3}); do
+                # A new name each run, so that the upload is not resumed
+                cp "$file" "$OUT/alice/$run-$file"
+                local start=$(now_ms)
+                echo "/file bob $run-$file" >&$alice
+                wait_log "$OUT/bob.log" "File received" $run || break
+                echo $(($(now_ms) - start)) >> "$OUT/times"
+            done
+            echo "$file ${option:-compress}: $(median < "$OUT/times") ms (median of ${RUNS:-3})"
+            stop_clients
+            stop_server
+            rm -rf "$OUT/alice" "$OUT/bob" "$OUT/times"
+        done
+    done
+}
+
+case "$1" in
+    lanes) bench_lanes "$2" ;;
+    compress) bench_compress "$2" ;;
+    *) echo "Usage: $0 lanes|compress [rev]"; exit 1 ;;
+esac
@@ -0,0 +1,190 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <string>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+#include "sha256.h"
+#include "memorybudget.h"
+#include "resume.h"
+
+/*
+    Deduplicated uploads (TCP_CAP_DEDUP, frames in outbound.h).
+
+    The client cuts a file into chunks where its content says so (gear
+    rolling hash, FastCDC style), so an edit only changes the chunks around
+    it, and names each chunk by its SHA-256. It announces the list with h;
+    the server answers with the chunks it doesn't have (H) and the client
+    sends only those (u). The file is then put together from the store and
+    delivered as a normal F frame. Sending the same file again, to anyone,
+    uploads next to nothing.
+
+    Chunks live in memory in a ChunkStore of --chunk-store bytes (256M by
+    default, 0 disables it), the least recently used evicted first. An
+    upload keeps references to its chunks, so evicting one it counts on
+    doesn't break it. A chunk is stored only after its hash is checked.
+*/
+
+#define CHUNK_MIN_SIZE (4 * 1024)
+#define CHUNK_AVG_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+// Cut points: 15 bits must be zero before the average size, 13 after
+#define CHUNK_MASK_SMALL (((1ull << 15) - 1) << 49)
+#define CHUNK_MASK_LARGE (((1ull << 13) - 1) << 51)
+// Files up to this size go deduplicated; larger ones resumably (resume.h)
+#define CHUNKED_MAX_SIZE RESUME_MIN_SIZE
+// H count of an upload the server refused (an E frame says why)
+#define CHUNKED_REFUSED 0xFFFFFFFFu
+
+// Gear table: one fixed random number per byte value (splitmix64), the
+// same in every client so equal content is cut the same way
+const uint64_t* gearTable() {
+    static const std::vector<uint64_t> table = []() {
+        std::vector<uint64_t> values(256);
+        uint64_t seed = 0x9E3779B97F4A7C15ull;
+        for (uint64_t& value : values) {
+            uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            value = z ^ (z >> 31);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// Length of the chunk that starts at 'data'
+size_t nextChunk(const char* data, size_t length) {
+    if (length <= CHUNK_MIN_SIZE) return length;
+    const unsigned char* bytes = (const unsigned char*)data;
+    const uint64_t* gear = gearTable();
+    size_t normal = std::min(length, (size_t)CHUNK_AVG_SIZE);
+    size_t end = std::min(length, (size_t)CHUNK_MAX_SIZE);
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if (!(hash & CHUNK_MASK_SMALL)) return i + 1;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if (!(hash & CHUNK_MASK_LARGE)) return i + 1;
+    }
+    return end;
+}
+
+// Lengths of the chunks of a whole content
+std::vector<size_t> chunkLengths(const char* data, size_t length) {
+    std::vector<size_t> lengths;
+    size_t offset = 0;
+    while (offset < length) {
+        size_t chunk = nextChunk(data + offset, length - offset);
+        lengths.push_back(chunk);
+        offset += chunk;
+    }
+    return lengths;
+}
+
+typedef std::shared_ptr<const std::string> Chunk;
+
+class ChunkStore {
+public:
+    void configure(uint64_t configured) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = configured;
+    }
+
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return limit > 0;
+    }
+
+    std::string description() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (limit == 0) return "disabled";
+        return "up to " + formatMemoryAmount(limit) + " of chunks";
+    }
+
+    // The chunk with this hash, or nullptr; it becomes the most recent
+    Chunk find(const std::string& hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = chunks.find(hash);
+        if (it == chunks.end()) return nullptr;
+        recent.splice(recent.begin(), recent, it->second.recent);
+        return it->second.data;
+    }
+
+    // Keep a chunk whose hash was checked, evicting the least recent ones
+    void insert(const std::string& hash, Chunk data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (data->size() > limit || chunks.count(hash)) return;
+        while (used + data->size() > limit) {
+            auto oldest = chunks.find(recent.back());
+            used -= oldest->second.data->size();
+            chunks.erase(oldest);
+            recent.pop_back();
+            evicted++;
+        }
+        recent.push_front(hash);
+        chunks[hash] = {data, recent.begin()};
+        used += data->size();
+    }
+
+    // Bytes of an upload that didn't have to be sent
+    void deduplicated(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        saved += bytes;
+    }
+
+    // Current state; 'changed' says whether it changed since the last call
+    std::string usage(bool* changed = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << chunks.size() << " chunks, " << formatMemoryAmount(used) << " of " << formatMemoryAmount(limit)
+            << ", " << formatMemoryAmount(saved) << " not uploaded again, " << evicted << " evicted";
+        if (changed != nullptr) {
+            *changed = used != reportedUsed || saved != reportedSaved || evicted != reportedEvicted;
+            reportedUsed = used;
+            reportedSaved = saved;
+            reportedEvicted = evicted;
+        }
+        return out.str();
+    }
+
+private:
+    struct Entry {
+        Chunk data;
+        std::list<std::string>::iterator recent;
+    };
+
+    std::mutex mutex;
+    uint64_t limit = 256ull * 1024 * 1024;
+    uint64_t used = 0;
+    std::map<std::string, Entry> chunks;
+    std::list<std::string> recent; // most recent first
+    uint64_t saved = 0;
+    uint64_t evicted = 0;
+    uint64_t reportedUsed = 0;
+    uint64_t reportedSaved = 0;
+    uint64_t reportedEvicted = 0;
+};
+
+// An upload announced by its chunks (h), waiting for the missing ones
+struct ChunkedUpload {
+    std::string dest;
+    std::string filename;
+    uint64_t size;
+    std::vector<std::string> hashes;
+    std::vector<size_t> lengths;
+    std::vector<Chunk> chunks; // nullptr until it arrives
+    size_t missing;
+    MemoryReservation memory;  // the file once put together
+};
+
+#endif
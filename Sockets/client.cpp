@@ -13,8 +13,25 @@
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
+#include <map>
+#include <set>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <functional>
+#include <deque>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "sala.h"
 #include "sala_serialized.h"
+#include "outbound.h"
+#include "lz.h"
+#include "resume.h"
+#include "chunkstore.h"
+#include "delta.h"
+#include "batch.h"
 
 using namespace std;
 
@@ -40,6 +57,34 @@ using namespace std;
     B: Board state (server → client)
     P: Position move (client → server)
     W: Game result (server → client)
+
+    c: Capabilities (client → server)
+    C: Accepted capabilities (server → client)
+    K: Chunk of a file or object (server → client), see outbound.h
+    z: Compressed f, o, m or t (client → server), see outbound.h
+    Z: Compressed F, O, M or T (server → client)
+    r: Offer a resumable upload (client → server), see outbound.h
+    k: Piece of a resumable upload (client → server)
+    R: Bytes of a resumable upload received (server → client)
+    D: Piece of a resumable delivery (server → client)
+    a: Piece of a resumable delivery saved (client → server)
+    S: Session token for data connections (server → client)
+    d: Open a data connection (client → server, instead of n)
+    h: Announce an upload by its chunks (client → server), see outbound.h
+    H: Chunks of an announced upload to send (server → client)
+    u: Chunk of an announced upload (client → server)
+    q: Ask a recipient for the signature of its copy of a file (client → server)
+    Q: Signature request (server → client)
+    g: Signature of a copy (client → server)
+    G: Signature of the recipient's copy (server → client)
+    v: File as a delta of the recipient's copy (client → server)
+    V: File as a delta of the local copy (server → client)
+    w: Envelope, t, f or o for several recipients (client → server), see outbound.h
+    Y: What became of each copy of an envelope (server → client)
+    b: Open a batch of small files (client → server), see outbound.h
+    s: Segment of a batch (client → server)
+    A: Header table of a batch (server → client)
+    N: Segment of a batch (server → client)
 */
 
 atomic<bool> waitingForGameInput(false);
@@ -50,6 +95,67 @@ condition_variable ready;
 string userInput;
 bool inputReady = false;
 
+// Bulk frames arrive in K chunks; a finished frame is replayed to the parser
+string replayFrame;
+size_t replayPos = 0;
+map<uint16_t, string> chunkStreams;
+mutex saveMutex;
+
+// Caps accepted by the server; compression is requested unless --no-compress
+atomic<uint16_t> serverCaps(0);
+
+// Largest text an M or T may carry (its 3 byte length field)
+#define MAX_MESSAGE_LENGTH ((1 << 24) - 1)
+
+// Largest file expanded from a compressed F frame; the whole file is held
+// in memory, and the stream header comes from the sender
+#define MAX_EXPANDED_FILE (4ull * 1024 * 1024 * 1024)
+
+// Resumable uploads: bytes the server acknowledged per transfer id, and
+// the name and size of each upload in progress
+#define RESUME_OFFER_TIMEOUT chrono::seconds(10)
+#define RESUME_STALL_TIMEOUT chrono::seconds(60)
+map<uint64_t, uint64_t> uploadAcks;
+map<uint64_t, pair<string, uint64_t>> uploadFiles;
+mutex uploadMutex;
+condition_variable uploadAcked;
+
+// Parallel uploads (TCP_CAP_PARALLEL): data connections per file, from
+// --streams, and the token the server gave this session to open them.
+// The default of 1 sends everything on the chat connection: on loopback
+// and on a shaped 400 Mbit/s link extra streams only added overhead, so
+// they are opt-in for paths where one flow's window is the limit.
+int dataStreams = 1;
+string sessionNickname;
+atomic<uint64_t> sessionToken(0);
+
+// Deduplicated uploads (TCP_CAP_DEDUP): the chunks the server asked for,
+// by upload id, and the uploads it refused (under uploadMutex)
+atomic<uint64_t> nextChunkedId(1);
+map<uint64_t, vector<uint32_t>> chunkRequests;
+set<uint64_t> chunkRefusals;
+
+// Delta transfers (TCP_CAP_DELTA): signatures of the recipients' copies,
+// by request id (under uploadMutex)
+#define DELTA_SIGNATURE_TIMEOUT chrono::seconds(5)
+atomic<uint64_t> nextDeltaId(1);
+map<uint64_t, DeltaSignature> deltaSignatures;
+
+// Batches of small files (TCP_CAP_BATCH): ids of the ones we send, and
+// the ones being received by sender and id (under saveMutex)
+struct IncomingBatch {
+    vector<BatchFile> files;
+    vector<uint64_t> saved; // bytes of each file written so far
+    size_t done = 0;        // files complete
+};
+atomic<uint64_t> nextBatchId(1);
+map<pair<string, uint64_t>, IncomingBatch> incomingBatches;
+
+// /ping: round trips of private messages to ourselves
+mutex pingMutex;
+vector<double> pingSamples;
+size_t pingExpected = 0;
+
 // Helper function to print protocol data in hex
 string formatProtocol(const string& data) {
     stringstream ss;
@@ -63,50 +169,174 @@ string formatProtocol(const string& data) {
     return ss.str();
 }
 
+// Send a frame whole (and 'body' right after it). The input loop, the
+// receiver thread (acks, signatures) and background uploads all send on
+// the chat connection, so frames must not interleave.
+mutex sendMutex;
+bool sendFrame(int sock, const string& frame, const char* body = nullptr, size_t length = 0) {
+    lock_guard<mutex> lock(sendMutex);
+    return sendFully(sock, frame.data(), frame.size()) && (length == 0 || sendFully(sock, body, length));
+}
+
 void sendNickname(int sock, const string nick) {
     string packet = "n";
     uint16_t len = htons(nick.size());
     packet.append((char*)&len,2);
     packet += nick;
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
+}
+
+void sendCaps(int sock, uint16_t caps) {
+    string packet = "c";
+    packet.push_back((caps >> 8) & 0xFF);
+    packet.push_back(caps & 0xFF);
+    cout << "Protocol sending: " << formatProtocol(packet) << endl;
+    sendFrame(sock, packet);
+}
+
+// Send a frame followed by 'length' bytes of body taken from 'read(data, n)'
+// a block at a time, holding sendMutex throughout. If the source comes up
+// short the rest is sent as zeros, so the connection keeps its framing.
+bool sendFrameFrom(int sock, const string& frame, function<bool(char*, size_t)> read, uint64_t length) {
+    lock_guard<mutex> lock(sendMutex);
+    if (!sendFully(sock, frame.data(), frame.size())) return false;
+    vector<char> block(LZ_BLOCK_SIZE);
+    bool complete = true;
+    while (length > 0) {
+        size_t n = min((uint64_t)block.size(), length);
+        if (complete && !read(block.data(), n)) {
+            complete = false;
+        }
+        if (!complete) {
+            fill(block.begin(), block.begin() + n, '\0');
+        }
+        if (!sendFully(sock, block.data(), n)) return false;
+        length -= n;
+    }
+    return complete;
+}
+
+// LZ stream of a file, written block by block to a temporary file, if the
+// server accepted TCP_CAP_COMPRESS and it comes out smaller; the stream is
+// left at its end (its position is its size). nullptr otherwise.
+FILE* compressFile(ifstream& file, uint64_t size) {
+    if (!(serverCaps & TCP_CAP_COMPRESS) || size < LZ_MIN_SIZE) return nullptr;
+    FILE* stream = tmpfile();
+    if (stream == nullptr) return nullptr;
+
+    LzEncoder encoder(size);
+    string out;
+    encoder.header(out);
+    vector<char> block(LZ_BLOCK_SIZE);
+    uint64_t written = 0;
+    for (uint64_t offset = 0; offset < size; offset += LZ_BLOCK_SIZE) {
+        size_t n = min((uint64_t)LZ_BLOCK_SIZE, size - offset);
+        if (!file.read(block.data(), n)) break;
+        encoder.block(block.data(), n, out);
+        written += out.size();
+        if (written >= size || fwrite(out.data(), 1, out.size(), stream) != out.size()) break;
+        out.clear();
+        if (offset + n == size) {
+            return stream;
+        }
+    }
+    fclose(stream);
+    return nullptr;
+}
+
+// Replace 'content' by its LZ stream if the server accepted TCP_CAP_COMPRESS
+// and it comes out smaller; returns the marker that goes before the frame
+string compressContent(string& content, const string& what) {
+    if (!(serverCaps & TCP_CAP_COMPRESS) || content.size() < LZ_MIN_SIZE) return "";
+    string stream = lzCompress(content.data(), content.size());
+    if (stream.size() >= content.size()) return "";
+    cout << "Compressed " << what << ": " << content.size() << " -> " << stream.size() << " bytes" << endl;
+    content = move(stream);
+    return "z";
+}
+
+// Recipients of a command: "bob" or, separated by commas, "bob,carol,dave"
+vector<string> splitRecipients(const string& dest) {
+    vector<string> recipients;
+    stringstream names(dest);
+    string name;
+    while (getline(names, name, ',')) {
+        if (!name.empty() && find(recipients.begin(), recipients.end(), name) == recipients.end()) {
+            recipients.push_back(name);
+        }
+    }
+    return recipients;
+}
+
+// Envelope (TCP_CAP_ENVELOPE) that has the server send the frame after it
+// to every recipient in 'dest'; "" for a single one. 'frameDest' is set to
+// the destination the frame itself carries (empty in an envelope).
+string buildEnvelope(const string& dest, string& frameDest) {
+    vector<string> recipients = splitRecipients(dest);
+    frameDest = dest;
+    if (recipients.size() <= 1) return "";
+    frameDest = "";
+    string packet = "w";
+    uint16_t count = htons(recipients.size());
+    packet.append((char*)&count, 2);
+    for (const string& recipient : recipients) {
+        uint16_t len = htons(recipient.size());
+        packet.append((char*)&len, 2);
+        packet += recipient;
+    }
+    return packet;
+}
+
+// Send to the recipients in 'dest': one upload in an envelope when the
+// server fans it out, otherwise one per recipient
+void sendToRecipients(const string& dest, const function<void(const string&)>& send) {
+    vector<string> recipients = splitRecipients(dest);
+    if (recipients.size() <= 1 || (serverCaps & TCP_CAP_ENVELOPE)) {
+        send(dest);
+        return;
+    }
+    for (const string& recipient : recipients) {
+        send(recipient);
+    }
 }
 
-void sendBroadcast(int sock, const string msg) {
-    string packet = "m";
+void sendBroadcast(int sock, string msg) {
+    string packet = compressContent(msg, "broadcast") + "m";
     uint32_t len = msg.size();
     packet.push_back((len>>16)&0xFF);
     packet.push_back((len>>8)&0xFF);
     packet.push_back(len&0xFF);
     packet += msg;
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
-void sendToClient(int sock, const string dest, const string msg) {
-    string packet = "t";
-    uint16_t dlen = htons(dest.size());
+void sendToClient(int sock, const string dest, string msg) {
+    string frameDest;
+    string packet = buildEnvelope(dest, frameDest) + compressContent(msg, "message") + "t";
+    uint16_t dlen = htons(frameDest.size());
     packet.append((char*)&dlen,2);
-    packet += dest;
+    packet += frameDest;
     uint32_t mlen = msg.size();
     packet.push_back((mlen>>16)&0xFF);
     packet.push_back((mlen>>8)&0xFF);
     packet.push_back(mlen&0xFF);
     packet += msg;
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
 void requestList(int sock) {
     string packet = "l";
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), 1, 0);
+    sendFrame(sock, packet);
 }
 
 void sendClose(int sock) {
     string packet = "x";
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), 1, 0);
+    sendFrame(sock, packet);
 }
 
 // Parse list response
@@ -137,7 +367,303 @@ void parseListResponse(char* buf, int len) {
     cout << endl;
 }
 
+// Append a big endian number of 'width' bytes
+void appendNumber(string& packet, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        packet.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+// Connect a new socket to the server; -1 if it can't
+int connectToServer() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Open a data connection for upload pieces; -1 if it can't
+int openDataConnection() {
+    int data = connectToServer();
+    if (data < 0) return -1;
+    string packet = "d";
+    appendNumber(packet, sessionNickname.size(), 2);
+    packet += sessionNickname;
+    appendNumber(packet, sessionToken, 8);
+    if (!sendFully(data, packet.data(), packet.size())) {
+        close(data);
+        return -1;
+    }
+    return data;
+}
+
+// Send the pieces of a resumable upload from 'offset' over several data
+// connections, so the file isn't held to what one TCP flow gets. Each
+// stream takes the next piece, but none runs more than a window ahead of
+// the server's ack: that bounds what the server holds out of order.
+void sendParallel(vector<int> streams, uint64_t id, string filename, uint64_t fsize, uint64_t offset) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t window = (uint64_t)max(RESUME_WINDOW, 2 * (int)streams.size()) * RESUME_PIECE_SIZE;
+    atomic<uint64_t> next(offset);
+    atomic<bool> failed(false);
+    vector<thread> workers;
+    for (int data : streams) {
+        workers.emplace_back([&, data]() {
+            ifstream file(filename, ios::binary);
+            vector<char> piece(RESUME_PIECE_SIZE);
+            while (!failed) {
+                uint64_t at = next.fetch_add(RESUME_PIECE_SIZE);
+                if (at >= fsize) break;
+                {
+                    unique_lock<mutex> lock(uploadMutex);
+                    bool open = uploadAcked.wait_for(lock, RESUME_STALL_TIMEOUT,
+                                                     [&] { return failed || uploadAcks[id] + window > at; });
+                    if (!open || failed) {
+                        failed = true;
+                        uploadAcked.notify_all();
+                        break;
+                    }
+                }
+                size_t length = min((uint64_t)RESUME_PIECE_SIZE, fsize - at);
+                string head = "k";
+                appendNumber(head, id, 8);
+                appendNumber(head, at, 10);
+                appendNumber(head, length, 3);
+                if (!file.seekg(at) || !file.read(piece.data(), length) || !sendFully(data, head.data(), head.size()) ||
+                    !sendFully(data, piece.data(), length)) {
+                    lock_guard<mutex> lock(uploadMutex);
+                    failed = true;
+                    uploadAcked.notify_all();
+                    break;
+                }
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    for (int data : streams) {
+        close(data);
+    }
+
+    unique_lock<mutex> lock(uploadMutex);
+    if (failed || !uploadAcked.wait_for(lock, RESUME_STALL_TIMEOUT, [&] { return uploadAcks[id] == fsize; })) {
+        cout << "Connection lost: the server has " << uploadAcks[id] << " of " << fsize << " bytes of " << filename
+             << ", send it again to resume" << endl;
+        return;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Sent " << filename << " (" << fsize - offset << " bytes) over " << streams.size() << " streams in "
+         << fixed << setprecision(2) << seconds << " s, " << (fsize - offset) / seconds / (1024 * 1024) << " MB/s"
+         << defaultfloat << endl;
+}
+
+// Send a file as a resumable upload (TCP_CAP_RESUME): offer it and send
+// pieces from where the server says it has it up to. Sending the same
+// file again after a lost connection continues from the last ack.
+void sendResumable(int sock, const string& dest, const string& filename, uint64_t fsize, int64_t modified) {
+    uint64_t id = transferId(dest, filename, fsize, modified);
+    {
+        lock_guard<mutex> lock(uploadMutex);
+        uploadAcks.erase(id);
+        uploadFiles[id] = {filename, fsize};
+    }
+
+    string packet = "r";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, dest.size(), 2);
+    packet += dest;
+    appendNumber(packet, filename.size(), 3);
+    packet += filename;
+    appendNumber(packet, fsize, 10);
+    cout << "Protocol sending: " << formatProtocol(packet) << endl;
+    if (!sendFrame(sock, packet)) {
+        cout << "Error: connection lost" << endl;
+        return;
+    }
+
+    uint64_t offset;
+    {
+        unique_lock<mutex> lock(uploadMutex);
+        if (!uploadAcked.wait_for(lock, RESUME_OFFER_TIMEOUT, [id] { return uploadAcks.count(id) > 0; })) {
+            cout << "Error: the server did not answer the upload offer" << endl;
+            return;
+        }
+        offset = uploadAcks[id];
+    }
+    if (offset > 0) {
+        cout << "Resuming upload of " << filename << " at " << offset << " of " << fsize << " bytes" << endl;
+    }
+
+    // With data connections the pieces go in the background and the chat
+    // connection stays free
+    if ((serverCaps & TCP_CAP_PARALLEL) && sessionToken != 0 && dataStreams > 1 && offset < fsize) {
+        vector<int> streams;
+        for (int i = 0; i < dataStreams; i++) {
+            int data = openDataConnection();
+            if (data >= 0) streams.push_back(data);
+        }
+        if (!streams.empty()) {
+            cout << "Protocol sending: k... (" << filename << " over " << streams.size() << " data connections)" << endl;
+            thread(sendParallel, streams, id, filename, fsize, offset).detach();
+            return;
+        }
+        cout << "Could not open data connections, sending on this one" << endl;
+    }
+
+    ifstream file(filename, ios::binary);
+    file.seekg(offset);
+    vector<char> piece(RESUME_PIECE_SIZE);
+    while (offset < fsize) {
+        size_t length = min((uint64_t)RESUME_PIECE_SIZE, fsize - offset);
+        if (!file.read(piece.data(), length)) {
+            cout << "Error: Could not read file" << endl;
+            return;
+        }
+        string head = "k";
+        appendNumber(head, id, 8);
+        appendNumber(head, offset, 10);
+        appendNumber(head, length, 3);
+        if (!sendFrame(sock, head, piece.data(), length)) {
+            lock_guard<mutex> lock(uploadMutex);
+            cout << "Connection lost: the server has " << uploadAcks[id] << " of " << fsize << " bytes of " << filename
+                 << ", send it again after reconnecting to resume" << endl;
+            return;
+        }
+        offset += length;
+    }
+    cout << "Protocol sending: k... (" << filename << " up to " << fsize << " bytes)" << endl;
+}
+
+// Send a file deduplicated (TCP_CAP_DEDUP): announce its chunks by hash
+// and send only the ones the server doesn't have
+void sendChunked(int sock, const string& dest, const string& filename, const string& content) {
+    uint64_t id = nextChunkedId++;
+    vector<size_t> lengths = chunkLengths(content.data(), content.size());
+    vector<size_t> offsets;
+    string packet = "h";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, dest.size(), 2);
+    packet += dest;
+    appendNumber(packet, filename.size(), 3);
+    packet += filename;
+    appendNumber(packet, content.size(), 10);
+    appendNumber(packet, lengths.size(), 4);
+    size_t offset = 0;
+    for (size_t length : lengths) {
+        offsets.push_back(offset);
+        appendNumber(packet, length, 3);
+        packet += sha256(content.data() + offset, length);
+        offset += length;
+    }
+    cout << "Protocol sending: h... (" << filename << ", " << lengths.size() << " chunks)" << endl;
+    if (!sendFrame(sock, packet)) {
+        cout << "Error: connection lost" << endl;
+        return;
+    }
+
+    vector<uint32_t> wanted;
+    {
+        unique_lock<mutex> lock(uploadMutex);
+        if (!uploadAcked.wait_for(lock, RESUME_OFFER_TIMEOUT,
+                                  [id] { return chunkRequests.count(id) > 0 || chunkRefusals.count(id) > 0; })) {
+            cout << "Error: the server did not answer the upload of " << filename << endl;
+            return;
+        }
+        if (chunkRefusals.erase(id) > 0) {
+            // The server's error frame already said why
+            return;
+        }
+        wanted = move(chunkRequests[id]);
+        chunkRequests.erase(id);
+    }
+
+    // The missing chunks, compressed when the server takes it and it pays
+    uint64_t sent = 0;
+    for (uint32_t index : wanted) {
+        if (index >= lengths.size()) continue;
+        string data = content.substr(offsets[index], lengths[index]);
+        string frame;
+        if (serverCaps & TCP_CAP_COMPRESS) {
+            string packed = lzCompress(data.data(), data.size());
+            if (packed.size() < data.size()) {
+                frame = "z";
+                data = move(packed);
+            }
+        }
+        frame += "u";
+        appendNumber(frame, id, 8);
+        appendNumber(frame, index, 4);
+        appendNumber(frame, data.size(), 3);
+        frame += data;
+        if (!sendFrame(sock, frame)) {
+            cout << "Error: connection lost" << endl;
+            return;
+        }
+        sent += lengths[index];
+    }
+    cout << "Deduplicated " << filename << ": uploaded " << wanted.size() << " of " << lengths.size() << " chunks ("
+         << sent << " of " << content.size() << " bytes)" << endl;
+}
+
+// Send a file as a delta of the recipient's copy from an earlier transfer
+// (TCP_CAP_DELTA). False if it has no copy or the delta wouldn't save
+// much: the file then goes the usual way.
+bool sendDelta(int sock, const string& dest, const string& filename, const string& content) {
+    uint64_t id = nextDeltaId++;
+    string request = "q";
+    appendNumber(request, id, 8);
+    appendNumber(request, dest.size(), 2);
+    request += dest;
+    appendNumber(request, filename.size(), 3);
+    request += filename;
+    cout << "Protocol sending: " << formatProtocol(request) << endl;
+    if (!sendFrame(sock, request)) return false;
+
+    DeltaSignature signature;
+    {
+        unique_lock<mutex> lock(uploadMutex);
+        if (!uploadAcked.wait_for(lock, DELTA_SIGNATURE_TIMEOUT, [id] { return deltaSignatures.count(id) > 0; })) {
+            return false;
+        }
+        signature = move(deltaSignatures[id]);
+        deltaSignatures.erase(id);
+    }
+    if (signature.blockSize == 0) return false;
+
+    uint64_t reused;
+    string delta = computeDelta(signature, content.data(), content.size(), reused);
+    if (delta.size() > content.size() / 2) {
+        cout << "Delta of " << filename << " would save little (" << reused << " bytes reused), sending it whole"
+             << endl;
+        return false;
+    }
+
+    string packet = "v";
+    appendNumber(packet, dest.size(), 2);
+    packet += dest;
+    appendNumber(packet, filename.size(), 3);
+    packet += filename;
+    appendNumber(packet, content.size(), 10);
+    appendNumber(packet, signature.baseSize, 10);
+    appendNumber(packet, signature.blockSize, 4);
+    packet += sha256(content.data(), content.size());
+    appendNumber(packet, delta.size(), 10);
+    cout << "Delta of " << filename << ": " << delta.size() << " bytes instead of " << content.size() << " ("
+         << reused << " reused from " << dest << "'s copy)" << endl;
+    return sendFrame(sock, packet, delta.data(), delta.size());
+}
+
 void sendFile(int sock, string dest, const string& filename) {
+    string frameDest;
+    string envelope = buildEnvelope(dest, frameDest);
+
     // Read file
     ifstream file(filename, ios::binary | ios::ate);
     if (!file.is_open()) {
@@ -148,21 +674,54 @@ void sendFile(int sock, string dest, const string& filename) {
     // get the length
     streamsize file_size = file.tellg();
     file.seekg(0, ios::beg);
-    
-    // Read the content
-    vector<char> file_data(file_size);
-    if (!file.read(file_data.data(), file_size)) {
-        cout << "Error: Could not read file" << endl;
+
+    // Large files go resumably when the server supports it (uncompressed:
+    // the pieces are the file's own bytes)
+    // (these and deltas and deduplication are per recipient; an envelope
+    // goes in one f frame)
+    struct stat info;
+    if (envelope.empty() && (serverCaps & TCP_CAP_RESUME) && file_size >= RESUME_MIN_SIZE && stat(filename.c_str(), &info) == 0) {
+        file.close();
+        sendResumable(sock, dest, filename, file_size, info.st_mtime);
         return;
     }
-    file.close();
     
-    string packet = "f";
+    // Deltas and deduplication work on the whole content in memory
+    bool delta = envelope.empty() && (serverCaps & TCP_CAP_DELTA) && file_size >= DELTA_MIN_SIZE && file_size <= DELTA_MAX_SIZE;
+    bool chunked = envelope.empty() && (serverCaps & TCP_CAP_DEDUP) && file_size >= CHUNK_MIN_SIZE;
+    if (delta || chunked) {
+        string file_data(file_size, '\0');
+        if (!file.read(&file_data[0], file_size)) {
+            cout << "Error: Could not read file" << endl;
+            return;
+        }
+        if (delta && sendDelta(sock, dest, filename, file_data)) {
+            return;
+        }
+        if (chunked) {
+            sendChunked(sock, dest, filename, file_data);
+            return;
+        }
+        file.seekg(0, ios::beg);
+    }
+
+    // The content is read (and compressed) a block at a time, so memory
+    // doesn't grow with the file
+    FILE* stream = compressFile(file, file_size);
+    uint64_t fsize = file_size;
+    string packet = envelope;
+    if (stream != nullptr) {
+        fsize = ftell(stream);
+        cout << "Compressed file: " << file_size << " -> " << fsize << " bytes" << endl;
+        rewind(stream);
+        packet += "z";
+    }
+    packet += "f";
     
     // nickname
-    uint16_t dlen = htons(dest.size());
+    uint16_t dlen = htons(frameDest.size());
     packet.append((char*)&dlen, 2);
-    packet += dest;
+    packet += frameDest;
     
     // filename
     uint32_t flen = filename.size();
@@ -173,37 +732,194 @@ void sendFile(int sock, string dest, const string& filename) {
     packet += filename;
     
     // file
-    uint64_t fsize = file_size;
-
     for (int i = 9; i >= 0; i--) {
         packet.push_back((fsize >> (i * 8)) & 0xFF);
     }
     
-    packet.append(file_data.data(), file_size);
-    
     cout << "Protocol sending: " << formatProtocol(packet.substr(0, 50)) << "..." << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    bool sent;
+    if (stream != nullptr) {
+        sent = sendFrameFrom(sock, packet, [stream](char* data, size_t length) {
+            return fread(data, 1, length, stream) == length;
+        }, fsize);
+        fclose(stream);
+    } else {
+        file.clear();
+        file.seekg(0, ios::beg);
+        sent = sendFrameFrom(sock, packet, [&file](char* data, size_t length) {
+            return (bool)file.read(data, length);
+        }, fsize);
+    }
+    if (!sent) {
+        cout << "Error: Could not send " << filename << endl;
+    }
+}
+
+// Send small files in one batch: a thread reads them into segments, up to
+// BATCH_READ_AHEAD ahead of the one being sent
+void sendBatch(int sock, const string& dest, const vector<string>& paths, const vector<BatchFile>& files) {
+    uint64_t id = nextBatchId++;
+    string table = encodeBatchTable(files);
+    string packet = "b";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, dest.size(), 2);
+    packet += dest;
+    appendNumber(packet, table.size(), 4);
+    cout << "Protocol sending: " << formatProtocol(packet) << " + table of " << files.size() << " files" << endl;
+    if (!sendFrame(sock, packet, table.data(), table.size())) {
+        cout << "Error: connection lost" << endl;
+        return;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    deque<string> segments;
+    bool finished = false;
+    bool stopped = false;
+    mutex segmentMutex;
+    condition_variable segmentReady;
+    auto push = [&](string& segment) {
+        unique_lock<mutex> lock(segmentMutex);
+        segmentReady.wait(lock, [&] { return segments.size() < BATCH_READ_AHEAD || stopped; });
+        segments.push_back(move(segment));
+        segment.clear();
+        segmentReady.notify_all();
+        return !stopped;
+    };
+    thread reader([&]() {
+        // A file that can't be read in full is sent padded with zeros, as
+        // the table already gave its size
+        string segment;
+        bool open = true;
+        for (size_t i = 0; i < files.size() && open; i++) {
+            ifstream in(paths[i], ios::binary);
+            uint64_t left = files[i].size;
+            bool complete = true;
+            while (left > 0 && open) {
+                size_t start = segment.size();
+                size_t n = min(left, (uint64_t)(BATCH_SEGMENT_SIZE - start));
+                segment.resize(start + n);
+                in.read(&segment[start], n);
+                if ((size_t)in.gcount() < n) {
+                    fill(segment.begin() + start + in.gcount(), segment.end(), '\0');
+                    complete = false;
+                }
+                left -= n;
+                if (segment.size() == BATCH_SEGMENT_SIZE) open = push(segment);
+            }
+            if (!complete) {
+                cout << "[Error] Could not read all of " << paths[i] << ", sent padded with zeros" << endl;
+            }
+        }
+        if (!segment.empty() && open) push(segment);
+        lock_guard<mutex> lock(segmentMutex);
+        finished = true;
+        segmentReady.notify_all();
+    });
+
+    uint64_t offset = 0;
+    while (true) {
+        string segment;
+        {
+            unique_lock<mutex> lock(segmentMutex);
+            segmentReady.wait(lock, [&] { return !segments.empty() || finished; });
+            if (segments.empty()) break;
+            segment = move(segments.front());
+            segments.pop_front();
+            segmentReady.notify_all();
+        }
+        string header = "s";
+        appendNumber(header, id, 8);
+        appendNumber(header, segment.size(), 3);
+        if (!sendFrame(sock, header, segment.data(), segment.size())) {
+            cout << "Error: connection lost" << endl;
+            lock_guard<mutex> lock(segmentMutex);
+            stopped = true;
+            segmentReady.notify_all();
+            break;
+        }
+        offset += segment.size();
+    }
+    reader.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Sent " << files.size() << " files (" << offset << " bytes) to " << dest << " in one batch, "
+         << fixed << setprecision(2) << seconds << " s" << defaultfloat << endl;
+}
+
+// /files: the files given and the regular files of the directories given.
+// Small ones go in a batch when the server takes it, the rest one by one.
+void sendFiles(int sock, const string& dest, const vector<string>& args) {
+    vector<string> paths;
+    for (const string& arg : args) {
+        struct stat info;
+        if (stat(arg.c_str(), &info) != 0) {
+            cout << "Error: Could not open file " << arg << endl;
+        } else if (S_ISDIR(info.st_mode)) {
+            DIR* dir = opendir(arg.c_str());
+            if (dir == nullptr) {
+                cout << "Error: Could not open directory " << arg << endl;
+                continue;
+            }
+            vector<string> entries;
+            while (struct dirent* entry = readdir(dir)) {
+                string path = arg + "/" + entry->d_name;
+                if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) entries.push_back(path);
+            }
+            closedir(dir);
+            sort(entries.begin(), entries.end());
+            paths.insert(paths.end(), entries.begin(), entries.end());
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    vector<string> batched;
+    vector<string> single;
+    vector<BatchFile> files;
+    uint64_t offset = 0;
+    for (const string& path : paths) {
+        struct stat info;
+        if (!(serverCaps & TCP_CAP_BATCH) || stat(path.c_str(), &info) != 0 || info.st_size > BATCH_MAX_FILE_SIZE) {
+            single.push_back(path);
+            continue;
+        }
+        // Sent under its own name, without the directory
+        size_t slash = path.find_last_of('/');
+        files.push_back({slash == string::npos ? path : path.substr(slash + 1), (uint64_t)info.st_size, offset});
+        batched.push_back(path);
+        offset += info.st_size;
+        if (files.size() == BATCH_MAX_FILES) {
+            sendBatch(sock, dest, batched, files);
+            batched.clear();
+            files.clear();
+            offset = 0;
+        }
+    }
+    if (!files.empty()) sendBatch(sock, dest, batched, files);
+    for (const string& path : single) {
+        sendFile(sock, dest, path);
+    }
 }
 
 void sendObject(int sock, const string &dest, const Sala &sala) {
-    string packet;
+    vector<char> serialized = serializarSala(sala);
+    string objectContent(serialized.begin(), serialized.end());
+    string frameDest;
+    string packet = buildEnvelope(dest, frameDest) + compressContent(objectContent, "object");
 
     packet.push_back('o');
 
-    uint16_t dlen = htons(static_cast<uint16_t>(dest.size()));
+    uint16_t dlen = htons(static_cast<uint16_t>(frameDest.size()));
     packet.append(reinterpret_cast<char*>(&dlen), sizeof(dlen));
-    packet += dest;
-
-    vector<char> objectContent = serializarSala(sala);
+    packet += frameDest;
 
     // 4 bytes
     uint32_t objSize = htonl(static_cast<uint32_t>(objectContent.size()));
     packet.append(reinterpret_cast<char*>(&objSize), sizeof(objSize));
 
     // object content
-    packet.insert(packet.end(), objectContent.begin(), objectContent.end());
+    packet += objectContent;
 
-    send(sock, packet.data(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
 void sendGameRequest(int sock, const string& dest) {
@@ -212,7 +928,7 @@ void sendGameRequest(int sock, const string& dest) {
     packet.append((char*)&dlen, 2);
     packet += dest;
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
 void sendGameResponse(int sock, const string& sender, bool accept) {
@@ -222,7 +938,7 @@ void sendGameResponse(int sock, const string& sender, bool accept) {
     packet += sender;
     packet.push_back(accept ? 'y' : 'n');
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
 void sendBoardPosition(int sock, int position) {
@@ -233,7 +949,7 @@ void sendBoardPosition(int sock, int position) {
     packet.push_back((pos >> 8) & 0xFF);
     packet.push_back(pos & 0xFF);
     cout << "Protocol sending: " << formatProtocol(packet) << endl;
-    send(sock, packet.c_str(), packet.size(), 0);
+    sendFrame(sock, packet);
 }
 
 void printBoard(const vector<char>& board, const string& currentPlayer, const string& myNickname) {
@@ -297,21 +1013,394 @@ string getBoardInput(const string& prompt) {
     return userInput;
 }
 
+// Read exactly len bytes from the socket
+int readExact(int sock, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        int r = recv(sock, (char*)buf + done, len - done, 0);
+        if (r <= 0) return r;
+        done += r;
+    }
+    return len;
+}
+
+// Total size of an F, O or D frame from its first chunk (0 if not known yet)
+size_t bulkFrameSize(const string& frame) {
+    if (!frame.empty() && frame[0] == COMPRESSED_FRAME) {
+        size_t inner = bulkFrameSize(frame.substr(1));
+        return inner == 0 ? 0 : 1 + inner;
+    }
+    if (!frame.empty() && frame[0] == 'D') {
+        if (frame.size() < 11) return 0;
+        size_t pos = 11 + (((unsigned char)frame[9] << 8) | (unsigned char)frame[10]);
+        if (frame.size() < pos + 3) return 0;
+        pos += 3 + (((unsigned char)frame[pos] << 16) | ((unsigned char)frame[pos + 1] << 8) | (unsigned char)frame[pos + 2]);
+        if (frame.size() < pos + 23) return 0;
+        pos += 20;
+        return pos + 3 + (((unsigned char)frame[pos] << 16) | ((unsigned char)frame[pos + 1] << 8) | (unsigned char)frame[pos + 2]);
+    }
+    if (frame.size() < 3) return 0;
+    size_t pos = 3 + (((unsigned char)frame[1] << 8) | (unsigned char)frame[2]);
+    if (frame[0] == 'O') {
+        if (frame.size() < pos + 4) return 0;
+        uint32_t objSize;
+        memcpy(&objSize, frame.data() + pos, 4);
+        return pos + 4 + ntohl(objSize);
+    }
+    if (frame[0] != 'F' || frame.size() < pos + 3) return 0;
+    pos += 3 + (((unsigned char)frame[pos] << 16) | ((unsigned char)frame[pos + 1] << 8) | (unsigned char)frame[pos + 2]);
+    if (frame.size() < pos + 10) return 0;
+    uint64_t fsize = 0;
+    for (int i = 0; i < 10; i++) {
+        fsize = (fsize << 8) | (unsigned char)frame[pos + i];
+    }
+    return pos + 10 + fsize;
+}
+
+// Read the type of the next frame. K chunks are joined per stream until the
+// last one, and then the whole frame is read from replayFrame.
+int receiveFrameType(int sock, char& type) {
+    while (true) {
+        if (replayPos < replayFrame.size()) {
+            type = replayFrame[replayPos++];
+            return 1;
+        }
+        replayFrame.clear();
+        replayPos = 0;
+
+        char first;
+        int r = readExact(sock, &first, 1);
+        if (r <= 0) return r;
+        if (first != CHUNK_FRAME) {
+            type = first;
+            return 1;
+        }
+
+        unsigned char head[CHUNK_HEADER_SIZE];
+        r = readExact(sock, head, CHUNK_HEADER_SIZE);
+        if (r <= 0) return r;
+        uint16_t stream = (head[0] << 8) | head[1];
+        uint32_t len = (head[3] << 16) | (head[4] << 8) | head[5];
+
+        string& pending = chunkStreams[stream];
+        size_t old_size = pending.size();
+        pending.resize(old_size + len);
+        r = readExact(sock, &pending[old_size], len);
+        if (r <= 0 && len > 0) return r;
+        if (old_size == 0) {
+            // Allocate the whole frame once instead of growing it chunk by chunk
+            pending.reserve(bulkFrameSize(pending));
+        }
+
+        if (head[2] & CHUNK_LAST) {
+            replayFrame = move(pending);
+            chunkStreams.erase(stream);
+        }
+    }
+}
+
+// recv() for the fields of a frame: from replayFrame if it came in chunks
+int receiveBytes(int sock, void* buf, size_t len) {
+    if (replayPos < replayFrame.size()) {
+        size_t n = min(len, replayFrame.size() - replayPos);
+        memcpy(buf, replayFrame.data() + replayPos, n);
+        replayPos += n;
+        return n;
+    }
+    return readExact(sock, buf, len);
+}
+
+// Read a big endian number of 'width' bytes of a frame
+uint64_t receiveNumber(int sock, int width) {
+    unsigned char buffer[10];
+    int received = 0;
+    while (received < width) {
+        int r = receiveBytes(sock, buffer + received, width - received);
+        if (r <= 0) return 0;
+        received += r;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+// Read a string preceded by its length in 'width' bytes
+string receiveString(int sock, int width) {
+    string value(receiveNumber(sock, width), '\0');
+    size_t received = 0;
+    while (received < value.size()) {
+        int r = receiveBytes(sock, &value[received], value.size() - received);
+        if (r <= 0) break;
+        received += r;
+    }
+    return value;
+}
+
+// Where a received file is saved: name_dest.ext
+string destinationName(const string& filename) {
+    size_t dot_pos = filename.find_last_of(".");
+    if (dot_pos != string::npos) {
+        return filename.substr(0, dot_pos) + "_dest" + filename.substr(dot_pos);
+    }
+    return filename + "_dest";
+}
+
+// Save a piece of a resumable delivery at its offset in the .part file
+// (pieces may arrive out of order) and acknowledge it. The empty piece at
+// the end means all are saved: the file gets its final name.
+void savePiece(int sock, uint64_t id, const string& sender, const string& filename, uint64_t fsize, uint64_t offset,
+               const char* data, size_t length) {
+    string final_name = destinationName(filename);
+    string part_name = final_name + ".part";
+    if (length == 0) {
+        if (truncate(part_name.c_str(), fsize) != 0 || rename(part_name.c_str(), final_name.c_str()) != 0) {
+            cout << "[Error] Could not save file: " << final_name << endl;
+            return;
+        }
+        cout << "[File received from " << sender << "] Saved as: " << final_name << " (" << fsize << " bytes)" << endl;
+    } else {
+        ofstream(part_name, ios::binary | ios::app); // create it if missing
+        fstream part(part_name, ios::binary | ios::in | ios::out);
+        part.seekp(offset);
+        part.write(data, length);
+        part.close();
+        if (!part) {
+            cout << "[Error] Could not save file: " << part_name << endl;
+            return;
+        }
+        if (offset % (64 * RESUME_PIECE_SIZE) == 0) {
+            cout << "[Receiving " << filename << " from " << sender << "] piece at " << offset << " of " << fsize
+                 << " bytes" << endl;
+        }
+    }
+
+    string ack = "a";
+    appendNumber(ack, id, 8);
+    appendNumber(ack, offset, 10);
+    sendFrame(sock, ack);
+}
+
+// A batch is announced: the empty files are saved now, the rest as their
+// segments come
+void startBatch(const string& sender, uint64_t id, const string& table) {
+    IncomingBatch batch;
+    if (!decodeBatchTable(table, batch.files)) {
+        cout << "[Error] Invalid batch from " << sender << endl;
+        return;
+    }
+    cout << "[Batch from " << sender << "] " << batch.files.size() << " files (" << batchSize(batch.files)
+         << " bytes) on the way" << endl;
+    batch.saved.assign(batch.files.size(), 0);
+    for (const BatchFile& file : batch.files) {
+        if (file.size > 0) continue;
+        ofstream(destinationName(file.filename), ios::binary | ios::trunc);
+        batch.done++;
+    }
+    lock_guard<mutex> lock(saveMutex);
+    if (batch.done == batch.files.size()) {
+        cout << "[Batch received from " << sender << "] " << batch.files.size() << " files saved (0 bytes)" << endl;
+        return;
+    }
+    incomingBatches[{sender, id}] = move(batch);
+}
+
+// Save a segment of a batch into the files it covers. A file the segment
+// holds whole is written at once; one split across segments goes through
+// a .part file, renamed when its last bytes are in.
+void saveBatchSegment(const string& sender, uint64_t id, uint64_t offset, const string& data) {
+    lock_guard<mutex> lock(saveMutex);
+    auto it = incomingBatches.find({sender, id});
+    if (it == incomingBatches.end()) return;
+    IncomingBatch& batch = it->second;
+    uint64_t end = offset + data.size();
+    for (size_t i = batchFileAt(batch.files, offset); i < batch.files.size() && batch.files[i].offset < end; i++) {
+        const BatchFile& file = batch.files[i];
+        if (file.size == 0) continue; // saved when the batch was announced
+        uint64_t from = max(offset, file.offset);
+        uint64_t to = min(end, file.offset + file.size);
+        string final_name = destinationName(file.filename);
+        string part_name = final_name + ".part";
+        bool whole = from == file.offset && to == file.offset + file.size;
+        bool written;
+        if (whole) {
+            ofstream out(final_name, ios::binary | ios::trunc);
+            out.write(data.data() + (from - offset), to - from);
+            written = (bool)out;
+        } else {
+            ofstream(part_name, ios::binary | ios::app); // create it if missing
+            fstream part(part_name, ios::binary | ios::in | ios::out);
+            part.seekp(from - file.offset);
+            part.write(data.data() + (from - offset), to - from);
+            part.close();
+            written = (bool)part;
+        }
+        if (!written) {
+            cout << "[Error] Could not save file: " << (whole ? final_name : part_name) << endl;
+        }
+        batch.saved[i] += to - from;
+        if (batch.saved[i] == file.size) {
+            if (!whole && (truncate(part_name.c_str(), file.size) != 0 ||
+                           rename(part_name.c_str(), final_name.c_str()) != 0)) {
+                cout << "[Error] Could not save file: " << final_name << endl;
+            }
+            batch.done++;
+        }
+    }
+    if (batch.done == batch.files.size()) {
+        cout << "[Batch received from " << sender << "] " << batch.files.size() << " files saved ("
+             << batchSize(batch.files) << " bytes)" << endl;
+        incomingBatches.erase(it);
+    }
+}
+
+// Send count private messages to ourselves, one every 10 ms; the receiver
+// thread records each round trip and prints the percentiles at the end
+void runPing(int sock, const string& nickname, size_t count) {
+    {
+        lock_guard<mutex> lock(pingMutex);
+        pingSamples.clear();
+        pingExpected = count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        long long now = chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+        string packet = "t";
+        uint16_t dlen = htons(nickname.size());
+        packet.append((char*)&dlen, 2);
+        packet += nickname;
+        string msg = "ping " + to_string(now);
+        packet.push_back((msg.size() >> 16) & 0xFF);
+        packet.push_back((msg.size() >> 8) & 0xFF);
+        packet.push_back(msg.size() & 0xFF);
+        packet += msg;
+        sendFrame(sock, packet);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+// Returns true if the message was a /ping probe: "ping <microseconds>"
+// to ourselves while a /ping run is waiting for replies. Anything else,
+// such as "/to me ping later", is shown as a normal private message.
+bool recordPing(const string& sender, const string& nickname, const string& msg) {
+    if (sender != nickname || msg.rfind("ping ", 0) != 0 || msg.size() == 5) return false;
+    char* end;
+    long long sent = strtoll(msg.c_str() + 5, &end, 10);
+    if (*end != '\0' || !isdigit((unsigned char)msg[5])) return false;
+    long long now = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+
+    lock_guard<mutex> lock(pingMutex);
+    if (pingSamples.size() >= pingExpected) return false;
+    pingSamples.push_back((now - sent) / 1000.0);
+    if (pingSamples.size() == pingExpected) {
+        vector<double> sorted = pingSamples;
+        sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p) { return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))]; };
+        cout << fixed << setprecision(2) << "[Ping] " << sorted.size() << " round trips: p50 " << percentile(0.50)
+             << " ms, p99 " << percentile(0.99) << " ms, max " << sorted.back() << " ms" << endl;
+        cout.unsetf(ios::fixed);
+    }
+    return true;
+}
+
+// Save a received file (fsize bytes of file_data from offset). Files are
+// written one at a time, in the order they arrived.
+void saveFile(string sender, string new_filename, string file_data, size_t offset, uint64_t fsize) {
+    lock_guard<mutex> lock(saveMutex);
+    ofstream out_file(new_filename, ios::binary);
+    if (out_file.is_open()) {
+        out_file.write(file_data.data() + offset, fsize);
+        out_file.close();
+        cout << "[File received from " << sender << "] Saved as: " << new_filename 
+            << " (" << fsize << " bytes)" << endl;
+    } else {
+        cout << "[Error] Could not save file: " << new_filename << endl;
+    }
+}
+
+// Our copy of a file received before, for delta transfers; false if
+// there is none (or it is too large to take part)
+bool readCopy(const string& filename, string& copy) {
+    struct stat info;
+    string name = destinationName(filename);
+    if (stat(name.c_str(), &info) != 0 || (uint64_t)info.st_size > DELTA_MAX_SIZE) return false;
+    ifstream file(name, ios::binary);
+    copy.resize(info.st_size);
+    return file.read(&copy[0], copy.size()) && file.gcount() == (streamsize)copy.size();
+}
+
+// Answer a signature request (Q) with the signature of our copy of
+// 'filename', an empty one if there is none
+void sendSignature(int sock, uint64_t id, string requester, string filename) {
+    DeltaSignature signature;
+    {
+        lock_guard<mutex> lock(saveMutex); // not while a received file is being written
+        string copy;
+        if (readCopy(filename, copy)) signature = computeSignature(copy);
+    }
+    string packet = "g";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, requester.size(), 2);
+    packet += requester;
+    appendNumber(packet, signature.baseSize, 10);
+    appendNumber(packet, signature.blockSize, 4);
+    appendNumber(packet, signature.weak.size(), 4);
+    for (size_t i = 0; i < signature.weak.size(); i++) {
+        appendNumber(packet, signature.weak[i], 4);
+        appendNumber(packet, signature.strong[i], 8);
+    }
+    sendFrame(sock, packet);
+}
+
+// Rebuild a file sent as a delta of our copy and save it over the copy
+void saveDelta(string sender, string filename, uint64_t fsize, uint64_t baseSize, uint32_t blockSize, string hash,
+               string delta) {
+    lock_guard<mutex> lock(saveMutex);
+    string copy, rebuilt;
+    if (!readCopy(filename, copy) || copy.size() != baseSize ||
+        !applyDelta(copy, blockSize, delta.data(), delta.size(), fsize, rebuilt) ||
+        sha256(rebuilt.data(), rebuilt.size()) != hash) {
+        cout << "[Error] " << filename << " from " << sender << " came as a delta of a copy that changed since, "
+             << "ask for it again" << endl;
+        return;
+    }
+    string new_filename = destinationName(filename);
+    ofstream out_file(new_filename, ios::binary);
+    out_file.write(rebuilt.data(), rebuilt.size());
+    out_file.close();
+    if (!out_file) {
+        cout << "[Error] Could not save file: " << new_filename << endl;
+        return;
+    }
+    cout << "[File received from " << sender << "] Saved as: " << new_filename << " (" << fsize
+         << " bytes, from a delta of " << delta.size() << ")" << endl;
+}
+
 // Receiver thread
 void receiveMessages(int sock, const string& nickname) {
     char header[4];
     while (true) {
-        int r = recv(sock, header, 1, 0);
+        int r = receiveFrameType(sock, header[0]);
         if (r<=0) { cout << "Disconnected." << endl; break; }
         char type = header[0];
 
+        // Compressed frame: the content of the frame that follows is an LZ stream
+        bool compressed = type == COMPRESSED_FRAME;
+        if (compressed) {
+            r = receiveFrameType(sock, header[0]);
+            if (r<=0) { cout << "Disconnected." << endl; break; }
+            type = header[0];
+        }
+
         if (type=='E') {
-            recv(sock, header, 3, 0);
+            receiveBytes(sock, header, 3);
             int len = ((unsigned char)header[0] << 16) |
                     ((unsigned char)header[1] << 8) |
                     (unsigned char)header[2];
             char* buf = new char[len+1];
-            recv(sock, buf, len, 0);
+            receiveBytes(sock, buf, len);
             buf[len]='\0';
             
             string errorPacket = "E";
@@ -321,67 +1410,82 @@ void receiveMessages(int sock, const string& nickname) {
             
             cout << "[Error] " << buf << endl;
             delete[] buf;
-            break;
+            // A refused nickname closes the connection; other errors are not fatal
         }
         else if (type=='M') {
             // read sender
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t slen; memcpy(&slen, header, 2); slen = ntohs(slen);
             char* sbuf = new char[slen+1];
-            recv(sock, sbuf, slen, 0); sbuf[slen] = '\0';
+            receiveBytes(sock, sbuf, slen); sbuf[slen] = '\0';
             string sender(sbuf);
             delete[] sbuf;
 
             // read message
-            recv(sock, header, 3, 0);
+            receiveBytes(sock, header, 3);
             int mlen = ((unsigned char)header[0]<<16) |
                     ((unsigned char)header[1]<<8)  |
                     (unsigned char)header[2];
             char* mbuf = new char[mlen+1];
-            recv(sock, mbuf, mlen, 0); mbuf[mlen] = '\0';
+            receiveBytes(sock, mbuf, mlen); mbuf[mlen] = '\0';
+            string text(mbuf, mlen);
+            bool corrupt = compressed && !lzDecompress(mbuf, mlen, text, MAX_MESSAGE_LENGTH);
+            delete[] mbuf;
+            if (corrupt) {
+                cout << "[Error] Corrupt compressed broadcast from " << sender << endl;
+                continue;
+            }
 
             string broadcastPacket = "M";
             uint16_t slen_net = htons(slen);
             broadcastPacket.append((char*)&slen_net, 2);
             broadcastPacket += sender;
             broadcastPacket += string(header, 3);
-            broadcastPacket += string(mbuf, mlen);
+            broadcastPacket += text;
             cout << "Protocol received: " << formatProtocol(broadcastPacket) << endl;
 
-            cout << "[Broadcast from " << sender << "] " << mbuf << endl;
-            delete[] mbuf;
+            cout << "[Broadcast from " << sender << "] " << text << endl;
         }
         else if (type=='T') {
-            recv(sock, header,2,0);
+            receiveBytes(sock, header,2);
             uint16_t slen; memcpy(&slen,header,2); slen=ntohs(slen);
             char* sbuf=new char[slen+1];
-            recv(sock,sbuf,slen,0); sbuf[slen]='\0';
+            receiveBytes(sock,sbuf,slen); sbuf[slen]='\0';
             string sender(sbuf);
             delete[] sbuf;
 
-            recv(sock,header,3,0);
+            receiveBytes(sock,header,3);
             int mlen = ((unsigned char)header[0]<<16)|
                        ((unsigned char)header[1]<<8)|
                        (unsigned char)header[2];
             char* mbuf=new char[mlen+1];
-            recv(sock,mbuf,mlen,0); mbuf[mlen]='\0';
+            receiveBytes(sock,mbuf,mlen); mbuf[mlen]='\0';
+            string text(mbuf, mlen);
+            bool corrupt = compressed && !lzDecompress(mbuf, mlen, text, MAX_MESSAGE_LENGTH);
+            delete[] mbuf;
+            if (corrupt) {
+                cout << "[Error] Corrupt compressed message from " << sender << endl;
+                continue;
+            }
+            if (recordPing(sender, nickname, text)) {
+                continue;
+            }
             
             string privatePacket = "T";
             uint16_t slen_net = htons(slen);
             privatePacket.append((char*)&slen_net, 2);
             privatePacket += sender;
             privatePacket += string(header, 3);
-            privatePacket += string(mbuf, mlen);
+            privatePacket += text;
             cout << "Protocol received: " << formatProtocol(privatePacket) << endl;
             
-            cout << "[Private from " << sender << "] " << mbuf << endl;
-            delete[] mbuf;
+            cout << "[Private from " << sender << "] " << text << endl;
         }
         else if (type=='L') {
-            recv(sock, header,2,0);
+            receiveBytes(sock, header,2);
             uint16_t total_len; memcpy(&total_len,header,2); total_len=ntohs(total_len);
             char* buf=new char[total_len+1];
-            recv(sock,buf,total_len,0); buf[total_len]='\0';
+            receiveBytes(sock,buf,total_len); buf[total_len]='\0';
             
             string listPacket = "L";
             uint16_t total_len_net = htons(total_len);
@@ -392,20 +1496,175 @@ void receiveMessages(int sock, const string& nickname) {
             parseListResponse(buf, total_len);
             delete[] buf;
         }
+        else if (type=='C') {
+            receiveBytes(sock, header, 2);
+            uint16_t caps = ((unsigned char)header[0] << 8) | (unsigned char)header[1];
+            cout << "Protocol received: " << formatProtocol("C" + string(header, 2)) << endl;
+            serverCaps = caps;
+            if (caps & TCP_CAP_CHUNKED) {
+                cout << "Server interleaves files with chat" << endl;
+            }
+            if (caps & TCP_CAP_RESUME) {
+                cout << "Server resumes interrupted transfers" << endl;
+            }
+            if (caps & TCP_CAP_PARALLEL) {
+                cout << "Server takes large files over parallel connections" << endl;
+            }
+            if (caps & TCP_CAP_DELTA) {
+                cout << "Server relays files sent again as deltas" << endl;
+            }
+            if (caps & TCP_CAP_DEDUP) {
+                cout << "Server keeps file chunks, repeated files upload only what changed" << endl;
+            }
+            if (caps & TCP_CAP_BATCH) {
+                cout << "Server sends many small files in one batch" << endl;
+            }
+            if (caps & TCP_CAP_ENVELOPE) {
+                cout << "Server sends one upload to several recipients" << endl;
+            }
+            if (caps & TCP_CAP_COMPRESS) {
+                cout << "Server accepts compressed files, objects and long messages" << endl;
+            }
+        }
+        else if (type=='S') {
+            // Token to open data connections with
+            sessionToken = receiveNumber(sock, 8);
+        }
+        else if (type=='Q') {
+            // The sender of a file asks for the signature of our copy
+            uint64_t id = receiveNumber(sock, 8);
+            string requester = receiveString(sock, 2);
+            string filename = receiveString(sock, 3);
+            thread(sendSignature, sock, id, requester, filename).detach();
+        }
+        else if (type=='G') {
+            // Signature of the recipient's copy of a file we are sending
+            uint64_t id = receiveNumber(sock, 8);
+            receiveString(sock, 2);
+            DeltaSignature signature;
+            signature.baseSize = receiveNumber(sock, 10);
+            signature.blockSize = receiveNumber(sock, 4);
+            uint32_t count = receiveNumber(sock, 4);
+            for (uint32_t i = 0; i < count; i++) {
+                signature.weak.push_back(receiveNumber(sock, 4));
+                signature.strong.push_back(receiveNumber(sock, 8));
+            }
+            lock_guard<mutex> lock(uploadMutex);
+            deltaSignatures[id] = move(signature);
+            uploadAcked.notify_all();
+        }
+        else if (type=='V') {
+            // File as a delta of our copy: rebuilt and saved on another thread
+            string sender = receiveString(sock, 2);
+            string filename = receiveString(sock, 3);
+            uint64_t fsize = receiveNumber(sock, 10);
+            uint64_t baseSize = receiveNumber(sock, 10);
+            uint32_t blockSize = receiveNumber(sock, 4);
+            string hash(SHA256_SIZE, '\0');
+            receiveBytes(sock, &hash[0], SHA256_SIZE);
+            string delta = receiveString(sock, 10);
+            thread(saveDelta, sender, filename, fsize, baseSize, blockSize, hash, move(delta)).detach();
+        }
+        else if (type=='A') {
+            // Header table of a batch of files
+            uint64_t id = receiveNumber(sock, 8);
+            string sender = receiveString(sock, 2);
+            string table = receiveString(sock, 4);
+            startBatch(sender, id, table);
+        }
+        else if (type=='N') {
+            // Segment of a batch, saved into the files it covers
+            uint64_t id = receiveNumber(sock, 8);
+            string sender = receiveString(sock, 2);
+            uint64_t offset = receiveNumber(sock, 10);
+            string data = receiveString(sock, 3);
+            saveBatchSegment(sender, id, offset, data);
+        }
+        else if (type=='Y') {
+            // What became of each copy of an envelope we sent
+            char inner = receiveNumber(sock, 1);
+            uint16_t count = receiveNumber(sock, 2);
+            cout << "[Delivery] " << (inner == 't' ? "message" : inner == 'f' ? "file" : "object") << ":";
+            for (uint16_t i = 0; i < count; i++) {
+                string recipient = receiveString(sock, 2);
+                int status = receiveNumber(sock, 1);
+                cout << (i > 0 ? "," : "") << " " << recipient << " "
+                     << (status == ENVELOPE_QUEUED ? "sent" : status == ENVELOPE_OFFLINE ? "not connected" : "not keeping up");
+            }
+            cout << endl;
+        }
+        else if (type=='H') {
+            // Chunks of an announced upload the server lacks
+            uint64_t id = receiveNumber(sock, 8);
+            uint32_t count = receiveNumber(sock, 4);
+            vector<uint32_t> wanted;
+            for (uint32_t i = 0; i < count && count != CHUNKED_REFUSED; i++) {
+                wanted.push_back(receiveNumber(sock, 4));
+            }
+            lock_guard<mutex> lock(uploadMutex);
+            if (count == CHUNKED_REFUSED) {
+                chunkRefusals.insert(id);
+            } else {
+                chunkRequests[id] = move(wanted);
+            }
+            uploadAcked.notify_all();
+        }
+        else if (type=='R') {
+            // The server holds a resumable upload up to 'offset'
+            uint64_t id = receiveNumber(sock, 8);
+            uint64_t offset = receiveNumber(sock, 10);
+            lock_guard<mutex> lock(uploadMutex);
+            uploadAcks[id] = offset;
+            auto it = uploadFiles.find(id);
+            if (it != uploadFiles.end() && offset == it->second.second) {
+                cout << "[Upload] " << it->second.first << ": all " << offset << " bytes received by the server" << endl;
+                uploadFiles.erase(it);
+            }
+            uploadAcked.notify_all();
+        }
+        else if (type=='D') {
+            // Piece of a resumable delivery
+            uint64_t id = receiveNumber(sock, 8);
+            uint16_t slen = receiveNumber(sock, 2);
+            string sender(slen, '\0');
+            receiveBytes(sock, &sender[0], slen);
+            uint32_t flen = receiveNumber(sock, 3);
+            string filename(flen, '\0');
+            if (flen > 0) receiveBytes(sock, &filename[0], flen);
+            uint64_t fsize = receiveNumber(sock, 10);
+            uint64_t offset = receiveNumber(sock, 10);
+            size_t length = receiveNumber(sock, 3);
+
+            string data;
+            const char* piece;
+            if (replayPos < replayFrame.size() && replayFrame.size() - replayPos >= length) {
+                // Came in chunks: use it where it is
+                piece = replayFrame.data() + replayPos;
+                replayPos += length;
+            } else {
+                data.resize(length);
+                if (length > 0 && readExact(sock, &data[0], length) <= 0) {
+                    cout << "Disconnected." << endl;
+                    break;
+                }
+                piece = data.data();
+            }
+            savePiece(sock, id, sender, filename, fsize, offset, piece, length);
+        }
         else if (type=='X') {
             cout << "Protocol received: X" << endl;
             cout << "Server closed the connection. Goodbye!" << endl;
             break;
         }
         else if (type=='F') {
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t slen; memcpy(&slen, header, 2); slen = ntohs(slen);
             char* sbuf = new char[slen+1];
-            recv(sock, sbuf, slen, 0); sbuf[slen] = '\0';
+            receiveBytes(sock, sbuf, slen); sbuf[slen] = '\0';
             string sender(sbuf);
             delete[] sbuf;
 
-            recv(sock, header, 3, 0);
+            receiveBytes(sock, header, 3);
             uint32_t flen = ((unsigned char)header[0] << 16) |
                         ((unsigned char)header[1] << 8) |
                         (unsigned char)header[2];
@@ -413,7 +1672,7 @@ void receiveMessages(int sock, const string& nickname) {
             char* fbuf = new char[flen+1];
             int bytes_received = 0;
             while (bytes_received < flen) {
-                int r = recv(sock, fbuf + bytes_received, flen - bytes_received, 0);
+                int r = receiveBytes(sock, fbuf + bytes_received, flen - bytes_received);
                 if (r <= 0) break;
                 bytes_received += r;
             }
@@ -424,7 +1683,7 @@ void receiveMessages(int sock, const string& nickname) {
             char size_buf[10];
             bytes_received = 0;
             while (bytes_received < 10) {
-                int r = recv(sock, size_buf + bytes_received, 10 - bytes_received, 0);
+                int r = receiveBytes(sock, size_buf + bytes_received, 10 - bytes_received);
                 if (r <= 0) break;
                 bytes_received += r;
             }
@@ -434,51 +1693,57 @@ void receiveMessages(int sock, const string& nickname) {
                 fsize = (fsize << 8) | (unsigned char)size_buf[i];
             }
 
-            char* file_data = new char[fsize];
-            bytes_received = 0;
-            while (bytes_received < fsize) {
-                int r = recv(sock, file_data + bytes_received, fsize - bytes_received, 0);
-                if (r <= 0) break;
-                bytes_received += r;
-            }
-            
-            size_t dot_pos = filename.find_last_of(".");
-            string new_filename;
-            if (dot_pos != string::npos) {
-                new_filename = filename.substr(0, dot_pos) + "_dest" + filename.substr(dot_pos);
+            string file_data;
+            size_t file_offset = 0;
+            if (replayPos < replayFrame.size() && replayFrame.size() - replayPos >= fsize) {
+                // Came in chunks: the content is already in memory, take it as is
+                file_offset = replayPos;
+                file_data = move(replayFrame);
+                replayFrame.clear();
+                replayPos = 0;
             } else {
-                new_filename = filename + "_dest";
+                file_data.resize(fsize);
+                uint64_t received = 0;
+                while (received < fsize) {
+                    int r = receiveBytes(sock, &file_data[received], fsize - received);
+                    if (r <= 0) break;
+                    received += r;
+                }
             }
-            
-            ofstream out_file(new_filename, ios::binary);
-            if (out_file.is_open()) {
-                out_file.write(file_data, fsize);
-                out_file.close();
-                cout << "[File received from " << sender << "] Saved as: " << new_filename 
-                    << " (" << fsize << " bytes)" << endl;
-            } else {
-                cout << "[Error] Could not save file: " << new_filename << endl;
+            if (compressed) {
+                string expanded;
+                if (!lzDecompress(file_data.data() + file_offset, fsize, expanded, MAX_EXPANDED_FILE)) {
+                    cout << "[Error] Corrupt compressed file from " << sender << ": " << filename << endl;
+                    continue;
+                }
+                cout << "Expanded " << filename << ": " << fsize << " -> " << expanded.size() << " bytes" << endl;
+                file_data = move(expanded);
+                file_offset = 0;
+                fsize = file_data.size();
             }
             
-            delete[] file_data;
+            string new_filename = destinationName(filename);
+            
+            // Write it to disk on another thread so chat keeps flowing
+            thread(saveFile, sender, new_filename, move(file_data), file_offset, fsize).detach();
         }
         else if (type == 'O') {
             char header[2];
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
 
             uint16_t slen;
             memcpy(&slen, header, 2);
             slen = ntohs(slen);
 
             char* sbuf = new char[slen + 1];
-            recv(sock, sbuf, slen, 0);
+            receiveBytes(sock, sbuf, slen);
             sbuf[slen] = '\0';
             string sender(sbuf);
             delete[] sbuf;
 
             // object length
             char sizeBuf[4];
-            recv(sock, sizeBuf, 4, 0);
+            receiveBytes(sock, sizeBuf, 4);
 
             uint32_t objSize;
             memcpy(&objSize, sizeBuf, 4);
@@ -486,7 +1751,15 @@ void receiveMessages(int sock, const string& nickname) {
 
             // content
             vector<char> objectBuf(objSize);
-            recv(sock, objectBuf.data(), objSize, 0);
+            receiveBytes(sock, objectBuf.data(), objSize);
+            if (compressed) {
+                string expanded;
+                if (!lzDecompress(objectBuf.data(), objSize, expanded, UINT32_MAX)) {
+                    cout << "[Error] Corrupt compressed object from " << sender << endl;
+                    continue;
+                }
+                objectBuf.assign(expanded.begin(), expanded.end());
+            }
 
             Sala sala = deserializeSala(objectBuf);
 
@@ -503,13 +1776,13 @@ void receiveMessages(int sock, const string& nickname) {
         }
         else if (type == 'J') {
             // Game request
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t slen;
             memcpy(&slen, header, 2);
             slen = ntohs(slen);
             
             char* sbuf = new char[slen + 1];
-            recv(sock, sbuf, slen, 0);
+            receiveBytes(sock, sbuf, slen);
             sbuf[slen] = '\0';
             string sender(sbuf);
             delete[] sbuf;
@@ -533,19 +1806,19 @@ void receiveMessages(int sock, const string& nickname) {
         }
         else if (type == 'j') {
             // Game response
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t slen;
             memcpy(&slen, header, 2);
             slen = ntohs(slen);
             
             char* sbuf = new char[slen + 1];
-            recv(sock, sbuf, slen, 0);
+            receiveBytes(sock, sbuf, slen);
             sbuf[slen] = '\0';
             string sender(sbuf);
             delete[] sbuf;
             
             char response;
-            recv(sock, &response, 1, 0);
+            receiveBytes(sock, &response, 1);
             
             string gameResponsePacket = "j";
             uint16_t slen_net = htons(slen);
@@ -562,21 +1835,21 @@ void receiveMessages(int sock, const string& nickname) {
         }
         else if (type == 'B') {
             // Board state
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t board_len;
             memcpy(&board_len, header, 2);
             board_len = ntohs(board_len);
             
             vector<char> board(board_len);
-            recv(sock, board.data(), board_len, 0);
+            receiveBytes(sock, board.data(), board_len);
             
-            recv(sock, header, 2, 0);
+            receiveBytes(sock, header, 2);
             uint16_t player_len;
             memcpy(&player_len, header, 2);
             player_len = ntohs(player_len);
             
             char* player_buf = new char[player_len + 1];
-            recv(sock, player_buf, player_len, 0);
+            receiveBytes(sock, player_buf, player_len);
             player_buf[player_len] = '\0';
             string currentPlayer(player_buf);
             delete[] player_buf;
@@ -612,7 +1885,7 @@ void receiveMessages(int sock, const string& nickname) {
         }
         else if (type == 'W') {
             // Game result
-            recv(sock, header, 1, 0);
+            receiveBytes(sock, header, 1);
             char result = header[0];
             
             string resultPacket = "W";
@@ -632,34 +1905,45 @@ void receiveMessages(int sock, const string& nickname) {
     }
 }
 
-int main() {
-    int sock;
-    struct sockaddr_in serv_addr;
-
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET,"127.0.0.1",&serv_addr.sin_addr);
+int main(int argc, char* argv[]) {
+    bool compress = true;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--no-compress") {
+            compress = false;
+        } else if (string(argv[i]) == "--streams" && i + 1 < argc && atoi(argv[i + 1]) >= 1) {
+            dataStreams = atoi(argv[++i]);
+        } else {
+            cout << "Usage: " << argv[0] << " [--no-compress] [--streams N]" << endl;
+            return 1;
+        }
+    }
 
-    if (connect(sock,(struct sockaddr*)&serv_addr,sizeof(serv_addr))<0) {
+    int sock = connectToServer();
+    if (sock < 0) {
         cout << "Connection failed" << endl; return 0;
     }
 
     string nickname;
     cout << "Enter nickname: ";
     getline(cin,nickname);
+    sessionNickname = nickname;
     sendNickname(sock,nickname);
+    sendCaps(sock, TCP_CAP_CHUNKED | TCP_CAP_RESUME | TCP_CAP_DEDUP | TCP_CAP_DELTA | TCP_CAP_ENVELOPE |
+                   TCP_CAP_BATCH | (compress ? TCP_CAP_COMPRESS : 0) |
+                   (dataStreams > 1 ? TCP_CAP_PARALLEL : 0));
 
     thread t(receiveMessages,sock,nickname);
 
     cout << "Commands:" << endl
      << "  /all msg   -> broadcast message" << endl
-     << "  /to user msg -> private message" << endl
+     << "  /to user[,user...] msg -> private message" << endl
      << "  /list      -> show users" << endl
      << "  /exit      -> quit" << endl
-     << "  /file dest file -> send files" << endl
-     << "  /object dest -> send Sala object" << endl
-     << "  /play dest -> invite to play tic tac toe" << endl;
+     << "  /file dest[,dest...] file -> send files" << endl
+     << "  /files dest[,dest...] path... -> send many files (or directories) in one batch" << endl
+     << "  /object dest[,dest...] -> send Sala object" << endl
+     << "  /play dest -> invite to play tic tac toe" << endl
+     << "  /ping [n]  -> measure chat round trip latency" << endl;
 
     string line;
     while (getline(cin,line)) {
@@ -686,7 +1970,7 @@ int main() {
             if (sp != string::npos && sp + 1 < line.length()) {
                 string dest = line.substr(4, sp - 4);
                 string msg = line.substr(sp + 1);
-                sendToClient(sock, dest, msg);
+                sendToRecipients(dest, [&](const string& to) { sendToClient(sock, to, msg); });
             } else {
                 cout << "Usage: /to username message" << endl;
             }
@@ -699,11 +1983,26 @@ int main() {
             if (sp != string::npos && sp + 1 < line.length()) {
                 string dest = line.substr(6, sp - 6);
                 string filename = line.substr(sp + 1);
-                sendFile(sock, dest, filename);
+                sendToRecipients(dest, [&](const string& to) { sendFile(sock, to, filename); });
             } else {
                 cout << "Usage: /file destination file_path" << endl;
             }
         }
+        else if (line.rfind("/files ", 0) == 0) {
+            stringstream words(line.substr(7));
+            string dest, path;
+            vector<string> paths;
+            words >> dest;
+            while (words >> path) paths.push_back(path);
+            if (!paths.empty()) {
+                // A batch goes to one recipient; several get one each
+                for (const string& recipient : splitRecipients(dest)) {
+                    sendFiles(sock, recipient, paths);
+                }
+            } else {
+                cout << "Usage: /files destination path [path...]" << endl;
+            }
+        }
         else if (line.rfind("/object ", 0) == 0) {
             size_t sp = line.find(' ', 8);
             if (sp != string::npos && sp + 1 < line.length()) {
@@ -721,7 +2020,7 @@ int main() {
                 sala.n = 42;
                 strcpy(sala.descripcion, "This is a sample room for testing");
                 
-                sendObject(sock, dest, sala);
+                sendToRecipients(dest, [&](const string& to) { sendObject(sock, to, sala); });
                 
                 // Clean up memory
                 delete sala.cocina;
@@ -737,8 +2036,16 @@ int main() {
                 cout << "Usage: /play username" << endl;
             }
         }
+        else if (line == "/ping" || line.rfind("/ping ", 0) == 0) {
+            size_t count = line.size() > 6 ? strtoul(line.c_str() + 6, nullptr, 10) : 100;
+            if (count > 0) {
+                runPing(sock, nickname, count);
+            } else {
+                cout << "Usage: /ping [count]" << endl;
+            }
+        }
         else {
-            cout << "Unknown command. Available: /all, /to, /list, /exit, /file, /object, /play" << endl;
+            cout << "Unknown command. Available: /all, /to, /list, /exit, /file, /files, /object, /play, /ping" << endl;
         }
     }
 
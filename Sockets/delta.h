@@ -0,0 +1,249 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "resume.h"
+
+/*
+    Delta transfers of files sent again after an edit (TCP_CAP_DELTA,
+    frames in outbound.h), in the manner of rsync.
+
+    Before sending a file the client asks the recipient, through the
+    server, for the signature of its copy from an earlier transfer
+    (name_dest.ext): a weak rolling checksum and a strong hash of each
+    block. The sender slides the weak checksum over the new file a byte at
+    a time; where it and the strong hash match a block, it sends a
+    reference to that block instead of the bytes. The recipient rebuilds
+    the file from its copy and the literal data, and checks the SHA-256 of
+    the result, so a stale copy or a hash collision can't go unnoticed.
+
+    Delta instructions:
+        L + length (3) + data       literal bytes
+        B + index (4) + count (4)   'count' blocks of the copy from 'index'
+*/
+
+#define DELTA_MIN_SIZE (64 * 1024)       // smaller files aren't worth a round trip
+#define DELTA_MAX_SIZE RESUME_MIN_SIZE   // larger ones go resumably
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_MAX_BLOCKS (DELTA_MAX_SIZE / DELTA_MIN_BLOCK)
+#define DELTA_MAX_LITERAL ((1 << 24) - 1)
+
+// Block size for a copy of 'size' bytes: about its square root, so the
+// signature and the expected literal data stay small together
+uint32_t deltaBlockSize(uint64_t size) {
+    uint64_t block = (uint64_t)std::sqrt((double)size) / 16 * 16;
+    return (uint32_t)std::min(std::max(block, (uint64_t)DELTA_MIN_BLOCK), (uint64_t)DELTA_MAX_BLOCK);
+}
+
+// rsync's weak checksum: a is the sum of the bytes, b the sum of the
+// running sums, both mod 2^16. Sliding by a byte costs a few additions.
+struct RollingChecksum {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t length = 0;
+
+    void reset(const unsigned char* data, uint32_t n) {
+        a = b = 0;
+        length = n;
+        for (uint32_t i = 0; i < n; i++) {
+            a += data[i];
+            b += (n - i) * data[i];
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - length * out;
+    }
+
+    uint32_t value() const {
+        return (a & 0xFFFF) | (b << 16);
+    }
+};
+
+// Strong hash of a block: 64 bits, eight bytes at a time. Collisions are
+// caught by the SHA-256 of the whole file.
+uint64_t blockHash(const char* data, size_t length) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word * 0xBF58476D1CE4E5B9ull;
+        hash = ((hash << 29) | (hash >> 35)) * 0x94D049BB133111EBull;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    hash ^= tail * 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 31;
+    hash *= 0x94D049BB133111EBull;
+    return hash ^ (hash >> 29);
+}
+
+// Signature of a copy: checksums of its whole blocks (the tail, shorter
+// than a block, is never matched)
+struct DeltaSignature {
+    uint64_t baseSize = 0;
+    uint32_t blockSize = 0; // 0: the recipient has no copy
+    std::vector<uint32_t> weak;
+    std::vector<uint64_t> strong;
+};
+
+DeltaSignature computeSignature(const std::string& base) {
+    DeltaSignature signature;
+    signature.baseSize = base.size();
+    signature.blockSize = deltaBlockSize(base.size());
+    RollingChecksum checksum;
+    for (size_t offset = 0; offset + signature.blockSize <= base.size(); offset += signature.blockSize) {
+        checksum.reset((const unsigned char*)base.data() + offset, signature.blockSize);
+        signature.weak.push_back(checksum.value());
+        signature.strong.push_back(blockHash(base.data() + offset, signature.blockSize));
+    }
+    return signature;
+}
+
+void deltaAppendNumber(std::string& out, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+void deltaLiteral(std::string& out, const char* data, size_t length) {
+    while (length > 0) {
+        size_t n = std::min(length, (size_t)DELTA_MAX_LITERAL);
+        out.push_back('L');
+        deltaAppendNumber(out, n, 3);
+        out.append(data, n);
+        data += n;
+        length -= n;
+    }
+}
+
+// Instructions that rebuild 'data' from the copy 'signature' describes.
+// 'reused' is set to the bytes taken from the copy.
+std::string computeDelta(const DeltaSignature& signature, const char* data, size_t length, uint64_t& reused) {
+    std::string delta;
+    reused = 0;
+    size_t blocks = signature.weak.size();
+    uint32_t blockSize = signature.blockSize;
+    if (blocks == 0 || length < blockSize) {
+        deltaLiteral(delta, data, length);
+        return delta;
+    }
+
+    // Weak checksums by hash, chained
+    size_t tableSize = 1;
+    while (tableSize < blocks * 2) tableSize <<= 1;
+    std::vector<int32_t> head(tableSize, -1);
+    std::vector<int32_t> next(blocks, -1);
+    auto slot = [tableSize](uint32_t weak) { return (weak * 2654435761u) & (tableSize - 1); };
+    for (size_t i = blocks; i-- > 0;) {
+        next[i] = head[slot(signature.weak[i])];
+        head[slot(signature.weak[i])] = (int32_t)i;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)data;
+    RollingChecksum checksum;
+    checksum.reset(bytes, blockSize);
+    size_t pos = 0;
+    size_t literal = 0;        // start of the literal data not yet written
+    int64_t runStart = -1;     // pending B: blocks runStart .. runStart + runCount
+    uint32_t runCount = 0;
+    auto flushRun = [&]() {
+        if (runStart < 0) return;
+        delta.push_back('B');
+        deltaAppendNumber(delta, runStart, 4);
+        deltaAppendNumber(delta, runCount, 4);
+        runStart = -1;
+        runCount = 0;
+    };
+
+    while (pos + blockSize <= length) {
+        uint32_t weak = checksum.value();
+        int32_t match = -1;
+        bool hashed = false;
+        uint64_t strong = 0;
+        for (int32_t i = head[slot(weak)]; i >= 0; i = next[i]) {
+            if (signature.weak[i] != weak) continue;
+            if (!hashed) {
+                strong = blockHash(data + pos, blockSize);
+                hashed = true;
+            }
+            if (signature.strong[i] != strong) continue;
+            if (match < 0) match = i;
+            // Prefer the block that continues the current run
+            bool extending = runStart >= 0 && literal == pos;
+            if (!extending || i == runStart + runCount) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            if (literal < pos) {
+                flushRun();
+                deltaLiteral(delta, data + literal, pos - literal);
+            }
+            if (runStart >= 0 && match != runStart + runCount) flushRun();
+            if (runStart < 0) runStart = match;
+            runCount++;
+            reused += blockSize;
+            pos += blockSize;
+            literal = pos;
+            if (pos + blockSize <= length) checksum.reset(bytes + pos, blockSize);
+            continue;
+        }
+        if (pos + blockSize == length) break;
+        checksum.roll(bytes[pos], bytes[pos + blockSize]);
+        pos++;
+    }
+    if (literal < length) {
+        flushRun();
+        deltaLiteral(delta, data + literal, length - literal);
+    }
+    flushRun();
+    return delta;
+}
+
+// Rebuild a file of 'size' bytes from the copy 'base' and its delta; false
+// if the instructions don't fit them, or 'size' (from the sender) is larger
+// than any file sent as a delta
+bool applyDelta(const std::string& base, uint32_t blockSize, const char* delta, size_t length, uint64_t size,
+                std::string& out) {
+    out.clear();
+    if (size > DELTA_MAX_SIZE) return false;
+    out.reserve(size);
+    const unsigned char* p = (const unsigned char*)delta;
+    const unsigned char* end = p + length;
+    while (p < end) {
+        char op = *p++;
+        if (op == 'L') {
+            if (end - p < 3) return false;
+            size_t n = (p[0] << 16) | (p[1] << 8) | p[2];
+            p += 3;
+            if ((size_t)(end - p) < n || out.size() + n > size) return false;
+            out.append((const char*)p, n);
+            p += n;
+        } else if (op == 'B') {
+            if (end - p < 8 || blockSize == 0) return false;
+            uint64_t index = ((uint64_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            uint64_t count = ((uint64_t)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+            p += 8;
+            uint64_t from = index * blockSize;
+            uint64_t n = count * blockSize;
+            if (from + n > base.size() || out.size() + n > size) return false;
+            out.append(base, from, n);
+        } else {
+            return false;
+        }
+    }
+    return out.size() == size;
+}
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <algorithm>
+
+/*
+    Presupuesto de memoria del proceso para los datos en vuelo: archivos y
+    objetos recibidos, y mensajes UDP a medio reconstruir. Antes de reservar
+    un buffer para un contenido se pide su tamaño al presupuesto; si no hay
+    lugar el contenido se rechaza (o se espera un poco a que se libere) en
+    vez de dejar que un encabezado falso o muchas subidas juntas agoten la
+    memoria del servidor.
+
+    Hay un límite total y uno por cliente. Un pedido que no entra en ninguno
+    de los dos aunque todo lo demás estuviera libre es MEMORY_TOO_LARGE; uno
+    que entraría si otros liberaran memoria es MEMORY_BUSY. Una reserva
+    puede crecer de a poco (un mensaje UDP que llega por fragmentos): el
+    límite se compara con todo lo que ya reservó.
+
+    Se configura con --memory-limit TOTAL[/POR_CLIENTE] (sufijos K, M, G),
+    por defecto 512M/128M.
+*/
+
+enum MemoryClass { MEMORY_FILE, MEMORY_OBJECT, MEMORY_REASSEMBLY, MEMORY_CLASSES };
+
+const char* const MEMORY_CLASS_NAMES[MEMORY_CLASSES] = {"file", "object", "reassembly"};
+
+enum MemoryResult { MEMORY_RESERVED, MEMORY_BUSY, MEMORY_TOO_LARGE };
+
+struct MemoryLimits {
+    uint64_t total = 512ull * 1024 * 1024;
+    uint64_t perClient = 128ull * 1024 * 1024;
+};
+
+// Bytes con sufijo opcional K, M o G (potencias de 1024)
+bool parseMemoryAmount(const std::string& value, uint64_t& bytes) {
+    char* end = nullptr;
+    double amount = strtod(value.c_str(), &end);
+    if (end == value.c_str() || amount < 0) return false;
+    switch (*end) {
+        case 'K': case 'k': amount *= 1024.0; end++; break;
+        case 'M': case 'm': amount *= 1024.0 * 1024; end++; break;
+        case 'G': case 'g': amount *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') return false;
+    bytes = (uint64_t)amount;
+    return true;
+}
+
+// "512M/128M" o "512M" (el límite por cliente queda en el total)
+bool parseMemoryLimits(const std::string& spec, MemoryLimits& limits) {
+    size_t slash = spec.find('/');
+    if (!parseMemoryAmount(spec.substr(0, slash), limits.total)) return false;
+    limits.perClient = limits.total;
+    if (slash != std::string::npos && !parseMemoryAmount(spec.substr(slash + 1), limits.perClient)) return false;
+    return limits.total > 0 && limits.perClient > 0;
+}
+
+// Al revés: 536870912 -> "512.0M"
+std::string formatMemoryAmount(uint64_t bytes) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (bytes >= (1ull << 30)) out << bytes / double(1ull << 30) << "G";
+    else if (bytes >= (1ull << 20)) out << bytes / double(1ull << 20) << "M";
+    else if (bytes >= (1ull << 10)) out << bytes / double(1ull << 10) << "K";
+    else out << std::setprecision(0) << (double)bytes;
+    return out.str();
+}
+
+class MemoryBudget;
+
+// Memoria reservada para un contenido; se devuelve al destruirse
+class MemoryReservation {
+public:
+    MemoryReservation() = default;
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    MemoryReservation(MemoryReservation&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    MemoryReservation& operator=(MemoryReservation&& other) noexcept {
+        if (this != &other) {
+            reset();
+            budget = other.budget;
+            client = std::move(other.client);
+            memoryClass = other.memoryClass;
+            bytes = other.bytes;
+            other.budget = nullptr;
+            other.bytes = 0;
+        }
+        return *this;
+    }
+
+    ~MemoryReservation() {
+        reset();
+    }
+
+    uint64_t size() const {
+        return bytes;
+    }
+
+    // Devolver parte de lo reservado (el contenido se achicó o ya se envió)
+    void shrink(uint64_t released);
+
+    void reset() {
+        shrink(bytes);
+        budget = nullptr;
+    }
+
+private:
+    friend class MemoryBudget;
+
+    MemoryBudget* budget = nullptr;
+    std::string client;
+    int memoryClass = 0;
+    uint64_t bytes = 0;
+};
+
+class MemoryBudget {
+public:
+    typedef std::chrono::steady_clock BudgetClock;
+
+    void configure(const MemoryLimits& configured) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limits = configured;
+    }
+
+    // Reservar 'bytes' para 'client'. Si 'reservation' ya es de ese cliente
+    // y clase, crece; si no, se reemplaza. Con 'wait' > 0 se espera hasta
+    // ese tiempo a que otros liberen memoria antes de responder MEMORY_BUSY.
+    MemoryResult reserve(const std::string& client, int memoryClass, uint64_t bytes, MemoryReservation& reservation,
+                         BudgetClock::duration wait = BudgetClock::duration::zero()) {
+        bool extend = reservation.budget == this && reservation.client == client && reservation.memoryClass == memoryClass;
+        if (!extend) {
+            reservation.reset(); // antes de tomar el mutex: devolver también lo toma
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t held = extend ? reservation.bytes : 0;
+        if (held + bytes > limits.total || held + bytes > limits.perClient) {
+            rejected[memoryClass]++;
+            return MEMORY_TOO_LARGE;
+        }
+
+        BudgetClock::time_point deadline = BudgetClock::now() + wait;
+        while (used + bytes > limits.total || clientUsage[client] + bytes > limits.perClient) {
+            if (wait <= BudgetClock::duration::zero() || freed.wait_until(lock, deadline) == std::cv_status::timeout) {
+                if (used + bytes <= limits.total && clientUsage[client] + bytes <= limits.perClient) break;
+                rejected[memoryClass]++;
+                if (clientUsage[client] == 0) clientUsage.erase(client);
+                return MEMORY_BUSY;
+            }
+        }
+
+        used += bytes;
+        peak = std::max(peak, used);
+        classUsage[memoryClass] += bytes;
+        clientUsage[client] += bytes;
+
+        reservation.budget = this;
+        reservation.client = client;
+        reservation.memoryClass = memoryClass;
+        reservation.bytes = held + bytes;
+        return MEMORY_RESERVED;
+    }
+
+    uint64_t inUse() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    // Lo más que un cliente puede reservar aunque todo lo demás esté libre
+    uint64_t largest() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::min(limits.total, limits.perClient);
+    }
+
+    std::string description() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return formatMemoryAmount(limits.total) + " total, " + formatMemoryAmount(limits.perClient) + " per client";
+    }
+
+    // Uso actual por clase y por cliente; 'changed' dice si cambió desde la llamada anterior
+    std::string usage(bool* changed = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << formatMemoryAmount(used) << " of " << formatMemoryAmount(limits.total) << " in use (";
+        uint64_t totalRejected = 0;
+        for (int i = 0; i < MEMORY_CLASSES; i++) {
+            if (i > 0) out << ", ";
+            out << MEMORY_CLASS_NAMES[i] << " " << formatMemoryAmount(classUsage[i]);
+            totalRejected += rejected[i];
+        }
+        out << "), peak " << formatMemoryAmount(peak) << ", " << totalRejected << " rejected";
+        for (auto& [client, bytes] : clientUsage) {
+            out << "; " << client << " " << formatMemoryAmount(bytes);
+        }
+        if (changed != nullptr) {
+            *changed = used != reportedUsed || peak != reportedPeak || totalRejected != reportedRejected;
+            reportedUsed = used;
+            reportedPeak = peak;
+            reportedRejected = totalRejected;
+        }
+        return out.str();
+    }
+
+private:
+    friend class MemoryReservation;
+
+    void release(const std::string& client, int memoryClass, uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+            classUsage[memoryClass] -= bytes;
+            auto it = clientUsage.find(client);
+            if (it != clientUsage.end()) {
+                it->second -= bytes;
+                if (it->second == 0) clientUsage.erase(it);
+            }
+        }
+        freed.notify_all();
+    }
+
+    std::mutex mutex;
+    std::condition_variable freed;
+    MemoryLimits limits;
+    uint64_t used = 0;
+    uint64_t peak = 0;
+    uint64_t classUsage[MEMORY_CLASSES] = {};
+    uint64_t rejected[MEMORY_CLASSES] = {};
+    std::map<std::string, uint64_t> clientUsage;
+    uint64_t reportedUsed = 0;
+    uint64_t reportedPeak = 0;
+    uint64_t reportedRejected = 0;
+};
+
+void MemoryReservation::shrink(uint64_t released) {
+    released = std::min(released, bytes);
+    if (budget == nullptr || released == 0) return;
+    bytes -= released;
+    budget->release(client, memoryClass, released);
+}
+
+#endif
@@ -0,0 +1,484 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "fairqueue.h"
+#include "codel.h"
+#include "spool.h"
+
+/*
+    Outbound priority lanes for one TCP connection.
+
+    Every frame sent to a client is queued on its Connection and written by
+    the connection's own writer thread, so a slow reader never blocks the
+    thread that produced the frame. Frames are classified by type:
+
+        control  E X L J j B W C   (errors, lists, game)
+        chat     M T
+        bulk     F O D G V N
+
+    The writer always drains control before chat and chat before bulk.
+    Within the chat lane each sender has its own queue, served deficit
+    round robin, so one client flooding messages gets the same share of a
+    recipient's link as everyone else; a sender with more than
+    CHAT_FLOW_LIMIT bytes waiting for one recipient loses the excess.
+    Clients that negotiated TCP_CAP_CHUNKED receive bulk frames cut into
+    chunk frames that can be interleaved with the other lanes:
+
+        K + stream (2) + flags (1) + length (3) + data
+            flags & CHUNK_LAST marks the final chunk; the client joins the
+            chunks of a stream and parses the result as a normal frame
+
+    Several bulk frames to the same client take turns chunk by chunk. Old
+    clients get bulk frames whole, but still behind control and chat frames
+    that were queued first. A bulk frame may keep its content in a spool
+    file (spool.h); the writer then reads it from disk one chunk at a time,
+    outside the lock.
+
+    Each connection also watches how long frames wait in its queue (see
+    codel.h). While that wait stays above target the client is not keeping
+    up, and new broadcasts (M) and bulk frames for it are refused so the
+    producer can report an overload error; control and private chat frames
+    are always queued.
+
+    Negotiation (after the nickname):
+        c + caps (2)   (client → server)
+        C + caps (2)   (server → client, accepted caps)
+
+    With TCP_CAP_COMPRESS a frame may be prefixed by a compression marker:
+        z + f, o, m or t frame   (client → server)
+        Z + F, O, M or T frame   (server → client)
+    The inner frame is unchanged except that its content is an LZ stream
+    (lz.h) and its size field is the stream's length. A compressed frame is
+    classified by its inner type.
+
+    With TCP_CAP_RESUME files can be sent resumably (see resume.h):
+        r + id (8) + dest (2+n) + filename (3+n) + size (10)
+                               (client → server, offer an upload)
+        k + id (8) + offset (10) + length (3) + data
+                               (client → server, piece of an upload)
+        R + id (8) + offset (10)
+                               (server → client, bytes of the upload the
+                                server holds: where to continue)
+        D + id (8) + sender (2+n) + filename (3+n) + size (10)
+          + offset (10) + length (3) + data
+                               (server → client, piece of a delivery)
+        a + id (8) + offset (10)
+                               (client → server, the piece of the delivery
+                                at 'offset' is saved)
+    A D frame usually takes its data from a range of a spool file; an empty
+    one at the end of the file completes the delivery.
+
+    With TCP_CAP_PARALLEL (only with TCP_CAP_RESUME) a client can open
+    extra data connections for the k pieces of its uploads, so several TCP
+    flows carry a file and the chat connection stays free:
+        S + token (8)          (server → client, after C: session token)
+        d + nickname (2+n) + token (8)
+                               (client → server, first frame of a data
+                                connection; then only k frames follow)
+    Pieces may then arrive out of order; acks and errors still go out on
+    the chat connection. Clients only open them when asked (--streams N).
+
+    With TCP_CAP_DEDUP files are announced by their chunks (chunkstore.h):
+        h + id (8) + dest (2+n) + filename (3+n) + size (10) + count (4)
+          + count * (length (3) + SHA-256 (32))
+                               (client → server, announce an upload)
+        H + id (8) + count (4) + count * index (4)
+                               (server → client, chunks to send; count
+                                CHUNKED_REFUSED and no indexes if the
+                                upload was refused)
+        u + id (8) + index (4) + length (3) + data
+                               (client → server, a missing chunk; may be
+                                compressed as z + u)
+
+    With TCP_CAP_DELTA a file the recipient had before goes as a delta of
+    its copy (delta.h); the server only relays:
+        q + id (8) + dest (2+n) + filename (3+n)
+                               (client → server, ask dest for a signature)
+        Q + id (8) + sender (2+n) + filename (3+n)
+                               (server → client)
+        g + id (8) + requester (2+n) + signature
+        G + id (8) + peer (2+n) + signature
+                               (recipient → server → sender; the server
+                                answers G itself, with no blocks, for a
+                                recipient without the cap)
+            signature: base size (10) + block size (4) + count (4)
+                       + count * (weak (4) + strong (8))
+        v + dest (2+n) + filename (3+n) + size (10) + base size (10)
+          + block size (4) + SHA-256 (32) + length (10) + delta
+        V + sender (2+n) + the same from filename on
+                               (sender → server → recipient)
+
+    With TCP_CAP_ENVELOPE a private message, file or object goes to
+    several recipients in one upload; the server fans it out from a single
+    buffer:
+        w + count (2) + count * recipient (2+n) + t, f or o frame
+                               (client → server; the inner frame may be
+                                compressed, and its destination is empty)
+        Y + type (1) + count (2) + count * (recipient (2+n) + status (1))
+                               (server → client, what became of each copy:
+                                ENVELOPE_QUEUED, ENVELOPE_OFFLINE or
+                                ENVELOPE_REFUSED; 'type' is the inner one)
+    An envelope refused as a whole (rate limit, memory, corrupt data) gets
+    an E instead of Y.
+
+    With TCP_CAP_BATCH many small files go in one batch (batch.h):
+        b + id (8) + dest (2+n) + table length (4) + table
+                               (client → server, open a batch)
+        s + id (8) + length (3) + data
+                               (client → server, next segment of the
+                                contents)
+        A + id (8) + sender (2+n) + table length (4) + table
+                               (server → client, control lane, so it comes
+                                before the segments)
+        N + id (8) + sender (2+n) + offset (10) + length (3) + data
+                               (server → client, segment at 'offset' of the
+                                contents)
+            table: count (4) + count * (filename (2+n) + size (10))
+*/
+
+#define TCP_CAP_CHUNKED 0x0001
+#define TCP_CAP_COMPRESS 0x0002
+#define TCP_CAP_RESUME 0x0004
+#define TCP_CAP_PARALLEL 0x0008
+#define TCP_CAP_DEDUP 0x0010
+#define TCP_CAP_DELTA 0x0020
+#define TCP_CAP_ENVELOPE 0x0040
+#define TCP_CAP_BATCH 0x0080
+
+#define ENVELOPE_QUEUED 0
+#define ENVELOPE_OFFLINE 1
+#define ENVELOPE_REFUSED 2 // not keeping up (or flooded with chat)
+
+#define COMPRESSED_FRAME 'Z'
+
+#define CHUNK_FRAME 'K'
+#define CHUNK_LAST 0x01
+#define CHUNK_HEADER_SIZE 6
+#define BULK_CHUNK_SIZE (16 * 1024)
+
+#define CHAT_QUANTUM 4096
+#define CHAT_FLOW_LIMIT (1024 * 1024)
+
+// Unsent bytes the kernel may hold for a connection. Keeping it small stops
+// a large transfer from filling the socket buffer ahead of chat frames.
+#define NOTSENT_LOWAT (64 * 1024)
+
+enum Lane { LANE_CONTROL, LANE_CHAT, LANE_BULK };
+
+Lane laneFor(char type) {
+    switch (type) {
+        case 'M':
+        case 'T':
+            return LANE_CHAT;
+        case 'F':
+        case 'O':
+        case 'D':
+        case 'G':
+        case 'V':
+        case 'N':
+            return LANE_BULK;
+        default:
+            return LANE_CONTROL;
+    }
+}
+
+typedef std::shared_ptr<const std::string> Frame;
+
+// Type of a frame, looking past the compression marker
+char frameType(const std::string& frame) {
+    if (frame.size() > 1 && frame[0] == COMPRESSED_FRAME) return frame[1];
+    return frame.empty() ? 0 : frame[0];
+}
+
+// Broadcasts and bulk frames are shed first when a connection is overloaded
+bool sheddable(char type) {
+    return type == 'M' || laneFor(type) == LANE_BULK;
+}
+
+// Queue delay and shedding of one connection, for the periodic report
+struct OverloadStats {
+    bool overloaded = false;
+    uint64_t episodes = 0;
+    uint64_t shedFrames = 0;
+    double maxDelayMs = 0;
+};
+
+// Sender of an M or T frame: its fair queue in the chat lane
+std::string chatSender(const std::string& frame) {
+    size_t start = frame[0] == COMPRESSED_FRAME ? 1 : 0;
+    if (frame.size() < start + 3) return "";
+    uint16_t slen = ((unsigned char)frame[start + 1] << 8) | (unsigned char)frame[start + 2];
+    return frame.substr(start + 3, slen);
+}
+
+// Write the whole buffer; false if the connection is gone
+bool sendFully(int socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+class Connection {
+public:
+    explicit Connection(int socket) : socket(socket) {
+        int lowat = NOTSENT_LOWAT;
+        setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    }
+
+    int fd() const {
+        return socket;
+    }
+
+    // Bytes queued and not yet handed to the kernel
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queuedBytes;
+    }
+
+    void setCaps(uint16_t accepted) {
+        std::lock_guard<std::mutex> lock(mutex);
+        caps = accepted;
+    }
+
+    bool hasCap(uint16_t cap) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (caps & cap) != 0;
+    }
+
+    // False if the frame was not queued: the connection is closing, the
+    // sender flooded the chat lane, or the frame was shed for overload.
+    // A bulk frame can carry its content in 'body', sent after 'frame':
+    // 'bodyLength' bytes from 'bodyOffset', or all of it by default.
+    bool enqueue(const Frame& frame, std::shared_ptr<SpoolFile> body = nullptr, uint64_t bodyOffset = 0,
+                 uint64_t bodyLength = UINT64_MAX) {
+        if (frame->empty()) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closing) return false;
+            Clock::time_point now = Clock::now();
+            if (sending) {
+                // A writer stuck in send is a queue that is not draining
+                delay.record(now - sendingSince, now);
+            }
+            char type = frameType(*frame);
+            if (sheddable(type) && delay.isOverloaded()) {
+                shedFrames++;
+                return false;
+            }
+
+            Lane lane = laneFor(type);
+            if (body) {
+                bodyLength = std::min(bodyLength, body->size() - bodyOffset);
+            }
+            uint64_t length = frame->size() + (body ? bodyLength : 0);
+            if (lane == LANE_BULK) {
+                bulk.push_back({nextStream++, frame, 0, (caps & TCP_CAP_CHUNKED) != 0, now, body, bodyOffset, length});
+            } else if (lane == LANE_CHAT) {
+                if (!chat.push(chatSender(*frame), {frame, now}, frame->size())) return false;
+            } else {
+                control.push_back({frame, now});
+            }
+            queuedBytes += length;
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    bool enqueue(const std::string& data) {
+        return enqueue(std::make_shared<const std::string>(data));
+    }
+
+    OverloadStats takeOverloadStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        OverloadStats stats;
+        stats.overloaded = delay.isOverloaded();
+        stats.episodes = delay.overloadEpisodes();
+        stats.shedFrames = shedFrames;
+        stats.maxDelayMs = std::chrono::duration<double, std::milli>(delay.takeMaxSojourn()).count();
+        return stats;
+    }
+
+    // Chat bytes delivered (and dropped) per sender since the last call
+    std::map<std::string, FlowShare> takeShares() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return chat.takeShares();
+    }
+
+    // Stop the writer; frames still queued are dropped
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        ready.notify_one();
+    }
+
+    // Writer thread: one frame or chunk at a time, highest lane first
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this] { return closing || hasWork(); });
+            if (closing) return;
+
+            std::string chunk;
+            SpoolRead bodyRead;
+            QueuedFrame next;
+            const char* data;
+            size_t length;
+            Clock::time_point now = Clock::now();
+            if (!control.empty() && !midFrame()) {
+                next = control.front();
+                control.pop_front();
+                delay.record(now - next.queuedAt, now);
+                queuedBytes -= next.frame->size();
+                data = next.frame->data();
+                length = next.frame->size();
+            } else if (!chat.empty() && !midFrame()) {
+                chat.pop(next);
+                delay.record(now - next.queuedAt, now);
+                queuedBytes -= next.frame->size();
+                data = next.frame->data();
+                length = next.frame->size();
+            } else {
+                if (bulk.front().offset == 0) {
+                    delay.record(now - bulk.front().queuedAt, now);
+                }
+                chunk = nextBulkChunk(bodyRead);
+                data = chunk.data();
+                length = chunk.size();
+            }
+
+            sending = true;
+            sendingSince = now;
+            lock.unlock();
+            bool ok = true;
+            if (bodyRead.body) {
+                // Content from the spool file: read it without holding the lock
+                size_t start = chunk.size();
+                chunk.resize(start + bodyRead.length);
+                ok = bodyRead.body->read(bodyRead.offset, &chunk[start], bodyRead.length);
+                bodyRead.body.reset();
+                data = chunk.data();
+                length = chunk.size();
+            }
+            ok = ok && sendFully(socket, data, length);
+            lock.lock();
+            sending = false;
+            if (!ok) {
+                closing = true;
+                return;
+            }
+            if (!hasWork()) {
+                delay.idle();
+            }
+        }
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct QueuedFrame {
+        Frame frame;
+        Clock::time_point queuedAt;
+    };
+
+    struct BulkFrame {
+        uint16_t stream;
+        Frame frame;
+        uint64_t offset;
+        bool chunked; // decided when queued, so a frame never changes format halfway
+        Clock::time_point queuedAt;
+        std::shared_ptr<SpoolFile> body; // content after 'frame', if spooled
+        uint64_t bodyOffset;             // where the content starts in 'body'
+        uint64_t length;                 // frame plus content
+    };
+
+    // Part of a chunk still to be read from a spool file
+    struct SpoolRead {
+        std::shared_ptr<SpoolFile> body;
+        uint64_t offset;
+        size_t length;
+    };
+
+    bool hasWork() const {
+        return !control.empty() || !chat.empty() || !bulk.empty();
+    }
+
+    // An old client is in the middle of a bulk frame: nothing may cut in
+    bool midFrame() const {
+        return !bulk.empty() && !bulk.front().chunked && bulk.front().offset > 0;
+    }
+
+    // Next piece of bulk data. Chunked clients get a K frame and the bulk
+    // frames rotate; old clients get the raw bytes of the frame in order.
+    // Bytes that live in a spool file are left in 'bodyRead' for the caller.
+    std::string nextBulkChunk(SpoolRead& bodyRead) {
+        BulkFrame& head = bulk.front();
+        size_t length = std::min((uint64_t)BULK_CHUNK_SIZE, head.length - head.offset);
+        bool last = head.offset + length == head.length;
+
+        std::string chunk;
+        if (head.chunked) {
+            chunk.reserve(CHUNK_HEADER_SIZE + length);
+            chunk.push_back(CHUNK_FRAME);
+            chunk.push_back((head.stream >> 8) & 0xFF);
+            chunk.push_back(head.stream & 0xFF);
+            chunk.push_back(last ? CHUNK_LAST : 0);
+            chunk.push_back((length >> 16) & 0xFF);
+            chunk.push_back((length >> 8) & 0xFF);
+            chunk.push_back(length & 0xFF);
+        }
+        size_t inFrame = head.offset < head.frame->size() ? std::min((uint64_t)length, head.frame->size() - head.offset) : 0;
+        chunk.append(head.frame->data() + head.offset, inFrame);
+        if (inFrame < length) {
+            bodyRead = {head.body, head.bodyOffset + head.offset + inFrame - head.frame->size(), length - inFrame};
+        }
+        head.offset += length;
+        queuedBytes -= length;
+
+        BulkFrame current = head;
+        bulk.pop_front();
+        if (!last) {
+            if (current.chunked) {
+                bulk.push_back(current);
+            } else {
+                bulk.push_front(current);
+            }
+        }
+        return chunk;
+    }
+
+    int socket;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<QueuedFrame> control;
+    FairQueue<QueuedFrame> chat{CHAT_QUANTUM, CHAT_FLOW_LIMIT};
+    std::deque<BulkFrame> bulk;
+    uint16_t nextStream = 0;
+    uint16_t caps = 0;
+    size_t queuedBytes = 0;
+    bool closing = false;
+    CoDelMonitor delay;
+    bool sending = false; // the writer is inside send
+    Clock::time_point sendingSince;
+    uint64_t shedFrames = 0;
+};
+
+#endif
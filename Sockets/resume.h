@@ -0,0 +1,315 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+#include "spool.h"
+
+/*
+    Resumable file transfers (TCP_CAP_RESUME, frames in outbound.h).
+
+    An upload is identified by its sender and a transfer id that the client
+    derives from the destination, file name, size and modification time, so
+    sending the same file again after a reconnect (or after restarting the
+    client) finds the partial upload. The server stages what arrives in a
+    spool file and acknowledges every piece with R; an offer for a known id
+    is answered with the offset to continue from. With parallel data
+    connections pieces can arrive out of order: those ahead of the spool
+    wait in memory (AheadPiece) until the gap before them is filled, and
+    the client keeps them within a window of the last ack.
+
+    A finished upload goes to a recipient that negotiated the cap in D
+    pieces of RESUME_PIECE_SIZE, at most RESUME_WINDOW pieces ahead of the
+    first one not yet acknowledged. Pieces of a delivery may finish out of
+    order (bulk frames share the link chunk by chunk), so the recipient
+    writes each one at its offset in a .part file and acknowledges it with
+    a; the server keeps the prefix of acknowledged pieces. Once all are
+    saved an empty piece at the end tells the recipient to rename the file,
+    and its ack completes the delivery. When the recipient reconnects the
+    delivery goes on from the acknowledged prefix. Pieces refused for
+    overload are queued again by the periodic check.
+
+    Uploads and deliveries without progress for the resume timeout
+    (--resume-timeout, 10 minutes by default) are dropped with their spool
+    file.
+*/
+
+#define RESUME_MIN_SIZE (16 * 1024 * 1024) // smaller files go in one f frame
+#define RESUME_PIECE_SIZE (1024 * 1024)
+#define RESUME_WINDOW 8
+#define RESUME_CHECK_INTERVAL std::chrono::seconds(1)
+
+typedef std::chrono::steady_clock ResumeClock;
+
+// Transfer id of a file: the same file to the same peer gets the same id
+uint64_t transferId(const std::string& dest, const std::string& filename, uint64_t size, int64_t modified) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    auto mix = [&hash](const void* data, size_t length) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    mix(dest.data(), dest.size());
+    mix("", 1);
+    mix(filename.data(), filename.size());
+    mix(&size, sizeof(size));
+    mix(&modified, sizeof(modified));
+    return hash;
+}
+
+// A piece that arrived before the ones in front of it
+struct AheadPiece {
+    std::string data;
+    MemoryReservation memory;
+};
+
+struct PartialUpload {
+    uint64_t id;
+    std::string dest;
+    std::string filename;
+    uint64_t size;
+    ResumeClock::time_point lastActive; // under the store's mutex
+
+    std::mutex mutex;                  // the spool and 'ahead'; the streams share them
+    std::shared_ptr<SpoolFile> spool;  // what arrived in order so far
+    std::map<uint64_t, AheadPiece> ahead;
+    std::atomic<uint64_t> received{0}; // spool size, readable without the mutex
+};
+
+// The fields up to 'spool' never change once the delivery is created
+struct PendingDelivery {
+    uint64_t id;
+    std::string sender;
+    std::string filename;
+    uint64_t size;
+    std::shared_ptr<SpoolFile> spool;
+    uint64_t acked = 0;         // the recipient saved everything before this
+    std::set<uint64_t> ahead;   // pieces after 'acked' it saved too
+    uint64_t queued = 0;        // pieces were queued up to here
+    bool endQueued = false;     // the empty piece at 'size'
+    ResumeClock::time_point lastActive;
+};
+
+// A piece of a delivery to queue for 'recipient'
+struct DeliveryPiece {
+    std::string recipient;
+    std::shared_ptr<const PendingDelivery> delivery;
+    uint64_t offset;
+    size_t length;
+};
+
+// Uploads by (sender, id) and deliveries by (recipient, id)
+typedef std::pair<std::string, uint64_t> TransferKey;
+
+class ResumeStore {
+public:
+    void configure(std::chrono::seconds configured) {
+        std::lock_guard<std::mutex> lock(mutex);
+        timeout = configured;
+    }
+
+    std::string description() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return "partial transfers kept " + std::to_string(timeout.count()) + " s";
+    }
+
+    // The upload for an offer: the one in progress if it is the same file,
+    // otherwise a new one. nullptr if no spool file could be created.
+    std::shared_ptr<PartialUpload> offer(const std::string& sender, uint64_t id, const std::string& dest,
+                                         const std::string& filename, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<PartialUpload>& upload = uploads[{sender, id}];
+        if (!upload || upload->dest != dest || upload->filename != filename || upload->size != size) {
+            std::shared_ptr<SpoolFile> spool = SpoolFile::create();
+            if (!spool) {
+                uploads.erase({sender, id});
+                return nullptr;
+            }
+            upload = std::make_shared<PartialUpload>();
+            upload->id = id;
+            upload->dest = dest;
+            upload->filename = filename;
+            upload->size = size;
+            upload->spool = spool;
+        }
+        upload->lastActive = ResumeClock::now();
+        return upload;
+    }
+
+    // The upload a piece belongs to; nullptr if unknown or expired
+    std::shared_ptr<PartialUpload> upload(const std::string& sender, uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = uploads.find({sender, id});
+        if (it == uploads.end()) return nullptr;
+        it->second->lastActive = ResumeClock::now();
+        return it->second;
+    }
+
+    // False if it was already finished (by another stream)
+    bool finishUpload(const std::string& sender, uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return uploads.erase({sender, id}) > 0;
+    }
+
+    // Start a delivery; returns its first pieces
+    std::vector<DeliveryPiece> deliver(const std::string& recipient, std::shared_ptr<PendingDelivery> delivery) {
+        std::lock_guard<std::mutex> lock(mutex);
+        delivery->lastActive = ResumeClock::now();
+        deliveries[{recipient, delivery->id}] = delivery;
+        std::vector<DeliveryPiece> pieces;
+        nextPieces(recipient, *delivery, pieces);
+        return pieces;
+    }
+
+    // The recipient saved the piece at 'offset'. Returns the pieces that
+    // now fit in the window; 'done' if that was the final empty piece.
+    std::vector<DeliveryPiece> acknowledge(const std::string& recipient, uint64_t id, uint64_t offset, bool& done) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<DeliveryPiece> pieces;
+        done = false;
+        auto it = deliveries.find({recipient, id});
+        if (it == deliveries.end()) return pieces;
+        PendingDelivery& delivery = *it->second;
+        delivery.lastActive = ResumeClock::now();
+        if (offset == delivery.size) {
+            if (delivery.endQueued) {
+                done = true;
+                deliveries.erase(it);
+            }
+            return pieces;
+        }
+        if (offset < delivery.acked || offset >= delivery.queued || offset % RESUME_PIECE_SIZE != 0) return pieces;
+        delivery.ahead.insert(offset);
+        while (delivery.ahead.count(delivery.acked)) {
+            delivery.ahead.erase(delivery.acked);
+            delivery.acked = std::min(delivery.acked + RESUME_PIECE_SIZE, delivery.size);
+        }
+        nextPieces(recipient, delivery, pieces);
+        return pieces;
+    }
+
+    // A piece was not queued: it and what follows go again later
+    void unqueue(const std::string& recipient, uint64_t id, uint64_t offset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = deliveries.find({recipient, id});
+        if (it != deliveries.end()) {
+            PendingDelivery& delivery = *it->second;
+            if (offset == delivery.size) {
+                delivery.endQueued = false;
+            } else {
+                delivery.queued = std::min(delivery.queued, offset);
+            }
+        }
+    }
+
+    // The recipient (re)connected: what it had queued was lost, so its
+    // deliveries continue from the last ack
+    std::vector<DeliveryPiece> reconnected(const std::string& recipient) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<DeliveryPiece> pieces;
+        for (auto it = deliveries.lower_bound({recipient, 0}); it != deliveries.end() && it->first.first == recipient; ++it) {
+            it->second->queued = it->second->acked;
+            it->second->ahead.clear();
+            it->second->endQueued = false;
+            it->second->lastActive = ResumeClock::now();
+            nextPieces(recipient, *it->second, pieces);
+        }
+        return pieces;
+    }
+
+    // Drop what made no progress within the timeout (logged in 'expired')
+    // and return the pieces of deliveries with nothing queued
+    std::vector<DeliveryPiece> check(std::vector<std::string>& expired) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ResumeClock::time_point deadline = ResumeClock::now() - timeout;
+        for (auto it = uploads.begin(); it != uploads.end();) {
+            if (it->second->lastActive < deadline) {
+                expired.push_back("upload of " + it->second->filename + " from " + it->first.first + " to " +
+                                  it->second->dest + " (" + std::to_string(it->second->received) + " of " +
+                                  std::to_string(it->second->size) + " bytes)");
+                it = uploads.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        std::vector<DeliveryPiece> pieces;
+        for (auto it = deliveries.begin(); it != deliveries.end();) {
+            PendingDelivery& delivery = *it->second;
+            if (delivery.lastActive < deadline) {
+                expired.push_back("delivery of " + delivery.filename + " from " + delivery.sender + " to " +
+                                  it->first.first + " (" + std::to_string(delivery.acked) + " of " +
+                                  std::to_string(delivery.size) + " bytes)");
+                it = deliveries.erase(it);
+                continue;
+            }
+            if (delivery.queued == delivery.acked && !delivery.endQueued) {
+                nextPieces(it->first.first, delivery, pieces);
+            }
+            ++it;
+        }
+        return pieces;
+    }
+
+    // Current state; 'changed' says whether it changed since the last call
+    std::string usage(bool* changed = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t received = 0;
+        for (auto& upload : uploads) {
+            received += upload.second->received;
+        }
+        uint64_t pending = 0;
+        for (auto& delivery : deliveries) {
+            pending += delivery.second->size - delivery.second->acked;
+        }
+        std::ostringstream out;
+        out << uploads.size() << " partial uploads (" << formatMemoryAmount(received) << " received), "
+            << deliveries.size() << " deliveries (" << formatMemoryAmount(pending) << " to go)";
+        if (changed != nullptr) {
+            *changed = uploads.size() != reportedUploads || received != reportedReceived ||
+                       deliveries.size() != reportedDeliveries || pending != reportedPending;
+            reportedUploads = uploads.size();
+            reportedReceived = received;
+            reportedDeliveries = deliveries.size();
+            reportedPending = pending;
+        }
+        return out.str();
+    }
+
+private:
+    // Pieces of 'delivery' up to RESUME_WINDOW ahead of its ack, and the
+    // empty one once everything is saved
+    void nextPieces(const std::string& recipient, PendingDelivery& delivery, std::vector<DeliveryPiece>& pieces) {
+        std::shared_ptr<PendingDelivery> shared = deliveries[{recipient, delivery.id}];
+        uint64_t window = delivery.acked + (uint64_t)RESUME_WINDOW * RESUME_PIECE_SIZE;
+        while (delivery.queued < delivery.size && delivery.queued < window) {
+            size_t length = std::min((uint64_t)RESUME_PIECE_SIZE, delivery.size - delivery.queued);
+            pieces.push_back({recipient, shared, delivery.queued, length});
+            delivery.queued += length;
+        }
+        if (delivery.acked == delivery.size && !delivery.endQueued) {
+            pieces.push_back({recipient, shared, delivery.size, 0});
+            delivery.endQueued = true;
+        }
+    }
+
+    std::mutex mutex;
+    std::chrono::seconds timeout{600};
+    std::map<TransferKey, std::shared_ptr<PartialUpload>> uploads;
+    std::map<TransferKey, std::shared_ptr<PendingDelivery>> deliveries;
+    size_t reportedUploads = 0;
+    uint64_t reportedReceived = 0;
+    size_t reportedDeliveries = 0;
+    uint64_t reportedPending = 0;
+};
+
+#endif
@@ -2,24 +2,78 @@
 #include <string>
 #include <thread>
 #include <map>
+#include <set>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <cstring>
 #include <iomanip>
 #include <sstream>
+#include <random>
+#include <algorithm>
 #include "sala.h"
 #include "sala_serialized.h"
+#include "timerwheel.h"
+#include "outbound.h"
+#include "ratelimit.h"
+#include "memorybudget.h"
+#include "spool.h"
+#include "lz.h"
+#include "resume.h"
+#include "chunkstore.h"
+#include "delta.h"
+#include "batch.h"
 
 using namespace std;
 
 #define PORT 45000
 
-map<string,int> clients;
+// A player who doesn't move within this time loses the game
+#define MOVE_TIMEOUT chrono::seconds(60)
+
+// TCP keepalive probes detect clients that vanished without closing:
+// first probe after KEEPALIVE_IDLE s of silence, then KEEPALIVE_COUNT
+// probes KEEPALIVE_INTERVAL s apart
+#define KEEPALIVE_IDLE 30
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+
+// How often each sender's share of the chat traffic is logged
+#define SHARE_REPORT_INTERVAL chrono::seconds(10)
+
+// A client over its rate limit waits up to this long (its reader pauses, so
+// TCP slows the sender down); beyond that the message is refused with 'E'
+#define RATE_MAX_DEFER 1.0
+
+// A sender whose broadcasts or files are shed for overload hears about it
+// at most once per interval
+#define OVERLOAD_NOTICE_INTERVAL chrono::seconds(1)
+
+// A file or object that doesn't fit in the memory budget right now waits
+// this long for memory to be freed (its reader pauses meanwhile)
+#define MEMORY_MAX_DEFER chrono::seconds(5)
+
+// How often memory usage is logged while it changes
+#define MEMORY_REPORT_INTERVAL chrono::seconds(1)
+
+// Largest text a compressed m or t may expand to (its 3 byte length field)
+#define MAX_MESSAGE_LENGTH ((1 << 24) - 1)
+
+RateLimiter rateLimiter;
+MemoryBudget memoryBudget;
+ResumeStore resumeStore;
+ChunkStore chunkStore;
+
+map<string, shared_ptr<Connection>> clients;
 mutex clients_mutex;
+map<string, uint64_t> reportedShed; // shed frames already logged per client, under clients_mutex
+map<string, uint64_t> sessionTokens; // for data connections (TCP_CAP_PARALLEL), under clients_mutex
 
 /*
     n: Nickname (client → server)
@@ -34,6 +88,33 @@ mutex clients_mutex;
     L: List of clients (server → client)
     X: Close connection (server → client)
     F: Send files (server → client)
+    c: Capabilities (client → server)
+    C: Accepted capabilities (server → client)
+    K: Chunk of a bulk frame (server → client), see outbound.h
+    z: Compressed f, o, m or t (client → server), see outbound.h
+    Z: Compressed F, O, M or T (server → client)
+    r: Offer a resumable upload (client → server), see outbound.h
+    k: Piece of a resumable upload (client → server)
+    R: Bytes of a resumable upload received (server → client)
+    D: Piece of a resumable delivery (server → client)
+    a: Piece of a resumable delivery saved (client → server)
+    S: Session token for data connections (server → client)
+    d: Open a data connection (client → server, instead of n)
+    h: Announce an upload by its chunks (client → server), see outbound.h
+    H: Chunks of an announced upload to send (server → client)
+    u: Chunk of an announced upload (client → server)
+    q: Ask a recipient for the signature of its copy of a file (client → server)
+    Q: Signature request (server → client)
+    g: Signature of a copy (client → server)
+    G: Signature of the recipient's copy (server → client)
+    v: File as a delta of the recipient's copy (client → server)
+    V: File as a delta of the local copy (server → client)
+    w: Envelope, t, f or o for several recipients (client → server), see outbound.h
+    Y: What became of each copy of an envelope (server → client)
+    b: Open a batch of small files (client → server), see outbound.h
+    s: Segment of a batch (client → server)
+    A: Header table of a batch (server → client)
+    N: Segment of a batch (server → client)
 */
 
 // Helper function to print protocol data in hex
@@ -49,29 +130,73 @@ string formatProtocol(const string& data) {
     return ss.str();
 }
 
+// Same, cut short for files and objects so logging doesn't hold up other clients
+string formatFrame(const string& data) {
+    if (data.size() <= 64) return formatProtocol(data);
+    return formatProtocol(data.substr(0, 50)) + "... (" + to_string(data.size()) + " bytes)";
+}
+
 // Build close connection message
 string buildClose() {
     return "X"; // Single byte message
 }
 
-// send a message to everyone except who is sending
-void sendAll(const string data, int sender_client = -1) {
+// send a message to everyone except who is sending; returns how many
+// clients refused it because they are overloaded. Clients that negotiated
+// TCP_CAP_COMPRESS get the 'compressed' version when there is one.
+int sendAll(const string data, int sender_client = -1, const string compressed = "") {
+    Frame frame = make_shared<const string>(data);
+    Frame compressedFrame = compressed.empty() ? frame : make_shared<const string>(compressed);
+    string logged = formatFrame(data);
+    string compressedLogged = formatFrame(compressed);
+    int refused = 0;
     lock_guard<mutex> lock(clients_mutex);
     for (auto client : clients) {
-        if (client.second != sender_client) {
-            cout << "Server sending to " << client.first << ": " << formatProtocol(data) << endl;
-            send(client.second, data.c_str(), data.size(), 0);
+        if (client.second->fd() != sender_client) {
+            bool packed = !compressed.empty() && client.second->hasCap(TCP_CAP_COMPRESS);
+            cout << "Server sending to " << client.first << ": " << (packed ? compressedLogged : logged) << endl;
+            if (!client.second->enqueue(packed ? compressedFrame : frame)) refused++;
         }
     }
+    return refused;
 }
 
-// send a message to a specific client
-void sendToClient(const string dest, const string data) {
+// Whether 'dest' takes compressed frames (TCP_CAP_COMPRESS)
+bool acceptsCompressed(const string& dest) {
+    lock_guard<mutex> lock(clients_mutex);
+    auto it = clients.find(dest);
+    return it != clients.end() && it->second->hasCap(TCP_CAP_COMPRESS);
+}
+
+// Whether every connected recipient of an envelope takes compressed frames
+// (nothing is built for one that isn't connected)
+bool acceptsCompressed(const vector<string>& dests) {
+    lock_guard<mutex> lock(clients_mutex);
+    for (const string& dest : dests) {
+        auto it = clients.find(dest);
+        if (it != clients.end() && !it->second->hasCap(TCP_CAP_COMPRESS)) return false;
+    }
+    return true;
+}
+
+// A frame that holds 'memory' (if any) until every queue sending it is done
+Frame heldFrame(string data, shared_ptr<MemoryReservation> memory) {
+    return memory ? Frame(new string(move(data)), [memory](const string* sent) { delete sent; })
+                  : make_shared<const string>(move(data));
+}
+
+// send a message to a specific client; its writer thread does the send.
+// Returns false if the client's queue refused the frame. A memory
+// reservation passed along is held until the frame has been sent.
+bool sendToClient(const string dest, const string data, shared_ptr<MemoryReservation> memory = nullptr) {
+    Frame frame = heldFrame(data, memory);
+    string logged = formatFrame(data);
     lock_guard<mutex> lock(clients_mutex);
     if (clients.count(dest)) {
-        cout << "Server sending to " << dest << ": " << formatProtocol(data) << endl;
-        send(clients[dest], data.c_str(), data.size(), 0);
+        cout << "Server sending to " << dest << ": " << logged << endl;
+        return clients[dest]->enqueue(frame);
     }
+    return true;
 }
 
 // Build the error message with the protocol
@@ -131,7 +256,8 @@ string buildList() {
 }
 
 // Function to build file message
-string buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size) {
+// Everything in a file message up to the content
+string buildFileHeader(const string& sender, const string& filename, uint64_t file_size) {
     string packet = "F"; // Type 'F' for file
     
     // Sender
@@ -153,12 +279,96 @@ string buildFile(const string& sender, const string& filename, const char* file_
         packet.push_back((file_size >> (i * 8)) & 0xFF);
     }
     
+    return packet;
+}
+
+string buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size) {
+    string packet = buildFileHeader(sender, filename, file_size);
+    packet.reserve(packet.size() + file_size);
+    
     // File content
     packet.append(file_data, file_size);
     
     return packet;
 }
 
+// Chunks of an announced upload the client has to send (TCP_CAP_DEDUP)
+string buildChunkRequest(uint64_t id, const vector<uint64_t>& missing) {
+    string packet = "H";
+    for (int i = 7; i >= 0; i--) {
+        packet.push_back((id >> (i * 8)) & 0xFF);
+    }
+    for (int i = 3; i >= 0; i--) {
+        packet.push_back((missing.size() >> (i * 8)) & 0xFF);
+    }
+    for (uint64_t index : missing) {
+        for (int i = 3; i >= 0; i--) {
+            packet.push_back((index >> (i * 8)) & 0xFF);
+        }
+    }
+    return packet;
+}
+
+// Answer to an announced upload the server won't take, after the E frame
+// saying why, so the client stops waiting for the chunk request
+string buildChunkRefusal(uint64_t id) {
+    string packet = "H";
+    for (int i = 7; i >= 0; i--) {
+        packet.push_back((id >> (i * 8)) & 0xFF);
+    }
+    for (int i = 3; i >= 0; i--) {
+        packet.push_back((CHUNKED_REFUSED >> (i * 8)) & 0xFF);
+    }
+    return packet;
+}
+
+// Token that lets the client open data connections (TCP_CAP_PARALLEL)
+string buildSessionToken(uint64_t token) {
+    string packet = "S";
+    for (int i = 7; i >= 0; i--) {
+        packet.push_back((token >> (i * 8)) & 0xFF);
+    }
+    return packet;
+}
+
+// Acknowledge the bytes of a resumable upload held by the server
+string buildResumeAck(uint64_t id, uint64_t offset) {
+    string packet = "R";
+    for (int i = 7; i >= 0; i--) {
+        packet.push_back((id >> (i * 8)) & 0xFF);
+    }
+    for (int i = 9; i >= 0; i--) {
+        packet.push_back((offset >> (i * 8)) & 0xFF);
+    }
+    return packet;
+}
+
+// Everything in a piece of a resumable delivery up to its data
+string buildDeliveryPiece(const PendingDelivery& delivery, uint64_t offset, size_t length) {
+    string packet = "D";
+    for (int i = 7; i >= 0; i--) {
+        packet.push_back((delivery.id >> (i * 8)) & 0xFF);
+    }
+    uint16_t slen = htons(delivery.sender.size());
+    packet.append((char*)&slen, 2);
+    packet += delivery.sender;
+    uint32_t flen = delivery.filename.size();
+    packet.push_back((flen >> 16) & 0xFF);
+    packet.push_back((flen >> 8) & 0xFF);
+    packet.push_back(flen & 0xFF);
+    packet += delivery.filename;
+    for (int i = 9; i >= 0; i--) {
+        packet.push_back((delivery.size >> (i * 8)) & 0xFF);
+    }
+    for (int i = 9; i >= 0; i--) {
+        packet.push_back((offset >> (i * 8)) & 0xFF);
+    }
+    packet.push_back((length >> 16) & 0xFF);
+    packet.push_back((length >> 8) & 0xFF);
+    packet.push_back(length & 0xFF);
+    return packet;
+}
+
 // Function to build object message
 string buildObject(const string& sender, const vector<char>& objectData) {
     string packet = "O";
@@ -184,10 +394,130 @@ struct Game {
     vector<char> board;
     string currentPlayer;
     bool gameActive;
+    uint32_t turn; // current turn; a timeout armed for another turn is ignored
 };
 
 map<pair<string, string>, Game> activeGames;
 mutex games_mutex;
+uint32_t nextTurn = 1; // guarded by games_mutex
+
+// Timers shared by all client threads, fired by runTimers
+TimerWheel timers;
+mutex timers_mutex;
+condition_variable timers_changed;
+
+void scheduleTimer(chrono::milliseconds delay, function<void()> callback) {
+    {
+        lock_guard<mutex> lock(timers_mutex);
+        timers.schedule(delay, move(callback));
+    }
+    timers_changed.notify_one();
+}
+
+// Timer thread: callbacks run without timers_mutex so they can take other
+// locks and schedule new timers
+void runTimers() {
+    unique_lock<mutex> lock(timers_mutex);
+    while (true) {
+        long wait = timers.nextTimeoutUs(chrono::steady_clock::now());
+        if (wait < 0) {
+            timers_changed.wait(lock);
+        } else if (wait > 0) {
+            timers_changed.wait_for(lock, chrono::microseconds(wait));
+        }
+        vector<function<void()>> due = timers.expire(chrono::steady_clock::now());
+        lock.unlock();
+        for (auto& callback : due) {
+            callback();
+        }
+        lock.lock();
+    }
+}
+
+// Log each sender's share of the chat bytes delivered to all clients, and
+// what was dropped because it flooded a recipient
+void scheduleShareReport() {
+    scheduleTimer(chrono::duration_cast<chrono::milliseconds>(SHARE_REPORT_INTERVAL), []() {
+        map<string, FlowShare> shares;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            for (auto& client : clients) {
+                for (auto& [sender, share] : client.second->takeShares()) {
+                    shares[sender].servedCost += share.servedCost;
+                    shares[sender].servedItems += share.servedItems;
+                    shares[sender].droppedItems += share.droppedItems;
+                }
+            }
+        }
+
+        bool limited = false;
+        string limits = rateLimiter.summary(&limited);
+        if (limited) {
+            cout << "Rate limits: " << limits << endl;
+        }
+
+        stringstream overload;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            for (auto& client : clients) {
+                OverloadStats stats = client.second->takeOverloadStats();
+                if (!stats.overloaded && stats.shedFrames == reportedShed[client.first]) continue;
+                reportedShed[client.first] = stats.shedFrames;
+                overload << " " << client.first << " " << (stats.overloaded ? "on" : "off") << " (max delay "
+                         << fixed << setprecision(1) << stats.maxDelayMs << " ms, " << stats.episodes
+                         << " episodes, " << stats.shedFrames << " shed)";
+            }
+        }
+        if (!overload.str().empty()) {
+            cout << "Overload:" << overload.str() << endl;
+        }
+
+        uint64_t total = 0;
+        bool dropped = false;
+        for (auto& [sender, share] : shares) {
+            total += share.servedCost;
+            dropped = dropped || share.droppedItems > 0;
+        }
+        if (shares.size() > 1 || dropped) {
+            stringstream out;
+            out << "Chat shares:";
+            for (auto& [sender, share] : shares) {
+                out << " " << sender << " " << fixed << setprecision(1)
+                    << (total ? share.servedCost * 100.0 / total : 0.0) << "% (" << share.servedItems << " messages";
+                if (share.droppedItems > 0) {
+                    out << ", " << share.droppedItems << " dropped";
+                }
+                out << ")";
+            }
+            cout << out.str() << endl;
+        }
+        scheduleShareReport();
+    });
+}
+
+// Log memory and spool usage once a second while they change
+void scheduleMemoryReport() {
+    scheduleTimer(chrono::duration_cast<chrono::milliseconds>(MEMORY_REPORT_INTERVAL), []() {
+        bool changed = false;
+        string usage = memoryBudget.usage(&changed);
+        if (changed) {
+            cout << "Memory: " << usage << endl;
+        }
+        string spoolUsage = spoolDirectory().usage(&changed);
+        if (changed) {
+            cout << "Spool: " << spoolUsage << endl;
+        }
+        string resumeUsage = resumeStore.usage(&changed);
+        if (changed) {
+            cout << "Resume: " << resumeUsage << endl;
+        }
+        string chunkUsage = chunkStore.usage(&changed);
+        if (changed) {
+            cout << "Chunk store: " << chunkUsage << endl;
+        }
+        scheduleMemoryReport();
+    });
+}
 
 string buildGameRequest(const string& sender) {
     string packet = "J";
@@ -257,15 +587,520 @@ void initializeGame(Game& game, const string& p1, const string& p2) {
     game.board = vector<char>(9, ' ');
     game.currentPlayer = p1;
     game.gameActive = true;
+    game.turn = nextTurn++;
+}
+
+// The player holding the turn loses if they don't move before MOVE_TIMEOUT
+void scheduleMoveTimeout(const pair<string, string>& gameKey, uint32_t turn) {
+    scheduleTimer(chrono::duration_cast<chrono::milliseconds>(MOVE_TIMEOUT), [gameKey, turn]() {
+        lock_guard<mutex> lock(games_mutex);
+        auto it = activeGames.find(gameKey);
+        if (it == activeGames.end() || it->second.turn != turn) return;
+
+        string loser = it->second.currentPlayer;
+        string winner = loser == it->second.player1 ? it->second.player2 : it->second.player1;
+        sendToClient(loser, buildGameResult('0'));
+        sendToClient(winner, buildGameResult('1'));
+        cout << loser << " ran out of time, " << winner << " wins" << endl;
+        activeGames.erase(it);
+    });
+}
+
+// Apply the sender's rate limit for this message before it fans out
+bool admitMessage(const string& nickname, Connection& connection, char type, double cost) {
+    int rateClass = rateClassFor(type);
+    while (true) {
+        double wait = rateLimiter.admit(nickname, rateClass, cost);
+        if (wait <= 0) return true;
+        if (wait > RATE_MAX_DEFER) {
+            stringstream error;
+            error << "Rate limited: " << rateLimiter.limitDescription(rateClass) << ", retry in "
+                  << fixed << setprecision(2) << wait << " s";
+            cout << nickname << " " << error.str() << endl;
+            connection.enqueue(buildError(error.str()));
+            return false;
+        }
+        this_thread::sleep_for(chrono::duration<double>(wait));
+    }
+}
+
+// send a message whose content is in a spool file: the writer streams the
+// content from disk after 'header'
+bool sendSpooled(const string dest, const string header, shared_ptr<SpoolFile> body) {
+    Frame frame = make_shared<const string>(header);
+    lock_guard<mutex> lock(clients_mutex);
+    if (clients.count(dest)) {
+        cout << "Server sending to " << dest << ": " << formatFrame(header) << " + " << body->size()
+             << " bytes from spool" << endl;
+        return clients[dest]->enqueue(frame, body);
+    }
+    return true;
+}
+
+// send the same frame to several clients (an envelope, TCP_CAP_ENVELOPE):
+// every queue shares it, so the cost doesn't grow with the recipients.
+// 'packed' (if any) goes to those with TCP_CAP_COMPRESS, 'frame' to the
+// rest; a spool 'body' follows either. Returns the ENVELOPE_* status of
+// each recipient.
+string sendToClients(const vector<string>& dests, Frame frame, Frame packed = nullptr,
+                     shared_ptr<SpoolFile> body = nullptr) {
+    string spooled = body ? " + " + to_string(body->size()) + " bytes from spool" : "";
+    string logged = frame ? formatFrame(*frame) + spooled : "";
+    string packedLogged = packed ? formatFrame(*packed) + spooled : "";
+    string statuses;
+    lock_guard<mutex> lock(clients_mutex);
+    for (const string& dest : dests) {
+        auto it = clients.find(dest);
+        if (it == clients.end()) {
+            statuses.push_back(ENVELOPE_OFFLINE);
+            continue;
+        }
+        bool usePacked = packed && (it->second->hasCap(TCP_CAP_COMPRESS) || !frame);
+        Frame sent = usePacked ? packed : frame;
+        cout << "Server sending to " << dest << ": " << (usePacked ? packedLogged : logged) << endl;
+        statuses.push_back(it->second->enqueue(sent, body) ? ENVELOPE_QUEUED : ENVELOPE_REFUSED);
+    }
+    return statuses;
+}
+
+// Queue pieces of resumable deliveries, their data read from the spool by
+// the writer. After a piece is refused (the recipient is gone or
+// overloaded) the rest of that delivery is left for resumeStore to retry.
+void queuePieces(const vector<DeliveryPiece>& pieces) {
+    set<TransferKey> refused;
+    lock_guard<mutex> lock(clients_mutex);
+    for (const DeliveryPiece& piece : pieces) {
+        TransferKey key(piece.recipient, piece.delivery->id);
+        if (refused.count(key)) continue;
+        auto it = clients.find(piece.recipient);
+        bool queued = false;
+        if (it != clients.end() && it->second->hasCap(TCP_CAP_RESUME)) {
+            Frame frame = make_shared<const string>(buildDeliveryPiece(*piece.delivery, piece.offset, piece.length));
+            queued = it->second->enqueue(frame, piece.delivery->spool, piece.offset, piece.length);
+        }
+        if (!queued) {
+            refused.insert(key);
+            resumeStore.unqueue(piece.recipient, piece.delivery->id, piece.offset);
+        }
+    }
+}
+
+// Send a finished resumable upload to its destination: resumably if it
+// negotiated TCP_CAP_RESUME, as a normal F frame from the spool otherwise
+void deliverUpload(const string& sender, const PartialUpload& upload) {
+    bool resumable = false;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        auto it = clients.find(upload.dest);
+        resumable = it != clients.end() && it->second->hasCap(TCP_CAP_RESUME);
+    }
+    if (!resumable || upload.size == 0) {
+        sendSpooled(upload.dest, buildFileHeader(sender, upload.filename, upload.size), upload.spool);
+        return;
+    }
+    auto delivery = make_shared<PendingDelivery>();
+    delivery->id = upload.id;
+    delivery->sender = sender;
+    delivery->filename = upload.filename;
+    delivery->size = upload.size;
+    delivery->spool = upload.spool;
+    cout << "Server delivering " << upload.filename << " to " << upload.dest << " resumably (" << upload.size
+         << " bytes)" << endl;
+    queuePieces(resumeStore.deliver(upload.dest, delivery));
+}
+
+// Drop stalled partial transfers and retry refused pieces
+void scheduleResumeCheck() {
+    scheduleTimer(chrono::duration_cast<chrono::milliseconds>(RESUME_CHECK_INTERVAL), []() {
+        vector<string> expired;
+        vector<DeliveryPiece> pieces = resumeStore.check(expired);
+        for (const string& transfer : expired) {
+            cout << "Resume timeout: dropped " << transfer << endl;
+        }
+        queuePieces(pieces);
+        scheduleResumeCheck();
+    });
+}
+
+// Reserve memory for a file or object before allocating it, so the size in
+// a client's header can't make the server allocate whatever it claims.
+// Files over the spool threshold, or that the memory budget can't hold,
+// get a spool file instead (spool.h) when there is room on disk.
+bool reservePayload(const string& nickname, Connection& connection, int memoryClass, uint64_t bytes,
+                    MemoryReservation& memory, shared_ptr<SpoolFile>* spool = nullptr) {
+    bool spoolable = spool != nullptr && spoolDirectory().fits(bytes);
+    MemoryResult result = MEMORY_TOO_LARGE;
+    if (!spoolable || bytes <= spoolDirectory().settings().threshold) {
+        // With the spool as fallback there is no point waiting for memory
+        result = memoryBudget.reserve(nickname, memoryClass, bytes, memory,
+                                      spoolable ? chrono::seconds(0) : MEMORY_MAX_DEFER);
+        if (result == MEMORY_RESERVED) return true;
+    }
+    if (spoolable) {
+        *spool = SpoolFile::create();
+        if (*spool) return true;
+    }
+
+    string error = result == MEMORY_TOO_LARGE
+        ? "Too large: " + to_string(bytes) + " bytes, memory budget is " + memoryBudget.description()
+        : "Server busy: memory budget exhausted, try again later";
+    cout << nickname << " " << error << endl;
+    connection.enqueue(buildError(error));
+    return false;
+}
+
+// The largest payload the server takes: what the memory budget gives one
+// client, or the whole spool. A compressed stream whose header claims more
+// is refused before it is forwarded or expanded.
+uint64_t payloadLimit() {
+    return max(memoryBudget.largest(), spoolDirectory().settings().limit);
+}
+
+// Receive a payload straight into its spool file. Returns false if the
+// connection closed; 'remaining' is left non zero if the spool filled up.
+bool receiveToSpool(int socket, SpoolFile& spool, uint64_t& remaining) {
+    while (remaining > 0) {
+        size_t available;
+        char* window = spool.writeWindow(available);
+        if (window == nullptr) return true;
+        int r = recv(socket, window, min((uint64_t)available, remaining), 0);
+        if (r <= 0) return false;
+        spool.commit(r);
+        remaining -= r;
+    }
+    return true;
+}
+
+// Receive a compressed payload and expand it into 'output' as it arrives,
+// one stream block at a time. Returns false if the connection closed; the
+// payload is complete only if decoder.finished() (a corrupt stream or an
+// 'output' that refuses a block stops the expansion, and 'remaining' is
+// left to be discarded).
+template <typename Output>
+bool receiveExpanded(int socket, LzDecoder& decoder, uint64_t& remaining, Output output) {
+    char buffer[64 * 1024];
+    while (remaining > 0) {
+        int r = recv(socket, buffer, min(remaining, (uint64_t)sizeof(buffer)), 0);
+        if (r <= 0) return false;
+        remaining -= r;
+        if (!decoder.feed(buffer, r, output)) return true;
+    }
+    return true;
+}
+
+// Expand a compressed object for a recipient without TCP_CAP_COMPRESS. The
+// expanded size is reserved first, on top of the stream already held.
+bool expandPayload(const string& nickname, Connection& connection, int memoryClass, const vector<char>& stream,
+                   uint64_t limit, MemoryReservation& memory, string& expanded) {
+    uint64_t size;
+    if (lzStreamSize(stream.data(), stream.size(), size) && size <= limit) {
+        if (!reservePayload(nickname, connection, memoryClass, size, memory)) return false;
+        if (lzDecompress(stream.data(), stream.size(), expanded, size)) return true;
+    }
+    cout << nickname << " sent corrupt compressed data" << endl;
+    connection.enqueue(buildError("Corrupt compressed data"));
+    return false;
+}
+
+// Read a big endian number of 'width' bytes (ids, sizes and offsets)
+bool receiveNumber(int socket, int width, uint64_t& value) {
+    unsigned char buffer[10];
+    int received = 0;
+    while (received < width) {
+        int r = recv(socket, buffer + received, width - received, 0);
+        if (r <= 0) return false;
+        received += r;
+    }
+    value = 0;
+    for (int i = 0; i < width; i++) {
+        value = (value << 8) | buffer[i];
+    }
+    return true;
+}
+
+// Read a string preceded by its length in 'width' bytes
+bool receiveString(int socket, int width, string& value) {
+    uint64_t length;
+    if (!receiveNumber(socket, width, length)) return false;
+    value.assign(length, '\0');
+    return length == 0 || recv(socket, &value[0], length, MSG_WAITALL) == (ssize_t)length;
+}
+
+// Append a big endian number of 'width' bytes
+void appendNumber(string& packet, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        packet.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+// Tell the sender of an envelope what became of each copy
+string buildDeliveryReport(char type, const vector<string>& dests, const string& statuses) {
+    string packet = "Y";
+    packet.push_back(type);
+    appendNumber(packet, dests.size(), 2);
+    for (size_t i = 0; i < dests.size(); i++) {
+        appendNumber(packet, dests[i].size(), 2);
+        packet += dests[i];
+        packet.push_back(statuses[i]);
+    }
+    return packet;
+}
+
+// Header table of a batch for its recipient (TCP_CAP_BATCH)
+string buildBatchTable(uint64_t id, const string& sender, const string& table) {
+    string packet = "A";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, sender.size(), 2);
+    packet += sender;
+    appendNumber(packet, table.size(), 4);
+    packet += table;
+    return packet;
+}
+
+// Segment of a batch at 'offset' of its contents
+string buildBatchSegment(uint64_t id, const string& sender, uint64_t offset, const string& data) {
+    string packet = "N";
+    appendNumber(packet, id, 8);
+    appendNumber(packet, sender.size(), 2);
+    packet += sender;
+    appendNumber(packet, offset, 10);
+    appendNumber(packet, data.size(), 3);
+    packet += data;
+    return packet;
+}
+
+// The recipients whose queue refused a frame, for an overload notice:
+// "bob is", "bob, carol are", or "" if there are none
+string refusedRecipients(const vector<string>& dests, const string& statuses) {
+    string refused;
+    int count = 0;
+    for (size_t i = 0; i < dests.size(); i++) {
+        if (statuses[i] != ENVELOPE_REFUSED) continue;
+        refused += (refused.empty() ? "" : ", ") + dests[i];
+        count++;
+    }
+    if (count == 0) return "";
+    return refused + (count > 1 ? " are" : " is");
+}
+
+// Read and drop a payload that was refused, to stay in step with the stream
+bool discardBytes(int socket, uint64_t length) {
+    char buffer[64 * 1024];
+    while (length > 0) {
+        int r = recv(socket, buffer, min(length, (uint64_t)sizeof(buffer)), 0);
+        if (r <= 0) return false;
+        length -= r;
+    }
+    return true;
+}
+
+// Tell the sender its broadcast or file was shed because recipients are
+// not keeping up (see outbound.h). Runs on the sender's own thread, so the
+// last notice time can be thread local.
+void reportShed(const string& nickname, Connection& connection, const string& what) {
+    thread_local chrono::steady_clock::time_point lastNotice;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now - lastNotice < OVERLOAD_NOTICE_INTERVAL) return;
+    lastNotice = now;
+
+    string error = "Server overloaded: " + what;
+    cout << nickname << " " << error << endl;
+    connection.enqueue(buildError(error));
+}
+
+// Receive the k piece at 'offset' of an upload, on the chat connection or
+// a data connection. A piece that continues the spool goes straight to it;
+// one that arrived ahead of others (parallel streams) waits in memory until
+// the gap before it is filled. Returns false if the connection closed.
+bool receivePiece(int socket, const string& nickname, Connection& connection, uint64_t id, uint64_t offset,
+                  uint64_t length) {
+    shared_ptr<PartialUpload> upload = resumeStore.upload(nickname, id);
+    if (!upload || offset < upload->received || offset + length > upload->size) {
+        string error = upload ? "Resumable upload out of step, continue at " + to_string(upload->received)
+                              : "Unknown or expired resumable upload, send the file again";
+        cout << nickname << " " << error << endl;
+        connection.enqueue(buildError(error));
+        if (upload) connection.enqueue(buildResumeAck(id, upload->received));
+        return discardBytes(socket, length);
+    }
+    if (!admitMessage(nickname, connection, 'f', length)) {
+        return discardBytes(socket, length);
+    }
+
+    unique_lock<mutex> lock(upload->mutex);
+    if (offset == upload->spool->size()) {
+        uint64_t remaining = length;
+        bool open = receiveToSpool(socket, *upload->spool, remaining);
+        upload->received = upload->spool->size();
+        if (!open) return false;
+        if (remaining > 0) {
+            lock.unlock();
+            string error = "Server busy: spool full, upload paused at " + to_string(upload->received);
+            cout << nickname << " " << error << endl;
+            connection.enqueue(buildError(error));
+            return discardBytes(socket, remaining);
+        }
+    } else {
+        // Ahead of the spool: into memory, without holding up the other streams
+        lock.unlock();
+        AheadPiece piece;
+        if (!reservePayload(nickname, connection, MEMORY_FILE, length, piece.memory)) {
+            return discardBytes(socket, length);
+        }
+        piece.data.resize(length);
+        if (length > 0 && recv(socket, &piece.data[0], length, MSG_WAITALL) != (ssize_t)length) return false;
+        lock.lock();
+        if (offset + length > upload->spool->size()) {
+            upload->ahead.emplace(offset, move(piece));
+        }
+    }
+
+    // Pieces that waited for this one. After a resume from the middle of a
+    // piece the new pieces overlap the old ones, so only what goes past the
+    // spool is appended.
+    while (!upload->ahead.empty() && upload->ahead.begin()->first <= upload->spool->size()) {
+        const string& data = upload->ahead.begin()->second.data;
+        uint64_t skip = upload->spool->size() - upload->ahead.begin()->first;
+        if (skip < data.size() && !upload->spool->append(data.data() + skip, data.size() - skip)) break;
+        upload->ahead.erase(upload->ahead.begin());
+    }
+    uint64_t received = upload->received = upload->spool->size();
+    lock.unlock();
+
+    connection.enqueue(buildResumeAck(id, received));
+    if (received == upload->size && resumeStore.finishUpload(nickname, id)) {
+        cout << nickname << " received: resumable " << upload->filename << " for " << upload->dest
+             << " (" << received << " bytes)" << endl;
+        deliverUpload(nickname, *upload);
+    }
+    return true;
+}
+
+// Relay the next segment of a batch: as is to a recipient with
+// TCP_CAP_BATCH, otherwise as the F frames of the files it completes (an
+// empty segment sends the empty files at the start). False if the
+// recipient is gone or refused it.
+bool relaySegment(const string& nickname, uint64_t id, RelayedBatch& batch, const string& data,
+                  shared_ptr<MemoryReservation> memory) {
+    if (!batch.expand) {
+        Frame frame = heldFrame(buildBatchSegment(id, nickname, batch.received, data), memory);
+        return sendToClients({batch.dest}, frame)[0] == ENVELOPE_QUEUED;
+    }
+    size_t used = 0;
+    while (batch.next < batch.files.size()) {
+        const BatchFile& file = batch.files[batch.next];
+        size_t take = min((uint64_t)(data.size() - used), file.size - batch.partial.size());
+        batch.partial.append(data, used, take);
+        used += take;
+        if (batch.partial.size() < file.size) break;
+        Frame frame = heldFrame(buildFile(nickname, file.filename, batch.partial.data(), file.size), memory);
+        batch.partial.clear();
+        batch.next++;
+        if (sendToClients({batch.dest}, frame)[0] != ENVELOPE_QUEUED) return false;
+    }
+    return true;
+}
+
+// Put a deduplicated upload together from its chunks and deliver it as an
+// F frame, compressed for a recipient that takes it. The frame is the only
+// copy of the file: chunks go straight into it (through a block of
+// LZ_BLOCK_SIZE when compressing), so upload.memory covers it.
+void deliverChunked(const string& nickname, Connection& connection, ChunkedUpload& upload) {
+    cout << nickname << " received: deduplicated " << upload.filename << " for " << upload.dest << " ("
+         << upload.size << " bytes)" << endl;
+
+    string frame;
+    if (upload.size >= LZ_MIN_SIZE && acceptsCompressed(upload.dest)) {
+        // The compressed size goes in the header once it is known
+        frame = COMPRESSED_FRAME + buildFileHeader(nickname, upload.filename, 0);
+        size_t start = frame.size();
+        frame.reserve(start + upload.size / 2);
+        LzEncoder encoder(upload.size);
+        encoder.header(frame);
+        string block;
+        block.reserve(LZ_BLOCK_SIZE);
+        for (const Chunk& chunk : upload.chunks) {
+            for (size_t used = 0; used < chunk->size();) {
+                size_t take = min(chunk->size() - used, LZ_BLOCK_SIZE - block.size());
+                block.append(*chunk, used, take);
+                used += take;
+                if (block.size() == LZ_BLOCK_SIZE) {
+                    encoder.block(block.data(), block.size(), frame);
+                    block.clear();
+                }
+            }
+        }
+        if (!block.empty()) encoder.block(block.data(), block.size(), frame);
+        uint64_t packed = frame.size() - start;
+        for (int i = 0; i < 10; i++) {
+            frame[start - 10 + i] = (packed >> ((9 - i) * 8)) & 0xFF;
+        }
+    } else {
+        frame = buildFileHeader(nickname, upload.filename, upload.size);
+        frame.reserve(frame.size() + upload.size);
+        for (const Chunk& chunk : upload.chunks) {
+            frame += *chunk;
+        }
+    }
+    upload.chunks.clear();
+
+    Frame held = heldFrame(move(frame), make_shared<MemoryReservation>(move(upload.memory)));
+    if (sendToClients({upload.dest}, held)[0] == ENVELOPE_REFUSED) {
+        reportShed(nickname, connection, upload.dest + " is not keeping up, file not delivered");
+    }
+}
+
+// A data connection (TCP_CAP_PARALLEL): d + nickname + the session token
+// sent on the client's chat connection, then only k pieces. Acks and errors
+// go out on the chat connection.
+void handleDataConnection(int client_socket) {
+    char header[2];
+    if (recv(client_socket, header, 2, MSG_WAITALL) != 2) { close(client_socket); return; }
+    uint16_t nlen = ((unsigned char)header[0] << 8) | (unsigned char)header[1];
+    string nickname(nlen, '\0');
+    if (nlen > 0 && recv(client_socket, &nickname[0], nlen, MSG_WAITALL) != nlen) { close(client_socket); return; }
+    uint64_t token;
+    if (!receiveNumber(client_socket, 8, token)) { close(client_socket); return; }
+
+    shared_ptr<Connection> connection;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        auto it = clients.find(nickname);
+        auto known = sessionTokens.find(nickname);
+        if (it != clients.end() && known != sessionTokens.end() && known->second == token) {
+            connection = it->second;
+        }
+    }
+    if (!connection) {
+        cout << "Refused data connection for " << nickname << endl;
+        close(client_socket);
+        return;
+    }
+    cout << nickname << " opened a data connection" << endl;
+
+    char type;
+    while (recv(client_socket, &type, 1, 0) > 0 && type == 'k') {
+        uint64_t id, offset, length;
+        if (!receiveNumber(client_socket, 8, id)) break;
+        if (!receiveNumber(client_socket, 10, offset)) break;
+        if (!receiveNumber(client_socket, 3, length)) break;
+        if (!receivePiece(client_socket, nickname, *connection, id, offset, length)) break;
+    }
+    cout << nickname << " closed a data connection" << endl;
+    close(client_socket);
 }
 
 // Manage each client with threads
 void handleClient(int client_socket) {
     char header[4];
     string nickname;
+    shared_ptr<Connection> connection;
+    map<uint64_t, ChunkedUpload> chunkedUploads; // announced with h, by id
+    map<uint64_t, RelayedBatch> batches;         // opened with b, by id
 
     // Read nickname (n)
     if (recv(client_socket, header, 1, 0) <= 0) { close(client_socket); return; }
+    if (header[0] == 'd') { handleDataConnection(client_socket); return; }
     if (header[0] != 'n') { close(client_socket); return; }
 
     //length of nickname
@@ -297,8 +1132,10 @@ void handleClient(int client_socket) {
             close(client_socket);
             return;
         }
-        clients[nickname] = client_socket;
+        connection = make_shared<Connection>(client_socket);
+        clients[nickname] = connection;
     }
+    thread writer(&Connection::run, connection);
 
     cout << nickname << " connected" << endl;
 
@@ -307,6 +1144,37 @@ void handleClient(int client_socket) {
         if (r <= 0) break;
         char type = header[0];
 
+        // Envelope (TCP_CAP_ENVELOPE): the t, f or o frame that follows goes
+        // to every recipient listed instead of its own destination
+        vector<string> envelope;
+        string envelopeNames;
+        if (type == 'w') {
+            uint64_t count;
+            if (!receiveNumber(client_socket, 2, count)) break;
+            bool open = true;
+            for (uint64_t i = 0; i < count && open; i++) {
+                string recipient;
+                open = receiveString(client_socket, 2, recipient);
+                if (find(envelope.begin(), envelope.end(), recipient) != envelope.end()) continue;
+                envelope.push_back(recipient);
+                envelopeNames += (envelopeNames.empty() ? "" : ", ") + recipient;
+            }
+            if (!open || recv(client_socket, header, 1, 0) <= 0) break;
+            type = header[0];
+            if (type != 't' && type != 'f' && type != 'o' && type != 'z') break;
+        }
+
+        // Compressed frame (TCP_CAP_COMPRESS): the content of the frame
+        // that follows is an LZ stream
+        bool compressed = type == 'z';
+        if (compressed) {
+            if (recv(client_socket, header, 1, 0) <= 0) break;
+            type = header[0];
+            if (type != 'm' && type != 't' && type != 'f' && type != 'o' && type != 'u') break;
+            if (!envelope.empty() && type != 't' && type != 'f' && type != 'o') break;
+        }
+        string enveloped = envelope.empty() ? "" : " (envelope to " + envelopeNames + ")";
+
         if (type == 'm') {
             // Read message length
             if (recv(client_socket, header, 3, 0) <= 0) break;
@@ -317,14 +1185,29 @@ void handleClient(int client_socket) {
             char* buf = new char[len+1];
             if (recv(client_socket, buf, len, 0) <= 0) { delete[] buf; break; }
             buf[len] = '\0';
+
+            string text(buf, len);
+            if (compressed && !lzDecompress(buf, len, text, MAX_MESSAGE_LENGTH)) {
+                cout << nickname << " sent a corrupt compressed broadcast" << endl;
+                connection->enqueue(buildError("Corrupt compressed data"));
+                delete[] buf;
+                continue;
+            }
             
             string broadcastPacket = "m";
             broadcastPacket += string(header, 3);
-            broadcastPacket += string(buf, len);
-            cout << nickname << " received: " << formatProtocol(broadcastPacket) << endl;
+            broadcastPacket += text;
+            cout << nickname << " received: " << formatProtocol(broadcastPacket)
+                 << (compressed ? " (compressed, " + to_string(len) + " bytes)" : "") << endl;
             
-            string msg = buildBroadcast(nickname, string(buf, len));
-            sendAll(msg, client_socket);
+            if (admitMessage(nickname, *connection, type, 1)) {
+                string msg = buildBroadcast(nickname, text);
+                string packed = compressed ? COMPRESSED_FRAME + buildBroadcast(nickname, string(buf, len)) : "";
+                int refused = sendAll(msg, client_socket, packed);
+                if (refused > 0) {
+                    reportShed(nickname, *connection, "broadcast not delivered to " + to_string(refused) + " clients");
+                }
+            }
             delete[] buf;
         }
         else if (type == 't') {
@@ -336,7 +1219,7 @@ void handleClient(int client_socket) {
             
             // Read destination
             char* dbuf = new char[dlen+1];
-            if (recv(client_socket, dbuf, dlen, 0) <= 0) { delete[] dbuf; break; }
+            if (dlen > 0 && recv(client_socket, dbuf, dlen, 0) <= 0) { delete[] dbuf; break; }
             dbuf[dlen] = '\0';
             string dest(dbuf);
             delete[] dbuf;
@@ -350,24 +1233,76 @@ void handleClient(int client_socket) {
             char* mbuf = new char[mlen+1];
             if (recv(client_socket, mbuf, mlen, 0) <= 0) { delete[] mbuf; break; }
             mbuf[mlen] = '\0';
+
+            // A compressed message is only expanded for a recipient
+            // without TCP_CAP_COMPRESS
+            string text(mbuf, mlen);
+            if (compressed && !lzDecompress(mbuf, mlen, text, MAX_MESSAGE_LENGTH)) {
+                cout << nickname << " sent a corrupt compressed message" << endl;
+                connection->enqueue(buildError("Corrupt compressed data"));
+                delete[] mbuf;
+                continue;
+            }
             
             string privatePacket = "t";
             uint16_t dlen_net = htons(dlen);
             privatePacket.append((char*)&dlen_net, 2);
             privatePacket += dest;
             privatePacket += string(header, 3);
-            privatePacket += string(mbuf, mlen);
-            cout << nickname << " received: " << formatProtocol(privatePacket) << endl;
+            privatePacket += text;
+            cout << nickname << " received: " << formatProtocol(privatePacket)
+                 << (compressed ? " (compressed, " + to_string(mlen) + " bytes)" : "") << enveloped << endl;
             
-            string msg = buildToClient(nickname, string(mbuf, mlen));
-            sendToClient(dest, msg);
+            vector<string> dests = envelope.empty() ? vector<string>{dest} : envelope;
+            Frame msg = make_shared<const string>(buildToClient(nickname, text));
+            Frame packed = compressed ? make_shared<const string>(COMPRESSED_FRAME + buildToClient(nickname, string(mbuf, mlen)))
+                                      : nullptr;
+            string statuses = sendToClients(dests, msg, packed);
+            if (!envelope.empty()) {
+                connection->enqueue(buildDeliveryReport(type, dests, statuses));
+            }
             delete[] mbuf;
         }
         else if (type == 'l') {
             cout << nickname << " received: l" << endl;
             string list = buildList();
             cout << "Server sending list to " << nickname << ": " << formatProtocol(list) << endl;
-            send(client_socket, list.c_str(), list.size(), 0);
+            connection->enqueue(list);
+        }
+        else if (type == 'c') {
+            // Capabilities: keep the ones this server knows and echo them back
+            if (recv(client_socket, header, 2, 0) <= 0) break;
+            uint16_t known = TCP_CAP_CHUNKED | TCP_CAP_COMPRESS;
+            if (spoolDirectory().enabled()) {
+                known |= TCP_CAP_RESUME | TCP_CAP_PARALLEL; // resumable transfers are staged in the spool
+            }
+            if (chunkStore.enabled()) {
+                known |= TCP_CAP_DEDUP;
+            }
+            known |= TCP_CAP_DELTA | TCP_CAP_ENVELOPE | TCP_CAP_BATCH; // relayed / fanned out from one buffer
+            uint16_t caps = (((unsigned char)header[0] << 8) | (unsigned char)header[1]) & known;
+            if (!(caps & TCP_CAP_RESUME)) caps &= ~TCP_CAP_PARALLEL;
+            cout << nickname << " received: " << formatProtocol("c" + string(header, 2)) << endl;
+            connection->setCaps(caps);
+
+            string reply = "C";
+            reply.push_back((caps >> 8) & 0xFF);
+            reply.push_back(caps & 0xFF);
+            connection->enqueue(reply);
+
+            if (caps & TCP_CAP_PARALLEL) {
+                random_device random;
+                uint64_t token = ((uint64_t)random() << 32) | random();
+                {
+                    lock_guard<mutex> lock(clients_mutex);
+                    sessionTokens[nickname] = token;
+                }
+                connection->enqueue(buildSessionToken(token));
+            }
+            if (caps & TCP_CAP_RESUME) {
+                // Deliveries interrupted by an earlier disconnect go on
+                queuePieces(resumeStore.reconnected(nickname));
+            }
         }
         else if (type == 'x') {
             cout << nickname << " received: x" << endl;
@@ -382,7 +1317,7 @@ void handleClient(int client_socket) {
             
             // Read destination
             char* dbuf = new char[dlen+1];
-            if (recv(client_socket, dbuf, dlen, 0) <= 0) { delete[] dbuf; break; }
+            if (dlen > 0 && recv(client_socket, dbuf, dlen, 0) <= 0) { delete[] dbuf; break; }
             dbuf[dlen] = '\0';
             string dest(dbuf);
             delete[] dbuf;
@@ -405,26 +1340,116 @@ void handleClient(int client_socket) {
             int bytes_received = 0;
             while (bytes_received < 10) {
                 int r = recv(client_socket, size_buf + bytes_received, 10 - bytes_received, 0);
-                if (r <= 0) { close(client_socket); return; }
+                if (r <= 0) break;
                 bytes_received += r;
             }
+            if (bytes_received < 10) break;
             
             uint64_t fsize = 0;
             for (int i = 0; i < 10; i++) {
                 fsize = (fsize << 8) | (unsigned char)size_buf[i];
             }
             
-            // Read file data
-            char* file_data = new char[fsize];
-            bytes_received = 0;
-            while (bytes_received < fsize) {
-                int r = recv(client_socket, file_data + bytes_received, fsize - bytes_received, 0);
-                if (r <= 0) { 
-                    delete[] file_data; 
-                    close(client_socket); 
-                    return; 
+            // A compressed file is forwarded as is to a recipient with
+            // TCP_CAP_COMPRESS; for any other it is expanded while it is
+            // received, so 'payload' is the expanded size (in the stream
+            // header). Either way the header is checked first, since the
+            // recipient expands what it claims.
+            vector<string> dests = envelope.empty() ? vector<string>{dest} : envelope;
+            bool expand = compressed && !acceptsCompressed(dests);
+            uint64_t payload = fsize;
+            uint64_t remaining = fsize;
+            LzDecoder decoder(payloadLimit());
+            char streamHeader[LZ_HEADER_SIZE];
+            int headerLength = 0;
+            if (compressed) {
+                headerLength = min(fsize, (uint64_t)LZ_HEADER_SIZE);
+                bytes_received = 0;
+                while (bytes_received < headerLength) {
+                    int r = recv(client_socket, streamHeader + bytes_received, headerLength - bytes_received, 0);
+                    if (r <= 0) break;
+                    bytes_received += r;
                 }
-                bytes_received += r;
+                if (bytes_received < headerLength) break;
+                remaining -= bytes_received;
+                bool fits = decoder.feed(streamHeader, bytes_received, [](const char*, size_t) { return true; });
+                if (!fits || !decoder.hasHeader()) {
+                    string error = fits ? "Corrupt compressed data"
+                                        : "Too large: compressed file expands past " + formatMemoryAmount(payloadLimit());
+                    cout << nickname << " " << error << endl;
+                    connection->enqueue(buildError(error));
+                    if (!discardBytes(client_socket, remaining)) break;
+                    continue;
+                }
+                if (expand) payload = decoder.rawSize();
+            }
+
+            MemoryReservation memory;
+            shared_ptr<SpoolFile> spool;
+            if (!reservePayload(nickname, *connection, MEMORY_FILE, payload, memory, &spool)) {
+                if (!discardBytes(client_socket, remaining)) break;
+                continue;
+            }
+
+            // Read file data, to memory or to its spool file
+            char* file_data = nullptr;
+            string preview;
+            if (spool) {
+                bool spoolFull = false;
+                if (expand) {
+                    bool open = receiveExpanded(client_socket, decoder, remaining, [&](const char* data, size_t length) {
+                        spoolFull = !spool->append(data, length);
+                        return !spoolFull;
+                    });
+                    if (!open) break;
+                } else {
+                    spoolFull = !spool->append(streamHeader, headerLength);
+                    if (!spoolFull && !receiveToSpool(client_socket, *spool, remaining)) break;
+                    spoolFull = spoolFull || remaining > 0;
+                }
+                if (spoolFull || (expand && !decoder.finished())) {
+                    string error = spoolFull ? "Server busy: spool full, file not delivered" : "Corrupt compressed data";
+                    cout << nickname << " " << error << endl;
+                    connection->enqueue(buildError(error));
+                    if (!discardBytes(client_socket, remaining)) break;
+                    continue;
+                }
+                preview.resize(min(payload, (uint64_t)10));
+                spool->read(0, &preview[0], preview.size());
+            } else if (expand) {
+                file_data = new char[payload];
+                uint64_t expanded = 0;
+                bool open = receiveExpanded(client_socket, decoder, remaining, [&](const char* data, size_t length) {
+                    memcpy(file_data + expanded, data, length);
+                    expanded += length;
+                    return true;
+                });
+                if (!open) {
+                    delete[] file_data;
+                    break;
+                }
+                if (!decoder.finished()) {
+                    cout << nickname << " sent a corrupt compressed file" << endl;
+                    connection->enqueue(buildError("Corrupt compressed data"));
+                    delete[] file_data;
+                    if (!discardBytes(client_socket, remaining)) break;
+                    continue;
+                }
+                preview.assign(file_data, min(payload, (uint64_t)10));
+            } else {
+                file_data = new char[fsize];
+                memcpy(file_data, streamHeader, headerLength);
+                uint64_t received = headerLength;
+                while (received < fsize) {
+                    ssize_t r = recv(client_socket, file_data + received, fsize - received, 0);
+                    if (r <= 0) break;
+                    received += (uint64_t)r;
+                }
+                if (received < fsize) {
+                    delete[] file_data;
+                    break;
+                }
+                preview.assign(file_data, min(fsize, (uint64_t)10));
             }
             
             string filePacket = "f";
@@ -434,14 +1459,375 @@ void handleClient(int client_socket) {
             filePacket += string(header, 3);
             filePacket += filename;
             filePacket += string(size_buf, 10);
-            filePacket += string(file_data, min(fsize, (uint64_t)10)) + "...";
-            cout << nickname << " received: " << formatProtocol(filePacket) << endl;
+            filePacket += compressed && !expand ? "(compressed)" : preview + "...";
+            cout << nickname << " received: " << formatProtocol(filePacket) << (spool ? " (spooled)" : "")
+                 << (expand ? " (expanded to " + to_string(payload) + " bytes)" : "") << enveloped << endl;
             
-            string msg = buildFile(nickname, filename, file_data, fsize);
-            sendToClient(dest, msg);
+            if (admitMessage(nickname, *connection, type, fsize)) {
+                // One frame for every recipient: compressed only if all of
+                // them take it
+                string marker = compressed && !expand ? string(1, COMPRESSED_FRAME) : "";
+                Frame frame = spool ? make_shared<const string>(marker + buildFileHeader(nickname, filename, payload))
+                                    : heldFrame(marker + buildFile(nickname, filename, file_data, payload),
+                                                make_shared<MemoryReservation>(move(memory)));
+                string statuses = sendToClients(dests, frame, nullptr, spool);
+                string refused = refusedRecipients(dests, statuses);
+                if (!refused.empty()) {
+                    reportShed(nickname, *connection, refused + " not keeping up, file not delivered");
+                }
+                if (!envelope.empty()) {
+                    connection->enqueue(buildDeliveryReport(type, dests, statuses));
+                }
+            }
             
             delete[] file_data;
         }
+        else if (type == 'r') {
+            // Offer of a resumable upload: answer where to continue
+            uint64_t id;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (recv(client_socket, header, 2, 0) <= 0) break;
+            uint16_t dlen = ((unsigned char)header[0] << 8) | (unsigned char)header[1];
+            string dest(dlen, '\0');
+            if (dlen > 0 && recv(client_socket, &dest[0], dlen, MSG_WAITALL) <= 0) break;
+            uint64_t flen;
+            if (!receiveNumber(client_socket, 3, flen)) break;
+            string filename(flen, '\0');
+            if (flen > 0 && recv(client_socket, &filename[0], flen, MSG_WAITALL) <= 0) break;
+            uint64_t fsize;
+            if (!receiveNumber(client_socket, 10, fsize)) break;
+
+            shared_ptr<PartialUpload> upload = resumeStore.offer(nickname, id, dest, filename, fsize);
+            if (!upload) {
+                string error = "Server busy: no room to stage a resumable upload";
+                cout << nickname << " " << error << endl;
+                connection->enqueue(buildError(error));
+                continue;
+            }
+            uint64_t received = upload->received;
+            cout << nickname << " offers " << filename << " for " << dest << " (" << fsize << " bytes), "
+                 << (received > 0 ? "resuming at " + to_string(received) : "new upload") << endl;
+            connection->enqueue(buildResumeAck(id, received));
+            if (received == fsize && resumeStore.finishUpload(nickname, id)) {
+                deliverUpload(nickname, *upload);
+            }
+        }
+        else if (type == 'k') {
+            // Piece of a resumable upload, staged in its spool file
+            uint64_t id, offset, length;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveNumber(client_socket, 10, offset)) break;
+            if (!receiveNumber(client_socket, 3, length)) break;
+
+            if (!receivePiece(client_socket, nickname, *connection, id, offset, length)) break;
+        }
+        else if (type == 'h') {
+            // Upload announced by its chunks: ask for the ones the store lacks
+            uint64_t id;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            uint64_t dlen;
+            if (!receiveNumber(client_socket, 2, dlen)) break;
+            ChunkedUpload upload;
+            upload.dest.resize(dlen);
+            if (dlen > 0 && recv(client_socket, &upload.dest[0], dlen, MSG_WAITALL) <= 0) break;
+            uint64_t flen;
+            if (!receiveNumber(client_socket, 3, flen)) break;
+            upload.filename.resize(flen);
+            if (flen > 0 && recv(client_socket, &upload.filename[0], flen, MSG_WAITALL) <= 0) break;
+            uint64_t count;
+            if (!receiveNumber(client_socket, 10, upload.size)) break;
+            if (!receiveNumber(client_socket, 4, count)) break;
+            if (count > CHUNKED_MAX_SIZE / CHUNK_MIN_SIZE + 1) break; // can't be a real chunk list
+
+            uint64_t total = 0;
+            bool valid = true;
+            for (uint64_t i = 0; i < count && valid; i++) {
+                uint64_t length;
+                string hash(SHA256_SIZE, '\0');
+                if (!receiveNumber(client_socket, 3, length)) {
+                    valid = false;
+                } else if (recv(client_socket, &hash[0], SHA256_SIZE, MSG_WAITALL) != SHA256_SIZE) {
+                    valid = false;
+                }
+                upload.lengths.push_back(length);
+                upload.hashes.push_back(hash);
+                total += length;
+            }
+            if (!valid) break;
+            if (total != upload.size || upload.size > CHUNKED_MAX_SIZE ||
+                any_of(upload.lengths.begin(), upload.lengths.end(),
+                       [](size_t length) { return length == 0 || length > CHUNK_MAX_SIZE; })) {
+                cout << nickname << " sent an invalid chunk list" << endl;
+                connection->enqueue(buildError("Invalid chunk list"));
+                connection->enqueue(buildChunkRefusal(id));
+                continue;
+            }
+
+            // The chunks it lacks, each hash asked for once
+            vector<uint64_t> missing;
+            set<string> asked;
+            uint64_t missingBytes = 0;
+            upload.chunks.resize(count);
+            for (uint64_t i = 0; i < count; i++) {
+                upload.chunks[i] = chunkStore.find(upload.hashes[i]);
+                if (!upload.chunks[i] && asked.insert(upload.hashes[i]).second) {
+                    missing.push_back(i);
+                    missingBytes += upload.lengths[i];
+                }
+            }
+            upload.missing = count_if(upload.chunks.begin(), upload.chunks.end(), [](const Chunk& chunk) { return !chunk; });
+            cout << nickname << " announces " << upload.filename << " for " << upload.dest << " (" << upload.size
+                 << " bytes, " << count << " chunks, " << missing.size() << " to upload)" << endl;
+            if (!admitMessage(nickname, *connection, 'f', missingBytes) ||
+                !reservePayload(nickname, *connection, MEMORY_FILE, upload.size, upload.memory)) {
+                connection->enqueue(buildChunkRefusal(id));
+                continue;
+            }
+            chunkStore.deduplicated(upload.size - missingBytes);
+            connection->enqueue(buildChunkRequest(id, missing));
+
+            if (upload.missing == 0) {
+                deliverChunked(nickname, *connection, upload);
+            } else {
+                chunkedUploads[id] = move(upload);
+            }
+        }
+        else if (type == 'u') {
+            // A chunk the store lacked: checked against its hash and kept
+            uint64_t id, index, length;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveNumber(client_socket, 4, index)) break;
+            if (!receiveNumber(client_socket, 3, length)) break;
+            auto it = chunkedUploads.find(id);
+            if (it == chunkedUploads.end() || index >= it->second.chunks.size() || it->second.chunks[index] ||
+                length > LZ_HEADER_SIZE + LZ_BLOCK_HEADER_SIZE + lzBlockBound(CHUNK_MAX_SIZE)) {
+                cout << nickname << " sent an unexpected chunk" << endl;
+                connection->enqueue(buildError("Unexpected chunk"));
+                if (!discardBytes(client_socket, length)) break;
+                continue;
+            }
+            ChunkedUpload& upload = it->second;
+            string data(length, '\0');
+            if (length > 0 && recv(client_socket, &data[0], length, MSG_WAITALL) != (ssize_t)length) break;
+            if (compressed) {
+                string expanded;
+                if (!lzDecompress(data.data(), data.size(), expanded, upload.lengths[index])) expanded.clear();
+                data = move(expanded);
+            }
+            if (data.size() != upload.lengths[index] || sha256(data.data(), data.size()) != upload.hashes[index]) {
+                string error = "Chunk " + to_string(index) + " of " + upload.filename + " does not match its hash";
+                cout << nickname << " " << error << endl;
+                connection->enqueue(buildError(error + ", file not delivered"));
+                chunkedUploads.erase(it);
+                continue;
+            }
+
+            Chunk chunk = make_shared<const string>(move(data));
+            chunkStore.insert(upload.hashes[index], chunk);
+            for (size_t i = 0; i < upload.chunks.size(); i++) {
+                if (!upload.chunks[i] && upload.hashes[i] == upload.hashes[index]) {
+                    upload.chunks[i] = chunk;
+                    upload.missing--;
+                }
+            }
+            if (upload.missing == 0) {
+                deliverChunked(nickname, *connection, upload);
+                chunkedUploads.erase(it);
+            }
+        }
+        else if (type == 'b') {
+            // Batch of small files: check its table once and pass it on
+            uint64_t id, tableLength;
+            RelayedBatch batch;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveString(client_socket, 2, batch.dest)) break;
+            if (!receiveNumber(client_socket, 4, tableLength)) break;
+            if (tableLength > BATCH_MAX_TABLE) break; // can't be a real table
+            string table(tableLength, '\0');
+            if (tableLength > 0 && recv(client_socket, &table[0], tableLength, MSG_WAITALL) != (ssize_t)tableLength) break;
+            if (!decodeBatchTable(table, batch.files)) {
+                cout << nickname << " sent an invalid batch table" << endl;
+                connection->enqueue(buildError("Invalid batch table"));
+                continue;
+            }
+            batch.size = batchSize(batch.files);
+            cout << nickname << " sends " << batch.files.size() << " files (" << batch.size << " bytes) to "
+                 << batch.dest << " in a batch" << endl;
+
+            bool connected;
+            {
+                lock_guard<mutex> lock(clients_mutex);
+                auto it = clients.find(batch.dest);
+                connected = it != clients.end();
+                batch.expand = connected && !it->second->hasCap(TCP_CAP_BATCH);
+            }
+            if (!connected) {
+                string error = batch.dest + " is not connected, batch not delivered";
+                cout << nickname << " " << error << endl;
+                connection->enqueue(buildError(error));
+                batch.failed = true;
+            } else if (batch.expand) {
+                relaySegment(nickname, id, batch, "", nullptr);
+            } else {
+                // Control lane: it is written before any of the segments
+                sendToClients({batch.dest}, make_shared<const string>(buildBatchTable(id, nickname, table)));
+            }
+            if (batch.size > 0) {
+                batches[id] = move(batch);
+            }
+        }
+        else if (type == 's') {
+            // Next segment of a batch, relayed as it arrives
+            uint64_t id, length;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveNumber(client_socket, 3, length)) break;
+            auto it = batches.find(id);
+            if (it == batches.end() || length == 0 || length > BATCH_SEGMENT_SIZE ||
+                it->second.received + length > it->second.size) {
+                cout << nickname << " sent an unexpected batch segment" << endl;
+                connection->enqueue(buildError("Unexpected batch segment"));
+                if (!discardBytes(client_socket, length)) break;
+                continue;
+            }
+            RelayedBatch& batch = it->second;
+            MemoryReservation memory;
+            bool relay = !batch.failed && admitMessage(nickname, *connection, 'f', length) &&
+                         reservePayload(nickname, *connection, MEMORY_FILE, length, memory);
+            if (relay) {
+                string data(length, '\0');
+                if (recv(client_socket, &data[0], length, MSG_WAITALL) != (ssize_t)length) break;
+                if (!relaySegment(nickname, id, batch, data, make_shared<MemoryReservation>(move(memory)))) {
+                    reportShed(nickname, *connection, batch.dest + " is not keeping up, batch not delivered");
+                    relay = false;
+                }
+            } else if (!discardBytes(client_socket, length)) {
+                break;
+            }
+            batch.failed = batch.failed || !relay;
+            batch.received += length;
+            if (batch.received == batch.size) {
+                cout << nickname << "'s batch of " << batch.files.size() << " files to " << batch.dest
+                     << (batch.failed ? " was not delivered" : " relayed") << endl;
+                batches.erase(it);
+            }
+        }
+        else if (type == 'q') {
+            // Ask the recipient for the signature of its copy of a file
+            uint64_t id;
+            string dest, filename;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveString(client_socket, 2, dest)) break;
+            if (!receiveString(client_socket, 3, filename)) break;
+            cout << nickname << " asks " << dest << " for a signature of " << filename << endl;
+
+            string request = "Q";
+            appendNumber(request, id, 8);
+            appendNumber(request, nickname.size(), 2);
+            request += nickname;
+            appendNumber(request, filename.size(), 3);
+            request += filename;
+            bool asked = false;
+            {
+                lock_guard<mutex> lock(clients_mutex);
+                auto it = clients.find(dest);
+                if (it != clients.end() && it->second->hasCap(TCP_CAP_DELTA)) {
+                    asked = it->second->enqueue(request);
+                }
+            }
+            if (!asked) {
+                // No copy to work from: an empty signature
+                string reply = "G";
+                appendNumber(reply, id, 8);
+                appendNumber(reply, dest.size(), 2);
+                reply += dest;
+                appendNumber(reply, 0, 10);
+                appendNumber(reply, 0, 4);
+                appendNumber(reply, 0, 4);
+                connection->enqueue(reply);
+            }
+        }
+        else if (type == 'g') {
+            // Signature of a copy, for the client that asked
+            uint64_t id, baseSize, blockSize, count;
+            string requester;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveString(client_socket, 2, requester)) break;
+            if (!receiveNumber(client_socket, 10, baseSize)) break;
+            if (!receiveNumber(client_socket, 4, blockSize)) break;
+            if (!receiveNumber(client_socket, 4, count)) break;
+            if (count > DELTA_MAX_BLOCKS) break; // can't be a real signature
+            string reply = "G";
+            appendNumber(reply, id, 8);
+            appendNumber(reply, nickname.size(), 2);
+            reply += nickname;
+            appendNumber(reply, baseSize, 10);
+            appendNumber(reply, blockSize, 4);
+            appendNumber(reply, count, 4);
+            size_t start = reply.size();
+            reply.resize(start + count * 12);
+            if (count > 0 && recv(client_socket, &reply[start], count * 12, MSG_WAITALL) != (ssize_t)(count * 12)) break;
+            cout << nickname << " sent " << requester << " a signature (" << count << " blocks of " << blockSize
+                 << " bytes)" << endl;
+            sendToClient(requester, reply);
+        }
+        else if (type == 'v') {
+            // File as a delta of the recipient's copy: relayed as it is
+            string dest, filename;
+            if (!receiveString(client_socket, 2, dest)) break;
+            if (!receiveString(client_socket, 3, filename)) break;
+            char fields[10 + 10 + 4 + SHA256_SIZE];
+            if (recv(client_socket, fields, sizeof(fields), MSG_WAITALL) != sizeof(fields)) break;
+            uint64_t length;
+            if (!receiveNumber(client_socket, 10, length)) break;
+            if (length > DELTA_MAX_SIZE) break; // the sender only sends deltas smaller than the file
+            uint64_t fsize = 0;
+            for (int i = 0; i < 10; i++) {
+                fsize = (fsize << 8) | (unsigned char)fields[i];
+            }
+            if (fsize > DELTA_MAX_SIZE) {
+                // The recipient rebuilds the file in memory: larger ones go resumably
+                cout << nickname << " sent a delta of a file too large for one (" << fsize << " bytes)" << endl;
+                connection->enqueue(buildError("Too large: files over " + formatMemoryAmount(DELTA_MAX_SIZE) +
+                                               " are not sent as deltas"));
+                if (!discardBytes(client_socket, length)) break;
+                continue;
+            }
+
+            MemoryReservation memory;
+            if (!reservePayload(nickname, *connection, MEMORY_FILE, length, memory)) {
+                if (!discardBytes(client_socket, length)) break;
+                continue;
+            }
+            string delta = "V";
+            appendNumber(delta, nickname.size(), 2);
+            delta += nickname;
+            appendNumber(delta, filename.size(), 3);
+            delta += filename;
+            delta.append(fields, sizeof(fields));
+            appendNumber(delta, length, 10);
+            size_t start = delta.size();
+            delta.resize(start + length);
+            if (length > 0 && recv(client_socket, &delta[start], length, MSG_WAITALL) != (ssize_t)length) break;
+            cout << nickname << " received: delta of " << filename << " for " << dest << " (" << length << " bytes)"
+                 << endl;
+
+            if (admitMessage(nickname, *connection, 'f', length) &&
+                !sendToClient(dest, delta, make_shared<MemoryReservation>(move(memory)))) {
+                reportShed(nickname, *connection, dest + " is not keeping up, file not delivered");
+            }
+        }
+        else if (type == 'a') {
+            // The recipient saved a resumable delivery up to 'offset'
+            uint64_t id, offset;
+            if (!receiveNumber(client_socket, 8, id)) break;
+            if (!receiveNumber(client_socket, 10, offset)) break;
+            bool done = false;
+            vector<DeliveryPiece> pieces = resumeStore.acknowledge(nickname, id, offset, done);
+            if (done) {
+                cout << nickname << " saved resumable delivery (" << offset << " bytes)" << endl;
+            }
+            queuePieces(pieces);
+        }
         else if (type == 'o') {
             // Read destination length
             if (recv(client_socket, header, 2, 0) <= 0) break;
@@ -451,7 +1837,7 @@ void handleClient(int client_socket) {
             
             // Read destination
             char* dbuf = new char[dlen + 1];
-            if (recv(client_socket, dbuf, dlen, 0) <= 0) {
+            if (dlen > 0 && recv(client_socket, dbuf, dlen, 0) <= 0) {
                 delete[] dbuf;
                 break;
             }
@@ -467,6 +1853,12 @@ void handleClient(int client_socket) {
             memcpy(&objSize, sizeBuf, 4);
             objSize = ntohl(objSize);
             
+            MemoryReservation memory;
+            if (!reservePayload(nickname, *connection, MEMORY_OBJECT, objSize, memory)) {
+                if (!discardBytes(client_socket, objSize)) break;
+                continue;
+            }
+
             // Read object content
             vector<char> objectBuf(objSize);
             if (recv(client_socket, objectBuf.data(), objSize, 0) <= 0) break;
@@ -477,10 +1869,44 @@ void handleClient(int client_socket) {
             objectPacket += dest;
             objectPacket += string(sizeBuf, 4);
             objectPacket += string(objectBuf.begin(), objectBuf.begin() + min(objSize, (uint32_t)10)) + "...";
-            cout << nickname << " received: " << formatProtocol(objectPacket) << endl;
+            cout << nickname << " received: " << formatProtocol(objectPacket) << (compressed ? " (compressed)" : "")
+                 << enveloped << endl;
             
-            string msg = buildObject(nickname, objectBuf);
-            sendToClient(dest, msg);
+            if (!admitMessage(nickname, *connection, type, objSize)) continue;
+            // Recipients expand the object in memory: the size its stream
+            // claims must fit the budget even when it is forwarded as is
+            uint64_t expandedSize;
+            if (compressed && (!lzStreamSize(objectBuf.data(), objSize, expandedSize) ||
+                               expandedSize > min((uint64_t)UINT32_MAX, memoryBudget.largest()))) {
+                cout << nickname << " sent a corrupt or too large compressed object" << endl;
+                connection->enqueue(buildError("Corrupt compressed data"));
+                continue;
+            }
+            vector<string> dests = envelope.empty() ? vector<string>{dest} : envelope;
+            string msg;
+            string packed;
+            if (!compressed) {
+                msg = buildObject(nickname, objectBuf);
+            } else {
+                packed = COMPRESSED_FRAME + buildObject(nickname, objectBuf);
+                if (!acceptsCompressed(dests)) {
+                    // Expanded once for the recipients without TCP_CAP_COMPRESS
+                    string expanded;
+                    if (!expandPayload(nickname, *connection, MEMORY_OBJECT, objectBuf, UINT32_MAX, memory, expanded)) continue;
+                    msg = buildObject(nickname, vector<char>(expanded.begin(), expanded.end()));
+                }
+            }
+            // Both versions hold the memory until the last copy is sent
+            shared_ptr<MemoryReservation> held = make_shared<MemoryReservation>(move(memory));
+            string statuses = sendToClients(dests, msg.empty() ? nullptr : heldFrame(msg, held),
+                                            packed.empty() ? nullptr : heldFrame(packed, held));
+            string refused = refusedRecipients(dests, statuses);
+            if (!refused.empty()) {
+                reportShed(nickname, *connection, refused + " not keeping up, object not delivered");
+            }
+            if (!envelope.empty()) {
+                connection->enqueue(buildDeliveryReport(type, dests, statuses));
+            }
         }
         else if (type == 'J') {
             // Game request
@@ -503,6 +1929,7 @@ void handleClient(int client_socket) {
             gameRequestPacket.append((char*)&dlen_net, 2);
             gameRequestPacket += dest;
             cout << nickname << " received: " << formatProtocol(gameRequestPacket) << endl;
+            if (!admitMessage(nickname, *connection, type, 1)) continue;
             
             string msg = buildGameRequest(nickname);
             sendToClient(dest, msg);
@@ -532,6 +1959,7 @@ void handleClient(int client_socket) {
             gameResponsePacket += sender;
             gameResponsePacket += response;
             cout << nickname << " received: " << formatProtocol(gameResponsePacket) << endl;
+            if (!admitMessage(nickname, *connection, type, 1)) continue;
             
             string msg = buildGameResponse(nickname, response == 'y');
             sendToClient(sender, msg);
@@ -541,6 +1969,7 @@ void handleClient(int client_socket) {
                 lock_guard<mutex> lock(games_mutex);
                 pair<string, string> gameKey = make_pair(min(nickname, sender), max(nickname, sender));
                 initializeGame(activeGames[gameKey], nickname, sender);
+                scheduleMoveTimeout(gameKey, activeGames[gameKey].turn);
                 
                 string boardMsg = buildBoard(activeGames[gameKey].board, activeGames[gameKey].currentPlayer);
                 sendToClient(nickname, boardMsg);
@@ -561,6 +1990,7 @@ void handleClient(int client_socket) {
             string positionPacket = "P";
             positionPacket += string(posBuf, 4);
             cout << nickname << " received: " << formatProtocol(positionPacket) << endl;
+            if (!admitMessage(nickname, *connection, type, 1)) continue;
             
             // Find the game
             lock_guard<mutex> lock(games_mutex);
@@ -622,6 +2052,8 @@ void handleClient(int client_socket) {
                 } else {
                     // Continue game - switch turns
                     currentGame->currentPlayer = opponent;
+                    currentGame->turn = nextTurn++;
+                    scheduleMoveTimeout(gameKey, currentGame->turn);
                     
                     // Send updated board to both players with turn information
                     string boardMsg = buildBoard(currentGame->board, currentGame->currentPlayer);
@@ -639,7 +2071,10 @@ void handleClient(int client_socket) {
     {
         lock_guard<mutex> lock(clients_mutex);
         clients.erase(nickname);
+        reportedShed.erase(nickname);
+        sessionTokens.erase(nickname);
     }
+    rateLimiter.forget(nickname);
     
     // Remove any active games involving this player
     {
@@ -662,14 +2097,72 @@ void handleClient(int client_socket) {
         }
     }
 
+    // Unblock a writer stuck on a client that stopped reading
+    connection->close();
+    shutdown(client_socket, SHUT_RDWR);
+    writer.join();
+
     cout << nickname << " disconnected" << endl;
     close(client_socket);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     int server_fd;
     struct sockaddr_in address;
     int opt = 1;
+    SpoolConfig spool;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--rate-limit" && i + 1 < argc) {
+            RateLimits limits;
+            if (!parseRateLimits(argv[++i], limits)) {
+                cout << "Invalid --rate-limit: " << argv[i] << endl;
+                return 1;
+            }
+            rateLimiter.configure(limits);
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            MemoryLimits limits;
+            if (!parseMemoryLimits(argv[++i], limits)) {
+                cout << "Invalid --memory-limit: " << argv[i] << endl;
+                return 1;
+            }
+            memoryBudget.configure(limits);
+        } else if (arg == "--spool-dir" && i + 1 < argc) {
+            spool.dir = argv[++i];
+        } else if (arg == "--spool-threshold" && i + 1 < argc) {
+            if (!parseMemoryAmount(argv[++i], spool.threshold)) {
+                cout << "Invalid --spool-threshold: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--spool-limit" && i + 1 < argc) {
+            if (!parseMemoryAmount(argv[++i], spool.limit)) {
+                cout << "Invalid --spool-limit: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--chunk-store" && i + 1 < argc) {
+            uint64_t limit;
+            if (!parseMemoryAmount(argv[++i], limit)) {
+                cout << "Invalid --chunk-store: " << argv[i] << endl;
+                return 1;
+            }
+            chunkStore.configure(limit);
+        } else if (arg == "--resume-timeout" && i + 1 < argc) {
+            char* end = nullptr;
+            long seconds = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || seconds <= 0) {
+                cout << "Invalid --resume-timeout: " << argv[i] << endl;
+                return 1;
+            }
+            resumeStore.configure(chrono::seconds(seconds));
+        } else {
+            cout << "Usage: " << argv[0] << " [--rate-limit SPEC] [--memory-limit TOTAL[/CLIENT]]"
+                 << " [--spool-dir DIR] [--spool-threshold N] [--spool-limit N] [--resume-timeout S]"
+                 << " [--chunk-store N]" << endl;
+            return 1;
+        }
+    }
+    spoolDirectory().configure(spool);
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
@@ -681,9 +2174,26 @@ int main() {
     listen(server_fd, 3);
 
     cout << "Server listening on port " << PORT << endl;
+    cout << "Rate limits: " << rateLimiter.description() << endl;
+    cout << "Memory budget: " << memoryBudget.description() << endl;
+    cout << "Spool: " << spoolDirectory().description() << endl;
+    cout << "Resume: " << resumeStore.description() << endl;
+    cout << "Chunk store: " << chunkStore.description() << endl;
+    cout << "Overload shedding: queue delay above " << CODEL_TARGET.count() << " ms for "
+         << CODEL_INTERVAL.count() << " ms" << endl;
+
+    thread(runTimers).detach();
+    scheduleShareReport();
+    scheduleMemoryReport();
+    scheduleResumeCheck();
 
     while (true) {
         int client_socket = accept(server_fd, nullptr, nullptr);
+        int keepalive = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, count = KEEPALIVE_COUNT;
+        setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
         thread t(handleClient, client_socket);
         t.detach();
     }
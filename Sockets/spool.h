@@ -0,0 +1,246 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "memorybudget.h"
+
+/*
+    Archivos temporales (spool) para contenidos que no conviene tener en
+    memoria: archivos más grandes que SpoolConfig::threshold o que no
+    entran en el presupuesto de memoria, y fragmentos UDP que esperan a un
+    destinatario lento.
+
+    Cada archivo se crea en el directorio del spool y se borra del
+    directorio enseguida (queda solo el descriptor, así no sobrevive a una
+    caída). Se escribe en orden, de a ventanas de SPOOL_WINDOW mapeadas con
+    mmap y alineadas a la ventana; al llenarse una ventana se desmapea y se
+    pide al kernel que la escriba al disco. Se lee con pread, sin estado
+    compartido, así varios hilos pueden leer el mismo archivo (un envío a
+    varios destinatarios). La memoria del proceso es a lo sumo una ventana
+    por archivo, sin importar el tamaño del contenido.
+
+    El espacio en disco se cobra por ventana contra SpoolConfig::limit.
+
+    Se configura en los servidores con:
+        --spool-dir DIR         (por defecto /tmp)
+        --spool-threshold N     contenidos más grandes van al disco (16M, TCP)
+        --spool-limit N         espacio total del spool (8G, 0 = sin spool)
+*/
+
+#define SPOOL_WINDOW (4 * 1024 * 1024)
+
+struct SpoolConfig {
+    std::string dir = "/tmp";
+    uint64_t threshold = 16ull * 1024 * 1024;
+    uint64_t limit = 8ull * 1024 * 1024 * 1024;
+};
+
+// Espacio usado por todos los archivos del spool
+class SpoolDirectory {
+public:
+    void configure(const SpoolConfig& configured) {
+        std::lock_guard<std::mutex> lock(mutex);
+        config = configured;
+    }
+
+    SpoolConfig settings() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return config;
+    }
+
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return config.limit > 0;
+    }
+
+    // ¿Cabe un contenido de este tamaño en el espacio libre?
+    bool fits(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return config.limit > 0 && used + bytes <= config.limit;
+    }
+
+    bool reserve(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (used + bytes > config.limit) {
+            refused++;
+            return false;
+        }
+        used += bytes;
+        peak = std::max(peak, used);
+        return true;
+    }
+
+    void release(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= bytes;
+    }
+
+    void opened() {
+        std::lock_guard<std::mutex> lock(mutex);
+        files++;
+        spooled++;
+    }
+
+    void closed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        files--;
+    }
+
+    std::string description() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (config.limit == 0) return "disabled";
+        return config.dir + ", payloads over " + formatMemoryAmount(config.threshold) + ", up to " +
+               formatMemoryAmount(config.limit);
+    }
+
+    // Uso actual; 'changed' dice si cambió desde la llamada anterior
+    std::string usage(bool* changed = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << files << " files, " << formatMemoryAmount(used) << " of " << formatMemoryAmount(config.limit)
+            << " on disk, peak " << formatMemoryAmount(peak) << ", " << spooled << " spooled, " << refused << " refused";
+        if (changed != nullptr) {
+            *changed = used != reportedUsed || spooled != reportedSpooled || refused != reportedRefused;
+            reportedUsed = used;
+            reportedSpooled = spooled;
+            reportedRefused = refused;
+        }
+        return out.str();
+    }
+
+private:
+    std::mutex mutex;
+    SpoolConfig config;
+    uint64_t used = 0;
+    uint64_t peak = 0;
+    uint64_t files = 0;
+    uint64_t spooled = 0;
+    uint64_t refused = 0;
+    uint64_t reportedUsed = 0;
+    uint64_t reportedSpooled = 0;
+    uint64_t reportedRefused = 0;
+};
+
+SpoolDirectory& spoolDirectory() {
+    static SpoolDirectory directory;
+    return directory;
+}
+
+// Un archivo del spool: se escribe en orden y se lee en cualquier posición.
+// La escritura no es segura entre hilos; la lectura de lo ya escrito sí.
+class SpoolFile {
+public:
+    // nullptr si no se pudo crear el archivo
+    static std::shared_ptr<SpoolFile> create() {
+        std::string path = spoolDirectory().settings().dir + "/spool.XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0) return nullptr;
+        unlink(path.c_str());
+        spoolDirectory().opened();
+        return std::shared_ptr<SpoolFile>(new SpoolFile(fd));
+    }
+
+    ~SpoolFile() {
+        unmap(writeMap, writeLength);
+        close(fd);
+        spoolDirectory().release(charged);
+        spoolDirectory().closed();
+    }
+
+    SpoolFile(const SpoolFile&) = delete;
+    SpoolFile& operator=(const SpoolFile&) = delete;
+
+    uint64_t size() const {
+        return written;
+    }
+
+    // Lugar para escribir lo siguiente (hasta el fin de la ventana actual),
+    // para recibir directo del socket; nullptr si el spool está lleno
+    char* writeWindow(size_t& available) {
+        if (writeMap == nullptr || written == writeBase + writeLength) {
+            unmap(writeMap, writeLength);
+            if (written > 0) {
+                // La ventana llena se escribe al disco en segundo plano
+                sync_file_range(fd, writeBase, SPOOL_WINDOW, SYNC_FILE_RANGE_WRITE);
+            }
+            writeBase = written;
+            if (!spoolDirectory().reserve(SPOOL_WINDOW)) return nullptr;
+            charged += SPOOL_WINDOW;
+            if (ftruncate(fd, writeBase + SPOOL_WINDOW) != 0) return nullptr;
+            writeMap = map(writeBase, PROT_READ | PROT_WRITE);
+            if (writeMap == nullptr) return nullptr;
+            writeLength = SPOOL_WINDOW;
+        }
+        available = writeBase + writeLength - written;
+        return writeMap + (written - writeBase);
+    }
+
+    // Marcar como escritos 'length' bytes de la ventana
+    void commit(size_t length) {
+        written += length;
+    }
+
+    bool append(const char* data, size_t length) {
+        while (length > 0) {
+            size_t available;
+            char* window = writeWindow(available);
+            if (window == nullptr) return false;
+            size_t n = std::min(available, length);
+            memcpy(window, data, n);
+            commit(n);
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Copiar 'length' bytes desde 'offset' (ya escritos)
+    bool read(uint64_t offset, char* out, size_t length) const {
+        if (offset + length > written) return false;
+        while (length > 0) {
+            ssize_t n = pread(fd, out, length, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            out += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+private:
+    explicit SpoolFile(int fd) : fd(fd) {}
+
+    char* map(uint64_t offset, int protection) {
+        void* mapped = mmap(nullptr, SPOOL_WINDOW, protection, MAP_SHARED, fd, offset);
+        return mapped == MAP_FAILED ? nullptr : (char*)mapped;
+    }
+
+    void unmap(char*& mapped, size_t& length) {
+        if (mapped != nullptr) {
+            munmap(mapped, length);
+            mapped = nullptr;
+            length = 0;
+        }
+    }
+
+    int fd;
+    uint64_t written = 0;
+    uint64_t charged = 0; // espacio cobrado al directorio
+    char* writeMap = nullptr;
+    uint64_t writeBase = 0;
+    size_t writeLength = 0;
+};
+
+#endif
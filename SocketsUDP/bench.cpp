@@ -0,0 +1,161 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include "framing.h"
+
+using namespace std;
+
+/*
+    Generador de carga para el servidor UDP (ver bench.sh).
+
+    Abre --clients sesiones varlen y las pone en anillo: cada cliente tiene
+    --window privados 't' en vuelo hacia el siguiente, y por cada 'T' que
+    recibe envía otro. Así la carga es cerrada (no satura colas que el
+    servidor descartaría) y los mensajes por segundo que se entregan miden
+    lo que el servidor procesa. Con --workers N en el servidor los clientes
+    quedan repartidos entre los workers y la mayoría de los privados cruzan
+    de un worker a otro.
+*/
+
+typedef chrono::steady_clock Clock;
+
+struct BenchClient {
+    int fd;
+    string nickname;
+    uint32_t sessionId;
+    uint64_t received;
+};
+
+// Handshake varlen con sesión; false si el servidor no respondió
+bool connectClient(BenchClient& client, const sockaddr_in& server) {
+    client.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 4 * 1024 * 1024;
+    setsockopt(client.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    string hello = "n";
+    appendU16(hello, client.nickname.size());
+    hello += client.nickname;
+    hello.push_back(CAPS_MARKER);
+    appendU16(hello, CAP_VARLEN | CAP_SESSION);
+    sendto(client.fd, hello.data(), hello.size(), 0, (const sockaddr*)&server, sizeof(server));
+
+    struct timeval timeout = {1, 0};
+    setsockopt(client.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char buffer[2048];
+    int n = recv(client.fd, buffer, sizeof(buffer), 0);
+    if (n < 7 || buffer[0] != 'N') return false;
+    client.sessionId = readU32(string(buffer, n), 3);
+    client.received = 0;
+    return true;
+}
+
+string buildPrivate(const string& sender, const string& dest, const string& text) {
+    string message = "t";
+    appendU16(message, sender.size());
+    message += sender;
+    appendU16(message, dest.size());
+    message += dest;
+    appendSizeField(message, text.size(), 3);
+    message += text;
+    return message;
+}
+
+int main(int argc, char* argv[]) {
+    int clientCount = 16;
+    int window = 4;
+    int seconds = 5;
+    int port = 45000;
+    size_t messageSize = 64;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        if (option == "--clients") clientCount = atoi(argv[i + 1]);
+        else if (option == "--window") window = atoi(argv[i + 1]);
+        else if (option == "--seconds") seconds = atoi(argv[i + 1]);
+        else if (option == "--port") port = atoi(argv[i + 1]);
+        else if (option == "--size") messageSize = atoi(argv[i + 1]);
+    }
+
+    sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+
+    vector<BenchClient> clients(clientCount);
+    for (int i = 0; i < clientCount; i++) {
+        clients[i].nickname = "bench" + to_string(i);
+        if (!connectClient(clients[i], server)) {
+            cerr << "Handshake of " << clients[i].nickname << " failed" << endl;
+            return 1;
+        }
+    }
+
+    // El privado de cada cliente hacia el siguiente se codifica una vez
+    string text(messageSize, 'x');
+    vector<string> datagrams(clientCount);
+    for (int i = 0; i < clientCount; i++) {
+        string message = buildPrivate(clients[i].nickname, clients[(i + 1) % clientCount].nickname, text);
+        datagrams[i] = withSession(clients[i].sessionId, encodeVarlen(message, 0, MAX_UDP_PAYLOAD)[0]);
+    }
+    auto send = [&](int i) {
+        sendto(clients[i].fd, datagrams[i].data(), datagrams[i].size(), 0, (const sockaddr*)&server, sizeof(server));
+    };
+
+    vector<pollfd> fds(clientCount);
+    for (int i = 0; i < clientCount; i++) {
+        fds[i] = {clients[i].fd, POLLIN, 0};
+        for (int k = 0; k < window; k++) send(i);
+    }
+
+    // Un segundo de calentamiento antes de medir
+    Clock::time_point start = Clock::now();
+    Clock::time_point measureFrom = start + chrono::seconds(1);
+    Clock::time_point end = measureFrom + chrono::seconds(seconds);
+    uint64_t delivered = 0;
+    uint64_t lost = 0;
+    char buffer[MAX_UDP_PAYLOAD + 1];
+    while (Clock::now() < end) {
+        int ready = poll(fds.data(), fds.size(), 200);
+        if (ready == 0) {
+            // Nada en vuelo volvió: el servidor descartó algo, se repone la ventana
+            lost += clientCount * window;
+            for (int i = 0; i < clientCount; i++) {
+                for (int k = 0; k < window; k++) send(i);
+            }
+            continue;
+        }
+        bool measuring = Clock::now() >= measureFrom;
+        for (int i = 0; i < clientCount; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            while (true) {
+                int n = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (n <= 0) break;
+                vector<Record> records;
+                if (!parseRecords(string(buffer, n), records)) continue;
+                for (const Record& record : records) {
+                    if (record.type != 'T') continue;
+                    if (measuring) delivered++;
+                    // Quien recibe de i - 1 responde con el suyo hacia i + 1
+                    send(i);
+                }
+            }
+        }
+    }
+
+    cout << clientCount << " clients, window " << window << ", " << messageSize << " byte messages: "
+         << delivered / seconds << " msg/s" << (lost ? " (windows refilled after loss)" : "") << endl;
+    for (const BenchClient& client : clients) {
+        string bye = withSession(client.sessionId, encodeVarlen("x", 0, MAX_UDP_PAYLOAD)[0]);
+        sendto(client.fd, bye.data(), bye.size(), 0, (const sockaddr*)&server, sizeof(server));
+        close(client.fd);
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+#!/bin/bash
+# Mediciones del servidor y el cliente UDP en loopback. Compila en un
+# directorio temporal con g++ y no deja nada en el árbol.
+#
+#   ./bench.sh workers [rev]   mensajes/s con --workers 1, 2 y 4 (bench.cpp);
+#                              con rev, también el servidor de esa revisión
+#   ./bench.sh mtu [rev]       MB/s de biblia.txt (sin comprimir) con
+#                              datagramas de 777, 1472, 8972 y 65507 bytes
+#   ./bench.sh compress [rev]  ms de biblia.txt e img.png del envío al
+#                              archivo guardado, con y sin --no-compress
+#
+# Con rev, mtu y compress usan servidor y clientes de esa revisión.
+# RATE (p. ej. 100mbit) limita loopback con tc tbf mientras dura la
+# medición (hace falta root).
+#
+# Variables: CLIENTS (16), WINDOW (4), SECONDS_PER_RUN (5), RUNS (3)
+
+cd "$(dirname "$0")"
+OUT=$(mktemp -d)
+SERVER_PID=
+CLIENT_PIDS=
+trap 'kill $SERVER_PID $CLIENT_PIDS 2>/dev/null; [ -n "$RATE" ] && tc qdisc del dev lo root 2>/dev/null; rm -rf "$OUT"' EXIT
+CXX="g++ -std=c++17 -O2 -pthread"
+
+# Compilar un programa de una revisión de git (o del árbol, sin rev)
+build() {
+    local rev=$1 source=$2 dest=$3
+    if [ -z "$rev" ]; then
+        $CXX "$source" -o "$dest" || exit 1
+    else
+        if [ ! -d "$OUT/$rev" ]; then
+            mkdir -p "$OUT/$rev"
+            git archive "$rev" . | tar -x -C "$OUT/$rev" || exit 1
+        fi
+        $CXX "$OUT/$rev/$source" -o "$dest" || exit 1
+    fi
+}
+
+start_server() {
+    "$@" > "$OUT/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.3
+}
+
+stop_server() {
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+}
+
+# Cliente que lee sus comandos de un FIFO: start_client nombre dir args...
+# deja el descriptor para escribirle en la variable con su nombre
+start_client() {
+    local name=$1 dir=$2
+    shift 2
+    mkdir -p "$dir"
+    mkfifo "$OUT/$name.in"
+    (cd "$dir" && exec "$OUT/client" "$@" < "$OUT/$name.in" > "$OUT/$name.log" 2>&1) &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
+    exec {fd}> "$OUT/$name.in"
+    eval "$name=$fd"
+    echo "$name" >&$fd
+}
+
+# El hilo receptor del cliente sigue en recv tras /exit, así que se le da
+# un momento para avisar al servidor y después se termina
+stop_clients() {
+    echo /exit >&$alice
+    echo /exit >&$bob
+    exec {alice}>&- {bob}>&-
+    sleep 0.2
+    kill $CLIENT_PIDS 2>/dev/null
+    wait $CLIENT_PIDS 2>/dev/null
+    CLIENT_PIDS=
+    rm -f "$OUT"/*.in
+}
+
+# Esperar hasta que el log tenga 'count' líneas con el patrón (60 s como mucho)
+wait_log() {
+    local log=$1 pattern=$2 count=$3
+    local deadline=$((SECONDS + 60))
+    while [ $SECONDS -lt $deadline ]; do
+        [ "$(grep -ac "$pattern" "$log")" -ge "$count" ] && return 0
+        sleep 0.002
+    done
+    echo "timed out waiting for '$pattern' in $log" >&2
+    return 1
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+shape() {
+    if [ -n "$RATE" ]; then
+        tc qdisc replace dev lo root tbf rate "$RATE" burst 256kb latency 50ms || exit 1
+        echo "loopback limited to $RATE"
+    fi
+}
+
+bench_workers() {
+    $CXX bench.cpp -o "$OUT/bench" || exit 1
+    build "" server.cpp "$OUT/server"
+    local servers="$OUT/server"
+    if [ -n "$1" ]; then
+        build "$1" server.cpp "$OUT/server-$1"
+        servers="$OUT/server-$1 $servers"
+    fi
+    echo "$(nproc) CPUs"
+    for server in $servers; do
+        for workers in 1 2 4; do
+            for run in $(seq ${RUNS:-3}); do
+                start_server "$server" --workers $workers
+                echo -n "$(basename "$server") --workers $workers: "
+                "$OUT/bench" --clients ${CLIENTS:-16} --window ${WINDOW:-4} --seconds ${SECONDS_PER_RUN:-5}
+                stop_server
+            done
+        done
+    done
+}
+
+bench_mtu() {
+    build "$1" server.cpp "$OUT/server"
+    build "$1" client.cpp "$OUT/client"
+    shape
+    for size in 777 1472 8972 65507; do
+        start_server "$OUT/server"
+        start_client bob "$OUT/bob" --no-compress
+        start_client alice "$OUT/alice" --no-compress
+        cp biblia.txt "$OUT/alice/"
+        sleep 1.5
+        echo "/mtu $size" >&$bob
+        echo "/mtu $size" >&$alice
+        sleep 0.2
+        for run in $(seq ${RUNS:-3}); do
+            echo "/file bob biblia.txt" >&$alice
+            wait_log "$OUT/bob.log" "File received" $run || break
+        done
+        echo "$size byte datagrams: $(grep -a "Reassembled message" "$OUT/bob.log" | grep -o "[0-9.]* MB/s" | median) MB/s (median of ${RUNS:-3})"
+        stop_clients
+        stop_server
+        rm -rf "$OUT/alice" "$OUT/bob"
+    done
+}
+
+bench_compress() {
+    build "$1" server.cpp "$OUT/server"
+    build "$1" client.cpp "$OUT/client"
+    shape
+    for file in biblia.txt img.png; do
+        for option in "" --no-compress; do
+            start_server "$OUT/server"
+            start_client bob "$OUT/bob" $option
+            start_client alice "$OUT/alice" $option
+            cp "$file" "$OUT/alice/"
+            sleep 1.5
+            for run in $(seq ${RUNS:-3}); do
+                local start=$(now_ms)
+                echo "/file bob $file" >&$alice
+                wait_log "$OUT/bob.log" "File received" $run || break
+                echo $(($(now_ms) - start)) >> "$OUT/times"
+            done
+            echo "$file ${option:-compress}: $(median < "$OUT/times") ms (median of ${RUNS:-3})"
+            stop_clients
+            stop_server
+            rm -rf "$OUT/alice" "$OUT/bob" "$OUT/times"
+        done
+    done
+}
+
+case "$1" in
+    workers) bench_workers "$2" ;;
+    mtu) bench_mtu "$2" ;;
+    compress) bench_compress "$2" ;;
+    *) echo "Usage: $0 workers|mtu|compress [rev]"; exit 1 ;;
+esac
@@ -16,12 +16,17 @@
 #include <unordered_map>
 #include "sala.h"
 #include "sala_serialized.h"
+#include "framing.h"
+#include "congestion.h"
+#include "fec.h"
+#include "crc32c.h"
+#include "netsim.h"
 #include <algorithm>
 
 using namespace std;
 
 #define PORT 45000
-#define MAX_DATAGRAM_SIZE 1024
+#define MAX_DATAGRAM_SIZE 65536
 
 /*
     n: Nickname (client → server)
@@ -53,56 +58,64 @@ condition_variable ready;
 string userInput;
 bool inputReady = false;
 
-int maxDatagramLength = 777;
-
 // Variables globales para socket y dirección del servidor
 int sock;
 struct sockaddr_in serv_addr;
 string nickname; // Variable global para el nickname
 
-// Función para completar datagramas
-string completeDatagram(string &packet) {
-    size_t len = packet.size();
-    if (len < (size_t)maxDatagramLength) {
-        packet.append(maxDatagramLength - len, '#');
-    }
-    return packet;
-}
+// Capacidades que pide este cliente y las que aceptó el servidor
+uint16_t requestedCaps = CAP_VARLEN | CAP_PMTU | CAP_PACING | CAP_FEC | CAP_SESSION | CAP_MULTICAST | CAP_CRC | CAP_HEARTBEAT | CAP_COMPRESS;
+uint16_t sessionCaps = 0;
+uint32_t sessionId = 0; // lo asigna el servidor con CAP_SESSION
+string sessionToken; // secreto de la sesión, para responder los desafíos de cambio de dirección
+struct sockaddr_in multicastGroup; // grupo de los broadcasts con CAP_MULTICAST
+atomic<uint32_t> nextMessageId(1);
 
-// Función para fragmentar datagramas grandes
-vector<string> fragmentDatagram(const string &header, const string &data, int sizeFieldBytes) {
-    vector<string> datagrams;
+// Tamaño de datagrama de la sesión en modo varlen (se ajusta con el sondeo de MTU)
+atomic<size_t> datagramSize(777);
 
-    size_t overhead = 1 + header.size() + sizeFieldBytes;
-    size_t maxDataPerPacket = maxDatagramLength - overhead;
-    size_t offset = 0;
-    int numPacket = 1;
+// Paridad FEC de las transferencias: k fragmentos de datos + m de paridad (0 = sin FEC)
+atomic<int> fecData(0);
+atomic<int> fecParity(0);
 
-    while (offset < data.size()) {
-        size_t remaining = data.size() - offset;
-        size_t chunkSize = min(remaining, maxDataPerPacket);
-        bool isLast = (offset + chunkSize >= data.size());
+// Datagramas y mensajes descartados por CRC32C (CAP_CRC)
+atomic<uint64_t> corruptDatagrams(0);
+atomic<uint64_t> corruptPayloads(0);
 
-        string fragment;
-        fragment.push_back(isLast ? 0 : (char)numPacket);
+// Tamaños candidatos (carga UDP): máximo IPv4/loopback, jumbo, Ethernet, mínimo IPv6
+const uint32_t PROBE_SIZES[] = {65507, 16384, 8972, 1472, 1252};
 
-        fragment += header;
+// Buffers de socket grandes para que una ventana de datagramas de 64 KB quepa
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
 
-        uint32_t len = (uint32_t)chunkSize;
-        for (int i = sizeFieldBytes - 1; i >= 0; --i)
-            fragment.push_back((len >> (8 * i)) & 0xFF);
+// Lo más que se descomprime de un mensaje 'Z': el contenido queda entero en
+// memoria y el tamaño de la cabecera lo pone el emisor
+#define MAX_EXPANDED_SIZE (4ull * 1024 * 1024 * 1024)
 
-        fragment += data.substr(offset, chunkSize);
+// Emisor con control de congestión (CAP_PACING); lo vacía el hilo runPacer
+PacedSender pacer;
+mutex pacer_mutex;
+condition_variable pacer_ready;
 
-        if (fragment.size() < (size_t)maxDatagramLength)
-            fragment = completeDatagram(fragment);
-
-        datagrams.push_back(fragment);
-        offset += chunkSize;
-        numPacket++;
+// Mostrar las transferencias confirmadas (con pacer_mutex tomado)
+void reportTransfers() {
+    string summary;
+    while (pacer.popCompleted(summary)) {
+        cout << "Transfer " << summary << endl;
     }
+}
+
+// Hora del último datagrama enviado, para saber cuándo hace falta un latido
+atomic<Clock::rep> lastSent(0);
 
-    return datagrams;
+// Enviar un datagrama con el id de sesión delante (si hay sesión) y el
+// CRC32C detrás (con CAP_CRC, salvo los sondeos de MTU)
+int sendRaw(int sock, const string& packet, const sockaddr_in& dest_addr) {
+    lastSent = Clock::now().time_since_epoch().count();
+    bool crc = (sessionCaps & CAP_CRC) && !isProbe(packet);
+    string datagram = withSession(sessionId, crc ? sealDatagram(packet) : packet);
+    return netsimSendto(sock, datagram.c_str(), datagram.size(), 0,
+                  (struct sockaddr*)&dest_addr, sizeof(dest_addr));
 }
 
 // Función para enviar datagramas (UDP)
@@ -110,8 +123,7 @@ void sendDatagram(int sock, const string& packet, const sockaddr_in& dest_addr)
     // Log del protocolo
     cout << "SEND: " << packet.substr(0, 100) << (packet.length() > 100 ? "..." : "") << endl;
     
-    sendto(sock, packet.c_str(), packet.size(), 0, 
-           (struct sockaddr*)&dest_addr, sizeof(dest_addr));
+    sendRaw(sock, packet, dest_addr);
 }
 
 // Función para enviar múltiples paquetes
@@ -121,12 +133,57 @@ void sendPackets(int sock, const vector<string>& packets, const sockaddr_in& des
     }
 }
 
+// Enviar un mensaje completo (tipo + campos) en el formato negociado
+// ('compress' = false si ya se sabe que no achica)
+void sendMessage(int sock, const string& message, const sockaddr_in& dest_addr, bool compress = true) {
+    if (compress && (sessionCaps & CAP_COMPRESS)) {
+        string compressed = compressMessage(message);
+        if (!compressed.empty()) {
+            cout << "Compressed " << message[0] << ": " << message.size() << " -> " << compressed.size() << " bytes ("
+                 << fixed << setprecision(1) << 100.0 * compressed.size() / message.size() << "%)" << defaultfloat << endl;
+            sendMessage(sock, compressed, dest_addr);
+            return;
+        }
+    }
+    if (sessionCaps & CAP_VARLEN) {
+        vector<string> packets;
+        int k = fecData;
+        bool crc = sessionCaps & CAP_CRC;
+        size_t size = datagramSize - (crc ? CRC_OVERHEAD : 0);
+        uint32_t messageId = nextMessageId++;
+        if ((sessionCaps & CAP_FEC) && k > 0) {
+            packets = addParity(encodeVarlen(message, messageId, size - fecOverhead(k)), k, fecParity);
+        } else {
+            packets = encodeVarlen(message, messageId, size);
+        }
+        if (crc) {
+            addPayloadCrc(packets, message, messageId);
+        }
+        if ((sessionCaps & CAP_PACING) && packets.size() > 1) {
+            {
+                lock_guard<mutex> lock(pacer_mutex);
+                pacer.enqueue(packets);
+            }
+            pacer_ready.notify_one();
+        } else {
+            sendPackets(sock, packets, dest_addr);
+        }
+    } else {
+        sendPackets(sock, encodeLegacy(message), dest_addr);
+    }
+}
+
 void sendNickname(int sock, const string nick, const sockaddr_in& serv_addr) {
     string packet = "n";
     uint16_t len = htons(nick.size());
     packet.append((char*)&len,2);
     packet += nick;
-    packet = completeDatagram(packet);
+    if (requestedCaps) {
+        packet.push_back(CAPS_MARKER);
+        appendU16(packet, requestedCaps);
+    } else {
+        packet = completeDatagram(packet);
+    }
     cout << "Sending nickname: " << nick << endl;
     sendDatagram(sock, packet, serv_addr);
 }
@@ -146,19 +203,8 @@ void sendBroadcast(int sock, const string& sender_nick, const string msg, const
     packet.push_back(mlen&0xFF);
     packet += msg;
     
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        packet = completeDatagram(packet);
-        cout << "Sending broadcast: " << msg << endl;
-        sendDatagram(sock, packet, serv_addr);
-    } else {
-        string header = "m";
-        header.append((char*)&slen, 2);
-        header += sender_nick;
-        
-        vector<string> fragments = fragmentDatagram(header, msg, 3);
-        cout << "Sending fragmented broadcast: " << msg << endl;
-        sendPackets(sock, fragments, serv_addr);
-    }
+    cout << "Sending broadcast: " << msg << endl;
+    sendMessage(sock, packet, serv_addr);
 }
 
 void sendToClient(int sock, const string& sender_nick, const string dest, const string msg, const sockaddr_in& serv_addr) {
@@ -181,35 +227,47 @@ void sendToClient(int sock, const string& sender_nick, const string dest, const
     packet.push_back(mlen&0xFF);
     packet += msg;
     
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        packet = completeDatagram(packet);
-        cout << "Sending private to " << dest << ": " << msg << endl;
-        sendDatagram(sock, packet, serv_addr);
+    cout << "Sending private to " << dest << ": " << msg << endl;
+    sendMessage(sock, packet, serv_addr);
+}
+
+// Fijar el tamaño de datagrama de la sesión y anunciarlo al servidor
+void setDatagramSize(int sock, size_t size, const sockaddr_in& serv_addr) {
+    datagramSize = size;
+    string packet = "u";
+    packet.push_back(OPT_DATAGRAM_SIZE);
+    appendU32(packet, (uint32_t)size);
+    cout << "Datagram size: " << size << " bytes" << endl;
+    sendMessage(sock, packet, serv_addr);
+}
+
+// Elegir la paridad de las próximas transferencias; el servidor usa la
+// misma proporción para lo que envía a este cliente
+void setFec(int sock, int k, int m, const sockaddr_in& serv_addr) {
+    fecData = k;
+    fecParity = m;
+    string packet = "u";
+    packet.push_back(OPT_FEC);
+    appendU32(packet, (uint32_t)((k << 8) | m));
+    if (k > 0) {
+        cout << "FEC: " << k << " data + " << m << " parity fragments per block ("
+             << fixed << setprecision(1) << 100.0 * m / k << "% overhead)" << defaultfloat << endl;
     } else {
-        string header = "t";
-        header.append((char*)&slen, 2);
-        header += sender_nick;
-        header.append((char*)&dlen, 2);
-        header += dest;
-        
-        vector<string> fragments = fragmentDatagram(header, msg, 3);
-        cout << "Sending fragmented private to " << dest << ": " << msg << endl;
-        sendPackets(sock, fragments, serv_addr);
+        cout << "FEC disabled" << endl;
     }
+    sendMessage(sock, packet, serv_addr);
 }
 
 void requestList(int sock, const sockaddr_in& serv_addr) {
     string packet = "l";
-    packet = completeDatagram(packet);
     cout << "Requesting client list" << endl;
-    sendDatagram(sock, packet, serv_addr);
+    sendMessage(sock, packet, serv_addr);
 }
 
 void sendClose(int sock, const sockaddr_in& serv_addr) {
     string packet = "x";
-    packet = completeDatagram(packet);
     cout << "Sending close connection" << endl;
-    sendDatagram(sock, packet, serv_addr);
+    sendMessage(sock, packet, serv_addr);
 }
 
 // Parse list response
@@ -240,6 +298,33 @@ void parseListResponse(const string& listData) {
     cout << endl;
 }
 
+// Mensaje 'z' con un archivo comprimido leyendo de a bloques, así no hace
+// falta tener el archivo en memoria además del mensaje. 'head' es el
+// mensaje 'f' hasta el campo de tamaño. "" si no achica.
+string compressFileMessage(ifstream& file, uint64_t size, const string& head) {
+    if (!(sessionCaps & CAP_COMPRESS) || size < LZ_MIN_SIZE) return "";
+
+    string message = "z" + head;
+    size_t sizeField = message.size();
+    appendSizeField(message, 0, 10);
+    size_t start = message.size();
+    LzEncoder encoder(size);
+    encoder.header(message);
+    vector<char> block(LZ_BLOCK_SIZE);
+    for (uint64_t offset = 0; offset < size; offset += LZ_BLOCK_SIZE) {
+        size_t n = min((uint64_t)LZ_BLOCK_SIZE, size - offset);
+        if (!file.read(block.data(), n)) return "";
+        encoder.block(block.data(), n, message);
+        if (message.size() - start >= size) return "";
+    }
+
+    // El tamaño del flujo se conoce al final
+    string field;
+    appendSizeField(field, message.size() - start, 10);
+    message.replace(sizeField, 10, field);
+    return message;
+}
+
 void sendFile(int sock, const string& sender_nick, string dest, const string& filename, const sockaddr_in& serv_addr) {
     // Read file
     ifstream file(filename, ios::binary | ios::ate);
@@ -252,14 +337,6 @@ void sendFile(int sock, const string& sender_nick, string dest, const string& fi
     streamsize file_size = file.tellg();
     file.seekg(0, ios::beg);
     
-    // Read the content
-    vector<char> file_data(file_size);
-    if (!file.read(file_data.data(), file_size)) {
-        cout << "Error: Could not read file" << endl;
-        return;
-    }
-    file.close();
-    
     string packet = "f";
     
     // Agregar nickname del sender
@@ -279,6 +356,18 @@ void sendFile(int sock, const string& sender_nick, string dest, const string& fi
     packet.push_back(flen & 0xFF);
     
     packet += filename;
+
+    cout << "Sending file to " << dest << ": " << filename << " (" << file_size << " bytes)" << endl;
+    string compressed = compressFileMessage(file, file_size, packet);
+    if (!compressed.empty()) {
+        size_t streamSize = compressed.size() - 1 - packet.size() - 10;
+        cout << "Compressed f: " << file_size << " -> " << streamSize << " bytes ("
+             << fixed << setprecision(1) << 100.0 * streamSize / file_size << "%)" << defaultfloat << endl;
+        sendMessage(sock, compressed, serv_addr);
+        return;
+    }
+    file.clear();
+    file.seekg(0, ios::beg);
     
     // file size
     uint64_t fsize = file_size;
@@ -286,31 +375,16 @@ void sendFile(int sock, const string& sender_nick, string dest, const string& fi
         packet.push_back((fsize >> (i * 8)) & 0xFF);
     }
     
-    // file data
-    packet.append(file_data.data(), file_size);
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        packet = completeDatagram(packet);
-        cout << "Sending file to " << dest << ": " << filename << " (" << file_size << " bytes)" << endl;
-        sendDatagram(sock, packet, serv_addr);
-    } else {
-        string header = "f";
-        header.append((char*)&slen, 2);
-        header += sender_nick;
-        header.append((char*)&dlen, 2);
-        header += dest;
-        header.push_back((flen >> 16) & 0xFF);
-        header.push_back((flen >> 8) & 0xFF);
-        header.push_back(flen & 0xFF);
-        header += filename;
-        for (int i = 9; i >= 0; i--) {
-            header.push_back((fsize >> (i * 8)) & 0xFF);
-        }
-        
-        vector<string> fragments = fragmentDatagram(header, string(file_data.data(), file_size), 0);
-        cout << "Sending fragmented file to " << dest << ": " << filename << " (" << file_size << " bytes)" << endl;
-        sendPackets(sock, fragments, serv_addr);
+    // file data, leído directo al mensaje
+    size_t start = packet.size();
+    packet.resize(start + file_size);
+    if (!file.read(&packet[start], file_size)) {
+        cout << "Error: Could not read file" << endl;
+        return;
     }
+    file.close();
+    
+    sendMessage(sock, packet, serv_addr, false);
 }
 
 void sendObject(int sock, const string& sender_nick, const string &dest, const Sala &sala, const sockaddr_in& serv_addr) {
@@ -336,22 +410,8 @@ void sendObject(int sock, const string& sender_nick, const string &dest, const S
     // object content
     packet.insert(packet.end(), objectContent.begin(), objectContent.end());
 
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        packet = completeDatagram(packet);
-        cout << "Sending object to " << dest << " (" << objectContent.size() << " bytes)" << endl;
-        sendDatagram(sock, packet, serv_addr);
-    } else {
-        string header = "o";
-        header.append(reinterpret_cast<const char*>(&slen), sizeof(slen));
-        header += sender_nick;
-        header.append(reinterpret_cast<const char*>(&dlen), sizeof(dlen));
-        header += dest;
-        header.append(reinterpret_cast<const char*>(&objSize), sizeof(objSize));
-        
-        vector<string> fragments = fragmentDatagram(header, string(objectContent.data(), objectContent.size()), 0);
-        cout << "Sending fragmented object to " << dest << " (" << objectContent.size() << " bytes)" << endl;
-        sendPackets(sock, fragments, serv_addr);
-    }
+    cout << "Sending object to " << dest << " (" << objectContent.size() << " bytes)" << endl;
+    sendMessage(sock, packet, serv_addr);
 }
 
 void sendGameRequest(int sock, const string& sender_nick, const string& dest, const sockaddr_in& serv_addr) {
@@ -365,9 +425,8 @@ void sendGameRequest(int sock, const string& sender_nick, const string& dest, co
     uint16_t dlen = htons(dest.size());
     packet.append((char*)&dlen, 2);
     packet += dest;
-    packet = completeDatagram(packet);
     cout << "Sending game request to " << dest << endl;
-    sendDatagram(sock, packet, serv_addr);
+    sendMessage(sock, packet, serv_addr);
 }
 
 void sendGameResponse(int sock, const string& sender_nick, const string& sender, bool accept, const sockaddr_in& serv_addr) {
@@ -382,9 +441,8 @@ void sendGameResponse(int sock, const string& sender_nick, const string& sender,
     packet.append((char*)&rlen, 2);
     packet += sender;
     packet.push_back(accept ? 'y' : 'n');
-    packet = completeDatagram(packet);
     cout << "Sending game response to " << sender << ": " << (accept ? "accept" : "decline") << endl;
-    sendDatagram(sock, packet, serv_addr);
+    sendMessage(sock, packet, serv_addr);
 }
 
 void sendBoardPosition(int sock, const string& sender_nick, int position, const sockaddr_in& serv_addr) {
@@ -400,9 +458,8 @@ void sendBoardPosition(int sock, const string& sender_nick, int position, const
     packet.push_back((pos >> 16) & 0xFF);
     packet.push_back((pos >> 8) & 0xFF);
     packet.push_back(pos & 0xFF);
-    packet = completeDatagram(packet);
     cout << "Sending board position: " << position << endl;
-    sendDatagram(sock, packet, serv_addr);
+    sendMessage(sock, packet, serv_addr);
 }
 
 void printBoard(const vector<char>& board, const string& currentPlayer, const string& myNickname) {
@@ -475,6 +532,8 @@ struct FragmentReassembly {
 };
 
 unordered_map<string, FragmentReassembly> reassemblyBuffers;
+unordered_map<uint32_t, MessageReassembly> messageBuffers; // modo varlen, clave = id del mensaje
+CompletedMessages completedMessages;
 mutex reassembly_mutex;
 
 // Función para reconstruir paquetes fragmentados
@@ -543,6 +602,16 @@ void processCompleteMessage(const string& fullData, char messageType, const stri
     size_t offset = 0;
     
     switch (messageType) {
+        case 'Z': { // Archivo u objeto comprimido (CAP_COMPRESS)
+            string message;
+            if (!expandMessage(fullData, message, MAX_EXPANDED_SIZE)) {
+                cout << "[Error] Corrupt compressed message" << endl;
+                return;
+            }
+            processCompleteMessage(message.substr(1), message[0], nickname);
+            break;
+        }
+
         case 'E': { // Error
             if (fullData.size() < offset + 3) return;
             uint32_t len = ((unsigned char)fullData[offset] << 16) |
@@ -836,20 +905,354 @@ void processCompleteMessage(const string& fullData, char messageType, const stri
             break;
         }
         
+        case 'Q': // Respuesta tardía a un sondeo de MTU
+            break;
+
+        case 'K': { // Desafío: el servidor nos ve desde otra dirección
+            if (fullData.size() < offset + CHALLENGE_SIZE || sessionToken.empty()) return;
+            string answer = "k" + fullData.substr(offset, CHALLENGE_SIZE) + sessionToken;
+            string datagram = withSession(sessionId, answer);
+            netsimSendto(sock, datagram.c_str(), datagram.size(), 0, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+            cout << "Answered the server's address challenge" << endl;
+            break;
+        }
+
         default:
             cout << "Unknown message type: " << messageType << endl;
             break;
     }
 }
 
+// Procesar un datagrama varlen: uno o más registros, simples o fragmentos
+void processVarlenDatagram(const string& data, const string& nickname) {
+    vector<Record> records;
+    if (!parseRecords(data, records)) {
+        cout << "Malformed datagram" << endl;
+        return;
+    }
+
+    // Los ACK de todos los fragmentos del datagrama salen en una sola respuesta
+    string acks;
+
+    // El CRC del contenido viaja junto al fragmento 0: se guarda antes de procesarlo
+    for (const auto& record : records) {
+        if (record.type != PAYLOAD_CRC_RECORD || record.body.size() < 8) continue;
+        lock_guard<mutex> lock(reassembly_mutex);
+        uint32_t messageId = readU32(record.body, 0);
+        if (completedMessages.contains(to_string(messageId))) continue;
+        MessageReassembly& reassembly = messageBuffers[messageId];
+        reassembly.crcExpected = true;
+        reassembly.expectedCrc = readU32(record.body, 4);
+    }
+
+    for (const auto& record : records) {
+        if (record.type == PAYLOAD_CRC_RECORD) continue;
+        if (record.type == ACK_RECORD) {
+            if (record.body.size() < 8) continue;
+            {
+                lock_guard<mutex> lock(pacer_mutex);
+                pacer.onAck(readU32(record.body, 0), readU32(record.body, 4));
+                reportTransfers();
+            }
+            pacer_ready.notify_one();
+            continue;
+        }
+
+        if (record.type != FRAGMENT_RECORD && record.type != PARITY_RECORD) {
+            processCompleteMessage(record.body, record.type, nickname);
+            continue;
+        }
+
+        FragmentHeader header;
+        ParityHeader parityHeader;
+        string chunk;
+        bool isParity = record.type == PARITY_RECORD;
+        if (isParity) {
+            if (!parseParity(record.body, parityHeader, chunk)) continue;
+            header.messageType = parityHeader.messageType;
+            header.messageId = parityHeader.messageId;
+            header.index = parityHeader.index;
+        } else if (!parseFragment(record.body, header, chunk)) {
+            continue;
+        }
+
+        if (sessionCaps & CAP_PACING) {
+            acks += buildAck(header.messageId, header.index);
+        }
+
+        string fullData;
+        bool complete = false;
+        {
+            lock_guard<mutex> lock(reassembly_mutex);
+            string key = to_string(header.messageId);
+            if (completedMessages.contains(key)) continue; // retransmisión tardía
+            MessageReassembly& reassembly = messageBuffers[header.messageId];
+
+            // Fragmentos reconstruidos por FEC: se confirman como si hubieran llegado
+            vector<uint32_t> recovered;
+            if (isParity) {
+                recovered = addParityRecord(reassembly, parityHeader, chunk);
+            } else {
+                addFragment(reassembly, header, chunk);
+                recovered = recoverAfterFragment(reassembly, header.index);
+            }
+            if (sessionCaps & CAP_PACING) {
+                for (uint32_t index : recovered) {
+                    acks += buildAck(header.messageId, index);
+                }
+            }
+
+            bool intact = advancePayloadCrc(reassembly);
+
+            if (isComplete(reassembly)) {
+                if (intact) {
+                    fullData = joinFragments(reassembly);
+                    cout << "Reassembled message " << header.messageId << ": " << transferSummary(reassembly) << endl;
+                    complete = true;
+                } else {
+                    cout << "Corrupt message " << header.messageId << " (payload CRC32C mismatch, "
+                         << ++corruptPayloads << " so far), dropped" << endl;
+                }
+                messageBuffers.erase(header.messageId);
+                completedMessages.insert(key);
+            }
+        }
+
+        if (complete) {
+            processCompleteMessage(fullData, header.messageType, nickname);
+        }
+    }
+
+    if (!acks.empty()) {
+        sendRaw(sock, acks, serv_addr);
+    }
+}
+
+// Procesar un datagrama recibido del servidor
+void handleDatagram(string data, const string& nickname) {
+    // Log del protocolo recibido
+    cout << "RECV: " << data.substr(0, 100) << (data.length() > 100 ? "..." : "") << endl;
+
+    size_t size = data.size();
+    if ((sessionCaps & CAP_CRC) && !openDatagram(data)) {
+        cout << "Corrupt datagram of " << size << " bytes (CRC32C mismatch, "
+             << ++corruptDatagrams << " so far), dropped" << endl;
+        return;
+    }
+
+    if (sessionCaps & CAP_VARLEN) {
+        processVarlenDatagram(data, nickname);
+        return;
+    }
+
+    // Determinar si es un mensaje simple o fragmentado
+    char firstByte = data[0];
+    
+    // Si el primer byte es un carácter de mensaje válido del servidor
+    // (E, M, T, L, X, F, O, J, j, B, W) entonces es un mensaje simple completo
+    if ((firstByte >= 'A' && firstByte <= 'Z') || firstByte == 'j') {
+        // Es un mensaje simple completo del servidor
+        processCompleteMessage(data.substr(1), firstByte, nickname);
+        return;
+    }
+
+    // Si llega aquí, es un mensaje fragmentado o con formato incorrecto
+    string fragment = data;
+    string fullData;
+    char messageType = 0;
+    string client_id = nickname + "_client";
+    
+    if (reconstructPacket(client_id, fragment, fullData, messageType)) {
+        // Mensaje completo reconstruido
+        processCompleteMessage(fullData, messageType, nickname);
+    } else {
+        // Fragmento recibido pero aún no está completo
+        cout << "Received fragment, type: " << messageType << endl;
+    }
+}
+
+// Esperar la respuesta 'N' al handshake. Un servidor antiguo no responde,
+// y entonces se sigue con el formato padded.
+void negotiateSession(int sock, const string& nickname) {
+    if (!requestedCaps) return;
+
+    struct timeval timeout = {0, 500000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    vector<char> buffer(MAX_DATAGRAM_SIZE);
+    int bytes_received = recvfrom(sock, buffer.data(), MAX_DATAGRAM_SIZE, 0, NULL, NULL);
+    if (bytes_received >= 3 && buffer[0] == 'N') {
+        string reply(buffer.data(), bytes_received);
+        sessionCaps = readU16(reply, 1);
+        size_t offset = 3;
+        if ((sessionCaps & CAP_SESSION) && reply.size() >= offset + 4) {
+            sessionId = readU32(reply, offset);
+            offset += 4;
+        }
+        if ((sessionCaps & CAP_MULTICAST) && reply.size() >= offset + 6) {
+            memset(&multicastGroup, 0, sizeof(multicastGroup));
+            multicastGroup.sin_family = AF_INET;
+            multicastGroup.sin_addr.s_addr = htonl(readU32(reply, offset));
+            multicastGroup.sin_port = htons(readU16(reply, offset + 4));
+            offset += 6;
+        } else {
+            sessionCaps &= ~CAP_MULTICAST;
+        }
+        if (sessionId && reply.size() >= offset + CHALLENGE_SIZE) {
+            sessionToken = reply.substr(offset, CHALLENGE_SIZE);
+        }
+        cout << "Session caps: 0x" << hex << sessionCaps << dec
+             << ((sessionCaps & CAP_VARLEN) ? " (variable-length datagrams)" : "") << endl;
+        if (sessionId) {
+            cout << "Session id: " << sessionId << endl;
+        }
+    } else if (bytes_received > 0) {
+        handleDatagram(string(buffer.data(), bytes_received), nickname);
+    } else {
+        cout << "Server did not answer the handshake, using padded datagrams" << endl;
+    }
+
+    timeout = {0, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Descubrir la MTU del camino: se envían sondeos con DF de cada tamaño
+// candidato y el servidor devuelve uno del mismo tamaño. Se usa el mayor
+// que hizo el viaje de ida y vuelta completo.
+void discoverPathMtu(int sock, const string& nickname, const sockaddr_in& serv_addr) {
+    if (!(sessionCaps & CAP_PMTU)) return;
+
+    int pmtu = IP_PMTUDISC_DO;
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+    // El id de sesión ocupa parte del datagrama: se mide el lugar que queda para registros
+    size_t header = sessionId ? SESSION_HEADER_SIZE : 0;
+    for (uint32_t size : PROBE_SIZES) {
+        string probe = buildProbe('q', size - header);
+        if (sendRaw(sock, probe, serv_addr) < 0) {
+            cout << "Probe of " << size << " bytes not sent: " << strerror(errno) << endl;
+        }
+    }
+
+    struct timeval timeout = {0, 300000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    size_t best = maxDatagramLength;
+    vector<char> buffer(MAX_DATAGRAM_SIZE);
+    while (true) {
+        int bytes_received = recvfrom(sock, buffer.data(), MAX_DATAGRAM_SIZE, 0, NULL, NULL);
+        if (bytes_received <= 0) break;
+
+        string data(buffer.data(), bytes_received);
+        if (data[0] == 'Q' && data.size() >= RECORD_HEADER_SIZE + 4 &&
+            readU32(data, RECORD_HEADER_SIZE) == data.size()) {
+            best = max(best, data.size());
+        } else {
+            handleDatagram(data, nickname);
+        }
+    }
+
+    timeout = {0, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    setDatagramSize(sock, best, serv_addr);
+}
+
+// Hilo emisor: envía los fragmentos encolados al ritmo que permite la ventana
+// y se despierta con cada ACK, cada mensaje nuevo o al vencer un RTO
+void runPacer(int sock, const sockaddr_in& serv_addr) {
+    unique_lock<mutex> lock(pacer_mutex);
+    while (true) {
+        long wait = pacer.pump([&](const string& packet) {
+            sendDatagram(sock, packet, serv_addr);
+        });
+        reportTransfers();
+        if (wait < 0) {
+            pacer_ready.wait(lock);
+        } else {
+            pacer_ready.wait_for(lock, chrono::microseconds(wait));
+        }
+    }
+}
+
+// Hilo de latidos (CAP_HEARTBEAT): si en HEARTBEAT_INTERVAL no salió nada,
+// enviar 'h' para que el servidor no dé la sesión por caída
+void sendHeartbeats(int sock, const sockaddr_in& serv_addr) {
+    while (true) {
+        Clock::time_point due = Clock::time_point(Clock::duration(lastSent.load())) + chrono::seconds(HEARTBEAT_INTERVAL);
+        if (Clock::now() >= due) {
+            sendMessage(sock, "h", serv_addr);
+        } else {
+            this_thread::sleep_until(due);
+        }
+    }
+}
+
+// Esperar a que se confirmen los fragmentos pendientes antes de salir
+void drainPacer() {
+    for (int i = 0; i < 100; i++) {
+        {
+            lock_guard<mutex> lock(pacer_mutex);
+            if (pacer.idle()) return;
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    cout << "Pending transfers dropped on exit" << endl;
+}
+
+// Unirse al grupo multicast anunciado en el handshake
+int joinMulticastGroup() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_port = multicastGroup.sin_port;
+
+    struct ip_mreq membership;
+    membership.imr_multiaddr = multicastGroup.sin_addr;
+    inet_pton(AF_INET, "127.0.0.1", &membership.imr_interface);
+
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        perror("multicast join");
+        close(fd);
+        return -1;
+    }
+    cout << "Joined multicast group " << inet_ntoa(multicastGroup.sin_addr) << ":" << ntohs(multicastGroup.sin_port) << endl;
+    return fd;
+}
+
+// Hilo receptor del grupo: solo trae 'M', y los propios se descartan
+void receiveMulticast(int fd, const string& nickname) {
+    vector<char> buffer(MAX_DATAGRAM_SIZE);
+    while (true) {
+        int bytes_received = recvfrom(fd, buffer.data(), MAX_DATAGRAM_SIZE, 0, NULL, NULL);
+        if (bytes_received <= 0) break;
+
+        vector<Record> records;
+        if (!parseRecords(string(buffer.data(), bytes_received), records)) continue;
+        for (const auto& record : records) {
+            if (record.type != 'M' || record.body.size() < 2) continue;
+            uint16_t slen = readU16(record.body, 0);
+            if (record.body.compare(2, slen, nickname) == 0 && slen == nickname.size()) continue;
+            cout << "RECV (group): M" << record.body.substr(0, 99) << endl;
+            processCompleteMessage(record.body, record.type, nickname);
+        }
+    }
+}
+
 // Receiver thread
 void receiveMessages(int sock, const string& nickname, const sockaddr_in& serv_addr) {
-    char buffer[MAX_DATAGRAM_SIZE];
+    vector<char> buffer(MAX_DATAGRAM_SIZE);
     struct sockaddr_in from_addr;
     socklen_t from_len = sizeof(from_addr);
     
     while (true) {
-        int bytes_received = recvfrom(sock, buffer, MAX_DATAGRAM_SIZE, 0, 
+        int bytes_received = recvfrom(sock, buffer.data(), MAX_DATAGRAM_SIZE, 0, 
                                      (struct sockaddr*)&from_addr, &from_len);
         
         if (bytes_received <= 0) {
@@ -857,58 +1260,74 @@ void receiveMessages(int sock, const string& nickname, const sockaddr_in& serv_a
             break;
         }
 
-        string data(buffer, bytes_received);
-        
-        // Log del protocolo recibido
-        cout << "RECV: " << data.substr(0, 100) << (data.length() > 100 ? "..." : "") << endl;
-
-        // Determinar si es un mensaje simple o fragmentado
-        char firstByte = data[0];
-        
-        // Si el primer byte es un carácter de mensaje válido del servidor
-        // (E, M, T, L, X, F, O, J, j, B, W) entonces es un mensaje simple completo
-        if ((firstByte >= 'A' && firstByte <= 'Z') || firstByte == 'j') {
-            // Es un mensaje simple completo del servidor
-            processCompleteMessage(data.substr(1), firstByte, nickname);
-            continue;
-        }
+        handleDatagram(string(buffer.data(), bytes_received), nickname);
+    }
+}
 
-        // Si llega aquí, es un mensaje fragmentado o con formato incorrecto
-        string fragment = data;
-        string fullData;
-        char messageType = 0;
-        string client_id = nickname + "_client";
-        
-        if (reconstructPacket(client_id, fragment, fullData, messageType)) {
-            // Mensaje completo reconstruido
-            processCompleteMessage(fullData, messageType, nickname);
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--padded") {
+            // Formato antiguo: datagramas rellenados con '#', sin negociación
+            requestedCaps = 0;
+        } else if (arg == "--no-compress") {
+            // Para comparar: archivos y mensajes sin comprimir
+            requestedCaps &= ~CAP_COMPRESS;
         } else {
-            // Fragmento recibido pero aún no está completo
-            cout << "Received fragment, type: " << messageType << endl;
+            cout << "Usage: " << argv[0] << " [--padded] [--no-compress]" << endl;
+            return 1;
         }
     }
-}
 
-int main() {
     // Cambiar a socket UDP
     sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int bufferSize = SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(PORT);
     inet_pton(AF_INET,"127.0.0.1",&serv_addr.sin_addr);
 
     // En UDP no hay connect(), pero guardamos la dirección del servidor
     cout << "UDP Client started" << endl;
+    if (netsimEnabled()) {
+        cout << "Network simulator: " << netsimDescription() << endl;
+    }
 
     cout << "Enter nickname: ";
     getline(cin,nickname);
     sendNickname(sock, nickname, serv_addr);
+    negotiateSession(sock, nickname);
+    discoverPathMtu(sock, nickname, serv_addr);
 
     thread t(receiveMessages, sock, nickname, serv_addr);
+    if (sessionCaps & CAP_PACING) {
+        thread(runPacer, sock, serv_addr).detach();
+    }
+    if (sessionCaps & CAP_HEARTBEAT) {
+        thread(sendHeartbeats, sock, serv_addr).detach();
+    }
+    if (sessionCaps & CAP_MULTICAST) {
+        int groupSock = joinMulticastGroup();
+        if (groupSock >= 0) {
+            thread(receiveMulticast, groupSock, nickname).detach();
+        } else {
+            // Sin grupo, pedir los broadcasts por unicast
+            sessionCaps &= ~CAP_MULTICAST;
+            string packet = "u";
+            packet.push_back(OPT_MULTICAST);
+            appendU32(packet, 0);
+            sendMessage(sock, packet, serv_addr);
+        }
+    }
 
     cout << "Commands:" << endl
      << "  /all msg   -> broadcast message" << endl
      << "  /to user msg -> private message" << endl
      << "  /list      -> show users" << endl
+     << "  /mtu [size] -> show or set datagram size" << endl
+     << "  /stats     -> show rate, RTT and loss of the session" << endl
+     << "  /fec k m | off -> add m parity fragments per k data fragments" << endl
      << "  /exit      -> quit" << endl
      << "  /file dest file -> send files" << endl
      << "  /object dest -> send Sala object" << endl
@@ -928,6 +1347,9 @@ int main() {
         }
         
         if (line == "/exit") {
+            if (sessionCaps & CAP_PACING) {
+                drainPacer();
+            }
             sendClose(sock, serv_addr);
             break;
         }
@@ -947,6 +1369,46 @@ int main() {
         else if (line == "/list") {
             requestList(sock, serv_addr);
         }
+        else if (line.rfind("/mtu", 0) == 0) {
+            if (line.length() > 5 && (sessionCaps & CAP_VARLEN)) {
+                // Forzar un tamaño, para comparar el rendimiento entre tamaños
+                size_t size = strtoul(line.c_str() + 5, nullptr, 10);
+                size_t limit = MAX_UDP_PAYLOAD - (sessionId ? SESSION_HEADER_SIZE : 0);
+                size = max((size_t)maxDatagramLength, min(size, limit));
+                setDatagramSize(sock, size, serv_addr);
+            } else {
+                cout << "Datagram size: " << ((sessionCaps & CAP_VARLEN) ? (size_t)datagramSize : (size_t)maxDatagramLength)
+                     << " bytes" << ((sessionCaps & CAP_VARLEN) ? "" : " (padded)") << endl;
+            }
+        }
+        else if (line == "/stats") {
+            if (sessionCaps & CAP_PACING) {
+                lock_guard<mutex> lock(pacer_mutex);
+                cout << "Session: " << pacer.summary() << endl;
+            } else {
+                cout << "Congestion control not negotiated" << endl;
+            }
+            if (sessionCaps & CAP_CRC) {
+                cout << "Integrity: " << corruptDatagrams << " corrupt datagrams, "
+                     << corruptPayloads << " corrupt messages dropped" << endl;
+            }
+            if (netsimEnabled()) {
+                cout << "Network simulator: " << netsimSummary() << endl;
+            }
+        }
+        else if (line.rfind("/fec", 0) == 0) {
+            int k = 0, m = 0;
+            if (!(sessionCaps & CAP_FEC)) {
+                cout << "FEC not negotiated" << endl;
+            } else if (line == "/fec off") {
+                setFec(sock, 0, 0, serv_addr);
+            } else if (sscanf(line.c_str(), "/fec %d %d", &k, &m) == 2 &&
+                       k >= 1 && k <= MAX_FEC_DATA && m >= 1 && m <= MAX_FEC_PARITY) {
+                setFec(sock, k, m, serv_addr);
+            } else {
+                cout << "Usage: /fec k m (1-" << MAX_FEC_DATA << " data, 1-" << MAX_FEC_PARITY << " parity) or /fec off" << endl;
+            }
+        }
         else if (line.rfind("/file ", 0) == 0) {
             size_t sp = line.find(' ', 6);
             if (sp != string::npos && sp + 1 < line.length()) {
@@ -991,7 +1453,7 @@ int main() {
             }
         }
         else {
-            cout << "Unknown command. Available: /all, /to, /list, /exit, /file, /object, /play" << endl;
+            cout << "Unknown command. Available: /all, /to, /list, /mtu, /stats, /fec, /exit, /file, /object, /play" << endl;
         }
     }
 
@@ -0,0 +1,77 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Detección de sobrecarga por tiempo de espera en cola, como CoDel: lo que
+    importa no es cuánto hay en la cola sino cuánto esperó lo que sale de
+    ella. Una ráfaga que se vacía rápido es una cola buena; si todo lo que
+    sale durante 'interval' esperó más que 'target', hay una cola que no se
+    vacía y el servidor está sobrecargado.
+
+    Mientras dura la sobrecarga se rechaza el trabajo de baja prioridad
+    (broadcasts y transferencias) con un 'E'; las jugadas y el control
+    siguen pasando. Basta que algo salga por debajo de 'target' o que la
+    cola se vacíe para volver a la normalidad.
+*/
+
+#define CODEL_TARGET std::chrono::milliseconds(20)
+#define CODEL_INTERVAL std::chrono::milliseconds(200)
+
+class CoDelMonitor {
+public:
+    typedef std::chrono::steady_clock MonitorClock;
+
+    // Tiempo de espera de un elemento que sale de la cola
+    void record(MonitorClock::duration sojourn, MonitorClock::time_point now) {
+        maxSojourn = std::max(maxSojourn, sojourn);
+        if (sojourn < CODEL_TARGET) {
+            reset();
+            return;
+        }
+        if (!above) {
+            above = true;
+            firstAbove = now;
+        } else if (!overloaded && now - firstAbove >= CODEL_INTERVAL) {
+            overloaded = true;
+            episodes++;
+        }
+    }
+
+    // La cola quedó vacía: no hay cola persistente
+    void idle() {
+        reset();
+    }
+
+    bool isOverloaded() const {
+        return overloaded;
+    }
+
+    uint64_t overloadEpisodes() const {
+        return episodes;
+    }
+
+    // Mayor espera vista desde la llamada anterior
+    MonitorClock::duration takeMaxSojourn() {
+        MonitorClock::duration taken = maxSojourn;
+        maxSojourn = MonitorClock::duration::zero();
+        return taken;
+    }
+
+private:
+    void reset() {
+        above = false;
+        overloaded = false;
+    }
+
+    bool above = false;
+    bool overloaded = false;
+    MonitorClock::time_point firstAbove;
+    MonitorClock::duration maxSojourn = MonitorClock::duration::zero();
+    uint64_t episodes = 0;
+};
+
+#endif
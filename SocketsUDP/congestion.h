@@ -0,0 +1,316 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "framing.h"
+
+/*
+    Control de congestión para fragmentos varlen (CAP_PACING).
+
+    El receptor confirma cada fragmento con un registro ACK_RECORD
+    [id (4)][índice (4)]. El emisor mantiene una ventana AIMD en fragmentos
+    (arranque lento hasta ssthresh, luego +1 por RTT, mitad ante pérdida) y
+    espacia los envíos srtt / ventana para no vaciar la ventana de golpe en
+    el buffer del receptor. Un fragmento se da por perdido si ya se
+    confirmaron DUP_THRESHOLD fragmentos enviados después de él, o si vence
+    su RTO; entonces se retransmite. Los registros de paridad FEC también se
+    confirman y cuentan en la ventana, pero no se retransmiten.
+*/
+
+#define INITIAL_WINDOW 10.0
+#define DUP_THRESHOLD 3
+#define MAX_TRANSMISSIONS 8
+#define MIN_RTO_US 20000
+#define MAX_RTO_US 2000000
+#define INITIAL_RTO_US 200000
+
+typedef std::chrono::steady_clock Clock;
+
+// ACK de un fragmento
+std::string buildAck(uint32_t messageId, uint32_t index) {
+    std::string body;
+    appendU32(body, messageId);
+    appendU32(body, index);
+
+    std::string record;
+    appendRecord(record, ACK_RECORD, body);
+    return record;
+}
+
+// Leer id e índice del registro de fragmento (o paridad) de un datagrama ya codificado
+bool fragmentKey(const std::string& datagram, uint32_t& messageId, uint32_t& index) {
+    if (datagram.size() < RECORD_HEADER_SIZE + FRAGMENT_HEADER_SIZE ||
+        (datagram[0] != FRAGMENT_RECORD && datagram[0] != PARITY_RECORD)) {
+        return false;
+    }
+    messageId = readU32(datagram, RECORD_HEADER_SIZE + 1);
+    index = readU32(datagram, RECORD_HEADER_SIZE + 5);
+    return true;
+}
+
+class PacedSender {
+public:
+    // Resúmenes de transferencias completadas (los imprime quien llama)
+    bool popCompleted(std::string& summary) {
+        if (completed.empty()) return false;
+        summary = completed.front();
+        completed.pop_front();
+        return true;
+    }
+
+    // Encolar los fragmentos de un mensaje
+    void enqueue(const std::vector<std::string>& datagrams) {
+        for (const auto& datagram : datagrams) {
+            Entry entry;
+            if (!fragmentKey(datagram, entry.messageId, entry.index)) continue;
+            entry.datagram = datagram;
+            entry.transmissions = 0;
+
+            Progress& progress = messages[entry.messageId];
+            if (progress.remaining == 0 && progress.dataSeen == 0) {
+                progress.start = Clock::now();
+            }
+            // Un mensaje reenviado en corte llega de a pocos fragmentos: se da
+            // por terminado cuando se confirmaron todos los de datos
+            if (datagram[0] == FRAGMENT_RECORD) {
+                progress.dataSeen++;
+                progress.count = readU32(datagram, RECORD_HEADER_SIZE + 9);
+            }
+            progress.remaining++;
+            progress.bytes += datagram.size();
+            pendingBytes += datagram.size();
+            queue.push_back(entry);
+        }
+    }
+
+    // Procesar un ACK
+    void onAck(uint32_t messageId, uint32_t index) {
+        Clock::time_point now = Clock::now();
+        auto it = sequenceOf.find(key(messageId, index));
+        if (it == sequenceOf.end()) return;
+
+        uint64_t seq = it->second;
+        sequenceOf.erase(it);
+        auto flight = inFlight.find(seq);
+        if (flight == inFlight.end()) return;
+
+        Entry entry = flight->second;
+        inFlight.erase(flight);
+        pendingBytes -= entry.datagram.size();
+        stats.fragmentsAcked++;
+        stats.bytesAcked += entry.datagram.size();
+
+        // Karn: solo se mide el RTT de fragmentos enviados una vez
+        if (entry.transmissions == 1) {
+            updateRtt(std::chrono::duration_cast<std::chrono::microseconds>(now - entry.sentAt).count());
+        }
+
+        if (cwnd < ssthresh) {
+            cwnd += 1.0;
+        } else {
+            cwnd += 1.0 / cwnd;
+        }
+
+        // Fragmentos enviados DUP_THRESHOLD o más envíos antes que este: perdidos
+        while (!inFlight.empty() && inFlight.begin()->first + DUP_THRESHOLD <= seq) {
+            markLost(inFlight.begin());
+        }
+
+        finishFragment(entry.messageId, true);
+    }
+
+    // Enviar lo que permitan la ventana y el ritmo. Devuelve los
+    // microsegundos hasta la próxima acción, o -1 si no queda nada.
+    long pump(const std::function<void(const std::string&)>& send) {
+        Clock::time_point now = Clock::now();
+
+        // Vencimiento de RTO (el más antiguo es el de menor secuencia). Todos
+        // los vencidos se dan por perdidos, pero el RTO se duplica una sola
+        // vez por vencimiento: una ráfaga de pérdidas no lo lleva al máximo
+        std::chrono::microseconds timeout(rto);
+        bool expired = false;
+        while (!inFlight.empty() && now >= inFlight.begin()->second.sentAt + timeout) {
+            markLost(inFlight.begin());
+            expired = true;
+        }
+        if (expired) {
+            rto = std::min((long)MAX_RTO_US, rto * 2);
+        }
+
+        while ((!retransmit.empty() || !queue.empty()) && inFlight.size() < (size_t)cwnd) {
+            if (now < nextSend) {
+                return std::chrono::duration_cast<std::chrono::microseconds>(nextSend - now).count() + 1;
+            }
+
+            std::deque<Entry>& source = retransmit.empty() ? queue : retransmit;
+            Entry entry = source.front();
+            source.pop_front();
+
+            if (entry.transmissions >= MAX_TRANSMISSIONS) {
+                pendingBytes -= entry.datagram.size();
+                stats.fragmentsDropped++;
+                finishFragment(entry.messageId, false);
+                continue;
+            }
+            if (entry.transmissions > 0) {
+                stats.retransmits++;
+                messages[entry.messageId].retransmits++;
+            }
+
+            entry.transmissions++;
+            entry.sentAt = now;
+            uint64_t seq = nextSeq++;
+            sequenceOf[key(entry.messageId, entry.index)] = seq;
+            inFlight[seq] = entry;
+
+            send(entry.datagram);
+            stats.fragmentsSent++;
+            stats.bytesSent += entry.datagram.size();
+
+            nextSend = std::max(nextSend, now) + pacingInterval(entry.datagram.size());
+        }
+
+        if (!inFlight.empty()) {
+            Clock::time_point deadline = inFlight.begin()->second.sentAt + std::chrono::microseconds(rto);
+            return std::max(0L, (long)std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count()) + 1;
+        }
+        return -1;
+    }
+
+    bool idle() const {
+        return queue.empty() && retransmit.empty() && inFlight.empty();
+    }
+
+    // Bytes encolados o sin confirmar (lo que ocupa este emisor en memoria)
+    size_t queuedBytes() const {
+        return pendingBytes;
+    }
+
+    // Tasa, RTT y pérdidas de la sesión
+    std::string summary() const {
+        double lossRate = stats.fragmentsSent ? 100.0 * stats.retransmits / stats.fragmentsSent : 0;
+        double rate = srtt > 0 ? (cwnd * averageSize() * 8.0) / srtt : 0; // Mbit/s
+        char text[256];
+        snprintf(text, sizeof(text),
+                 "rate %.1f Mbit/s, srtt %.2f ms, rttvar %.2f ms, cwnd %.1f, sent %lu, acked %lu, retransmitted %lu (%.2f%%), dropped %lu",
+                 rate, srtt / 1000.0, rttvar / 1000.0, cwnd,
+                 stats.fragmentsSent, stats.fragmentsAcked, stats.retransmits, lossRate, stats.fragmentsDropped);
+        return text;
+    }
+
+private:
+    struct Entry {
+        uint32_t messageId;
+        uint32_t index;
+        std::string datagram;
+        Clock::time_point sentAt;
+        int transmissions;
+    };
+
+    struct Progress {
+        size_t remaining = 0;
+        uint32_t dataSeen = 0;
+        uint32_t count = 0;
+        size_t bytes = 0;
+        size_t retransmits = 0;
+        bool failed = false;
+        Clock::time_point start;
+    };
+
+    struct Stats {
+        unsigned long fragmentsSent = 0;
+        unsigned long fragmentsAcked = 0;
+        unsigned long retransmits = 0;
+        unsigned long fragmentsDropped = 0;
+        unsigned long bytesSent = 0;
+        unsigned long bytesAcked = 0;
+    };
+
+    std::deque<Entry> queue;
+    std::deque<Entry> retransmit;
+    std::map<uint64_t, Entry> inFlight; // por secuencia de envío
+    std::unordered_map<uint64_t, uint64_t> sequenceOf;
+    std::map<uint32_t, Progress> messages;
+    std::deque<std::string> completed;
+    size_t pendingBytes = 0;
+    Stats stats;
+
+    double cwnd = INITIAL_WINDOW;
+    double ssthresh = 1e9;
+    long srtt = 0; // microsegundos
+    long rttvar = 0;
+    long rto = INITIAL_RTO_US;
+    uint64_t nextSeq = 0;
+    uint64_t recoverySeq = 0;
+    Clock::time_point nextSend;
+
+    static uint64_t key(uint32_t messageId, uint32_t index) {
+        return ((uint64_t)messageId << 32) | index;
+    }
+
+    double averageSize() const {
+        return stats.fragmentsSent ? (double)stats.bytesSent / stats.fragmentsSent : 0;
+    }
+
+    void updateRtt(long sample) {
+        if (srtt == 0) {
+            srtt = sample;
+            rttvar = sample / 2;
+        } else {
+            rttvar = (3 * rttvar + std::labs(srtt - sample)) / 4;
+            srtt = (7 * srtt + sample) / 8;
+        }
+        rto = std::max((long)MIN_RTO_US, std::min((long)MAX_RTO_US, srtt + 4 * rttvar));
+    }
+
+    // Espaciado entre envíos: la ventana repartida en un RTT, con 25% de margen
+    Clock::duration pacingInterval(size_t) const {
+        if (srtt == 0) return Clock::duration::zero();
+        return std::chrono::microseconds((long)(srtt / (cwnd * 1.25)));
+    }
+
+    void markLost(std::map<uint64_t, Entry>::iterator it) {
+        // Una sola reducción de ventana por ventana enviada
+        if (it->first >= recoverySeq) {
+            ssthresh = std::max(2.0, cwnd / 2);
+            cwnd = ssthresh;
+            recoverySeq = nextSeq;
+        }
+        sequenceOf.erase(key(it->second.messageId, it->second.index));
+        if (it->second.datagram[0] == PARITY_RECORD) {
+            // La paridad perdida no se reenvía: los datos se retransmiten solos
+            pendingBytes -= it->second.datagram.size();
+            finishFragment(it->second.messageId, true);
+        } else {
+            retransmit.push_back(it->second);
+        }
+        inFlight.erase(it);
+    }
+
+    void finishFragment(uint32_t messageId, bool delivered) {
+        auto it = messages.find(messageId);
+        if (it == messages.end()) return;
+
+        Progress& progress = it->second;
+        if (!delivered) progress.failed = true;
+        if (--progress.remaining > 0 || progress.dataSeen < progress.count) return;
+
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - progress.start).count();
+        char text[256];
+        snprintf(text, sizeof(text), "message %u %s: %zu bytes in %.1f ms (%.2f MB/s), %zu retransmits",
+                 messageId, progress.failed ? "incomplete" : "delivered", progress.bytes, ms,
+                 ms > 0 ? (progress.bytes / 1e6) / (ms / 1000.0) : 0, progress.retransmits);
+        completed.push_back(text);
+        messages.erase(it);
+    }
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "framing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+/*
+    Integridad CRC32C (Castagnoli) de datagramas y archivos (CAP_CRC).
+
+    Cada datagrama varlen de una sesión con CAP_CRC termina con un registro
+    CRC_RECORD [crc (4)] calculado sobre todo lo anterior; si no coincide,
+    el datagrama se descarta y se cuenta (con CAP_PACING se retransmite
+    porque no se confirma). Los sondeos de MTU ('q'/'Q') no lo llevan.
+
+    Los 'f'/'o'/'F'/'O' fragmentados llevan además, junto al fragmento 0,
+    un registro PAYLOAD_CRC_RECORD [id (4)][crc (4)] del contenido del
+    archivo u objeto (sin la cabecera, que el reenvío reescribe). El
+    receptor lo verifica a medida que el prefijo contiguo del mensaje se
+    completa.
+
+    Se usa la instrucción crc32 de SSE4.2 si el procesador la tiene, y si no
+    una tabla de 8 bytes por vuelta.
+*/
+
+#define CRC_TRAILER_SIZE (RECORD_HEADER_SIZE + 4)
+#define PAYLOAD_CRC_SIZE (RECORD_HEADER_SIZE + 8)
+// Lugar que hay que dejar en cada datagrama para ambos registros
+#define CRC_OVERHEAD (CRC_TRAILER_SIZE + PAYLOAD_CRC_SIZE)
+
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+uint32_t crc32cPortable(uint32_t crc, const unsigned char* data, size_t length) {
+    static Crc32cTables tables;
+    const uint32_t (*t)[256] = tables.table;
+
+    while (length >= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                              ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Continuar un CRC32C (empezar con crc = 0)
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+#ifdef CRC32C_X86
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32cHardware(crc, bytes, length);
+    }
+#endif
+    return ~crc32cPortable(crc, bytes, length);
+}
+
+uint32_t crc32c(const std::string& data) {
+    return crc32c(0, data.data(), data.size());
+}
+
+// Agregar el registro CRC_RECORD al final de un datagrama
+std::string sealDatagram(const std::string& datagram) {
+    std::string body;
+    appendU32(body, crc32c(datagram));
+    std::string sealed = datagram;
+    appendRecord(sealed, CRC_RECORD, body);
+    return sealed;
+}
+
+bool isProbe(const std::string& datagram) {
+    return !datagram.empty() && (datagram[0] == 'q' || datagram[0] == 'Q');
+}
+
+// Verificar y quitar el registro CRC_RECORD. Devuelve false si falta o no coincide.
+bool openDatagram(std::string& datagram) {
+    if (isProbe(datagram)) return true;
+    size_t size = datagram.size();
+    if (size < CRC_TRAILER_SIZE || datagram[size - CRC_TRAILER_SIZE] != CRC_RECORD ||
+        readU16(datagram, size - CRC_TRAILER_SIZE + 1) != 4) {
+        return false;
+    }
+    uint32_t expected = readU32(datagram, size - 4);
+    datagram.resize(size - CRC_TRAILER_SIZE);
+    return crc32c(datagram) == expected;
+}
+
+// Bytes de cabecera de un 'f'/'F'/'o'/'O' antes del contenido (0 = no se sabe aún).
+// Uno comprimido ('z'/'Z') lleva el tipo real delante y el CRC es del flujo.
+size_t payloadOffset(char type, const std::string& body) {
+    size_t offset = 0;
+    if (type == 'z' || type == 'Z') {
+        if (body.empty()) return 0;
+        type = body[0];
+        offset = 1;
+    }
+    switch (type) {
+        case 'f':
+        case 'o':
+            if (body.size() < offset + 2) return 0;
+            offset += 2 + readU16(body, offset);
+            if (body.size() < offset + 2) return 0;
+            offset += 2 + readU16(body, offset);
+            break;
+        case 'F':
+        case 'O':
+            if (body.size() < offset + 2) return 0;
+            offset += 2 + readU16(body, offset);
+            break;
+        default:
+            return 0;
+    }
+
+    if (type == 'f' || type == 'F') {
+        if (body.size() < offset + 3) return 0;
+        offset += 3 + readU24(body, offset) + 10;
+    } else {
+        offset += 4;
+    }
+    return body.size() >= offset ? offset : 0;
+}
+
+std::string buildPayloadCrc(uint32_t messageId, uint32_t crc) {
+    std::string body;
+    appendU32(body, messageId);
+    appendU32(body, crc);
+    std::string record;
+    appendRecord(record, PAYLOAD_CRC_RECORD, body);
+    return record;
+}
+
+// Agregar el CRC del contenido junto al fragmento 0 de un mensaje ya codificado
+void addPayloadCrc(std::vector<std::string>& datagrams, const std::string& message, uint32_t messageId) {
+    if (datagrams.size() < 2 || datagrams[0][0] != FRAGMENT_RECORD) return;
+    std::string body = message.substr(1);
+    size_t offset = payloadOffset(message[0], body);
+    if (offset == 0) return;
+    datagrams[0] += buildPayloadCrc(messageId, crc32c(0, body.data() + offset, body.size() - offset));
+}
+
+// Avanzar el CRC del contenido por los fragmentos contiguos ya recibidos.
+// Devuelve false si el mensaje está completo y el CRC no coincide.
+bool advancePayloadCrc(MessageReassembly& reassembly) {
+    if (!reassembly.crcExpected || reassembly.chunks.empty()) return true;
+
+    while (reassembly.crcNext < reassembly.chunks.size() && reassembly.present[reassembly.crcNext]) {
+        const std::string& chunk = reassembly.chunks[reassembly.crcNext];
+        if (reassembly.crcNext == 0) {
+            reassembly.crcSkip = payloadOffset(reassembly.messageType, chunk);
+            if (reassembly.crcSkip == 0) {
+                // La cabecera no entra en el fragmento 0: no se verifica
+                reassembly.crcExpected = false;
+                return true;
+            }
+        }
+        size_t skip = std::min(reassembly.crcSkip, chunk.size());
+        reassembly.runningCrc = crc32c(reassembly.runningCrc, chunk.data() + skip, chunk.size() - skip);
+        reassembly.crcSkip -= skip;
+        reassembly.crcNext++;
+    }
+
+    if (reassembly.crcNext < reassembly.chunks.size()) return true;
+    return reassembly.runningCrc == reassembly.expectedCrc;
+}
+
+#endif
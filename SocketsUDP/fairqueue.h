@@ -0,0 +1,124 @@
+#ifndef FAIRQUEUE_H
+#define FAIRQUEUE_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+/*
+    Cola justa por flujo (deficit round robin). Cada flujo (un cliente) tiene
+    su propia cola; en cada vuelta el flujo suma 'quantum' a su déficit y
+    sale lo que cabe en él. Así un cliente que inunda al servidor recibe la
+    misma parte que los demás y no más, y su exceso espera o se descarta en
+    su propia cola sin demorar la de los otros.
+
+    El costo de cada elemento lo elige quien encola (por ejemplo bytes más
+    un costo fijo por mensaje). Un flujo no puede tener más de 'flowLimit'
+    de costo en espera: lo que no entra se descarta y se cuenta.
+
+    No es segura entre hilos: la usa un solo hilo o quien la protege.
+*/
+
+struct FlowShare {
+    uint64_t servedCost = 0;
+    uint64_t servedItems = 0;
+    uint64_t droppedItems = 0;
+};
+
+template <typename Item>
+class FairQueue {
+public:
+    FairQueue(size_t quantum, size_t flowLimit) : quantum(quantum), flowLimit(flowLimit) {}
+
+    // Encolar en el flujo 'flow'. Devuelve false si se descartó por exceder el límite.
+    bool push(const std::string& flow, Item item, size_t cost) {
+        Flow& state = flows[flow];
+        if (!state.queue.empty() && state.queuedCost + cost > flowLimit) {
+            shares[flow].droppedItems++;
+            return false;
+        }
+        if (state.queue.empty()) {
+            active.push_back(flow);
+        }
+        state.queue.push_back({std::move(item), cost});
+        state.queuedCost += cost;
+        totalItems++;
+        return true;
+    }
+
+    bool empty() const {
+        return totalItems == 0;
+    }
+
+    size_t size() const {
+        return totalItems;
+    }
+
+    // Siguiente elemento según DRR; false si no hay nada
+    bool pop(Item& item, std::string* flowName = nullptr) {
+        while (!active.empty()) {
+            Flow& state = flows[active.front()];
+            if (!state.visited) {
+                state.deficit += quantum;
+                state.visited = true;
+            }
+
+            Entry& head = state.queue.front();
+            if (head.cost <= state.deficit) {
+                state.deficit -= head.cost;
+                state.queuedCost -= head.cost;
+                FlowShare& share = shares[active.front()];
+                share.servedCost += head.cost;
+                share.servedItems++;
+                item = std::move(head.item);
+                if (flowName != nullptr) *flowName = active.front();
+                state.queue.pop_front();
+                totalItems--;
+
+                if (state.queue.empty()) {
+                    // Un flujo vacío no guarda déficit para la próxima ráfaga
+                    flows.erase(active.front());
+                    active.pop_front();
+                }
+                return true;
+            }
+
+            // No le alcanza: sigue el próximo flujo y el déficit queda para la vuelta siguiente
+            state.visited = false;
+            active.push_back(active.front());
+            active.pop_front();
+        }
+        return false;
+    }
+
+    // Servicio por flujo desde la última llamada
+    std::map<std::string, FlowShare> takeShares() {
+        std::map<std::string, FlowShare> taken;
+        taken.swap(shares);
+        return taken;
+    }
+
+private:
+    struct Entry {
+        Item item;
+        size_t cost;
+    };
+
+    struct Flow {
+        std::deque<Entry> queue;
+        size_t queuedCost = 0;
+        size_t deficit = 0;
+        bool visited = false;
+    };
+
+    size_t quantum;
+    size_t flowLimit;
+    size_t totalItems = 0;
+    std::unordered_map<std::string, Flow> flows;
+    std::deque<std::string> active; // flujos con algo en cola, en orden de turno
+    std::map<std::string, FlowShare> shares;
+};
+
+#endif
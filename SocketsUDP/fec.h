@@ -0,0 +1,303 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "framing.h"
+
+/*
+    Corrección de errores hacia adelante para fragmentos varlen (CAP_FEC).
+
+    Los fragmentos de un mensaje se agrupan en bloques de k y a cada bloque
+    se le agregan m registros de paridad Reed-Solomon (matriz de Cauchy sobre
+    GF(256)). El receptor reconstruye hasta m fragmentos perdidos por bloque
+    sin pedir retransmisión. Con m = 1 equivale a una paridad XOR.
+
+    Registro PARITY_RECORD, misma cabecera que un fragmento:
+        [tipo][id (4)][índice (4)][total (4)][k (1)][m (1)][largos (2 × n)][paridad]
+    índice = total + bloque * m + j, y los largos son los de los n
+    fragmentos de datos del bloque (el último bloque puede tener n < k).
+
+    La proporción se elige por transferencia con /fec k m; el valor
+    (k << 8) | m viaja en la opción de sesión OPT_FEC.
+*/
+
+#define MAX_FEC_DATA 64
+#define MAX_FEC_PARITY 16
+
+// Tablas de logaritmos de GF(256), polinomio x^8 + x^4 + x^3 + x^2 + 1
+struct GaloisField {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GaloisField() {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        for (int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+    }
+};
+
+const GaloisField& galoisField() {
+    static GaloisField field;
+    return field;
+}
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    const GaloisField& gf = galoisField();
+    return gf.exp[gf.log[a] + gf.log[b]];
+}
+
+uint8_t gfInv(uint8_t a) {
+    const GaloisField& gf = galoisField();
+    return gf.exp[255 - gf.log[a]];
+}
+
+// Coeficiente de la fila de paridad j para el fragmento i del bloque:
+// 1 / (x_j + y_i) con x_j = k + j, y_i = i (la suma en GF(256) es XOR)
+uint8_t cauchyCoefficient(int k, int j, int i) {
+    return gfInv((uint8_t)((k + j) ^ i));
+}
+
+// dst ^= c * src (src puede ser más corto: se completa con ceros)
+void gfMulAdd(std::string& dst, const std::string& src, uint8_t c) {
+    if (c == 0) return;
+    size_t n = std::min(dst.size(), src.size());
+    if (c == 1) {
+        for (size_t i = 0; i < n; i++) dst[i] ^= src[i];
+        return;
+    }
+    const GaloisField& gf = galoisField();
+    int logC = gf.log[c];
+    for (size_t i = 0; i < n; i++) {
+        uint8_t s = src[i];
+        if (s) dst[i] ^= gf.exp[gf.log[s] + logC];
+    }
+}
+
+void gfScale(std::string& data, uint8_t c) {
+    if (c == 1) return;
+    for (auto& byte : data) {
+        byte = gfMul(byte, c);
+    }
+}
+
+// Bytes extra de un registro de paridad respecto de un fragmento. Los
+// fragmentos se cortan más chicos para que la paridad quepa en el datagrama.
+size_t fecOverhead(int k) {
+    return 2 + 2 * k;
+}
+
+// Paridad de un bloque calculada a medida que llegan sus fragmentos
+struct ParityBlock {
+    std::vector<std::string> rows;
+    std::vector<uint16_t> lengths;
+    uint32_t filled = 0;
+};
+
+// Sumar el fragmento i (de n) del bloque; devuelve true cuando están todos
+bool accumulateParity(ParityBlock& block, int k, int m, uint32_t n, uint32_t i, const std::string& chunk) {
+    if (block.rows.empty()) {
+        block.rows.resize(m);
+        block.lengths.resize(n, 0);
+    }
+    for (int j = 0; j < m; j++) {
+        if (block.rows[j].size() < chunk.size()) {
+            block.rows[j].resize(chunk.size(), '\0');
+        }
+        gfMulAdd(block.rows[j], chunk, cauchyCoefficient(k, j, i));
+    }
+    block.lengths[i] = chunk.size();
+    return ++block.filled == n;
+}
+
+// Registros PARITY_RECORD de un bloque completo
+std::vector<std::string> parityRecords(const ParityBlock& block, char messageType, uint32_t messageId,
+                                       uint32_t count, uint32_t blockIndex, int k, int m) {
+    std::vector<std::string> records;
+    for (int j = 0; j < m; j++) {
+        std::string body;
+        body.push_back(messageType);
+        appendU32(body, messageId);
+        appendU32(body, count + blockIndex * m + j);
+        appendU32(body, count);
+        body.push_back((char)k);
+        body.push_back((char)m);
+        for (uint16_t length : block.lengths) {
+            appendU16(body, length);
+        }
+        body += block.rows[j];
+
+        std::string datagram;
+        appendRecord(datagram, PARITY_RECORD, body);
+        records.push_back(datagram);
+    }
+    return records;
+}
+
+// Agregar los registros de paridad de cada bloque a continuación de sus datos
+std::vector<std::string> addParity(const std::vector<std::string>& datagrams, int k, int m) {
+    if (k <= 0 || m <= 0 || datagrams.size() < 2) return datagrams;
+
+    std::vector<std::string> output;
+    uint32_t count = datagrams.size();
+
+    for (uint32_t base = 0; base < count; base += k) {
+        uint32_t n = std::min((uint32_t)k, count - base);
+        ParityBlock block;
+        for (uint32_t i = 0; i < n; i++) {
+            const std::string& datagram = datagrams[base + i];
+            output.push_back(datagram);
+            accumulateParity(block, k, m, n, i, datagram.substr(RECORD_HEADER_SIZE + FRAGMENT_HEADER_SIZE));
+        }
+
+        const std::string& first = datagrams[base];
+        std::vector<std::string> parity = parityRecords(block, first[RECORD_HEADER_SIZE],
+                                                        readU32(first, RECORD_HEADER_SIZE + 1),
+                                                        count, base / k, k, m);
+        output.insert(output.end(), parity.begin(), parity.end());
+    }
+
+    return output;
+}
+
+struct ParityHeader {
+    char messageType;
+    uint32_t messageId;
+    uint32_t index;
+    uint32_t count;
+    int k;
+    int m;
+    uint32_t block;
+    int row;
+    std::vector<uint16_t> lengths;
+};
+
+bool parseParity(const std::string& body, ParityHeader& header, std::string& parity) {
+    if (body.size() < FRAGMENT_HEADER_SIZE + 2) return false;
+    header.messageType = body[0];
+    header.messageId = readU32(body, 1);
+    header.index = readU32(body, 5);
+    header.count = readU32(body, 9);
+    header.k = (unsigned char)body[13];
+    header.m = (unsigned char)body[14];
+    if (header.count == 0 || header.count > MAX_FRAGMENTS || header.index < header.count ||
+        header.k < 1 || header.k > MAX_FEC_DATA || header.m < 1 || header.m > MAX_FEC_PARITY) {
+        return false;
+    }
+
+    header.block = (header.index - header.count) / header.m;
+    header.row = (header.index - header.count) % header.m;
+    if ((uint64_t)header.block * header.k >= header.count) return false;
+
+    uint32_t n = std::min((uint32_t)header.k, header.count - header.block * header.k);
+    size_t offset = FRAGMENT_HEADER_SIZE + 2;
+    if (body.size() < offset + 2 * n) return false;
+    header.lengths.clear();
+    for (uint32_t i = 0; i < n; i++) {
+        header.lengths.push_back(readU16(body, offset + 2 * i));
+    }
+    parity = body.substr(offset + 2 * n);
+    return true;
+}
+
+// Reconstruir los fragmentos que faltan en un bloque si hay suficiente
+// paridad. Devuelve los índices recuperados.
+std::vector<uint32_t> recoverBlock(MessageReassembly& reassembly, uint32_t block) {
+    std::vector<uint32_t> recovered;
+    auto parityIt = reassembly.parity.find(block);
+    if (parityIt == reassembly.parity.end()) return recovered;
+
+    int k = reassembly.fecData;
+    uint32_t base = block * k;
+    const std::vector<uint16_t>& lengths = reassembly.shardLengths[block];
+
+    std::vector<uint32_t> missing;
+    for (uint32_t i = 0; i < lengths.size(); i++) {
+        if (!reassembly.present[base + i]) missing.push_back(i);
+    }
+    const std::map<int, std::string>& rows = parityIt->second;
+    if (missing.empty() || rows.size() < missing.size()) return recovered;
+
+    // Sistema A x = b con una ecuación por fila de paridad disponible
+    size_t e = missing.size();
+    std::vector<std::vector<uint8_t>> a(e, std::vector<uint8_t>(e));
+    std::vector<std::string> b;
+    auto row = rows.begin();
+    for (size_t r = 0; r < e; r++, row++) {
+        std::string rhs = row->second;
+        for (uint32_t i = 0; i < lengths.size(); i++) {
+            if (reassembly.present[base + i]) {
+                gfMulAdd(rhs, reassembly.chunks[base + i], cauchyCoefficient(k, row->first, i));
+            }
+        }
+        for (size_t c = 0; c < e; c++) {
+            a[r][c] = cauchyCoefficient(k, row->first, missing[c]);
+        }
+        b.push_back(rhs);
+    }
+
+    // Gauss-Jordan (toda submatriz de Cauchy es invertible)
+    for (size_t c = 0; c < e; c++) {
+        size_t pivot = c;
+        while (a[pivot][c] == 0) pivot++;
+        std::swap(a[pivot], a[c]);
+        std::swap(b[pivot], b[c]);
+
+        uint8_t inverse = gfInv(a[c][c]);
+        for (auto& value : a[c]) value = gfMul(value, inverse);
+        gfScale(b[c], inverse);
+
+        for (size_t r = 0; r < e; r++) {
+            uint8_t factor = a[r][c];
+            if (r == c || factor == 0) continue;
+            for (size_t col = 0; col < e; col++) {
+                a[r][col] ^= gfMul(factor, a[c][col]);
+            }
+            gfMulAdd(b[r], b[c], factor);
+        }
+    }
+
+    for (size_t c = 0; c < e; c++) {
+        uint32_t index = base + missing[c];
+        reassembly.chunks[index] = b[c].substr(0, lengths[missing[c]]);
+        reassembly.present[index] = true;
+        reassembly.received++;
+        reassembly.receivedBytes += reassembly.chunks[index].size();
+        reassembly.recovered++;
+        recovered.push_back(index);
+    }
+    reassembly.parity.erase(parityIt);
+    return recovered;
+}
+
+// Guardar un registro de paridad e intentar recuperar su bloque
+std::vector<uint32_t> addParityRecord(MessageReassembly& reassembly, const ParityHeader& header, const std::string& parity) {
+    startReassembly(reassembly, header.messageType, header.count);
+    if (reassembly.chunks.size() != header.count ||
+        (reassembly.fecData != 0 && reassembly.fecData != header.k)) {
+        return std::vector<uint32_t>();
+    }
+    reassembly.fecData = header.k;
+    reassembly.shardLengths[header.block] = header.lengths;
+    reassembly.parity[header.block][header.row] = parity;
+    return recoverBlock(reassembly, header.block);
+}
+
+// Tras llegar un fragmento de datos, puede que su bloque ya tenga paridad suficiente
+std::vector<uint32_t> recoverAfterFragment(MessageReassembly& reassembly, uint32_t index) {
+    if (reassembly.fecData == 0) return std::vector<uint32_t>();
+    return recoverBlock(reassembly, index / reassembly.fecData);
+}
+
+#endif
@@ -0,0 +1,538 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <arpa/inet.h>
+#include "lz.h"
+
+/*
+    Formato padded (clientes antiguos):
+        mensaje simple:  [tipo][campos...] rellenado con '#' hasta maxDatagramLength
+        fragmento:       [num][cabecera][tamaño?][datos] rellenado con '#'
+
+    Formato varlen (negociado con CAP_VARLEN en el handshake):
+        datagrama = uno o más registros [tipo][largo (2 bytes)][cuerpo]
+        mensaje simple:  tipo = tipo del mensaje, cuerpo = campos sin relleno
+        fragmento:       tipo = FRAGMENT_RECORD,
+                         cuerpo = [tipo][id (4)][índice (4)][total (4)][datos]
+
+    Handshake:
+        n + largo + nickname + 'c' + caps (2 bytes)   (cliente → servidor)
+        N + caps aceptadas (2 bytes) [+ sesión (4)] [+ grupo (4) + puerto (2)]
+          [+ token (8)]                                (servidor → cliente)
+
+    Sesión (CAP_SESSION): todo datagrama posterior del cliente empieza con
+        SESSION_MARKER + id de sesión (4)
+    y el servidor identifica al cliente por ese id, no por su dirección.
+    El id es aleatorio y el token secreto solo viaja en la respuesta al
+    handshake.
+
+    Cambio de dirección (NAT, cambio de puerto): el servidor descarta lo que
+    llega con el id desde otra dirección y le envía un desafío; solo mueve
+    la sesión cuando esa dirección lo responde con el token:
+        K + desafío (8)                                (servidor → nueva dirección)
+        SESSION_MARKER + id (4) + k + desafío (8) + token (8)
+                                                       (cliente → servidor, sin CRC)
+
+    Multicast (CAP_MULTICAST, opcional en el servidor): el cliente se une al
+    grupo del handshake y los 'M' llegan una sola vez al grupo, como un
+    datagrama varlen de un registro. Cada cliente descarta sus propios 'M'.
+
+    Sondeo de MTU (CAP_PMTU, registros varlen con DF activado):
+        q + tamaño (4) + relleno hasta 'tamaño' bytes  (cliente → servidor)
+        Q + tamaño (4) + relleno hasta 'tamaño' bytes  (servidor → cliente)
+        u + opción (1) + valor (4)                     (cliente → servidor)
+
+    Confirmaciones (CAP_PACING, ver congestion.h):
+        registro ACK_RECORD, cuerpo = [id (4)][índice (4)] por fragmento recibido
+
+    Paridad (CAP_FEC, ver fec.h):
+        registro PARITY_RECORD por cada m fragmentos de paridad de un bloque de k
+
+    Latido (CAP_HEARTBEAT):
+        h                                              (cliente → servidor)
+    cada HEARTBEAT_INTERVAL; sin datagramas durante SESSION_TIMEOUT el
+    servidor da la sesión por caída.
+
+    Integridad (CAP_CRC, ver crc32c.h):
+        registro CRC_RECORD al final de cada datagrama y PAYLOAD_CRC_RECORD
+        con el CRC del contenido de un archivo u objeto fragmentado
+
+    Compresión (CAP_COMPRESS, ver lz.h):
+        z + mensaje 'f', 'o', 'm' o 't'                (cliente → servidor)
+        Z + mensaje 'F' u 'O'                          (servidor → cliente)
+    el mensaje interno va igual pero su contenido es un flujo comprimido y
+    el campo de tamaño es el largo del flujo. El cliente solo comprime lo
+    que achica; el servidor reenvía en corte con 'Z' a quien lo negoció y
+    descomprime para los demás.
+*/
+
+#define CAP_VARLEN 0x0001
+#define CAP_PMTU   0x0002
+#define CAP_PACING 0x0004
+#define CAP_FEC    0x0008
+#define CAP_SESSION 0x0010
+#define CAP_MULTICAST 0x0020
+#define CAP_CRC    0x0040
+#define CAP_HEARTBEAT 0x0080
+#define CAP_COMPRESS 0x0100
+
+// Opciones de sesión del registro 'u'
+#define OPT_DATAGRAM_SIZE 1
+#define OPT_FEC 2
+#define OPT_MULTICAST 3
+
+#define MAX_UDP_PAYLOAD 65507
+
+// Segundos entre latidos del cliente (CAP_HEARTBEAT)
+#define HEARTBEAT_INTERVAL 10
+
+#define CAPS_MARKER 'c'
+#define SESSION_MARKER ((char)0xFE)
+#define SESSION_HEADER_SIZE 5
+#define CHALLENGE_SIZE 8
+#define SESSION_ANSWER_SIZE (SESSION_HEADER_SIZE + 1 + 2 * CHALLENGE_SIZE)
+#define FRAGMENT_RECORD 0x01
+#define ACK_RECORD 0x02
+#define PARITY_RECORD 0x03
+#define CRC_RECORD 0x04
+#define PAYLOAD_CRC_RECORD 0x05
+#define RECORD_HEADER_SIZE 3
+#define FRAGMENT_HEADER_SIZE 13
+#define MAX_FRAGMENTS (1u << 20)
+
+int maxDatagramLength = 777;
+
+uint16_t readU16(const std::string& data, size_t offset) {
+    return ((unsigned char)data[offset] << 8) | (unsigned char)data[offset + 1];
+}
+
+uint32_t readU24(const std::string& data, size_t offset) {
+    return ((unsigned char)data[offset] << 16) |
+           ((unsigned char)data[offset + 1] << 8) |
+           (unsigned char)data[offset + 2];
+}
+
+uint32_t readU32(const std::string& data, size_t offset) {
+    return ((uint32_t)(unsigned char)data[offset] << 24) |
+           ((unsigned char)data[offset + 1] << 16) |
+           ((unsigned char)data[offset + 2] << 8) |
+           (unsigned char)data[offset + 3];
+}
+
+void appendU16(std::string& data, uint16_t value) {
+    data.push_back((value >> 8) & 0xFF);
+    data.push_back(value & 0xFF);
+}
+
+void appendU32(std::string& data, uint32_t value) {
+    data.push_back((value >> 24) & 0xFF);
+    data.push_back((value >> 16) & 0xFF);
+    data.push_back((value >> 8) & 0xFF);
+    data.push_back(value & 0xFF);
+}
+
+// Función para completar datagramas
+std::string completeDatagram(std::string &packet) {
+    size_t len = packet.size();
+    if (len < (size_t)maxDatagramLength) {
+        packet.append(maxDatagramLength - len, '#');
+    }
+    return packet;
+}
+
+// Función para fragmentar datagramas grandes
+std::vector<std::string> fragmentDatagram(const std::string &header, const std::string &data, int sizeFieldBytes) {
+    std::vector<std::string> datagrams;
+
+    size_t overhead = 1 + header.size() + sizeFieldBytes;
+    size_t maxDataPerPacket = maxDatagramLength - overhead;
+    size_t offset = 0;
+    int numPacket = 1;
+
+    while (offset < data.size()) {
+        size_t remaining = data.size() - offset;
+        size_t chunkSize = std::min(remaining, maxDataPerPacket);
+        bool isLast = (offset + chunkSize >= data.size());
+
+        std::string fragment;
+        fragment.push_back(isLast ? 0 : (char)numPacket);
+
+        fragment += header;
+
+        uint32_t len = (uint32_t)chunkSize;
+        for (int i = sizeFieldBytes - 1; i >= 0; --i)
+            fragment.push_back((len >> (8 * i)) & 0xFF);
+
+        fragment += data.substr(offset, chunkSize);
+
+        if (fragment.size() < (size_t)maxDatagramLength)
+            fragment = completeDatagram(fragment);
+
+        datagrams.push_back(fragment);
+        offset += chunkSize;
+        numPacket++;
+    }
+
+    return datagrams;
+}
+
+// Largo de la cabecera que el formato padded repite en cada fragmento.
+// Devuelve 0 para los tipos que nunca se fragmentan.
+size_t legacyHeaderLength(const std::string& message, int& sizeFieldBytes) {
+    size_t offset = 1;
+    sizeFieldBytes = 0;
+
+    switch (message[0]) {
+        case 'E':
+            sizeFieldBytes = 3;
+            return 1;
+        case 'M':
+        case 'T':
+        case 'm':
+            sizeFieldBytes = 3;
+            return 3 + readU16(message, 1);
+        case 't':
+            offset += 2 + readU16(message, offset);
+            sizeFieldBytes = 3;
+            return offset + 2 + readU16(message, offset);
+        case 'F':
+            offset += 2 + readU16(message, offset);
+            return offset + 3 + readU24(message, offset) + 10;
+        case 'f':
+            offset += 2 + readU16(message, offset);
+            offset += 2 + readU16(message, offset);
+            return offset + 3 + readU24(message, offset) + 10;
+        case 'O':
+            return 3 + readU16(message, 1) + 4;
+        case 'o':
+            offset += 2 + readU16(message, offset);
+            return offset + 2 + readU16(message, offset) + 4;
+        case 'B':
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Codificar un mensaje completo (tipo + campos) en el formato padded
+std::vector<std::string> encodeLegacy(const std::string& message) {
+    std::vector<std::string> packets;
+    int sizeFieldBytes = 0;
+    size_t headerLength = 0;
+
+    if (message.size() > (size_t)maxDatagramLength) {
+        headerLength = legacyHeaderLength(message, sizeFieldBytes);
+    }
+
+    if (headerLength == 0) {
+        std::string packet = message;
+        packets.push_back(completeDatagram(packet));
+        return packets;
+    }
+
+    return fragmentDatagram(message.substr(0, headerLength),
+                            message.substr(headerLength + sizeFieldBytes),
+                            sizeFieldBytes);
+}
+
+// Campo de tamaño del contenido de un mensaje que puede ir comprimido:
+// posición en 'message' (que empieza con el tipo) y ancho en bytes. Los
+// campos anteriores son cadenas con su largo delante.
+bool contentSizeField(const std::string& message, size_t& offset, int& width) {
+    std::vector<int> strings;
+    switch (message.empty() ? 0 : message[0]) {
+        case 'm': case 'M': case 'T': strings = {2}; width = 3; break;
+        case 't': strings = {2, 2}; width = 3; break;
+        case 'f': strings = {2, 2, 3}; width = 10; break;
+        case 'F': strings = {2, 3}; width = 10; break;
+        case 'o': strings = {2, 2}; width = 4; break;
+        case 'O': strings = {2}; width = 4; break;
+        default: return false;
+    }
+    offset = 1;
+    for (int prefix : strings) {
+        if (message.size() < offset + prefix) return false;
+        offset += prefix + (prefix == 2 ? readU16(message, offset) : readU24(message, offset));
+    }
+    return message.size() >= offset + width;
+}
+
+uint64_t readSizeField(const std::string& message, size_t offset, int width) {
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++) {
+        value = (value << 8) | (unsigned char)message[offset + i];
+    }
+    return value;
+}
+
+void appendSizeField(std::string& message, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        message.push_back(i < 8 ? (value >> (i * 8)) & 0xFF : 0);
+    }
+}
+
+// 'z' + el mensaje con su contenido comprimido; vacío si el tipo no se
+// comprime, el contenido es chico o no achica (una imagen, un zip)
+std::string compressMessage(const std::string& message) {
+    size_t offset;
+    int width;
+    if (!contentSizeField(message, offset, width)) return "";
+    size_t start = offset + width;
+    if (message.size() - start < LZ_MIN_SIZE) return "";
+
+    std::string stream = lzCompress(message.data() + start, message.size() - start);
+    if (stream.size() >= message.size() - start) return "";
+    std::string compressed = "z";
+    compressed.reserve(1 + start + stream.size());
+    compressed.append(message, 0, offset);
+    appendSizeField(compressed, stream.size(), width);
+    compressed += stream;
+    return compressed;
+}
+
+// Tamaño que tendrá el contenido de un mensaje comprimido ('body' sin la
+// 'z'/'Z'), para reservar memoria antes de descomprimirlo
+bool expandedSize(const std::string& body, uint64_t& size) {
+    size_t offset;
+    int width;
+    if (!contentSizeField(body, offset, width) || body.size() < offset + width + LZ_HEADER_SIZE) return false;
+    size = readSizeField(body, offset + width, LZ_HEADER_SIZE);
+    return true;
+}
+
+// El mensaje original de uno comprimido ('body' sin la 'z'/'Z'). false si
+// el flujo es inválido, el contenido pasa de 'limit' o no entra en su
+// campo de tamaño.
+bool expandMessage(const std::string& body, std::string& message, uint64_t limit) {
+    size_t offset;
+    int width;
+    if (!contentSizeField(body, offset, width)) return false;
+    size_t start = offset + width;
+    uint64_t length = readSizeField(body, offset, width);
+    if (body.size() - start < length) return false;
+
+    std::string content;
+    if (width < 8) {
+        limit = std::min(limit, (uint64_t)((1ull << (width * 8)) - 1));
+    }
+    if (!lzDecompress(body.data() + start, length, content, limit)) return false;
+    message.assign(body, 0, offset);
+    appendSizeField(message, content.size(), width);
+    message += content;
+    return true;
+}
+
+// Anteponer el id de sesión a un datagrama del cliente (0 = sin sesión)
+std::string withSession(uint32_t sessionId, const std::string& datagram) {
+    if (sessionId == 0) return datagram;
+    std::string prefixed;
+    prefixed.reserve(SESSION_HEADER_SIZE + datagram.size());
+    prefixed.push_back(SESSION_MARKER);
+    appendU32(prefixed, sessionId);
+    prefixed += datagram;
+    return prefixed;
+}
+
+void appendRecord(std::string& datagram, char type, const std::string& body) {
+    datagram.push_back(type);
+    appendU16(datagram, (uint16_t)body.size());
+    datagram += body;
+}
+
+// Registro de sondeo de exactamente 'size' bytes ('q' o 'Q')
+std::string buildProbe(char type, uint32_t size) {
+    std::string body;
+    appendU32(body, size);
+    body.append(size - RECORD_HEADER_SIZE - 4, '\0');
+
+    std::string datagram;
+    appendRecord(datagram, type, body);
+    return datagram;
+}
+
+// Registro de fragmento con id, índice y total explícitos
+std::string buildFragment(char messageType, uint32_t messageId, uint32_t index, uint32_t count, const std::string& chunk) {
+    std::string body;
+    body.push_back(messageType);
+    appendU32(body, messageId);
+    appendU32(body, index);
+    appendU32(body, count);
+    body += chunk;
+
+    std::string datagram;
+    appendRecord(datagram, FRAGMENT_RECORD, body);
+    return datagram;
+}
+
+// Codificar un mensaje completo en el formato varlen: un solo registro si
+// cabe en el datagrama, si no fragmentos con id, índice y total explícitos
+std::vector<std::string> encodeVarlen(const std::string& message, uint32_t messageId, size_t datagramSize) {
+    std::vector<std::string> datagrams;
+
+    if (message.size() - 1 + RECORD_HEADER_SIZE <= datagramSize) {
+        std::string datagram;
+        appendRecord(datagram, message[0], message.substr(1));
+        datagrams.push_back(datagram);
+        return datagrams;
+    }
+
+    size_t chunkSize = datagramSize - RECORD_HEADER_SIZE - FRAGMENT_HEADER_SIZE;
+    size_t dataSize = message.size() - 1;
+    uint32_t count = (dataSize + chunkSize - 1) / chunkSize;
+
+    for (uint32_t index = 0; index < count; index++) {
+        size_t offset = 1 + index * chunkSize;
+        datagrams.push_back(buildFragment(message[0], messageId, index, count,
+                                          message.substr(offset, std::min(chunkSize, message.size() - offset))));
+    }
+
+    return datagrams;
+}
+
+struct Record {
+    char type;
+    std::string body;
+};
+
+// Separar un datagrama varlen en sus registros
+bool parseRecords(const std::string& datagram, std::vector<Record>& records) {
+    size_t offset = 0;
+    while (offset < datagram.size()) {
+        if (datagram.size() < offset + RECORD_HEADER_SIZE) return false;
+        char type = datagram[offset];
+        uint16_t len = readU16(datagram, offset + 1);
+        offset += RECORD_HEADER_SIZE;
+
+        if (datagram.size() < offset + len) return false;
+        records.push_back({type, datagram.substr(offset, len)});
+        offset += len;
+    }
+    return true;
+}
+
+struct FragmentHeader {
+    char messageType;
+    uint32_t messageId;
+    uint32_t index;
+    uint32_t count;
+};
+
+bool parseFragment(const std::string& body, FragmentHeader& header, std::string& chunk) {
+    if (body.size() < FRAGMENT_HEADER_SIZE) return false;
+    header.messageType = body[0];
+    header.messageId = readU32(body, 1);
+    header.index = readU32(body, 5);
+    header.count = readU32(body, 9);
+    if (header.count == 0 || header.count > MAX_FRAGMENTS || header.index >= header.count) return false;
+    chunk = body.substr(FRAGMENT_HEADER_SIZE);
+    return true;
+}
+
+// Estructura para reconstrucción de mensajes varlen (por índice, admite desorden)
+struct MessageReassembly {
+    char messageType;
+    uint32_t received;
+    std::vector<std::string> chunks;
+    std::vector<bool> present;
+    size_t receivedBytes;
+    time_t lastFragmentTime;
+    std::chrono::steady_clock::time_point startTime;
+
+    // FEC: paridad recibida por bloque y fila, y largos de los fragmentos del bloque
+    int fecData;
+    uint32_t recovered;
+    std::map<uint32_t, std::map<int, std::string>> parity;
+    std::map<uint32_t, std::vector<uint16_t>> shardLengths;
+
+    // CRC del contenido: esperado, y calculado hasta el fragmento crcNext
+    bool crcExpected;
+    uint32_t expectedCrc;
+    uint32_t runningCrc;
+    uint32_t crcNext;
+    size_t crcSkip;
+};
+
+void startReassembly(MessageReassembly& reassembly, char messageType, uint32_t count) {
+    if (reassembly.chunks.empty()) {
+        reassembly.messageType = messageType;
+        reassembly.received = 0;
+        reassembly.receivedBytes = 0;
+        reassembly.startTime = std::chrono::steady_clock::now();
+        reassembly.chunks.resize(count);
+        reassembly.present.resize(count, false);
+        reassembly.fecData = 0;
+        reassembly.recovered = 0;
+    }
+    reassembly.lastFragmentTime = time(nullptr);
+}
+
+bool isComplete(const MessageReassembly& reassembly) {
+    return !reassembly.chunks.empty() && reassembly.received == reassembly.chunks.size();
+}
+
+// Guardar un fragmento; devuelve true cuando ya llegaron todos
+bool addFragment(MessageReassembly& reassembly, const FragmentHeader& header, const std::string& chunk) {
+    startReassembly(reassembly, header.messageType, header.count);
+
+    if (header.index >= reassembly.chunks.size() || reassembly.present[header.index]) {
+        return false;
+    }
+    reassembly.chunks[header.index] = chunk;
+    reassembly.present[header.index] = true;
+    reassembly.received++;
+    reassembly.receivedBytes += chunk.size();
+    return isComplete(reassembly);
+}
+
+// Resumen de la transferencia para comparar tamaños de datagrama
+std::string transferSummary(const MessageReassembly& reassembly) {
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - reassembly.startTime).count();
+    double mbps = ms > 0 ? (reassembly.receivedBytes / 1e6) / (ms / 1000.0) : 0;
+    char summary[192];
+    snprintf(summary, sizeof(summary), "%zu bytes in %zu fragments (%u recovered by FEC), %.1f ms, %.2f MB/s",
+             reassembly.receivedBytes, reassembly.chunks.size(), reassembly.recovered, ms, mbps);
+    return summary;
+}
+
+// Mensajes ya reconstruidos, para no volver a abrir una reconstrucción
+// con un fragmento retransmitido que llega tarde
+class CompletedMessages {
+public:
+    bool contains(const std::string& key) const {
+        return ids.count(key) > 0;
+    }
+
+    void insert(const std::string& key) {
+        if (!ids.insert(key).second) return;
+        order.push_back(key);
+        if (order.size() > 4096) {
+            ids.erase(order.front());
+            order.pop_front();
+        }
+    }
+
+private:
+    std::deque<std::string> order;
+    std::unordered_set<std::string> ids;
+};
+
+std::string joinFragments(const MessageReassembly& reassembly) {
+    std::string fullData;
+    for (const auto& chunk : reassembly.chunks) {
+        fullData += chunk;
+    }
+    return fullData;
+}
+
+#endif
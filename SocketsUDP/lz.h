@@ -0,0 +1,371 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/*
+    Compresión LZ rápida para el contenido de archivos, objetos y mensajes
+    largos (de la familia LZ4: solo literales y copias hacia atrás, sin
+    entropía, así comprimir y descomprimir cuestan poco más que copiar).
+
+    Flujo comprimido:
+        [tamaño original (8)] y un bloque por cada LZ_BLOCK_SIZE bytes
+        originales (el último puede ser menor):
+            [largo (4), bit alto = LZ_STORED][datos]
+        un bloque LZ_STORED va tal cual, sin comprimir
+
+    Cada bloque se comprime por separado, así se codifica y decodifica de a
+    partes (LzDecoder) sin tener el contenido entero. Un bloque que no
+    achica al menos 1/16 se guarda tal cual; tras varios así seguidos (una
+    imagen, un zip) los siguientes se guardan sin intentar, y se vuelve a
+    probar cada tanto.
+
+    Bloque comprimido: secuencias
+        [token: literales (4 bits) | copia - 4 (4 bits)]
+        [más literales: bytes de 255 y uno menor, si el campo es 15]
+        [literales]
+        [distancia (2, little endian)][más largo de copia, ídem]
+    la última secuencia lleva solo literales.
+*/
+
+#define LZ_BLOCK_SIZE (64 * 1024)
+#define LZ_HEADER_SIZE 8
+#define LZ_BLOCK_HEADER_SIZE 4
+#define LZ_STORED 0x80000000u
+#define LZ_MIN_SIZE 256   // contenidos más chicos no se comprimen
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 16
+#define LZ_MAX_SKIP 16    // bloques guardados sin intentar, como máximo
+
+// Peor caso de un bloque comprimido de 'length' bytes
+size_t lzBlockBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+uint32_t lzRead32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+uint32_t lzHash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+unsigned char* lzWriteLength(unsigned char* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Comprimir un bloque de hasta LZ_BLOCK_SIZE bytes en 'out' (lugar para
+// lzBlockBound(length)); devuelve el largo comprimido
+size_t lzCompressBlock(const char* data, size_t length, char* out) {
+    const unsigned char* src = (const unsigned char*)data;
+    const unsigned char* end = src + length;
+    const unsigned char* anchor = src;
+    unsigned char* op = (unsigned char*)out;
+    uint16_t table[1 << LZ_HASH_BITS] = {};
+
+    if (length > LZ_MIN_MATCH + 8) {
+        const unsigned char* limit = end - LZ_MIN_MATCH;
+        const unsigned char* p = src;
+        while (p < limit) {
+            uint32_t value = lzRead32(p);
+            uint32_t h = lzHash(value);
+            const unsigned char* candidate = src + table[h];
+            table[h] = (uint16_t)(p - src);
+            if (candidate >= p || lzRead32(candidate) != value) {
+                // Sin coincidencias se avanza más rápido (datos que no comprimen)
+                p += 1 + ((p - anchor) >> 6);
+                continue;
+            }
+
+            size_t match = LZ_MIN_MATCH;
+            while (p + match < end && candidate[match] == p[match]) {
+                match++;
+            }
+            while (p > anchor && candidate > src && p[-1] == candidate[-1]) {
+                p--;
+                candidate--;
+                match++;
+            }
+
+            size_t literals = p - anchor;
+            unsigned char* token = op++;
+            *token = (unsigned char)((std::min(literals, (size_t)15) << 4) | std::min(match - LZ_MIN_MATCH, (size_t)15));
+            if (literals >= 15) op = lzWriteLength(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            uint16_t distance = (uint16_t)(p - candidate);
+            *op++ = distance & 0xFF;
+            *op++ = distance >> 8;
+            if (match - LZ_MIN_MATCH >= 15) op = lzWriteLength(op, match - LZ_MIN_MATCH - 15);
+
+            p += match;
+            anchor = p;
+            if (p < limit) {
+                table[lzHash(lzRead32(p - 2))] = (uint16_t)(p - 2 - src);
+            }
+        }
+    }
+
+    size_t literals = end - anchor;
+    *op++ = (unsigned char)(std::min(literals, (size_t)15) << 4);
+    if (literals >= 15) op = lzWriteLength(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - (unsigned char*)out;
+}
+
+// Descomprimir un bloque que debe dar exactamente 'rawLength' bytes.
+// Verifica todos los largos y distancias: el bloque puede venir de la red.
+bool lzDecompressBlock(const char* data, size_t length, char* out, size_t rawLength) {
+    const unsigned char* ip = (const unsigned char*)data;
+    const unsigned char* iend = ip + length;
+    unsigned char* op = (unsigned char*)out;
+    unsigned char* oend = op + rawLength;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned char b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return false;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == iend) break; // última secuencia
+
+        if (iend - ip < 2) return false;
+        size_t distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > (size_t)(op - (unsigned char*)out)) return false;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            unsigned char b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (match > (size_t)(oend - op)) return false;
+
+        const unsigned char* from = op - distance;
+        if (distance >= match) {
+            memcpy(op, from, match);
+            op += match;
+        } else {
+            // La copia se superpone con lo que escribe (repeticiones): de a
+            // lo ya escrito, que se duplica en cada vuelta
+            while (match > 0) {
+                size_t n = std::min(match, (size_t)(op - from));
+                memcpy(op, from, n);
+                op += n;
+                match -= n;
+            }
+        }
+    }
+    return op == oend;
+}
+
+void lzAppendU32(std::string& out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+// Codificador de un flujo, de a bloques: la cabecera con el tamaño total y
+// después cada bloque a medida que se tiene
+class LzEncoder {
+public:
+    explicit LzEncoder(uint64_t rawSize) : rawSize(rawSize) {}
+
+    void header(std::string& out) {
+        for (int i = 7; i >= 0; i--) {
+            out.push_back((rawSize >> (i * 8)) & 0xFF);
+        }
+    }
+
+    // Agregar a 'out' un bloque de hasta LZ_BLOCK_SIZE bytes
+    void block(const char* data, size_t length, std::string& out) {
+        if (skip == 0) {
+            size_t start = out.size();
+            out.resize(start + LZ_BLOCK_HEADER_SIZE + lzBlockBound(length));
+            size_t compressed = lzCompressBlock(data, length, &out[start + LZ_BLOCK_HEADER_SIZE]);
+            if (compressed < length - length / 16) {
+                for (int i = 0; i < LZ_BLOCK_HEADER_SIZE; i++) {
+                    out[start + i] = (compressed >> ((LZ_BLOCK_HEADER_SIZE - 1 - i) * 8)) & 0xFF;
+                }
+                out.resize(start + LZ_BLOCK_HEADER_SIZE + compressed);
+                failures = 0;
+                return;
+            }
+            out.resize(start);
+            failures++;
+            skip = std::min(1 << std::min(failures, 4), LZ_MAX_SKIP) - 1;
+        } else {
+            skip--;
+        }
+        lzAppendU32(out, (uint32_t)length | LZ_STORED);
+        out.append(data, length);
+    }
+
+private:
+    uint64_t rawSize;
+    int failures = 0; // bloques seguidos que no comprimieron
+    int skip = 0;     // bloques a guardar sin intentar
+};
+
+// Flujo comprimido de todo un contenido
+std::string lzCompress(const char* data, size_t length) {
+    std::string out;
+    out.reserve(LZ_HEADER_SIZE + length / 2);
+    LzEncoder encoder(length);
+    encoder.header(out);
+    for (size_t offset = 0; offset < length; offset += LZ_BLOCK_SIZE) {
+        encoder.block(data + offset, std::min((size_t)LZ_BLOCK_SIZE, length - offset), out);
+    }
+    return out;
+}
+
+// Tamaño original que declara la cabecera de un flujo; false si no la tiene
+// entera. Lo manda el otro extremo: hay que compararlo con un límite.
+bool lzStreamSize(const char* data, size_t length, uint64_t& size) {
+    if (length < LZ_HEADER_SIZE) return false;
+    size = 0;
+    for (int i = 0; i < LZ_HEADER_SIZE; i++) {
+        size = (size << 8) | (unsigned char)data[i];
+    }
+    return true;
+}
+
+// Decodificador incremental: recibe el flujo en pedazos de cualquier
+// tamaño y entrega cada bloque descomprimido a 'output(data, length)', que
+// devuelve false para cortar. Guarda a lo sumo un bloque.
+class LzDecoder {
+public:
+    // 'limit' acota el tamaño original que se acepta en la cabecera
+    explicit LzDecoder(uint64_t limit) : limit(limit) {}
+
+    bool hasHeader() const {
+        return headerDone;
+    }
+
+    uint64_t rawSize() const {
+        return total;
+    }
+
+    bool finished() const {
+        return headerDone && produced == total;
+    }
+
+    // false si el flujo es inválido (o 'output' cortó)
+    template <typename Output>
+    bool feed(const char* data, size_t length, Output output) {
+        while (length > 0) {
+            if (!headerDone) {
+                take(data, length, LZ_HEADER_SIZE);
+                if (pending.size() < LZ_HEADER_SIZE) return true;
+                total = 0;
+                for (int i = 0; i < LZ_HEADER_SIZE; i++) {
+                    total = (total << 8) | (unsigned char)pending[i];
+                }
+                if (total > limit) return false;
+                headerDone = true;
+                pending.clear();
+                continue;
+            }
+            if (produced == total) return false; // sobran bytes
+
+            if (!inBlock) {
+                take(data, length, LZ_BLOCK_HEADER_SIZE);
+                if (pending.size() < LZ_BLOCK_HEADER_SIZE) return true;
+                uint32_t word = 0;
+                for (int i = 0; i < LZ_BLOCK_HEADER_SIZE; i++) {
+                    word = (word << 8) | (unsigned char)pending[i];
+                }
+                pending.clear();
+                stored = word & LZ_STORED;
+                encoded = word & ~LZ_STORED;
+                blockRaw = (size_t)std::min((uint64_t)LZ_BLOCK_SIZE, total - produced);
+                if (stored ? encoded != blockRaw : (encoded == 0 || encoded > lzBlockBound(blockRaw))) return false;
+                inBlock = true;
+                continue;
+            }
+
+            if (stored) {
+                // Tal cual: sale sin pasar por el buffer
+                size_t n = std::min(length, encoded);
+                if (!output(data, n)) return false;
+                data += n;
+                length -= n;
+                encoded -= n;
+                produced += n;
+                if (encoded == 0) inBlock = false;
+                continue;
+            }
+
+            take(data, length, encoded);
+            if (pending.size() < encoded) return true;
+            block.resize(blockRaw);
+            if (!lzDecompressBlock(pending.data(), encoded, &block[0], blockRaw)) return false;
+            pending.clear();
+            inBlock = false;
+            produced += blockRaw;
+            if (!output(block.data(), blockRaw)) return false;
+        }
+        return true;
+    }
+
+private:
+    // Juntar en 'pending' hasta 'want' bytes
+    void take(const char*& data, size_t& length, size_t want) {
+        size_t n = std::min(length, want - pending.size());
+        pending.append(data, n);
+        data += n;
+        length -= n;
+    }
+
+    uint64_t limit;
+    bool headerDone = false;
+    uint64_t total = 0;
+    uint64_t produced = 0;
+    bool inBlock = false;
+    bool stored = false;
+    size_t encoded = 0;
+    size_t blockRaw = 0;
+    std::string pending;
+    std::string block;
+};
+
+// Descomprimir un flujo entero; false si es inválido o pasa de 'limit'
+bool lzDecompress(const char* data, size_t length, std::string& out, uint64_t limit) {
+    LzDecoder decoder(limit);
+    out.clear();
+    bool valid = decoder.feed(data, length, [&out, &decoder, length](const char* block, size_t n) {
+        // La cabecera no se cree para reservar: a lo sumo unas veces lo que
+        // ocupa el flujo, el resto crece con los bloques que llegan
+        if (out.empty()) out.reserve(std::min(decoder.rawSize(), (uint64_t)length * 4));
+        out.append(block, n);
+        return true;
+    });
+    return valid && decoder.finished();
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+    Simulador de red para probar UDP en una sola máquina (loopback nunca
+    pierde ni desordena). Todos los sendto de cliente y servidor pasan por
+    netsimSendto; sin la variable de entorno NETSIM se envía directo.
+
+        NETSIM="loss=2%,dup=1%,reorder=5%,gap=15ms,delay=40ms,jitter=10ms,rate=20mbit,queue=200ms,seed=7"
+
+    loss     probabilidad de descartar un datagrama
+    dup      probabilidad de enviarlo dos veces
+    reorder  probabilidad de retrasarlo 'gap' más, así lo adelantan los siguientes
+    delay    demora fija de ida; jitter suma una demora uniforme en [0, jitter]
+    rate     ancho de banda del enlace (bit, kbit, mbit, gbit por segundo)
+    queue    demora máxima en la cola del enlace; lo que no entra se descarta
+    seed     semilla: con el mismo orden de envíos se repiten las mismas decisiones
+
+    Cada proceso afecta solo lo que envía; para perturbar ambos sentidos se
+    define NETSIM en cliente y servidor. Los datagramas demorados los envía
+    un hilo aparte cuando vence su hora de llegada.
+*/
+
+typedef std::chrono::steady_clock NetsimClock;
+
+struct NetsimConfig {
+    bool enabled = false;
+    double loss = 0;
+    double duplicate = 0;
+    double reorder = 0;
+    long gapUs = 10000;
+    long delayUs = 0;
+    long jitterUs = 0;
+    double rateBps = 0;     // 0 = sin límite
+    long queueUs = 100000;
+    unsigned seed = 1;
+};
+
+struct NetsimPacket {
+    NetsimClock::time_point due;
+    uint64_t sequence;      // desempate: mismo vencimiento, orden de envío
+    int fd;
+    std::string data;
+    sockaddr_storage address;
+    socklen_t addr_len;
+
+    bool operator>(const NetsimPacket& other) const {
+        return due != other.due ? due > other.due : sequence > other.sequence;
+    }
+};
+
+struct NetworkSimulator {
+    NetsimConfig config;
+    std::mt19937 rng;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::priority_queue<NetsimPacket, std::vector<NetsimPacket>, std::greater<NetsimPacket>> pending;
+    NetsimClock::time_point linkFree;
+    uint64_t sequence = 0;
+    bool running = false;
+
+    uint64_t sent = 0;
+    uint64_t lost = 0;
+    uint64_t queueDrops = 0;
+    uint64_t duplicated = 0;
+    uint64_t reordered = 0;
+};
+
+// Porcentaje ("2%") o fracción ("0.02")
+double parseProbability(const std::string& value) {
+    double p = atof(value.c_str());
+    if (!value.empty() && value.back() == '%') p /= 100;
+    return std::min(1.0, std::max(0.0, p));
+}
+
+// Duración en microsegundos: "us", "ms" o "s" (sin unidad = ms)
+long parseDurationUs(const std::string& value) {
+    double amount = atof(value.c_str());
+    if (value.size() > 2 && value.compare(value.size() - 2, 2, "us") == 0) return amount;
+    if (value.size() > 2 && value.compare(value.size() - 2, 2, "ms") == 0) return amount * 1000;
+    if (value.size() > 1 && value.back() == 's') return amount * 1000000;
+    return amount * 1000;
+}
+
+// Bits por segundo: "bit", "kbit", "mbit" o "gbit"
+double parseRate(const std::string& value) {
+    double amount = atof(value.c_str());
+    if (value.find("gbit") != std::string::npos) return amount * 1e9;
+    if (value.find("mbit") != std::string::npos) return amount * 1e6;
+    if (value.find("kbit") != std::string::npos) return amount * 1e3;
+    return amount;
+}
+
+NetsimConfig parseNetsim(const std::string& spec) {
+    NetsimConfig config;
+    std::stringstream ss(spec);
+    std::string item;
+    while (getline(ss, item, ',')) {
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) continue;
+        std::string key = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+        if (key == "loss") config.loss = parseProbability(value);
+        else if (key == "dup") config.duplicate = parseProbability(value);
+        else if (key == "reorder") config.reorder = parseProbability(value);
+        else if (key == "gap") config.gapUs = parseDurationUs(value);
+        else if (key == "delay") config.delayUs = parseDurationUs(value);
+        else if (key == "jitter") config.jitterUs = parseDurationUs(value);
+        else if (key == "rate") config.rateBps = parseRate(value);
+        else if (key == "queue") config.queueUs = parseDurationUs(value);
+        else if (key == "seed") config.seed = strtoul(value.c_str(), nullptr, 10);
+        else continue;
+        config.enabled = true;
+    }
+    return config;
+}
+
+NetworkSimulator& networkSimulator() {
+    static NetworkSimulator sim;
+    static std::once_flag configured;
+    std::call_once(configured, [] {
+        const char* spec = getenv("NETSIM");
+        if (spec != nullptr) {
+            sim.config = parseNetsim(spec);
+            sim.rng.seed(sim.config.seed);
+        }
+    });
+    return sim;
+}
+
+bool netsimEnabled() {
+    return networkSimulator().config.enabled;
+}
+
+// Hilo que envía los datagramas demorados cuando vence su hora
+void runNetsim() {
+    NetworkSimulator& sim = networkSimulator();
+    std::unique_lock<std::mutex> lock(sim.mutex);
+    while (true) {
+        if (sim.pending.empty()) {
+            sim.wake.wait(lock);
+            continue;
+        }
+        NetsimClock::time_point due = sim.pending.top().due;
+        if (NetsimClock::now() < due) {
+            sim.wake.wait_until(lock, due);
+            continue;
+        }
+        NetsimPacket packet = sim.pending.top();
+        sim.pending.pop();
+        lock.unlock();
+        ::sendto(packet.fd, packet.data.data(), packet.data.size(), 0,
+                 (const sockaddr*)&packet.address, packet.addr_len);
+        lock.lock();
+    }
+}
+
+// Reemplazo de sendto que aplica las perturbaciones configuradas
+ssize_t netsimSendto(int fd, const void* buffer, size_t length, int flags, const sockaddr* address, socklen_t addr_len) {
+    NetworkSimulator& sim = networkSimulator();
+    if (!sim.config.enabled) {
+        return ::sendto(fd, buffer, length, flags, address, addr_len);
+    }
+
+    const NetsimConfig& config = sim.config;
+    std::lock_guard<std::mutex> lock(sim.mutex);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    sim.sent++;
+
+    if (chance(sim.rng) < config.loss) {
+        sim.lost++;
+        return length;
+    }
+
+    // Cola del enlace: cada datagrama sale cuando termina de salir el anterior
+    NetsimClock::time_point now = NetsimClock::now();
+    NetsimClock::time_point departure = now;
+    if (config.rateBps > 0) {
+        departure = std::max(now, sim.linkFree);
+        if (departure - now > std::chrono::microseconds(config.queueUs)) {
+            sim.queueDrops++;
+            return length;
+        }
+        sim.linkFree = departure + std::chrono::microseconds((long)(length * 8 * 1e6 / config.rateBps));
+        departure = sim.linkFree;
+    }
+
+    int copies = 1;
+    if (chance(sim.rng) < config.duplicate) {
+        sim.duplicated++;
+        copies = 2;
+    }
+
+    for (int copy = 0; copy < copies; copy++) {
+        long extraUs = config.delayUs;
+        if (config.jitterUs > 0) {
+            extraUs += std::uniform_int_distribution<long>(0, config.jitterUs)(sim.rng);
+        }
+        if (chance(sim.rng) < config.reorder) {
+            sim.reordered++;
+            extraUs += config.gapUs;
+        }
+
+        NetsimClock::time_point due = departure + std::chrono::microseconds(extraUs);
+        if (due <= now && sim.pending.empty()) {
+            ::sendto(fd, buffer, length, flags, address, addr_len);
+            continue;
+        }
+
+        NetsimPacket packet;
+        packet.due = due;
+        packet.sequence = sim.sequence++;
+        packet.fd = fd;
+        packet.data.assign((const char*)buffer, length);
+        memcpy(&packet.address, address, addr_len);
+        packet.addr_len = addr_len;
+        sim.pending.push(packet);
+    }
+
+    if (!sim.running) {
+        sim.running = true;
+        std::thread(runNetsim).detach();
+    }
+    sim.wake.notify_one();
+    return length;
+}
+
+std::string netsimSummary() {
+    NetworkSimulator& sim = networkSimulator();
+    std::lock_guard<std::mutex> lock(sim.mutex);
+    std::ostringstream out;
+    out << sim.sent << " datagrams, " << sim.lost << " lost, " << sim.queueDrops << " queue drops, "
+        << sim.duplicated << " duplicated, " << sim.reordered << " reordered, " << sim.pending.size() << " in flight";
+    return out.str();
+}
+
+std::string netsimDescription() {
+    const NetsimConfig& config = networkSimulator().config;
+    std::ostringstream out;
+    out << "loss " << config.loss * 100 << "%, dup " << config.duplicate * 100 << "%, reorder "
+        << config.reorder * 100 << "% (+" << config.gapUs / 1000.0 << " ms), delay " << config.delayUs / 1000.0
+        << " ms + jitter " << config.jitterUs / 1000.0 << " ms, rate ";
+    if (config.rateBps > 0) {
+        out << config.rateBps / 1e6 << " Mbit/s (queue " << config.queueUs / 1000.0 << " ms)";
+    } else {
+        out << "unlimited";
+    }
+    out << ", seed " << config.seed;
+    return out.str();
+}
+
+#endif
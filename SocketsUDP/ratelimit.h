@@ -0,0 +1,230 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <string>
+#include <map>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Límites de envío por cliente con token buckets, uno por clase de
+    mensaje, aplicados antes de repartir el mensaje a los destinatarios:
+
+        broadcast  'm'            mensajes por segundo
+        file       'f' 'o'        bytes por segundo
+        game       'J' 'j' 'P'    mensajes por segundo
+
+    Cada cubeta se llena a 'rate' por segundo hasta 'burst'. Un mensaje pasa
+    si hay fichas para su costo, o si la cubeta está llena aunque no
+    alcancen (así un archivo mayor que 'burst' no queda bloqueado para
+    siempre; la cubeta queda en negativo y el siguiente espera más).
+
+    Se configura con --rate-limit en los servidores:
+
+        --rate-limit "broadcast=10/30,file=16M/64M,game=5/10"
+        --rate-limit off
+
+    rate/burst; los números aceptan sufijos K, M y G. Una clase con rate 0
+    no tiene límite.
+*/
+
+enum RateClass { RATE_BROADCAST, RATE_FILE, RATE_GAME, RATE_CLASSES };
+
+const char* const RATE_CLASS_NAMES[RATE_CLASSES] = {"broadcast", "file", "game"};
+
+struct RateLimit {
+    double rate;  // por segundo, 0 = sin límite
+    double burst;
+};
+
+struct RateLimits {
+    RateLimit limits[RATE_CLASSES] = {{10, 30}, {16e6, 64e6}, {5, 10}};
+};
+
+// Clase de un tipo de mensaje (-1 = sin límite)
+int rateClassFor(char type) {
+    switch (type) {
+        case 'm':
+            return RATE_BROADCAST;
+        case 'f':
+        case 'o':
+            return RATE_FILE;
+        case 'J':
+        case 'j':
+        case 'P':
+            return RATE_GAME;
+        default:
+            return -1;
+    }
+}
+
+// Número con sufijo opcional K, M o G
+double parseRateAmount(const std::string& value) {
+    char* end = nullptr;
+    double amount = strtod(value.c_str(), &end);
+    if (end != nullptr) {
+        switch (*end) {
+            case 'K': case 'k': amount *= 1e3; break;
+            case 'M': case 'm': amount *= 1e6; break;
+            case 'G': case 'g': amount *= 1e9; break;
+        }
+    }
+    return amount;
+}
+
+// Al revés: 16000000 -> "16M"
+std::string formatRateAmount(double amount) {
+    std::ostringstream out;
+    if (amount >= 1e9) out << amount / 1e9 << "G";
+    else if (amount >= 1e6) out << amount / 1e6 << "M";
+    else if (amount >= 1e3) out << amount / 1e3 << "K";
+    else out << amount;
+    return out.str();
+}
+
+// "broadcast=10/30,file=16M/64M,game=5/10" u "off". Las clases que no
+// aparecen quedan con el valor por defecto.
+bool parseRateLimits(const std::string& spec, RateLimits& limits) {
+    if (spec == "off") {
+        for (auto& limit : limits.limits) {
+            limit = {0, 0};
+        }
+        return true;
+    }
+
+    std::stringstream ss(spec);
+    std::string item;
+    while (getline(ss, item, ',')) {
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) return false;
+        std::string name = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+
+        int rateClass = -1;
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            if (name == RATE_CLASS_NAMES[i]) rateClass = i;
+        }
+        if (rateClass < 0) return false;
+
+        size_t slash = value.find('/');
+        double rate = parseRateAmount(value.substr(0, slash));
+        double burst = slash == std::string::npos ? rate : parseRateAmount(value.substr(slash + 1));
+        if (rate < 0 || burst < 0) return false;
+        limits.limits[rateClass] = {rate, std::max(burst, rate > 0 ? 1.0 : 0.0)};
+    }
+    return true;
+}
+
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock BucketClock;
+
+    // Segundos que faltan para poder gastar 'cost' (0 = se gastó)
+    double take(const RateLimit& limit, double cost, BucketClock::time_point now) {
+        if (!started) {
+            tokens = limit.burst;
+            last = now;
+            started = true;
+        }
+        double elapsed = std::chrono::duration<double>(now - last).count();
+        tokens = std::min(limit.burst, tokens + elapsed * limit.rate);
+        last = now;
+
+        if (tokens >= cost || tokens >= limit.burst) {
+            tokens -= cost;
+            return 0;
+        }
+        return (std::min(cost, limit.burst) - tokens) / limit.rate;
+    }
+
+private:
+    double tokens = 0;
+    BucketClock::time_point last;
+    bool started = false;
+};
+
+class RateLimiter {
+public:
+    void configure(const RateLimits& configured) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limits = configured;
+    }
+
+    // Segundos que 'client' debe esperar para enviar 'cost' de la clase
+    // (0 = admitido, y ya se descontó de su cubeta)
+    double admit(const std::string& client, int rateClass, double cost) {
+        if (rateClass < 0) return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        const RateLimit& limit = limits.limits[rateClass];
+        if (limit.rate <= 0) return 0;
+
+        double wait = buckets[client][rateClass].take(limit, cost, TokenBucket::BucketClock::now());
+        if (wait > 0) {
+            limited[rateClass]++;
+        } else {
+            allowed[rateClass]++;
+        }
+        return wait;
+    }
+
+    void forget(const std::string& client) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buckets.erase(client);
+    }
+
+    std::string limitDescription(int rateClass) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << RATE_CLASS_NAMES[rateClass] << " limit is " << formatRateAmount(limits.limits[rateClass].rate)
+            << (rateClass == RATE_FILE ? " bytes/s" : "/s");
+        return out.str();
+    }
+
+    // Contadores acumulados; 'changed' dice si hubo rechazos desde la llamada anterior
+    std::string summary(bool* changed = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        uint64_t totalLimited = 0;
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            if (i > 0) out << ", ";
+            out << RATE_CLASS_NAMES[i] << " " << allowed[i] << " allowed / " << limited[i] << " limited";
+            totalLimited += limited[i];
+        }
+        if (changed != nullptr) {
+            *changed = totalLimited != reportedLimited;
+            reportedLimited = totalLimited;
+        }
+        return out.str();
+    }
+
+    std::string description() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            if (i > 0) out << ", ";
+            out << RATE_CLASS_NAMES[i] << " ";
+            if (limits.limits[i].rate <= 0) {
+                out << "unlimited";
+            } else {
+                out << formatRateAmount(limits.limits[i].rate) << "/s (burst "
+                    << formatRateAmount(limits.limits[i].burst) << ")";
+            }
+        }
+        return out.str();
+    }
+
+private:
+    std::mutex mutex;
+    RateLimits limits;
+    std::map<std::string, std::array<TokenBucket, RATE_CLASSES>> buckets;
+    uint64_t allowed[RATE_CLASSES] = {};
+    uint64_t limited[RATE_CLASSES] = {};
+    uint64_t reportedLimited = 0;
+};
+
+#endif
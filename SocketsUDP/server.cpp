@@ -12,26 +12,148 @@
 #include <iomanip>
 #include <sstream>
 #include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <linux/filter.h>
 #include "sala.h"
 #include "sala_serialized.h"
+#include "framing.h"
+#include "congestion.h"
+#include "fec.h"
+#include "crc32c.h"
+#include "netsim.h"
+#include "timerwheel.h"
+#include "fairqueue.h"
+#include "ratelimit.h"
+#include "codel.h"
+#include "memorybudget.h"
+#include "spool.h"
 #include <vector>
 #include <algorithm>
 
 using namespace std;
 
 #define PORT 45000
-#define MAX_DATAGRAM_SIZE 1024
+#define MAX_DATAGRAM_SIZE 65536
 
-int maxDatagramLength = 777;
+// Capacidades que este servidor acepta en el handshake
+const uint16_t SERVER_CAPS = CAP_VARLEN | CAP_PMTU | CAP_PACING | CAP_FEC | CAP_SESSION | CAP_MULTICAST | CAP_CRC | CAP_HEARTBEAT | CAP_COMPRESS;
+
+// Grupo multicast para los 'M' (--multicast). Los broadcasts que no caben en
+// un datagrama de este tamaño siguen saliendo por unicast.
+#define MULTICAST_GROUP "239.255.0.1"
+#define MULTICAST_PORT (PORT + 1)
+#define MULTICAST_DATAGRAM_SIZE 1472
+int multicastSocket = -1;
+struct sockaddr_in multicastAddress;
+
+// Buffers de socket grandes para que una ventana de datagramas de 64 KB quepa
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Bytes que el reenvío en corte deja acumular hacia un destinatario antes de
+// frenar al emisor
+#define RELAY_WINDOW (2 * 1024 * 1024)
+
+// Con la ventana llena, los fragmentos de un reenvío siguen confirmándose y
+// esperan en el spool (--spool-dir, --spool-limit); cada SPOOL_DRAIN_INTERVAL
+// salen hasta SPOOL_DRAIN_BYTES mientras el destinatario tenga lugar
+#define SPOOL_DRAIN_INTERVAL chrono::milliseconds(5)
+#define SPOOL_DRAIN_BYTES (RELAY_WINDOW / 4)
+
+// Una sesión sin datagramas durante este tiempo se da por caída. Los clientes
+// con CAP_HEARTBEAT envían 'h' cada HEARTBEAT_INTERVAL; los antiguos no, y
+// se les da más margen.
+#define SESSION_TIMEOUT chrono::seconds(30)
+#define LEGACY_SESSION_TIMEOUT chrono::minutes(30)
+// Un mensaje a medio llegar se descarta tras este tiempo sin fragmentos
+#define REASSEMBLY_TIMEOUT 30
+// Tiempo de cada jugada; quien no juega a tiempo pierde la partida
+#define MOVE_TIMEOUT chrono::seconds(60)
+
+// Entrada justa: cada worker vacía el socket (hasta INPUT_READ_BATCH
+// datagramas por vuelta) a colas por cliente y procesa INPUT_SERVE_BATCH
+// por deficit round robin. Leer es mucho más barato que procesar, así la
+// cola FIFO del kernel no se llena con lo de un solo cliente. El costo de un
+// datagrama es su tamaño más INPUT_DATAGRAM_COST (procesar, registrar,
+// reenviar); un cliente con más de INPUT_FLOW_LIMIT en espera pierde lo
+// que sigue enviando.
+#define INPUT_READ_BATCH 1024
+#define INPUT_SERVE_BATCH 64
+#define INPUT_DATAGRAM_COST 512
+#define INPUT_QUANTUM 8192
+#define INPUT_FLOW_LIMIT (2 * 1024 * 1024)
+// Cada cuánto se informa la parte de servicio de cada cliente
+#define SHARE_REPORT_INTERVAL chrono::seconds(10)
+
+// Con la cola de entrada sobrecargada (codel.h) se avisa al cliente al que
+// se le descartan broadcasts o datos de archivo, como mucho una vez por intervalo
+#define OVERLOAD_NOTICE_INTERVAL chrono::seconds(1)
+
+// Cada cuánto se informa el uso del presupuesto de memoria, si cambió
+#define MEMORY_REPORT_INTERVAL chrono::seconds(1)
 
 struct ClientInfo {
     int socket_fd;
     sockaddr_in address;
     socklen_t addr_len;
+    int worker; // worker dueño de la sesión (el que recibe sus datagramas)
+    uint16_t caps; // capacidades negociadas (0 = cliente antiguo, formato padded)
+    size_t datagramSize; // tamaño de datagrama de la sesión (modo varlen)
+    uint16_t fec; // (k << 8) | m de la paridad que pidió el cliente, 0 = sin FEC
+    uint32_t sessionId; // 0 = cliente identificado por su dirección
+    Clock::time_point connectedAt;
+    Clock::time_point lastSeen; // último datagrama recibido
+    string sessionToken; // secreto del handshake, prueba de dueño al cambiar de dirección
+    string challenge; // desafío pendiente hacia 'challenged' (vacío = ninguno)
+    sockaddr_in challenged;
+    Clock::time_point challengedAt;
 };
 map<string, ClientInfo> clients;
+unordered_map<uint32_t, string> sessions; // id de sesión -> nickname
 mutex clients_mutex;
 
+// Un desafío de cambio de dirección no se repite antes de este tiempo, así
+// un id adivinado no sirve para hacer que el servidor inunde a un tercero
+#define CHALLENGE_INTERVAL chrono::seconds(1)
+
+// Mensaje que otro worker pidió enviar a un cliente de este worker
+struct OutboundDatagram {
+    string nickname;
+    ClientInfo info;
+    vector<string> packets;
+};
+
+// Registros chicos que esperan compartir datagrama hacia un cliente varlen
+struct PendingDatagram {
+    string records;
+    sockaddr_in address;
+    socklen_t addr_len;
+    bool crc;
+    Clock::time_point deadline;
+};
+
+// Demora máxima de un mensaje chico esperando a otros (--coalesce-delay-us, 0 = sin agrupar)
+long coalesceDelayUs = 200;
+
+// Emisor con control de congestión hacia un cliente (CAP_PACING)
+struct PacedSession {
+    PacedSender sender;
+    sockaddr_in address;
+    socklen_t addr_len;
+    bool crc;
+};
+
+// Datagrama recibido que espera su turno en la cola justa de entrada
+struct InputDatagram {
+    string data;
+    sockaddr_in address;
+    socklen_t addr_len;
+    Clock::time_point arrived; // para medir la espera en cola
+};
+
 // Estructura para reconstrucción de paquetes fragmentados
 struct FragmentReassembly {
     vector<string> fragments;
@@ -42,8 +164,78 @@ struct FragmentReassembly {
     time_t lastFragmentTime;
 };
 
-unordered_map<string, FragmentReassembly> reassemblyBuffers;
-mutex reassembly_mutex;
+// Reenvío en corte de un 'f' u 'o' fragmentado: cada fragmento sale hacia el
+// destinatario apenas llega, con la cabecera reescrita ('f' -> 'F' sin el
+// campo destino, id del servidor), en vez de reconstruir el archivo entero.
+// Solo se guardan los fragmentos que llegan antes del fragmento 0 y los de
+// bloques FEC incompletos, así la memoria por transferencia es O(ventana).
+// Fragmento de entrada que espera en el spool
+struct SpooledFragment {
+    uint32_t index;
+    uint64_t offset;
+    size_t length;
+};
+
+struct RelayTransfer {
+    bool relaying;      // false = se reconstruye el mensaje completo
+    string dest;        // vacío = destinatario desconectado, se descarta
+    int destWorker;
+    char outType;
+    uint32_t outId;
+    size_t cutOffset;   // posición y largo del campo destino en el fragmento 0
+    size_t cutLength;
+    size_t outChunk;
+    uint32_t split;     // fragmentos de salida por fragmento de entrada
+    uint32_t outCount;
+    int outData;        // FEC hacia el destinatario (k, m)
+    int outParity;
+    bool outCrc;        // el destinatario verifica CRC32C
+    map<uint32_t, ParityBlock> parity; // bloques de salida con paridad a medio calcular
+    shared_ptr<SpoolFile> spool;        // fragmentos que esperan al destinatario
+    deque<SpooledFragment> waiting;     // en orden de llegada
+};
+
+// Cada worker tiene su propio socket SO_REUSEPORT y una cola para entregas
+// cruzadas, así el orden de salida hacia un cliente lo decide un solo hilo
+struct Worker {
+    int socket_fd;
+    int wake_fd;
+    deque<OutboundDatagram> queue;
+    mutex queue_mutex;
+    unordered_map<string, PacedSession> pacers; // solo lo toca el hilo del worker
+    unordered_map<string, PendingDatagram> coalescing; // ídem
+    atomic<size_t> backlog{0}; // bytes encolados o sin confirmar en sus pacers
+    TimerWheel timers; // vencimientos de sus sesiones, mensajes y partidas
+    FairQueue<InputDatagram> inputs{INPUT_QUANTUM, INPUT_FLOW_LIMIT}; // por cliente, solo el hilo del worker
+    CoDelMonitor inputDelay; // espera en 'inputs', ídem
+    uint64_t shedBroadcasts = 0; // descartados por sobrecarga
+    uint64_t shedBulk = 0;
+    uint64_t reportedShed = 0;
+    unordered_map<string, Clock::time_point> notices; // último aviso de sobrecarga o memoria por cliente
+    // Mensajes a medio reconstruir de sus clientes, solo el hilo del worker
+    unordered_map<string, FragmentReassembly> reassemblyBuffers; // formato padded, clave nickname:puerto
+    unordered_map<string, MessageReassembly> messageBuffers; // modo varlen, clave nickname:id
+    unordered_map<string, MemoryReservation> reassemblyMemory; // lo reservado por cada reconstrucción, misma clave
+    unordered_map<string, RelayTransfer> relays; // misma clave que messageBuffers
+    CompletedMessages completedMessages;
+};
+
+vector<Worker*> workers;
+thread_local int currentWorker = 0;
+
+
+// Datagramas y mensajes descartados por CRC32C (CAP_CRC)
+atomic<uint64_t> corruptDatagrams{0};
+atomic<uint64_t> corruptPayloads{0};
+
+// Límites de envío por cliente (--rate-limit)
+RateLimiter rateLimiter;
+
+// Memoria de los mensajes a medio reconstruir (--memory-limit)
+MemoryBudget memoryBudget;
+
+// Ids de los mensajes fragmentados que envía el servidor (modo varlen)
+atomic<uint32_t> nextMessageId(1);
 
 struct Game {
     string player1;
@@ -51,79 +243,46 @@ struct Game {
     vector<char> board;
     string currentPlayer;
     bool gameActive;
+    uint32_t turn; // turno en curso; un vencimiento de otro turno no aplica
 };
 
 map<pair<string, string>, Game> activeGames;
 mutex games_mutex;
+uint32_t nextTurn = 1; // con games_mutex
 
 // Declaraciones de funciones
-vector<string> buildBroadcast(const string& sender, const string& msg);
-vector<string> buildToClient(const string& sender, const string& msg);
-vector<string> buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size);
-vector<string> buildObject(const string& sender, const vector<char>& objectData);
-vector<string> buildGameRequest(const string& sender);
-vector<string> buildGameResponse(const string& sender, bool accepted);
-vector<string> buildBoard(const vector<char>& board, const string& currentPlayer);
-vector<string> buildGameResult(char result);
-vector<string> buildError(const string& msg);
-vector<string> buildList();
-vector<string> buildClose();
-
-void sendAll(const vector<string> packets, const string& sender_nickname);
-void sendToClient(const string dest, const vector<string> packets);
+string buildBroadcast(const string& sender, const string& msg);
+string buildToClient(const string& sender, const string& msg);
+string buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size);
+string buildObject(const string& sender, const vector<char>& objectData);
+string buildGameRequest(const string& sender);
+string buildGameResponse(const string& sender, bool accepted);
+string buildBoard(const vector<char>& board, const string& currentPlayer);
+string buildGameResult(char result);
+string buildError(const string& msg);
+string buildList();
+string buildClose();
+
+void sendAll(const string message, const string& sender_nickname);
+void sendToClient(const string dest, const string message);
+void noticeClient(const string& nickname, const string& error);
+void reportTransfers(const string& nickname, PacedSender& sender);
+void deliverToClient(const string& nickname, const ClientInfo& info, const vector<string>& packets);
 void initializeGame(Game& game, const string& p1, const string& p2);
 void processGameMove(const string& player, uint32_t position);
+void disconnectClient(const string& nickname);
+Clock::duration sessionTimeout(const ClientInfo& info);
+void scheduleSessionExpiry(const string& nickname, Clock::time_point connectedAt, Clock::duration delay);
+template <typename Buffers>
+void scheduleReassemblyExpiry(Buffers& buffers, const string& key, long seconds);
+void scheduleMoveTimeout(const pair<string, string>& gameKey, uint32_t turn);
 void processCompleteMessage(const string& client_nickname, const string& fullData, char messageType, 
                            const sockaddr_in& client_addr, socklen_t addr_len, int server_fd);
 
-string completeDatagram(string &packet) {
-    size_t len = packet.size();
-    if (len < (size_t)maxDatagramLength) {
-        packet.append(maxDatagramLength - len, '#');
-    }
-    return packet;
-}
-
-vector<string> fragmentDatagram(const string &header, const string &data, int sizeFieldBytes) {
-    vector<string> datagrams;
-
-    size_t overhead = 1 + header.size() + sizeFieldBytes;
-    size_t maxDataPerPacket = maxDatagramLength - overhead;
-    size_t offset = 0;
-    int numPacket = 1;
-    int totalPackets = (data.size() + maxDataPerPacket - 1) / maxDataPerPacket;
-
-    while (offset < data.size()) {
-        size_t remaining = data.size() - offset;
-        size_t chunkSize = min(remaining, maxDataPerPacket);
-        bool isLast = (offset + chunkSize >= data.size());
-
-        string fragment;
-        fragment.push_back(isLast ? 0 : (char)numPacket);
-
-        fragment += header;
-
-        uint32_t len = (uint32_t)chunkSize;
-        for (int i = sizeFieldBytes - 1; i >= 0; --i)
-            fragment.push_back((len >> (8 * i)) & 0xFF);
-
-        fragment += data.substr(offset, chunkSize);
-
-        if (fragment.size() < (size_t)maxDatagramLength)
-            fragment = completeDatagram(fragment);
-
-        datagrams.push_back(fragment);
-        offset += chunkSize;
-        numPacket++;
-    }
-
-    return datagrams;
-}
-
 // Función para reconstruir paquetes fragmentados
 bool reconstructPacket(const string& client_id, const string& fragment, string& fullData, char& messageType) {
-    lock_guard<mutex> lock(reassembly_mutex);
-    
+    Worker* worker = workers[currentWorker];
+
     if (fragment.empty()) {
         return false;
     }
@@ -139,23 +298,36 @@ bool reconstructPacket(const string& client_id, const string& fragment, string&
             return false;
         }
 
+        // Cada fragmento guardado se cobra al presupuesto del cliente; si no
+        // alcanza se descarta el mensaje entero
+        string nickname = client_id.substr(0, client_id.rfind(':'));
+        MemoryReservation& memory = worker->reassemblyMemory[client_id];
+        if (memoryBudget.reserve(nickname, MEMORY_REASSEMBLY, fragment.size(), memory) != MEMORY_RESERVED) {
+            cout << "Dropped message from " << nickname << ": memory budget exceeded ("
+                 << formatMemoryAmount(memory.size()) << " already buffered)" << endl;
+            worker->reassemblyBuffers.erase(client_id);
+            worker->reassemblyMemory.erase(client_id);
+            return false;
+        }
+
         if (fragmentNum != 0) {
             // Fragmento intermedio
-            if (reassemblyBuffers.find(client_id) == reassemblyBuffers.end()) {
+            if (worker->reassemblyBuffers.find(client_id) == worker->reassemblyBuffers.end()) {
                 FragmentReassembly reassembly;
                 reassembly.fragments.push_back(fragment);
                 reassembly.messageType = messageType;
                 reassembly.lastFragmentTime = time(nullptr);
-                reassemblyBuffers[client_id] = reassembly;
+                worker->reassemblyBuffers[client_id] = reassembly;
+                scheduleReassemblyExpiry(worker->reassemblyBuffers, client_id, REASSEMBLY_TIMEOUT);
             } else {
-                reassemblyBuffers[client_id].fragments.push_back(fragment);
-                reassemblyBuffers[client_id].lastFragmentTime = time(nullptr);
+                worker->reassemblyBuffers[client_id].fragments.push_back(fragment);
+                worker->reassemblyBuffers[client_id].lastFragmentTime = time(nullptr);
             }
             return false;
         } else {
             // Último fragmento
-            if (reassemblyBuffers.find(client_id) != reassemblyBuffers.end()) {
-                auto& reassembly = reassemblyBuffers[client_id];
+            if (worker->reassemblyBuffers.find(client_id) != worker->reassemblyBuffers.end()) {
+                auto& reassembly = worker->reassemblyBuffers[client_id];
                 reassembly.fragments.push_back(fragment);
                 
                 // Reconstruir en orden (no necesitamos ordenar si llegan en orden)
@@ -165,11 +337,13 @@ bool reconstructPacket(const string& client_id, const string& fragment, string&
                 }
                 
                 messageType = reassembly.messageType;
-                reassemblyBuffers.erase(client_id);
+                worker->reassemblyBuffers.erase(client_id);
+                worker->reassemblyMemory.erase(client_id);
                 return true;
             } else {
                 // Si es el único fragmento (mensaje pequeño)
                 fullData = fragment.substr(1);
+                worker->reassemblyMemory.erase(client_id);
                 return true;
             }
         }
@@ -181,6 +355,33 @@ bool reconstructPacket(const string& client_id, const string& fragment, string&
     }
 }
 
+// Bytes impredecibles para ids de sesión, tokens y desafíos
+string randomBytes(size_t count) {
+    string bytes(count, '\0');
+    size_t filled = 0;
+    while (filled < count) {
+        ssize_t n = getrandom(&bytes[filled], count - filled, 0);
+        if (n > 0) {
+            filled += n;
+        }
+    }
+    return bytes;
+}
+
+// Id de sesión aleatorio libre (con clients_mutex). Cumple
+// id % workers == worker dueño, así el programa BPF lo dirige siempre al
+// mismo worker aunque cambie la dirección.
+uint32_t newSessionId() {
+    uint64_t count = workers.size();
+    while (true) {
+        uint64_t value = readU32(randomBytes(4), 0);
+        uint64_t id = value - value % count + currentWorker;
+        if (id != 0 && id <= UINT32_MAX && !sessions.count(id)) {
+            return id;
+        }
+    }
+}
+
 // Función separada para procesar mensajes de nickname
 void processNicknameMessage(int server_fd, const string& data, const sockaddr_in& client_addr, socklen_t addr_len) {
     size_t offset = 1;
@@ -193,20 +394,71 @@ void processNicknameMessage(int server_fd, const string& data, const sockaddr_in
     
     if (data.size() < offset + nlen) return;
     string nickname(data.c_str() + offset, nlen);
+    offset += nlen;
+
+    // Clientes nuevos anuncian sus capacidades tras el nickname; los antiguos
+    // solo traen relleno '#'
+    bool hasCaps = data.size() >= offset + 3 && data[offset] == CAPS_MARKER;
+    uint16_t caps = hasCaps ? (readU16(data, offset + 1) & SERVER_CAPS) : 0;
+    if (multicastSocket < 0) {
+        caps &= ~CAP_MULTICAST;
+    }
     
     {
         lock_guard<mutex> lock(clients_mutex);
         if (clients.count(nickname)) {
-            vector<string> err = buildError("Nickname already taken");
+            vector<string> err = encodeLegacy(buildError("Nickname already taken"));
             for (const auto& packet : err) {
-                sendto(server_fd, packet.c_str(), packet.size(), 0, (struct sockaddr*)&client_addr, addr_len);
+                netsimSendto(server_fd, packet.c_str(), packet.size(), 0, (struct sockaddr*)&client_addr, addr_len);
             }
             return;
         }
-        ClientInfo info = {server_fd, client_addr, addr_len};
+        uint32_t sessionId = 0;
+        string sessionToken;
+        if (caps & CAP_SESSION) {
+            sessionId = newSessionId();
+            sessionToken = randomBytes(CHALLENGE_SIZE);
+            sessions[sessionId] = nickname;
+        }
+        Clock::time_point now = Clock::now();
+        ClientInfo info = {server_fd, client_addr, addr_len, currentWorker, caps, (size_t)maxDatagramLength, 0, sessionId, now, now, sessionToken, "", {}, {}};
         clients[nickname] = info;
-        cout << nickname << " connected" << endl;
+        cout << nickname << " connected (worker " << currentWorker << ", caps 0x" << hex << caps << dec << ")" << endl;
+        scheduleSessionExpiry(nickname, now, sessionTimeout(info));
     }
+
+    if (hasCaps) {
+        string reply = "N";
+        appendU16(reply, caps);
+        if (caps & CAP_SESSION) {
+            lock_guard<mutex> lock(clients_mutex);
+            appendU32(reply, clients[nickname].sessionId);
+        }
+        if (caps & CAP_MULTICAST) {
+            appendU32(reply, ntohl(multicastAddress.sin_addr.s_addr));
+            appendU16(reply, ntohs(multicastAddress.sin_port));
+        }
+        if (caps & CAP_SESSION) {
+            lock_guard<mutex> lock(clients_mutex);
+            reply += clients[nickname].sessionToken;
+        }
+        netsimSendto(server_fd, reply.c_str(), reply.size(), 0, (struct sockaddr*)&client_addr, addr_len);
+    }
+}
+
+// Aplicar el límite de la clase del mensaje antes de repartirlo. El worker
+// no puede esperar, así que lo que excede se rechaza con un 'E'.
+bool rejectOverLimit(const string& client_nickname, char messageType, double cost) {
+    int rateClass = rateClassFor(messageType);
+    double wait = rateLimiter.admit(client_nickname, rateClass, cost);
+    if (wait <= 0) return false;
+
+    ostringstream error;
+    error << "Rate limited: " << rateLimiter.limitDescription(rateClass) << ", retry in "
+          << fixed << setprecision(2) << wait << " s";
+    cout << client_nickname << " " << error.str() << endl;
+    sendToClient(client_nickname, buildError(error.str()));
+    return true;
 }
 
 // Función para procesar mensajes completos (simples o reconstruidos)
@@ -214,6 +466,28 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
                            const sockaddr_in& client_addr, socklen_t addr_len, int server_fd) {
     
     size_t offset = 0;
+
+    // Comprimido (CAP_COMPRESS): se descomprime y se procesa como el original.
+    // Lo que va a ocupar se reserva antes, así un flujo que promete más de lo
+    // que entra no llega a reservar nada.
+    if (messageType == 'z') {
+        uint64_t size = 0;
+        MemoryReservation memory;
+        string message;
+        if (!expandedSize(fullData, size) ||
+            memoryBudget.reserve(client_nickname, MEMORY_REASSEMBLY, size, memory) != MEMORY_RESERVED ||
+            !expandMessage(fullData, message, size)) {
+            cout << "Dropped compressed message from " << client_nickname << " (corrupt or over the memory budget)" << endl;
+            sendToClient(client_nickname, buildError("Compressed message could not be expanded"));
+            return;
+        }
+        processCompleteMessage(client_nickname, message.substr(1), message[0], client_addr, addr_len, server_fd);
+        return;
+    }
+
+    if (rejectOverLimit(client_nickname, messageType, rateClassFor(messageType) == RATE_FILE ? fullData.size() : 1)) {
+        return;
+    }
     
     switch (messageType) {
         case 'm': { // Broadcast message
@@ -236,8 +510,7 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
             if (fullData.size() < offset + mlen) return;
             string message(fullData.c_str() + offset, mlen);
             
-            cout << sender << " sent broadcast: " << message << endl;
-            vector<string> packets = buildBroadcast(sender, message);
+            string packets = buildBroadcast(sender, message);
             sendAll(packets, sender);
             break;
         }
@@ -272,8 +545,7 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
             if (fullData.size() < offset + mlen) return;
             string message(fullData.c_str() + offset, mlen);
             
-            cout << sender << " sent private to " << dest << ": " << message << endl;
-            vector<string> packets = buildToClient(sender, message);
+            string packets = buildToClient(sender, message);
             sendToClient(dest, packets);
             break;
         }
@@ -321,68 +593,45 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
             cout << sender << " sent file to " << dest << ": " << filename << " (" << file_size << " bytes)" << endl;
             
             // Reenviar archivo al destinatario
-            vector<string> packets = buildFile(sender, filename, file_data.data(), file_size);
+            string packets = buildFile(sender, filename, file_data.data(), file_size);
             sendToClient(dest, packets);
             break;
         }
         
         case 'o': { // Object transfer
-            cout << "DEBUG: Processing object transfer" << endl;
-            if (fullData.size() < offset + 2) {
-                cout << "DEBUG: Object data too short for sender length" << endl;
-                return;
-            }
+            if (fullData.size() < offset + 2) return;
             uint16_t slen;
             memcpy(&slen, fullData.c_str() + offset, 2);
             slen = ntohs(slen);
             offset += 2;
             
-            if (fullData.size() < offset + slen) {
-                cout << "DEBUG: Object data too short for sender name" << endl;
-                return;
-            }
+            if (fullData.size() < offset + slen) return;
             string sender(fullData.c_str() + offset, slen);
             offset += slen;
             
-            cout << "DEBUG: Object from " << sender << endl;
-            
-            if (fullData.size() < offset + 2) {
-                cout << "DEBUG: Object data too short for destination length" << endl;
-                return;
-            }
+            if (fullData.size() < offset + 2) return;
             uint16_t dlen;
             memcpy(&dlen, fullData.c_str() + offset, 2);
             dlen = ntohs(dlen);
             offset += 2;
             
-            if (fullData.size() < offset + dlen) {
-                cout << "DEBUG: Object data too short for destination name" << endl;
-                return;
-            }
+            if (fullData.size() < offset + dlen) return;
             string dest(fullData.c_str() + offset, dlen);
             offset += dlen;
             
-            if (fullData.size() < offset + 4) {
-                cout << "DEBUG: Object data too short for object size" << endl;
-                return;
-            }
+            if (fullData.size() < offset + 4) return;
             uint32_t objSize;
             memcpy(&objSize, fullData.c_str() + offset, 4);
             objSize = ntohl(objSize);
             offset += 4;
             
-            cout << "DEBUG: Object size: " << objSize << ", available: " << (fullData.size() - offset) << endl;
-            
-            if (fullData.size() < offset + objSize) {
-                cout << "DEBUG: ERROR - Not enough data for object" << endl;
-                return;
-            }
+            if (fullData.size() < offset + objSize) return;
             vector<char> objectData(fullData.begin() + offset, fullData.begin() + offset + objSize);
             
-            cout << "DEBUG: Object data received, forwarding to " << dest << endl;
+            cout << sender << " sent object to " << dest << " (" << objSize << " bytes)" << endl;
             
             // Reenviar objeto al destinatario
-            vector<string> packets = buildObject(sender, objectData);
+            string packets = buildObject(sender, objectData);
             sendToClient(dest, packets);
             break;
         }
@@ -408,7 +657,7 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
             string dest(fullData.c_str() + offset, dlen);
             
             cout << sender << " sent game request to " << dest << endl;
-            vector<string> packets = buildGameRequest(sender);
+            string packets = buildGameRequest(sender);
             sendToClient(dest, packets);
             break;
         }
@@ -439,15 +688,16 @@ void processCompleteMessage(const string& client_nickname, const string& fullDat
             
             cout << sender << " responded to game request from " << responder << ": " << response << endl;
             
-            vector<string> packets = buildGameResponse(sender, response == 'y');
+            string packets = buildGameResponse(sender, response == 'y');
             sendToClient(responder, packets);
             
             if (response == 'y') {
                 lock_guard<mutex> lock(games_mutex);
                 pair<string, string> gameKey = make_pair(min(sender, responder), max(sender, responder));
                 initializeGame(activeGames[gameKey], sender, responder);
+                scheduleMoveTimeout(gameKey, activeGames[gameKey].turn);
                 
-                vector<string> boardPackets = buildBoard(activeGames[gameKey].board, activeGames[gameKey].currentPlayer);
+                string boardPackets = buildBoard(activeGames[gameKey].board, activeGames[gameKey].currentPlayer);
                 sendToClient(sender, boardPackets);
                 sendToClient(responder, boardPackets);
                 cout << "Game started between " << sender << " and " << responder << endl;
@@ -492,24 +742,70 @@ void processSimpleClientMessage(const string& client_nickname, const string& dat
     switch (messageType) {
         case 'l': { // List request
             cout << client_nickname << " requested client list" << endl;
-            vector<string> packets = buildList();
+            string packets = buildList();
             sendToClient(client_nickname, packets);
             break;
         }
         
-        case 'x': { // Close connection
-            cout << client_nickname << " disconnected" << endl;
-            {
+        case 'q': { // Sondeo de MTU: responder con un datagrama del mismo tamaño
+            if (data.size() < 5) return;
+            uint32_t probeSize = readU32(data, 1);
+            if (probeSize != data.size() + RECORD_HEADER_SIZE - 1) return;
+
+            string reply = buildProbe('Q', probeSize);
+            if (netsimSendto(server_fd, reply.c_str(), reply.size(), 0, (struct sockaddr*)&client_addr, addr_len) < 0) {
+                cout << "Probe reply of " << probeSize << " bytes to " << client_nickname << " failed: " << strerror(errno) << endl;
+            }
+            break;
+        }
+
+        case 'u': { // Opción de sesión
+            if (data.size() < 6) return;
+            char option = data[1];
+            uint32_t value = readU32(data, 2);
+            if (option == OPT_DATAGRAM_SIZE) {
+                size_t size = max((size_t)maxDatagramLength, min((size_t)value, (size_t)MAX_UDP_PAYLOAD));
+                lock_guard<mutex> lock(clients_mutex);
+                if (clients.count(client_nickname)) {
+                    clients[client_nickname].datagramSize = size;
+                }
+                cout << client_nickname << " datagram size set to " << size << " bytes" << endl;
+            } else if (option == OPT_FEC) {
+                int k = (value >> 8) & 0xFF;
+                int m = value & 0xFF;
+                if (k > MAX_FEC_DATA || m > MAX_FEC_PARITY || k == 0 || m == 0) {
+                    k = m = 0;
+                }
+                lock_guard<mutex> lock(clients_mutex);
+                if (clients.count(client_nickname)) {
+                    clients[client_nickname].fec = (k << 8) | m;
+                }
+                cout << client_nickname << " FEC set to " << k << " data + " << m << " parity" << endl;
+            } else if (option == OPT_MULTICAST && value == 0) {
+                // El cliente no pudo unirse al grupo: sus 'M' vuelven a unicast
                 lock_guard<mutex> lock(clients_mutex);
-                clients.erase(client_nickname);
+                if (clients.count(client_nickname)) {
+                    clients[client_nickname].caps &= ~CAP_MULTICAST;
+                }
+                cout << client_nickname << " left the multicast group" << endl;
             }
             break;
         }
+
+        case 'x': { // Close connection
+            cout << client_nickname << " disconnected" << endl;
+            disconnectClient(client_nickname);
+            break;
+        }
+
+        case 'h': // Heartbeat: la actividad ya quedó registrada al recibirlo
+            break;
         
         case 'm': // Broadcast message
         case 't': // Private message  
         case 'f': // File transfer
         case 'o': // Object transfer
+        case 'z': // Cualquiera de los anteriores, comprimido
         case 'J': // Game request
         case 'j': // Game response
         case 'P': // Game move
@@ -523,7 +819,492 @@ void processSimpleClientMessage(const string& client_nickname, const string& dat
     }
 }
 
-void processDatagram(int server_fd, char* buffer, int bytes_received, const sockaddr_in& client_addr, socklen_t addr_len, string client_nickname) {
+
+// Tipo del mensaje que se reconstruye; uno comprimido lleva el real delante
+char relayedType(const MessageReassembly& reassembly) {
+    if (reassembly.messageType == 'z' && !reassembly.chunks.empty() && !reassembly.chunks[0].empty()) {
+        return reassembly.chunks[0][0];
+    }
+    return reassembly.messageType;
+}
+
+// Con el fragmento 0 ya se conoce el destino: preparar el reenvío en corte.
+// Devuelve false si el mensaje hay que reconstruirlo entero. Uno comprimido
+// sigue comprimido ('Z') solo hacia quien negoció CAP_COMPRESS.
+bool startRelay(const MessageReassembly& reassembly, RelayTransfer& relay) {
+    const string& first = reassembly.chunks[0];
+    char type = relayedType(reassembly);
+    if (type != 'f' && type != 'o') return false;
+    bool compressed = reassembly.messageType == 'z';
+
+    // [largo remitente][remitente][largo destino][destino]... (tras el tipo real si va comprimido)
+    size_t start = compressed ? 1 : 0;
+    if (first.size() < start + 2) return false;
+    size_t offset = start + 2 + readU16(first, start);
+    if (first.size() < offset + 2) return false;
+    uint16_t dlen = readU16(first, offset);
+    if (first.size() < offset + 2 + dlen) return false;
+
+    relay.dest = first.substr(offset + 2, dlen);
+    relay.cutOffset = offset;
+    relay.cutLength = 2 + dlen;
+
+    lock_guard<mutex> lock(clients_mutex);
+    auto it = clients.find(relay.dest);
+    if (it == clients.end()) {
+        relay.dest.clear();
+        return true;
+    }
+
+    const ClientInfo& info = it->second;
+    if (!(info.caps & CAP_VARLEN)) return false;
+    if (compressed && !(info.caps & CAP_COMPRESS)) return false;
+    // El destinatario descomprime lo que diga la cabecera del flujo: si no
+    // entra en el presupuesto se reconstruye entero, y processCompleteMessage
+    // lo rechaza como a cualquier otro
+    uint64_t expanded;
+    if (compressed && (!expandedSize(first, expanded) || expanded > memoryBudget.largest())) return false;
+
+    relay.destWorker = info.worker;
+    relay.outType = compressed ? 'Z' : type == 'f' ? 'F' : 'O';
+    relay.outId = nextMessageId++;
+    relay.outData = (info.caps & CAP_FEC) ? info.fec >> 8 : 0;
+    relay.outParity = relay.outData ? info.fec & 0xFF : 0;
+    relay.outCrc = info.caps & CAP_CRC;
+    relay.outChunk = info.datagramSize - RECORD_HEADER_SIZE - FRAGMENT_HEADER_SIZE -
+                     (relay.outData ? fecOverhead(relay.outData) : 0) - (relay.outCrc ? CRC_OVERHEAD : 0);
+    relay.split = (first.size() + relay.outChunk - 1) / relay.outChunk;
+    relay.outCount = reassembly.chunks.size() * relay.split;
+    return relay.outCount <= MAX_FRAGMENTS;
+}
+
+// Reescribir un fragmento de entrada en los de salida (partido en 'split'
+// pedazos si el destinatario usa datagramas más chicos), más la paridad de
+// los bloques de salida que complete
+vector<string> relayChunk(RelayTransfer& relay, uint32_t index, string chunk) {
+    vector<string> out;
+    if (index == 0) {
+        chunk.erase(relay.cutOffset, relay.cutLength);
+        if (relay.outType == 'Z') {
+            chunk[0] = chunk[0] == 'f' ? 'F' : 'O';
+        }
+    }
+
+    for (uint32_t piece = 0; piece < relay.split; piece++) {
+        uint32_t outIndex = index * relay.split + piece;
+        size_t offset = piece * relay.outChunk;
+        // Los pedazos que sobran (fragmento 0 recortado, último fragmento) van vacíos
+        string part = offset < chunk.size() ? chunk.substr(offset, relay.outChunk) : string();
+        out.push_back(buildFragment(relay.outType, relay.outId, outIndex, relay.outCount, part));
+
+        if (relay.outData) {
+            uint32_t block = outIndex / relay.outData;
+            uint32_t n = min((uint32_t)relay.outData, relay.outCount - block * relay.outData);
+            ParityBlock& parity = relay.parity[block];
+            if (accumulateParity(parity, relay.outData, relay.outParity, n, outIndex % relay.outData, part)) {
+                vector<string> records = parityRecords(parity, relay.outType, relay.outId, relay.outCount,
+                                                       block, relay.outData, relay.outParity);
+                out.insert(out.end(), records.begin(), records.end());
+                relay.parity.erase(block);
+            }
+        }
+    }
+    return out;
+}
+
+// Liberar lo ya reenviado: sin FEC de entrada, el fragmento; con FEC, su
+// bloque cuando está completo (antes puede hacer falta para recuperar otro).
+// Devuelve los bytes liberados, para devolverlos al presupuesto.
+size_t releaseRelayed(MessageReassembly& reassembly, uint32_t index) {
+    int k = reassembly.fecData;
+    if (k == 0) {
+        size_t freed = reassembly.chunks[index].size();
+        string().swap(reassembly.chunks[index]);
+        return freed;
+    }
+
+    uint32_t base = index / k * k;
+    uint32_t end = min((uint32_t)reassembly.chunks.size(), base + k);
+    for (uint32_t i = base; i < end; i++) {
+        if (!reassembly.present[i]) return 0;
+    }
+    size_t freed = 0;
+    for (uint32_t i = base; i < end; i++) {
+        freed += reassembly.chunks[i].size();
+        string().swap(reassembly.chunks[i]);
+    }
+    auto parity = reassembly.parity.find(index / k);
+    if (parity != reassembly.parity.end()) {
+        for (auto& [row, shard] : parity->second) {
+            freed += shard.size();
+        }
+        reassembly.parity.erase(parity);
+    }
+    return freed;
+}
+
+// Contrapresión: si el destinatario tiene una ventana entera sin confirmar
+// (o el fragmento 0 no llega), el fragmento se descarta sin ACK y el emisor
+// lo reenvía más tarde
+bool relayWindowFull(const RelayTransfer* relay, const MessageReassembly& reassembly, uint32_t index) {
+    if (relay == nullptr) {
+        bool pending = !reassembly.chunks.empty() && !reassembly.present[0] &&
+                       (reassembly.messageType == 'f' || reassembly.messageType == 'o' || reassembly.messageType == 'z');
+        return index != 0 && pending && reassembly.receivedBytes > RELAY_WINDOW;
+    }
+    return relay->relaying && !relay->dest.empty() && workers[relay->destWorker]->backlog > RELAY_WINDOW;
+}
+
+// Sacar del spool lo que el destinatario pueda recibir. Cuando se vacía se
+// borra el archivo y, si ya llegó todo, el reenvío termina acá.
+void scheduleSpoolDrain(const string& key) {
+    Worker* worker = workers[currentWorker];
+    worker->timers.schedule(SPOOL_DRAIN_INTERVAL, [worker, key]() {
+        string destNickname;
+        ClientInfo destInfo;
+        vector<string> forward;
+        bool pending = false;
+        {
+            auto relayIt = worker->relays.find(key);
+            auto bufferIt = worker->messageBuffers.find(key);
+            if (relayIt == worker->relays.end() || bufferIt == worker->messageBuffers.end()) return; // se descartó
+            RelayTransfer& relay = relayIt->second;
+            MessageReassembly& reassembly = bufferIt->second;
+
+            bool online = false;
+            {
+                lock_guard<mutex> clientsLock(clients_mutex);
+                auto it = clients.find(relay.dest);
+                if (it != clients.end()) {
+                    online = true;
+                    destNickname = relay.dest;
+                    destInfo = it->second;
+                }
+            }
+
+            // Si el destinatario se fue, lo que esperaba se descarta
+            size_t sent = 0;
+            while (!relay.waiting.empty() &&
+                   (!online || (sent < SPOOL_DRAIN_BYTES && workers[relay.destWorker]->backlog <= RELAY_WINDOW))) {
+                SpooledFragment fragment = relay.waiting.front();
+                relay.waiting.pop_front();
+                if (!online) continue;
+                string chunk(fragment.length, '\0');
+                if (!relay.spool->read(fragment.offset, &chunk[0], fragment.length)) {
+                    cout << "Spool read failed, dropping relay " << key << " to " << relay.dest << endl;
+                    relay.dest.clear();
+                    online = false;
+                    forward.clear();
+                    continue;
+                }
+                vector<string> packets = relayChunk(relay, fragment.index, chunk);
+                if (fragment.index == 0 && relay.outCrc && reassembly.crcExpected) {
+                    packets[0] += buildPayloadCrc(relay.outId, reassembly.expectedCrc);
+                }
+                forward.insert(forward.end(), packets.begin(), packets.end());
+                sent += fragment.length;
+            }
+            if (sent > 0) {
+                reassembly.lastFragmentTime = time(nullptr); // no vence mientras avanza
+            }
+
+            if (!relay.waiting.empty()) {
+                pending = true;
+            } else {
+                relay.spool.reset();
+                if (isComplete(reassembly)) {
+                    cout << "Relayed message " << key << " to " << relay.dest << " (from spool): "
+                         << transferSummary(reassembly) << endl;
+                    worker->relays.erase(relayIt);
+                    worker->messageBuffers.erase(bufferIt);
+                    worker->reassemblyMemory.erase(key);
+                    worker->completedMessages.insert(key);
+                }
+            }
+        }
+
+        if (!forward.empty()) {
+            deliverToClient(destNickname, destInfo, forward);
+        }
+        if (pending) {
+            scheduleSpoolDrain(key);
+        }
+    });
+}
+
+// Un reenvío con el destinatario atrasado sigue en el spool en vez de frenar
+// al emisor. false si no hay spool o no queda lugar para otra ventana (los
+// fragmentos de un datagrama entran en una): rige la contrapresión.
+bool spoolRelay(RelayTransfer& relay, const string& key) {
+    if (relay.dest.empty() || !spoolDirectory().fits(SPOOL_WINDOW)) return false;
+    if (relay.spool == nullptr) {
+        relay.spool = SpoolFile::create();
+        if (relay.spool == nullptr) return false;
+        cout << "Relay " << key << " to " << relay.dest << " backlogged, spooling to disk" << endl;
+        scheduleSpoolDrain(key);
+    }
+    return true;
+}
+
+// Pasar un fragmento al spool; devuelve los bytes que dejan de ocupar memoria
+size_t spoolFragment(RelayTransfer& relay, MessageReassembly& reassembly, uint32_t index) {
+    const string& chunk = reassembly.chunks[index];
+    uint64_t offset = relay.spool->size();
+    if (!relay.spool->append(chunk.data(), chunk.size())) {
+        cout << "Spool write failed, dropping relay to " << relay.dest << endl;
+        relay.dest.clear();
+        relay.waiting.clear();
+    } else {
+        relay.waiting.push_back({index, offset, chunk.size()});
+    }
+    return releaseRelayed(reassembly, index);
+}
+
+// Buscar o crear la reconstrucción de un mensaje en el worker actual. Al
+// crearla se agenda su descarte por inactividad.
+MessageReassembly& reassemblyFor(const string& key) {
+    Worker* worker = workers[currentWorker];
+    auto [it, inserted] = worker->messageBuffers.try_emplace(key);
+    if (inserted) {
+        scheduleReassemblyExpiry(worker->messageBuffers, key, REASSEMBLY_TIMEOUT);
+    }
+    return it->second;
+}
+
+// Procesar un datagrama varlen: uno o más registros, simples o fragmentos
+void processVarlenDatagram(int server_fd, const string& data, const sockaddr_in& client_addr, socklen_t addr_len, const string& client_nickname, uint16_t caps) {
+    Worker* worker = workers[currentWorker];
+    vector<Record> records;
+    if (!parseRecords(data, records)) {
+        cout << "Malformed datagram from " << client_nickname << endl;
+        return;
+    }
+
+    // Los ACK de todos los fragmentos del datagrama salen en una sola respuesta
+    string acks;
+
+    // El CRC del contenido viaja junto al fragmento 0: se guarda antes de procesarlo
+    for (const auto& record : records) {
+        if (record.type != PAYLOAD_CRC_RECORD || record.body.size() < 8) continue;
+        string key = client_nickname + ":" + to_string(readU32(record.body, 0));
+        if (worker->completedMessages.contains(key)) continue;
+        MessageReassembly& reassembly = reassemblyFor(key);
+        reassembly.crcExpected = true;
+        reassembly.expectedCrc = readU32(record.body, 4);
+    }
+
+    for (const auto& record : records) {
+        if (record.type == PAYLOAD_CRC_RECORD) continue;
+        if (record.type == ACK_RECORD) {
+            if (record.body.size() < 8) continue;
+            // Un ACK sin emisor (par desconocido o sesión ya cerrada) se ignora:
+            // no debe crear un PacedSession que nadie borraría
+            auto pacer = workers[currentWorker]->pacers.find(client_nickname);
+            if (pacer == workers[currentWorker]->pacers.end()) continue;
+            pacer->second.sender.onAck(readU32(record.body, 0), readU32(record.body, 4));
+            reportTransfers(client_nickname, pacer->second.sender);
+            continue;
+        }
+
+        if (record.type != FRAGMENT_RECORD && record.type != PARITY_RECORD) {
+            processSimpleClientMessage(client_nickname, string(1, record.type) + record.body, record.type, client_addr, addr_len, server_fd);
+            continue;
+        }
+
+        FragmentHeader header;
+        ParityHeader parityHeader;
+        string chunk;
+        bool isParity = record.type == PARITY_RECORD;
+        if (isParity) {
+            if (!parseParity(record.body, parityHeader, chunk)) continue;
+            header.messageType = parityHeader.messageType;
+            header.messageId = parityHeader.messageId;
+            header.index = parityHeader.index;
+        } else if (!parseFragment(record.body, header, chunk)) {
+            continue;
+        }
+
+        string fullData;
+        bool complete = false;
+        bool relayed = false;
+        bool intact = true;
+        RelayTransfer* relay = nullptr;
+        string destNickname;
+        ClientInfo destInfo;
+        vector<string> forward;
+        {
+            string key = client_nickname + ":" + to_string(header.messageId);
+            if (worker->completedMessages.contains(key)) { // retransmisión tardía
+                if (caps & CAP_PACING) {
+                    acks += buildAck(header.messageId, header.index);
+                }
+                continue;
+            }
+            MessageReassembly& reassembly = reassemblyFor(key);
+            auto relayIt = worker->relays.find(key);
+            if (relayIt != worker->relays.end()) {
+                relay = &relayIt->second;
+            }
+
+            // Con el destinatario atrasado (o fragmentos ya esperando) se usa el spool
+            bool spooled = relay != nullptr && relay->relaying &&
+                           (!relay->waiting.empty() || relayWindowFull(relay, reassembly, header.index)) &&
+                           spoolRelay(*relay, key);
+            if ((caps & CAP_PACING) && !spooled && relayWindowFull(relay, reassembly, header.index)) {
+                continue;
+            }
+
+            // Lo que se va a guardar se cobra antes al presupuesto (con el primer
+            // registro, también el índice de fragmentos). Sin lugar el registro
+            // no se confirma y el emisor lo reenvía más tarde; un mensaje que no
+            // entra en el límite del cliente se descarta entero.
+            bool stores = isParity || reassembly.chunks.empty() ||
+                          (header.index < reassembly.present.size() && !reassembly.present[header.index]);
+            if (stores) {
+                uint64_t cost = chunk.size();
+                if (reassembly.chunks.empty()) {
+                    cost += (uint64_t)(isParity ? parityHeader.count : header.count) * (sizeof(string) + 1);
+                }
+                MemoryResult result = memoryBudget.reserve(client_nickname, MEMORY_REASSEMBLY, cost, worker->reassemblyMemory[key]);
+                if (result == MEMORY_TOO_LARGE) {
+                    string error = "Message too large for the memory budget (" + memoryBudget.description() + ")";
+                    cout << client_nickname << " message " << header.messageId << ": " << error << endl;
+                    sendToClient(client_nickname, buildError(error));
+                    worker->relays.erase(key);
+                    worker->messageBuffers.erase(key);
+                    worker->reassemblyMemory.erase(key);
+                    worker->completedMessages.insert(key); // lo que siga llegando se confirma y se descarta
+                    continue;
+                }
+                if (result == MEMORY_BUSY) {
+                    noticeClient(client_nickname, (caps & CAP_PACING) ? "Server busy, memory budget exhausted, message deferred"
+                                                                     : "Server busy, memory budget exhausted, message dropped");
+                    continue;
+                }
+            }
+            if (caps & CAP_PACING) {
+                acks += buildAck(header.messageId, header.index);
+            }
+
+            // Fragmentos de datos nuevos: el recibido y los reconstruidos por FEC,
+            // que se confirman como si hubieran llegado
+            vector<uint32_t> arrived;
+            if (isParity) {
+                arrived = addParityRecord(reassembly, parityHeader, chunk);
+            } else {
+                bool duplicate = !reassembly.chunks.empty() && header.index < reassembly.present.size() &&
+                                 reassembly.present[header.index];
+                addFragment(reassembly, header, chunk);
+                arrived = recoverAfterFragment(reassembly, header.index);
+                if (!duplicate) {
+                    arrived.push_back(header.index);
+                }
+            }
+            if (caps & CAP_PACING) {
+                for (uint32_t index : arrived) {
+                    if (isParity || index != header.index) {
+                        acks += buildAck(header.messageId, index);
+                    }
+                }
+            }
+
+            // Con el fragmento 0 se decide si el mensaje se reenvía en corte
+            if (relay == nullptr && !reassembly.chunks.empty() && reassembly.present[0] && reassembly.chunks.size() > 1) {
+                RelayTransfer transfer = {};
+                transfer.relaying = startRelay(reassembly, transfer);
+                // El límite de archivos se cobra al empezar, con el tamaño estimado;
+                // si se excede, los fragmentos se confirman y se descartan
+                if (transfer.relaying && !transfer.dest.empty() &&
+                    rejectOverLimit(client_nickname, relayedType(reassembly),
+                                    (double)reassembly.chunks.size() * reassembly.chunks[0].size())) {
+                    transfer.dest.clear();
+                }
+                relay = &worker->relays.emplace(key, transfer).first->second;
+                if (relay->relaying) {
+                    lock_guard<mutex> clientsLock(clients_mutex);
+                    if (reassembly.fecData == 0 && clients.count(client_nickname) && (caps & CAP_FEC)) {
+                        reassembly.fecData = clients[client_nickname].fec >> 8;
+                    }
+                    cout << client_nickname << " relaying " << reassembly.messageType << " to "
+                         << (relay->dest.empty() ? "(disconnected)" : relay->dest) << " (cut-through)" << endl;
+                    // Los fragmentos que esperaban al 0 salen ahora
+                    arrived.clear();
+                    for (uint32_t index = 0; index < reassembly.present.size(); index++) {
+                        if (reassembly.present[index]) arrived.push_back(index);
+                    }
+                }
+            }
+
+            if (relay != nullptr && relay->relaying) {
+                relayed = true;
+                sort(arrived.begin(), arrived.end());
+                for (uint32_t index : arrived) {
+                    if (spooled && !relay->dest.empty()) {
+                        worker->reassemblyMemory[key].shrink(spoolFragment(*relay, reassembly, index));
+                        continue;
+                    }
+                    if (!relay->dest.empty()) {
+                        vector<string> packets = relayChunk(*relay, index, reassembly.chunks[index]);
+                        // El CRC es del contenido, que el reenvío no cambia
+                        if (index == 0 && relay->outCrc && reassembly.crcExpected) {
+                            packets[0] += buildPayloadCrc(relay->outId, reassembly.expectedCrc);
+                        }
+                        forward.insert(forward.end(), packets.begin(), packets.end());
+                    }
+                    worker->reassemblyMemory[key].shrink(releaseRelayed(reassembly, index));
+                }
+                if (!forward.empty()) {
+                    lock_guard<mutex> clientsLock(clients_mutex);
+                    if (clients.count(relay->dest)) {
+                        destNickname = relay->dest;
+                        destInfo = clients[relay->dest];
+                    } else {
+                        forward.clear();
+                    }
+                }
+            } else {
+                // Sin reenvío en corte los fragmentos quedan guardados: el CRC
+                // del contenido avanza con el prefijo contiguo
+                intact = advancePayloadCrc(reassembly);
+            }
+
+            // Un reenvío con fragmentos en el spool lo termina scheduleSpoolDrain
+            if (isComplete(reassembly) && (relay == nullptr || relay->waiting.empty())) {
+                if (relayed) {
+                    cout << "Relayed message " << header.messageId << " from " << client_nickname << " to "
+                         << relay->dest << ": " << transferSummary(reassembly) << endl;
+                } else if (intact) {
+                    fullData = joinFragments(reassembly);
+                    complete = true;
+                } else {
+                    cout << "Corrupt " << reassembly.messageType << " message " << header.messageId << " from "
+                         << client_nickname << " (payload CRC32C mismatch, " << ++corruptPayloads << " so far), dropped" << endl;
+                }
+                worker->relays.erase(key);
+                worker->messageBuffers.erase(key);
+                worker->reassemblyMemory.erase(key);
+                worker->completedMessages.insert(key);
+            }
+        }
+
+        if (!forward.empty()) {
+            deliverToClient(destNickname, destInfo, forward);
+        }
+
+        if (complete) {
+            processCompleteMessage(client_nickname, fullData, header.messageType, client_addr, addr_len, server_fd);
+        }
+    }
+
+    if (!acks.empty()) {
+        if (caps & CAP_CRC) {
+            acks = sealDatagram(acks);
+        }
+        netsimSendto(server_fd, acks.c_str(), acks.size(), 0, (struct sockaddr*)&client_addr, addr_len);
+    }
+}
+
+void processDatagram(int server_fd, char* buffer, int bytes_received, const sockaddr_in& client_addr, socklen_t addr_len, string client_nickname, uint16_t caps) {
     if (bytes_received < 1) return;
 
     string data(buffer, bytes_received);
@@ -539,6 +1320,19 @@ void processDatagram(int server_fd, char* buffer, int bytes_received, const sock
         return;
     }
 
+    // Con CAP_CRC un datagrama dañado se descarta entero; si traía fragmentos
+    // con control de congestión, el emisor los reenvía al no recibir el ACK
+    if ((caps & CAP_CRC) && !openDatagram(data)) {
+        cout << "Corrupt datagram of " << bytes_received << " bytes from " << client_nickname
+             << " (CRC32C mismatch, " << ++corruptDatagrams << " so far), dropped" << endl;
+        return;
+    }
+
+    if (caps & CAP_VARLEN) {
+        processVarlenDatagram(server_fd, data, client_addr, addr_len, client_nickname, caps);
+        return;
+    }
+
     // Determinar si es un mensaje simple o fragmentado
     char firstByte = data[0];
     
@@ -558,79 +1352,258 @@ void processDatagram(int server_fd, char* buffer, int bytes_received, const sock
     
     if (reconstructPacket(client_id, fragment, fullData, messageType)) {
         // Mensaje completo reconstruido
-        cout << "DEBUG: Reconstructed complete message of type: " << messageType << ", size: " << fullData.size() << endl;
         processCompleteMessage(client_nickname, fullData, messageType, client_addr, addr_len, server_fd);
-    } else {
-        // Fragmento recibido pero aún no está completo
-        cout << "DEBUG: Received fragment from " << client_nickname << ", type: " << messageType 
-             << ", total fragments: " << reassemblyBuffers[client_id].fragments.size() << endl;
     }
 }
 
 // Build close connection message
-vector<string> buildClose() {
-    string packet = "X";
-    vector<string> packets;
-    packets.push_back(completeDatagram(packet));
-    return packets;
+string buildClose() {
+    return "X";
 }
 
-// send a message to everyone except who is sending
-void sendAll(const vector<string> packets, const string& sender_nickname) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (auto client : clients) {
-        if (client.first != sender_nickname) {
-            for (const auto& packet : packets) {
-                cout << "TO " << client.first << ": " << packet.substr(0, 100) << (packet.length() > 100 ? "..." : "") << endl;
-                
-                sendto(client.second.socket_fd,
-                       packet.c_str(),
-                       packet.size(),
-                       0,
-                       (struct sockaddr*)&client.second.address,
-                       client.second.addr_len);
-            }
+// Enviar un datagrama ya armado desde el socket de este worker, sellado con
+// CRC32C si la sesión lo negoció. Sale enseguida, sin PacedSender: lo usan
+// los registros agrupados, los datagramas hacia sesiones sin control de
+// congestión y los desafíos de migración.
+void sendToAddress(Worker* worker, const string& packet, const sockaddr_in& address, socklen_t addr_len, bool crc) {
+    string datagram = crc ? sealDatagram(packet) : packet;
+    netsimSendto(worker->socket_fd,
+           datagram.c_str(),
+           datagram.size(),
+           0,
+           (struct sockaddr*)&address,
+           addr_len);
+}
+
+// Enviar el datagrama con los registros agrupados hacia un cliente
+void flushPending(Worker* worker, const string& nickname) {
+    auto it = worker->coalescing.find(nickname);
+    if (it == worker->coalescing.end()) return;
+    sendToAddress(worker, it->second.records, it->second.address, it->second.addr_len, it->second.crc);
+    worker->coalescing.erase(it);
+}
+
+// Enviar los datagramas agrupados cuya demora venció. Devuelve los
+// microsegundos hasta el próximo vencimiento (-1 = ninguno).
+long flushCoalesced(Worker* worker) {
+    Clock::time_point now = Clock::now();
+    long next = -1;
+    for (auto it = worker->coalescing.begin(); it != worker->coalescing.end();) {
+        if (it->second.deadline <= now) {
+            sendToAddress(worker, it->second.records, it->second.address, it->second.addr_len, it->second.crc);
+            it = worker->coalescing.erase(it);
+            continue;
+        }
+        long wait = chrono::duration_cast<chrono::microseconds>(it->second.deadline - now).count() + 1;
+        if (next < 0 || wait < next) {
+            next = wait;
         }
+        ++it;
     }
+    return next;
 }
 
-// send a message to a specific client
-void sendToClient(const string dest, const vector<string> packets) {
-    lock_guard<mutex> lock(clients_mutex);
-    if (clients.count(dest)) {
-        for (const auto& packet : packets) {
-            cout << "TO " << dest << ": " << packet.substr(0, 100) << (packet.length() > 100 ? "..." : "") << endl;
-            
-            sendto(clients[dest].socket_fd,
-                   packet.c_str(),
-                   packet.size(),
+// Enviar datagramas a un cliente de este worker. Los mensajes fragmentados
+// hacia sesiones con control de congestión pasan por su PacedSender, y los
+// mensajes de un solo registro hacia clientes varlen esperan hasta
+// coalesceDelayUs para compartir datagrama con otros.
+void transmit(Worker* worker, const string& nickname, const ClientInfo& info, const vector<string>& packets) {
+    if (packets.empty()) return;
+
+    bool fragments = packets[0][0] == FRAGMENT_RECORD || packets[0][0] == PARITY_RECORD;
+    if ((info.caps & CAP_VARLEN) && !fragments && packets.size() == 1 && coalesceDelayUs > 0) {
+        const string& record = packets[0];
+        size_t limit = info.datagramSize - ((info.caps & CAP_CRC) ? CRC_TRAILER_SIZE : 0);
+        auto it = worker->coalescing.find(nickname);
+        if (it != worker->coalescing.end() && it->second.records.size() + record.size() > limit) {
+            flushPending(worker, nickname);
+            it = worker->coalescing.end();
+        }
+        if (it == worker->coalescing.end()) {
+            it = worker->coalescing.emplace(nickname, PendingDatagram()).first;
+            it->second.deadline = Clock::now() + chrono::microseconds(coalesceDelayUs);
+        }
+        it->second.records += record;
+        it->second.address = info.address;
+        it->second.addr_len = info.addr_len;
+        it->second.crc = info.caps & CAP_CRC;
+        return;
+    }
+
+    // Lo ya agrupado sale antes, para no alterar el orden hacia el cliente
+    flushPending(worker, nickname);
+
+    // Los fragmentos y la paridad van por el PacedSender; un mensaje reenviado
+    // en corte llega de a pocos fragmentos
+    if ((info.caps & CAP_PACING) && fragments) {
+        PacedSession& session = worker->pacers[nickname];
+        session.address = info.address;
+        session.addr_len = info.addr_len;
+        session.crc = info.caps & CAP_CRC;
+        session.sender.enqueue(packets);
+        return;
+    }
+
+    for (const auto& packet : packets) {
+        sendToAddress(worker, packet, info.address, info.addr_len, (info.caps & CAP_VARLEN) && (info.caps & CAP_CRC));
+    }
+}
+
+// Enviar datagramas a un cliente desde el worker dueño de su sesión.
+// Si el cliente pertenece a otro worker, se encolan y se despierta a ese worker.
+void deliverToClient(const string& nickname, const ClientInfo& info, const vector<string>& packets) {
+    if (info.worker == currentWorker) {
+        transmit(workers[currentWorker], nickname, info, packets);
+        return;
+    }
+
+    Worker* owner = workers[info.worker];
+    {
+        lock_guard<mutex> lock(owner->queue_mutex);
+        owner->queue.push_back({nickname, info, packets});
+    }
+    uint64_t one = 1;
+    write(owner->wake_fd, &one, sizeof(one));
+}
+
+// Enviar los datagramas que otros workers dejaron en la cola de este worker
+void flushWorkerQueue(Worker* worker) {
+    deque<OutboundDatagram> pending;
+    {
+        lock_guard<mutex> lock(worker->queue_mutex);
+        pending.swap(worker->queue);
+    }
+    for (const auto& out : pending) {
+        transmit(worker, out.nickname, out.info, out.packets);
+    }
+}
+
+// Mostrar las transferencias que terminó de confirmar un emisor
+void reportTransfers(const string& nickname, PacedSender& sender) {
+    string summary;
+    bool any = false;
+    while (sender.popCompleted(summary)) {
+        cout << "Transfer to " << nickname << ": " << summary << endl;
+        any = true;
+    }
+    if (any) {
+        cout << "Session " << nickname << ": " << sender.summary() << endl;
+    }
+}
+
+// Dar servicio a los emisores con control de congestión de este worker.
+// Devuelve los microsegundos hasta el próximo envío o vencimiento (-1 = ninguno).
+long pumpPacers(Worker* worker) {
+    long next = -1;
+    size_t backlog = 0;
+    for (auto& [nickname, session] : worker->pacers) {
+        long wait = session.sender.pump([&](const string& packet) {
+            string datagram = session.crc ? sealDatagram(packet) : packet;
+            netsimSendto(worker->socket_fd,
+                   datagram.c_str(),
+                   datagram.size(),
                    0,
-                   (struct sockaddr*)&clients[dest].address,
-                   clients[dest].addr_len);
+                   (struct sockaddr*)&session.address,
+                   session.addr_len);
+        });
+        reportTransfers(nickname, session.sender);
+        backlog += session.sender.queuedBytes();
+        if (wait >= 0 && (next < 0 || wait < next)) {
+            next = wait;
         }
     }
+    worker->backlog = backlog;
+    return next;
+}
+
+// Codificar un mensaje en el formato que negoció el cliente
+vector<string> encodeForClient(const ClientInfo& info, const string& message) {
+    if (info.caps & CAP_VARLEN) {
+        int k = info.fec >> 8;
+        int m = info.fec & 0xFF;
+        bool crc = info.caps & CAP_CRC;
+        size_t size = info.datagramSize - (crc ? CRC_OVERHEAD : 0);
+        uint32_t messageId = nextMessageId++;
+        vector<string> packets;
+        if ((info.caps & CAP_FEC) && k > 0) {
+            packets = addParity(encodeVarlen(message, messageId, size - fecOverhead(k)), k, m);
+        } else {
+            packets = encodeVarlen(message, messageId, size);
+        }
+        if (crc) {
+            addPayloadCrc(packets, message, messageId);
+        }
+        return packets;
+    }
+    return encodeLegacy(message);
+}
+
+// send a message to everyone except who is sending
+void sendAll(const string message, const string& sender_nickname) {
+    // Solo se copian los destinatarios con el lock; codificar y entregar
+    // va sin él, así los demás workers no esperan a este broadcast
+    vector<pair<string, ClientInfo>> recipients;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        recipients.reserve(clients.size());
+        for (const auto& client : clients) {
+            if (client.first != sender_nickname) {
+                recipients.push_back(client);
+            }
+        }
+    }
+
+    // Los miembros del grupo reciben el 'M' con un solo envío, sin importar
+    // cuántos sean; el resto sigue por unicast
+    bool multicast = false;
+    if (multicastSocket >= 0 && message[0] == 'M') {
+        vector<string> packets = encodeVarlen(message, nextMessageId++, MULTICAST_DATAGRAM_SIZE);
+        if (packets.size() == 1) {
+            netsimSendto(multicastSocket, packets[0].c_str(), packets[0].size(), 0,
+                   (struct sockaddr*)&multicastAddress, sizeof(multicastAddress));
+            multicast = true;
+        }
+    }
+
+    // Cada formato, tamaño de datagrama, FEC y CRC se codifica una sola vez (0 = padded)
+    map<size_t, vector<string>> encoded;
+    for (const auto& client : recipients) {
+        if (multicast && (client.second.caps & CAP_MULTICAST)) continue;
+        size_t key = (client.second.caps & CAP_VARLEN) ?
+                     (client.second.datagramSize << 17) | ((client.second.caps & CAP_CRC) ? 1 << 16 : 0) | client.second.fec : 0;
+        vector<string>& packets = encoded[key];
+        if (packets.empty()) {
+            packets = encodeForClient(client.second, message);
+        }
+        deliverToClient(client.first, client.second, packets);
+    }
+}
+
+// send a message to a specific client
+void sendToClient(const string dest, const string message) {
+    ClientInfo info;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        auto it = clients.find(dest);
+        if (it == clients.end()) return;
+        info = it->second;
+    }
+    deliverToClient(dest, info, encodeForClient(info, message));
 }
 
 // Build the error message with the protocol
-vector<string> buildError(const string& msg) {
+string buildError(const string& msg) {
     string packet = "E";
     uint32_t len = msg.size();
     packet.push_back((len >> 16) & 0xFF);
     packet.push_back((len >> 8) & 0xFF);
     packet.push_back(len & 0xFF);
     packet += msg;
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        return fragmentDatagram("E", msg, 3);
-    }
+    return packet;
 }
 
 // Build the message with the protocol
-vector<string> buildBroadcast(const string& sender, const string& msg) {
+string buildBroadcast(const string& sender, const string& msg) {
     string packet = "M";
     uint16_t slen = htons(sender.size());
     packet.append((char*)&slen, 2);
@@ -640,18 +1613,11 @@ vector<string> buildBroadcast(const string& sender, const string& msg) {
     packet.push_back((mlen >> 8) & 0xFF);
     packet.push_back(mlen & 0xFF);
     packet += msg;
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        return fragmentDatagram("M" + string((char*)&slen, 2) + sender, msg, 3);
-    }
+    return packet;
 }
 
 // Build the message to a specific client with the protocol
-vector<string> buildToClient(const string& sender, const string& msg) {
+string buildToClient(const string& sender, const string& msg) {
     string packet = "T";
     uint16_t slen = htons(sender.size());
     packet.append((char*)&slen, 2);
@@ -661,18 +1627,11 @@ vector<string> buildToClient(const string& sender, const string& msg) {
     packet.push_back((mlen >> 8) & 0xFF);
     packet.push_back(mlen & 0xFF);
     packet += msg;
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        return fragmentDatagram("T" + string((char*)&slen, 2) + sender, msg, 3);
-    }
+    return packet;
 }
 
 //Build list with the protocol
-vector<string> buildList() {
+string buildList() {
     lock_guard<mutex> lock(clients_mutex);
     string all;
     for (auto client : clients) {
@@ -685,15 +1644,11 @@ vector<string> buildList() {
     uint16_t total_len = htons(all.size());
     packet.append((char*)&total_len, 2);
     packet += all;
-    
-    packet = completeDatagram(packet);
-    vector<string> packets;
-    packets.push_back(packet);
-    return packets;
+    return packet;
 }
 
 // Function to build file message
-vector<string> buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size) {
+string buildFile(const string& sender, const string& filename, const char* file_data, uint64_t file_size) {
     string packet = "F";
     
     uint16_t slen = htons(sender.size());
@@ -712,27 +1667,11 @@ vector<string> buildFile(const string& sender, const string& filename, const cha
     }
     
     packet.append(file_data, file_size);
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        string header = "F" + string((char*)&slen, 2) + sender;
-        header.push_back((flen >> 16) & 0xFF);
-        header.push_back((flen >> 8) & 0xFF);
-        header.push_back(flen & 0xFF);
-        header += filename;
-        for (int i = 9; i >= 0; i--) {
-            header.push_back((file_size >> (i * 8)) & 0xFF);
-        }
-        
-        return fragmentDatagram(header, string(file_data, file_size), 0);
-    }
+    return packet;
 }
 
 // Function to build object message
-vector<string> buildObject(const string& sender, const vector<char>& objectData) {
+string buildObject(const string& sender, const vector<char>& objectData) {
     string packet = "O";
     
     uint16_t slen = htons(sender.size());
@@ -743,41 +1682,27 @@ vector<string> buildObject(const string& sender, const vector<char>& objectData)
     packet.append(reinterpret_cast<const char*>(&objSize), sizeof(objSize));
     
     packet.append(objectData.data(), objectData.size());
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        string header = "O" + string((char*)&slen, 2) + sender;
-        header.append(reinterpret_cast<const char*>(&objSize), sizeof(objSize));
-        
-        return fragmentDatagram(header, string(objectData.data(), objectData.size()), 0);
-    }
+    return packet;
 }
 
-vector<string> buildGameRequest(const string& sender) {
+string buildGameRequest(const string& sender) {
     string packet = "J";
     uint16_t slen = htons(sender.size());
     packet.append((char*)&slen, 2);
     packet += sender;
-    vector<string> packets;
-    packets.push_back(completeDatagram(packet));
-    return packets;
+    return packet;
 }
 
-vector<string> buildGameResponse(const string& sender, bool accepted) {
+string buildGameResponse(const string& sender, bool accepted) {
     string packet = "j";
     uint16_t slen = htons(sender.size());
     packet.append((char*)&slen, 2);
     packet += sender;
     packet.push_back(accepted ? 'y' : 'n');
-    vector<string> packets;
-    packets.push_back(completeDatagram(packet));
-    return packets;
+    return packet;
 }
 
-vector<string> buildBoard(const vector<char>& board, const string& currentPlayer) {
+string buildBoard(const vector<char>& board, const string& currentPlayer) {
     string packet = "B";
     uint16_t board_len = htons(board.size());
     packet.append((char*)&board_len, 2);
@@ -786,25 +1711,13 @@ vector<string> buildBoard(const vector<char>& board, const string& currentPlayer
     uint16_t player_len = htons(currentPlayer.size());
     packet.append((char*)&player_len, 2);
     packet += currentPlayer;
-    
-    if (packet.size() <= (size_t)maxDatagramLength) {
-        vector<string> packets;
-        packets.push_back(completeDatagram(packet));
-        return packets;
-    } else {
-        string header = "B" + string((char*)&board_len, 2);
-        string data = string(board.begin(), board.end()) + string((char*)&player_len, 2) + currentPlayer;
-        
-        return fragmentDatagram(header, data, 0);
-    }
+    return packet;
 }
 
-vector<string> buildGameResult(char result) {
+string buildGameResult(char result) {
     string packet = "W";
     packet.push_back(result);
-    vector<string> packets;
-    packets.push_back(completeDatagram(packet));
-    return packets;
+    return packet;
 }
 
 bool checkWinner(const vector<char>& board, char player) {
@@ -835,6 +1748,7 @@ void initializeGame(Game& game, const string& p1, const string& p2) {
     game.board = vector<char>(9, ' ');
     game.currentPlayer = p1;
     game.gameActive = true;
+    game.turn = nextTurn++;
 }
 
 void processGameMove(const string& player, uint32_t position) {
@@ -854,19 +1768,19 @@ void processGameMove(const string& player, uint32_t position) {
     }
     
     if (!currentGame) {
-        vector<string> err = buildError("No active game found");
+        string err = buildError("No active game found");
         sendToClient(player, err);
         return;
     }
     
     if (currentGame->currentPlayer != player) {
-        vector<string> err = buildError("Not your turn");
+        string err = buildError("Not your turn");
         sendToClient(player, err);
         return;
     }
     
     if (position >= 9) {
-        vector<string> err = buildError("Invalid position");
+        string err = buildError("Invalid position");
         sendToClient(player, err);
         return;
     }
@@ -876,15 +1790,15 @@ void processGameMove(const string& player, uint32_t position) {
         
         char currentSymbol = (player == currentGame->player1) ? 'X' : 'O';
         if (checkWinner(currentGame->board, currentSymbol)) {
-            vector<string> result1 = buildGameResult('1');
-            vector<string> result2 = buildGameResult('0');
+            string result1 = buildGameResult('1');
+            string result2 = buildGameResult('0');
             sendToClient(player, result1);
             sendToClient(opponent, result2);
             currentGame->gameActive = false;
             activeGames.erase(gameKey);
             cout << "Game finished. Winner: " << player << endl;
         } else if (checkIsPositionUsed(currentGame->board)) {
-            vector<string> result = buildGameResult('2');
+            string result = buildGameResult('2');
             sendToClient(player, result);
             sendToClient(opponent, result);
             currentGame->gameActive = false;
@@ -892,77 +1806,615 @@ void processGameMove(const string& player, uint32_t position) {
             cout << "Game finished in draw between " << player << " and " << opponent << endl;
         } else {
             currentGame->currentPlayer = opponent;
-            vector<string> boardPackets = buildBoard(currentGame->board, currentGame->currentPlayer);
+            currentGame->turn = nextTurn++;
+            scheduleMoveTimeout(gameKey, currentGame->turn);
+            string boardPackets = buildBoard(currentGame->board, currentGame->currentPlayer);
             sendToClient(player, boardPackets);
             sendToClient(opponent, boardPackets);
             cout << "Turn switched to: " << currentGame->currentPlayer << endl;
         }
     } else {
-        vector<string> err = buildError("Position already occupied");
+        string err = buildError("Position already occupied");
         sendToClient(player, err);
     }
 }
 
-void handleClient(int server_fd) {
-    char buffer[MAX_DATAGRAM_SIZE];
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    
-    int bytes_received = recvfrom(server_fd, 
-                                  buffer, 
-                                  MAX_DATAGRAM_SIZE, 
-                                  0, 
-                                  (struct sockaddr*)&client_addr, 
-                                  &addr_len);
-
-    if (bytes_received <= 0) {
-        return;
+// Sacar a un cliente: sesión, emisores de su worker y partidas en curso
+void disconnectClient(const string& nickname) {
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        if (clients.count(nickname)) {
+            sessions.erase(clients[nickname].sessionId);
+        }
+        clients.erase(nickname);
+    }
+    rateLimiter.forget(nickname);
+    workers[currentWorker]->pacers.erase(nickname);
+    workers[currentWorker]->coalescing.erase(nickname);
+
+    lock_guard<mutex> lock(games_mutex);
+    for (auto it = activeGames.begin(); it != activeGames.end();) {
+        if (it->second.player1 == nickname || it->second.player2 == nickname) {
+            string otherPlayer = it->second.player1 == nickname ? it->second.player2 : it->second.player1;
+            sendToClient(otherPlayer, buildGameResult('3'));
+            it = activeGames.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+Clock::duration sessionTimeout(const ClientInfo& info) {
+    if (info.caps & CAP_HEARTBEAT) {
+        return SESSION_TIMEOUT;
+    }
+    return LEGACY_SESSION_TIMEOUT;
+}
+
+// Revisar la inactividad de una sesión dentro de 'delay'. Los vencimientos
+// se agendan en la rueda del worker dueño de la sesión, así corren en su hilo.
+// En vez de reagendar con cada datagrama, al vencer se mira lastSeen y, si
+// hubo actividad, se vuelve a agendar por lo que falta.
+void scheduleSessionExpiry(const string& nickname, Clock::time_point connectedAt, Clock::duration delay) {
+    auto wait = chrono::duration_cast<chrono::milliseconds>(delay);
+    workers[currentWorker]->timers.schedule(wait, [nickname, connectedAt]() {
+        Clock::duration timeout;
+        Clock::duration remaining;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            auto it = clients.find(nickname);
+            // Ya se fue, o es otra sesión con el mismo nickname
+            if (it == clients.end() || it->second.connectedAt != connectedAt) return;
+            timeout = sessionTimeout(it->second);
+            remaining = timeout - (Clock::now() - it->second.lastSeen);
+        }
+        if (remaining > Clock::duration::zero()) {
+            scheduleSessionExpiry(nickname, connectedAt, remaining);
+            return;
+        }
+        cout << nickname << " timed out (no datagrams for "
+             << chrono::duration_cast<chrono::seconds>(timeout).count() << " s)" << endl;
+        disconnectClient(nickname);
+    });
+}
+
+// Descartar un mensaje a medio reconstruir tras REASSEMBLY_TIMEOUT segundos
+// sin fragmentos nuevos (messageBuffers o reassemblyBuffers del worker)
+template <typename Buffers>
+void scheduleReassemblyExpiry(Buffers& buffers, const string& key, long seconds) {
+    Worker* worker = workers[currentWorker];
+    worker->timers.schedule(chrono::seconds(seconds), [worker, &buffers, key]() {
+        auto it = buffers.find(key);
+        if (it == buffers.end()) return; // ya se completó
+        long idle = time(nullptr) - it->second.lastFragmentTime;
+        if (idle < REASSEMBLY_TIMEOUT) {
+            scheduleReassemblyExpiry(buffers, key, REASSEMBLY_TIMEOUT - idle);
+            return;
+        }
+        cout << "Dropped incomplete message " << key << " (no fragments for " << REASSEMBLY_TIMEOUT << " s)" << endl;
+        worker->relays.erase(key);
+        worker->reassemblyMemory.erase(key);
+        buffers.erase(it);
+    });
+}
+
+// Quien tiene el turno pierde si no juega antes de MOVE_TIMEOUT
+void scheduleMoveTimeout(const pair<string, string>& gameKey, uint32_t turn) {
+    workers[currentWorker]->timers.schedule(chrono::duration_cast<chrono::milliseconds>(MOVE_TIMEOUT), [gameKey, turn]() {
+        lock_guard<mutex> lock(games_mutex);
+        auto it = activeGames.find(gameKey);
+        if (it == activeGames.end() || it->second.turn != turn) return;
+
+        string loser = it->second.currentPlayer;
+        string winner = loser == it->second.player1 ? it->second.player2 : it->second.player1;
+        sendToClient(loser, buildGameResult('0'));
+        sendToClient(winner, buildGameResult('1'));
+        cout << loser << " ran out of time, " << winner << " wins" << endl;
+        activeGames.erase(it);
+    });
+}
+
+// Enviar un 'E' que se repetiría con cada datagrama descartado, como mucho
+// una vez por OVERLOAD_NOTICE_INTERVAL a cada cliente
+void noticeClient(const string& nickname, const string& error) {
+    Worker* worker = workers[currentWorker];
+    Clock::time_point now = Clock::now();
+    auto notice = worker->notices.find(nickname);
+    if (notice != worker->notices.end() && now - notice->second < OVERLOAD_NOTICE_INTERVAL) return;
+    worker->notices[nickname] = now;
+    cout << nickname << " " << error << endl;
+    sendToClient(nickname, buildError(error));
+}
+
+// Broadcasts y archivos son lo primero que se descarta con sobrecarga
+bool isLowPriority(char messageType) {
+    return messageType == 'm' || messageType == 'f' || messageType == 'o';
+}
+
+// Tipo de baja prioridad que lleva el datagrama, o 0 si trae algo más
+// (jugadas, control, ACKs) y hay que procesarlo igual
+char lowPriorityType(const string& data, uint16_t caps) {
+    if (data.empty()) return 0;
+
+    if (!(caps & CAP_VARLEN)) {
+        if (data[0] == 'm') return 'm';
+        if (data[0] >= 0 && data[0] <= 9 && data.size() > 1 && isLowPriority(data[1])) return data[1];
+        return 0;
+    }
+
+    vector<Record> records;
+    if (!parseRecords(data, records)) return 0;
+    char type = 0;
+    for (const Record& record : records) {
+        if (record.type == CRC_RECORD || record.type == PAYLOAD_CRC_RECORD) continue;
+        char recordType = record.type;
+        if ((record.type == FRAGMENT_RECORD || record.type == PARITY_RECORD) && !record.body.empty()) {
+            recordType = record.body[0];
+            if (recordType == 'z') recordType = 'f'; // comprimido y fragmentado: datos de transferencia
+        } else if (record.type == 'z' && !record.body.empty()) {
+            recordType = record.body[0];
+        }
+        if (!isLowPriority(recordType)) return 0;
+        type = recordType;
+    }
+    return type;
+}
+
+// Con la cola de entrada sobrecargada, descartar broadcasts y datos de
+// archivo. Los fragmentos con control de congestión no se confirman y el
+// cliente los reenvía más lento, así que para él es una demora.
+bool shedOverloaded(const string& nickname, const char* buffer, int bytes_received, uint16_t caps) {
+    Worker* worker = workers[currentWorker];
+    if (nickname.empty() || !worker->inputDelay.isOverloaded()) return false;
+
+    char type = lowPriorityType(string(buffer, bytes_received), caps);
+    if (type == 0) return false;
+
+    if (type == 'm') {
+        worker->shedBroadcasts++;
+    } else {
+        worker->shedBulk++;
     }
 
+    noticeClient(nickname, type == 'm' ? "Server overloaded, broadcast dropped"
+                           : (caps & CAP_PACING) ? "Server overloaded, file data deferred"
+                           : "Server overloaded, file data dropped");
+    return true;
+}
+
+void handleClient(int server_fd, InputDatagram& input) {
+    char* buffer = &input.data[0];
+    int bytes_received = input.data.size();
+    const sockaddr_in& client_addr = input.address;
+    socklen_t addr_len = input.addr_len;
+
     string nickname = "";
+    uint16_t caps = 0;
+
+    // Con id de sesión la búsqueda es directa y la sesión sigue al cliente
+    // si cambia de dirección (NAT, cambio de puerto), una vez que la nueva
+    // dirección responde el desafío con el token de la sesión
+    if (bytes_received >= SESSION_HEADER_SIZE && buffer[0] == SESSION_MARKER) {
+        uint32_t sessionId = readU32(string(buffer + 1, 4), 0);
+        bool moved = false;
+        bool stranger = false; // llegó desde otra dirección que la de la sesión
+        ClientInfo challenged;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            auto it = sessions.find(sessionId);
+            if (it == sessions.end()) {
+                return;
+            }
+            nickname = it->second;
+            ClientInfo& info = clients[nickname];
+            caps = info.caps;
+            if (info.address.sin_addr.s_addr != client_addr.sin_addr.s_addr ||
+                info.address.sin_port != client_addr.sin_port) {
+                stranger = true;
+                bool fromChallenged = !info.challenge.empty() &&
+                    info.challenged.sin_addr.s_addr == client_addr.sin_addr.s_addr &&
+                    info.challenged.sin_port == client_addr.sin_port;
+                if (fromChallenged && bytes_received == SESSION_ANSWER_SIZE && buffer[SESSION_HEADER_SIZE] == 'k' &&
+                    info.challenge.compare(0, CHALLENGE_SIZE, buffer + SESSION_HEADER_SIZE + 1, CHALLENGE_SIZE) == 0 &&
+                    info.sessionToken.compare(0, CHALLENGE_SIZE, buffer + SESSION_HEADER_SIZE + 1 + CHALLENGE_SIZE, CHALLENGE_SIZE) == 0) {
+                    info.address = client_addr;
+                    info.addr_len = addr_len;
+                    info.challenge.clear();
+                    info.lastSeen = Clock::now();
+                    moved = true;
+                } else if (!fromChallenged || Clock::now() - info.challengedAt >= CHALLENGE_INTERVAL) {
+                    info.challenge = randomBytes(CHALLENGE_SIZE);
+                    info.challenged = client_addr;
+                    info.challengedAt = Clock::now();
+                    challenged = info;
+                    challenged.address = client_addr;
+                    challenged.addr_len = addr_len;
+                }
+            } else {
+                info.lastSeen = Clock::now();
+            }
+        }
+
+        // Hasta que la nueva dirección se pruebe dueña, lo que manda no cuenta
+        if (!challenged.challenge.empty()) {
+            for (const auto& packet : encodeForClient(challenged, "K" + challenged.challenge)) {
+                sendToAddress(workers[currentWorker], packet, client_addr, addr_len,
+                              (caps & CAP_VARLEN) && (caps & CAP_CRC));
+            }
+        }
+        if (moved) {
+            // El datagrama era la respuesta al desafío, no trae nada más
+            cout << nickname << " moved to " << inet_ntoa(client_addr.sin_addr) << ":" << ntohs(client_addr.sin_port) << endl;
+            auto pacer = workers[currentWorker]->pacers.find(nickname);
+            if (pacer != workers[currentWorker]->pacers.end()) {
+                pacer->second.address = client_addr;
+                pacer->second.addr_len = addr_len;
+            }
+            return;
+        }
+        if (stranger) {
+            return;
+        }
+
+        if (shedOverloaded(nickname, buffer + SESSION_HEADER_SIZE, bytes_received - SESSION_HEADER_SIZE, caps)) {
+            return;
+        }
+        processDatagram(server_fd, buffer + SESSION_HEADER_SIZE, bytes_received - SESSION_HEADER_SIZE,
+                        client_addr, addr_len, nickname, caps);
+        return;
+    }
+
     {
         lock_guard<mutex> lock(clients_mutex);
-        for (auto const& [nick, info] : clients) {
+        for (auto& [nick, info] : clients) {
             if (info.address.sin_addr.s_addr == client_addr.sin_addr.s_addr &&
                 info.address.sin_port == client_addr.sin_port) {
                 nickname = nick;
+                caps = info.caps;
+                info.lastSeen = Clock::now();
                 break;
             }
         }
     }
 
-    processDatagram(server_fd, buffer, bytes_received, client_addr, addr_len, nickname);
+    if (shedOverloaded(nickname, buffer, bytes_received, caps)) {
+        return;
+    }
+    processDatagram(server_fd, buffer, bytes_received, client_addr, addr_len, nickname, caps);
 }
 
-int main() {
-    int server_fd;
-    struct sockaddr_in address;
+// Flujo de la cola justa: el id de sesión si lo trae, si no la dirección
+string inputFlow(const InputDatagram& input) {
+    if (input.data.size() >= SESSION_HEADER_SIZE && input.data[0] == SESSION_MARKER) {
+        return "#" + to_string(readU32(input.data, 1));
+    }
+    return string(inet_ntoa(input.address.sin_addr)) + ":" + to_string(ntohs(input.address.sin_port));
+}
+
+// Nickname del dueño de un flujo, o el flujo mismo si no tiene sesión
+string flowOwner(const string& flow) {
+    lock_guard<mutex> lock(clients_mutex);
+    if (flow[0] == '#') {
+        auto it = sessions.find(strtoul(flow.c_str() + 1, nullptr, 10));
+        return it != sessions.end() ? it->second : flow;
+    }
+    for (auto& [nick, info] : clients) {
+        string address = string(inet_ntoa(info.address.sin_addr)) + ":" + to_string(ntohs(info.address.sin_port));
+        if (address == flow) return nick;
+    }
+    return flow;
+}
+
+// Leer lo que haya en el socket (hasta INPUT_READ_BATCH) a las colas por cliente
+void receiveInputs(Worker* worker) {
+    char buffer[MAX_DATAGRAM_SIZE];
+    for (int i = 0; i < INPUT_READ_BATCH; i++) {
+        InputDatagram input;
+        input.addr_len = sizeof(input.address);
+        int bytes_received = recvfrom(worker->socket_fd, buffer, MAX_DATAGRAM_SIZE, MSG_DONTWAIT,
+                                      (struct sockaddr*)&input.address, &input.addr_len);
+        if (bytes_received <= 0) {
+            return;
+        }
+        input.data.assign(buffer, bytes_received);
+        input.arrived = Clock::now();
+        string flow = inputFlow(input);
+        worker->inputs.push(flow, move(input), bytes_received + INPUT_DATAGRAM_COST);
+    }
+}
+
+// Procesar hasta INPUT_SERVE_BATCH datagramas en orden DRR, midiendo cuánto
+// esperó cada uno para detectar una cola que no se vacía
+void serveInputs(Worker* worker) {
+    InputDatagram input;
+    for (int i = 0; i < INPUT_SERVE_BATCH && worker->inputs.pop(input); i++) {
+        Clock::time_point now = Clock::now();
+        worker->inputDelay.record(now - input.arrived, now);
+        handleClient(worker->socket_fd, input);
+    }
+    if (worker->inputs.empty()) {
+        worker->inputDelay.idle();
+    }
+}
+
+// Informar qué parte del servicio recibió cada cliente y cuánto se le descartó
+void scheduleShareReport(Worker* worker) {
+    worker->timers.schedule(chrono::duration_cast<chrono::milliseconds>(SHARE_REPORT_INTERVAL), [worker]() {
+        map<string, FlowShare> shares = worker->inputs.takeShares();
+        uint64_t total = 0;
+        bool dropped = false;
+        for (auto& [flow, share] : shares) {
+            total += share.servedCost;
+            dropped = dropped || share.droppedItems > 0;
+        }
+        bool limited = false;
+        string limits = rateLimiter.summary(&limited);
+        if (limited) {
+            cout << "Rate limits: " << limits << endl;
+        }
+        uint64_t shed = worker->shedBroadcasts + worker->shedBulk;
+        double maxDelay = chrono::duration<double, milli>(worker->inputDelay.takeMaxSojourn()).count();
+        if (shed != worker->reportedShed || worker->inputDelay.isOverloaded()) {
+            cout << "Overload (worker " << currentWorker << "): " << (worker->inputDelay.isOverloaded() ? "on" : "off")
+                 << ", max input delay " << fixed << setprecision(1) << maxDelay << " ms, "
+                 << worker->inputDelay.overloadEpisodes() << " episodes, shed " << worker->shedBroadcasts
+                 << " broadcasts / " << worker->shedBulk << " file datagrams" << endl;
+            worker->reportedShed = shed;
+        }
+        if (!worker->inputDelay.isOverloaded()) {
+            worker->notices.clear();
+        }
+        if (shares.size() > 1 || dropped) {
+            ostringstream out;
+            out << "Input shares (worker " << currentWorker << "):";
+            for (auto& [flow, share] : shares) {
+                out << " " << flowOwner(flow) << " " << fixed << setprecision(1)
+                    << (total ? share.servedCost * 100.0 / total : 0.0) << "% (" << share.servedItems << " datagrams";
+                if (share.droppedItems > 0) {
+                    out << ", " << share.droppedItems << " dropped";
+                }
+                out << ")";
+            }
+            cout << out.str() << endl;
+        }
+        scheduleShareReport(worker);
+    });
+}
+
+// Informar el uso del presupuesto de memoria y del spool mientras cambian (lo agenda el worker 0)
+void scheduleMemoryReport(Worker* worker) {
+    worker->timers.schedule(chrono::duration_cast<chrono::milliseconds>(MEMORY_REPORT_INTERVAL), [worker]() {
+        bool changed = false;
+        string usage = memoryBudget.usage(&changed);
+        if (changed) {
+            cout << "Memory: " << usage << endl;
+        }
+        string spoolUsage = spoolDirectory().usage(&changed);
+        if (changed) {
+            cout << "Spool: " << spoolUsage << endl;
+        }
+        scheduleMemoryReport(worker);
+    });
+}
+
+// Crear un socket UDP del grupo SO_REUSEPORT
+int createWorkerSocket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
     int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
-    server_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int bufferSize = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(PORT);
 
-    bind(server_fd, (struct sockaddr*)&address, sizeof(address));
+    // DF activado: un datagrama mayor que la MTU del camino falla en vez de
+    // fragmentarse en IP, así las respuestas a los sondeos miden el camino real
+    int pmtu = IP_PMTUDISC_DO;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind error");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Socket de envío al grupo multicast, por loopback (los clientes están en 127.0.0.1)
+int createMulticastSocket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    struct in_addr loopback;
+    inet_pton(AF_INET, "127.0.0.1", &loopback);
+    unsigned char loop = 1;
+    unsigned char ttl = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        perror("multicast setup");
+        close(fd);
+        return -1;
+    }
+
+    memset(&multicastAddress, 0, sizeof(multicastAddress));
+    multicastAddress.sin_family = AF_INET;
+    multicastAddress.sin_port = htons(MULTICAST_PORT);
+    inet_pton(AF_INET, MULTICAST_GROUP, &multicastAddress.sin_addr);
+    cout << "Broadcasts go to multicast group " << MULTICAST_GROUP << ":" << MULTICAST_PORT << endl;
+    return fd;
+}
+
+// Programa BPF del grupo reuseport: el kernel elige el socket
+// id de sesión % workers si el datagrama lo trae, y si no
+// (IP origen ^ puerto origen) % workers, así cada cliente cae siempre en el
+// mismo worker. Los datos empiezan en la carga UDP; asume cabecera IP sin
+// opciones (20 bytes).
+void attachSteeringProgram(int fd, int workerCount) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, 0 },
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 3, (uint32_t)(unsigned char)SESSION_MARKER },
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, 1 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workerCount },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 12) },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 20) },
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workerCount },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { (unsigned short)(sizeof(code) / sizeof(code[0])), code };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        // Sin BPF el kernel reparte por hash de la 4-tupla, que también es estable por cliente
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
+}
 
-    cout << "Server listening on port " << PORT << endl;
+// Bucle de un worker: datagramas de sus clientes y entregas de otros workers
+void runWorker(int index) {
+    currentWorker = index;
+    Worker* worker = workers[index];
+    scheduleShareReport(worker);
+    if (index == 0) {
+        scheduleMemoryReport(worker);
+    }
 
     while (true) {
         fd_set read_fds;
         FD_ZERO(&read_fds);
-        FD_SET(server_fd, &read_fds);
+        FD_SET(worker->socket_fd, &read_fds);
+        FD_SET(worker->wake_fd, &read_fds);
+        int max_fd = max(worker->socket_fd, worker->wake_fd);
+
+        // Dormir solo hasta el próximo envío o RTO de los emisores con ritmo,
+        // hasta que venza la demora de un datagrama agrupado o un temporizador
+        long wait = pumpPacers(worker);
+        long flush = flushCoalesced(worker);
+        if (flush >= 0 && (wait < 0 || flush < wait)) {
+            wait = flush;
+        }
+        for (auto& callback : worker->timers.expire(Clock::now())) {
+            callback();
+        }
+        long timer = worker->timers.nextTimeoutUs(Clock::now());
+        if (timer >= 0 && (wait < 0 || timer < wait)) {
+            wait = timer;
+        }
+        if (!worker->inputs.empty()) {
+            wait = 0; // quedan datagramas en las colas de entrada
+        }
+        struct timeval tv;
+        struct timeval* timeout = NULL;
+        if (wait >= 0) {
+            tv.tv_sec = wait / 1000000;
+            tv.tv_usec = wait % 1000000;
+            timeout = &tv;
+        }
 
-        if (select(server_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        if (select(max_fd + 1, &read_fds, NULL, NULL, timeout) < 0) {
+            if (errno == EINTR) continue;
             perror("select error");
             break;
         }
 
-        if (FD_ISSET(server_fd, &read_fds)) {
-            handleClient(server_fd);
+        if (FD_ISSET(worker->wake_fd, &read_fds)) {
+            uint64_t count;
+            read(worker->wake_fd, &count, sizeof(count));
+            flushWorkerQueue(worker);
         }
+
+        if (FD_ISSET(worker->socket_fd, &read_fds)) {
+            receiveInputs(worker);
+        }
+        serveInputs(worker);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int workerCount = 1;
+    SpoolConfig spool;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            workerCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--coalesce-delay-us" && i + 1 < argc) {
+            coalesceDelayUs = max(0L, atol(argv[++i]));
+        } else if (arg == "--rate-limit" && i + 1 < argc) {
+            RateLimits limits;
+            if (!parseRateLimits(argv[++i], limits)) {
+                cout << "Invalid --rate-limit: " << argv[i] << endl;
+                return 1;
+            }
+            rateLimiter.configure(limits);
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            MemoryLimits limits;
+            if (!parseMemoryLimits(argv[++i], limits)) {
+                cout << "Invalid --memory-limit: " << argv[i] << endl;
+                return 1;
+            }
+            memoryBudget.configure(limits);
+        } else if (arg == "--spool-dir" && i + 1 < argc) {
+            spool.dir = argv[++i];
+        } else if (arg == "--spool-limit" && i + 1 < argc) {
+            if (!parseMemoryAmount(argv[++i], spool.limit)) {
+                cout << "Invalid --spool-limit: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--multicast") {
+            multicastSocket = createMulticastSocket();
+            if (multicastSocket < 0) {
+                return 1;
+            }
+        } else {
+            cout << "Usage: " << argv[0] << " [--workers N] [--coalesce-delay-us US] [--multicast] [--rate-limit SPEC] [--memory-limit TOTAL[/CLIENT]]"
+                 << " [--spool-dir DIR] [--spool-limit N]" << endl;
+            return 1;
+        }
+    }
+    spoolDirectory().configure(spool);
+
+    for (int i = 0; i < workerCount; i++) {
+        Worker* worker = new Worker();
+        worker->socket_fd = createWorkerSocket();
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (worker->socket_fd < 0 || worker->wake_fd < 0) {
+            return 1;
+        }
+        workers.push_back(worker);
+    }
+
+    if (workerCount > 1) {
+        attachSteeringProgram(workers[0]->socket_fd, workerCount);
+    }
+
+    cout << "Server listening on port " << PORT << " (" << workerCount << " workers)" << endl;
+    cout << "Rate limits: " << rateLimiter.description() << endl;
+    cout << "Memory budget: " << memoryBudget.description() << endl;
+    cout << "Spool: " << spoolDirectory().description() << endl;
+    cout << "Overload shedding: input delay above " << CODEL_TARGET.count() << " ms for "
+         << CODEL_INTERVAL.count() << " ms" << endl;
+    if (netsimEnabled()) {
+        cout << "Network simulator: " << netsimDescription() << endl;
+    }
+
+    vector<thread> threads;
+    for (int i = 1; i < workerCount; i++) {
+        threads.emplace_back(runWorker, i);
+    }
+    runWorker(0);
+
+    for (auto& t : threads) {
+        t.join();
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,160 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Rueda de temporizadores jerárquica: 4 niveles de 64 casillas. Con ticks
+    de 100 ms alcanza para vencimientos de hasta ~19 días. Agregar y
+    cancelar un temporizador es O(1); al avanzar, cada temporizador baja de
+    nivel como mucho 3 veces antes de vencer.
+
+    No es segura entre hilos: la usa un solo hilo, o quien la comparte la
+    protege con un mutex. expire() saca los vencidos y devuelve sus
+    callbacks para ejecutarlos fuera de ese mutex (pueden volver a agendar).
+
+    Para timeouts de inactividad conviene no reagendar en cada paquete: se
+    guarda la hora de la última actividad y el callback, al vencer, vuelve a
+    agendarse por lo que falta.
+*/
+
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock WheelClock;
+    typedef uint64_t TimerId;
+
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(100))
+        : tickLength(tick), origin(WheelClock::now()) {}
+
+    // Agendar un callback para dentro de 'delay'. Devuelve su id (nunca 0).
+    TimerId schedule(std::chrono::milliseconds delay, std::function<void()> callback) {
+        uint64_t ticks = (delay.count() + tickLength.count() - 1) / tickLength.count();
+        Entry entry = {nextId++, currentTick + std::max<uint64_t>(ticks, 1), std::move(callback)};
+        TimerId id = entry.id;
+        std::list<Entry> single;
+        single.push_back(std::move(entry));
+        place(single, single.begin());
+        return id;
+    }
+
+    bool cancel(TimerId id) {
+        auto it = index.find(id);
+        if (it == index.end()) return false;
+        slots[it->second.level][it->second.slot].erase(it->second.entry);
+        index.erase(it);
+        return true;
+    }
+
+    size_t size() const {
+        return index.size();
+    }
+
+    // Avanzar hasta 'now' y devolver los callbacks vencidos, en orden de vencimiento
+    std::vector<std::function<void()>> expire(WheelClock::time_point now) {
+        std::vector<std::function<void()>> due;
+        uint64_t target = ticksAt(now);
+
+        while (currentTick < target) {
+            if (index.empty()) {
+                currentTick = target;
+                break;
+            }
+            currentTick++;
+
+            // Al dar la vuelta un nivel, se reparte la casilla que toca del nivel de arriba
+            for (int level = 1; level < LEVELS; level++) {
+                if ((currentTick & ((1ull << (SLOT_BITS * level)) - 1)) != 0) break;
+                cascade(level, (currentTick >> (SLOT_BITS * level)) & (SLOTS - 1));
+            }
+
+            std::list<Entry>& slot = slots[0][currentTick & (SLOTS - 1)];
+            for (auto& entry : slot) {
+                due.push_back(std::move(entry.callback));
+                index.erase(entry.id);
+            }
+            slot.clear();
+        }
+        return due;
+    }
+
+    // Microsegundos hasta el próximo tick con algo que hacer (-1 = no hay temporizadores)
+    long nextTimeoutUs(WheelClock::time_point now) const {
+        if (index.empty()) return -1;
+
+        // Sin vencimientos en el nivel 0, lo próximo es la vuelta del nivel 0
+        uint64_t ahead = SLOTS - (currentTick & (SLOTS - 1));
+        for (uint64_t step = 1; step < ahead; step++) {
+            if (!slots[0][(currentTick + step) & (SLOTS - 1)].empty()) {
+                ahead = step;
+                break;
+            }
+        }
+
+        WheelClock::time_point when = origin + tickLength * (currentTick + ahead);
+        long wait = std::chrono::duration_cast<std::chrono::microseconds>(when - now).count();
+        return wait > 0 ? wait : 0;
+    }
+
+private:
+    struct Entry {
+        TimerId id;
+        uint64_t expires; // tick de vencimiento
+        std::function<void()> callback;
+    };
+
+    struct Location {
+        int level;
+        int slot;
+        std::list<Entry>::iterator entry;
+    };
+
+    uint64_t ticksAt(WheelClock::time_point now) const {
+        if (now <= origin) return 0;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now - origin).count() / tickLength.count();
+    }
+
+    // Mover 'entry' (de la lista 'from') a la casilla que le toca según lo que falta
+    void place(std::list<Entry>& from, std::list<Entry>::iterator entry) {
+        uint64_t remaining = entry->expires > currentTick ? entry->expires - currentTick : 0;
+        uint64_t expires = remaining ? entry->expires : currentTick;
+        int level = 0;
+        while (level < LEVELS - 1 && remaining >= (1ull << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        if (remaining >= (1ull << (SLOT_BITS * LEVELS))) {
+            // Más allá del último nivel: se agenda al máximo y se recoloca al bajar
+            expires = currentTick + (1ull << (SLOT_BITS * LEVELS)) - 1;
+        }
+        int slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+        std::list<Entry>& target = slots[level][slot];
+        target.splice(target.end(), from, entry);
+        index[entry->id] = {level, slot, entry};
+    }
+
+    void cascade(int level, int slot) {
+        std::list<Entry>& source = slots[level][slot];
+        while (!source.empty()) {
+            place(source, source.begin());
+        }
+    }
+
+    std::chrono::milliseconds tickLength;
+    WheelClock::time_point origin;
+    uint64_t currentTick = 0;
+    TimerId nextId = 1;
+    std::list<Entry> slots[LEVELS][SLOTS];
+    std::unordered_map<TimerId, Location> index;
+};
+
+#endif